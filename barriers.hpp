@@ -0,0 +1,355 @@
+#pragma once
+
+#include "binning.hpp"
+#include "curves.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Parameters of the barrier rasterization.
+ */
+struct barrier_options
+{
+    /**
+     * @brief Block the edges crossed by all diffusion curves, not only by the curves that have a Neumann side.
+     */
+    bool all_curves = false;
+};
+
+/**
+ * @brief Grid edges that diffusion must not cross, packed into two bits per pixel.
+ * @details For each pixel, one bit blocks the edge to its right neighbor and one bit blocks the edge to the neighbor below. The bits are stored per row in 64-bit words, such that bit k of word w of a row belongs to pixel 64 w + k. Edges that leave the image, as well as the padding bits after the last pixel of a row, are always blocked, which gives the Neumann boundary at the image border without special cases in the stencils.
+ */
+class edge_barriers
+{
+public:
+    /**
+     * @brief Creates an empty set of barriers.
+     */
+    edge_barriers()
+        : width(0)
+        , height(0)
+        , words_per_row(0)
+    {
+    }
+
+    /**
+     * @brief Creates barriers where only the image border is blocked.
+     * @param _width Width in pixels.
+     * @param _height Height in pixels.
+     */
+    edge_barriers(int _width, int _height)
+        : width(_width)
+        , height(_height)
+        , words_per_row((_width + 63) / 64)
+        , right((size_t)words_per_row * _height, 0)
+        , down((size_t)words_per_row * _height, 0)
+    {
+        block_border();
+    }
+
+    /**
+     * @brief Blocks the grid edges crossed by the diffusion curves that have a Neumann side.
+     * @details A horizontal edge connects two pixel centers in a row and a vertical edge two pixel centers in a column. Each segment is intersected with the lines through the pixel centers, using half-open intervals so that shared vertices are counted once. The segments are binned into tiles of 64 pixels, so that each tile owns whole words and the tiles are processed in parallel without atomics.
+     * @param _scene Scene with the boundary conditions of the curves.
+     * @param _curves Flattened curves of the scene.
+     * @param _width Width in pixels.
+     * @param _height Height in pixels.
+     * @param _options Parameters of the rasterization.
+     */
+    edge_barriers(const scene& _scene, const flattened_scene& _curves, int _width, int _height, const barrier_options& _options)
+        : edge_barriers(_width, _height)
+    {
+        flattened_scene blocking(_curves.width, _curves.height);
+        blocking.diffusion_curves.resize(_curves.diffusion_curves.size());
+        for (size_t i = 0; i < _curves.diffusion_curves.size(); i++)
+        {
+            const diffusion_curve& curve = _scene.diffusion_curves[i];
+            if (_options.all_curves || curve.boundary_left == boundary_condition::Neumann || curve.boundary_right == boundary_condition::Neumann)
+                blocking.diffusion_curves[i] = _curves.diffusion_curves[i];
+        }
+
+        binning_options binning;
+        binning.tile_size      = 64;
+        binning.margin         = 1;
+        binning.poisson_curves = false;
+        binning.mesh_patches   = false;
+        tile_bins bins(blocking, std::vector<mesh_patch>(), _width, _height, binning);
+        bins.parallel_for_tiles([&](int tile) {
+            block_tile(blocking, bins, tile);
+        });
+    }
+
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Number of 64-bit words per row of each bitset.
+     */
+    int words_per_row;
+    /**
+     * @brief Bits of the edges to the right neighbors.
+     */
+    std::vector<uint64_t> right;
+    /**
+     * @brief Bits of the edges to the neighbors below.
+     */
+    std::vector<uint64_t> down;
+
+    /**
+     * @brief Checks whether the edge to the right neighbor is blocked.
+     * @param _x Column.
+     * @param _y Row.
+     * @return True if diffusion to the right is blocked.
+     */
+    bool blocked_right(int _x, int _y) const
+    {
+        return (right[(size_t)_y * words_per_row + (_x >> 6)] >> (_x & 63)) & 1;
+    }
+
+    /**
+     * @brief Checks whether the edge to the neighbor below is blocked.
+     * @param _x Column.
+     * @param _y Row.
+     * @return True if diffusion downwards is blocked.
+     */
+    bool blocked_down(int _x, int _y) const
+    {
+        return (down[(size_t)_y * words_per_row + (_x >> 6)] >> (_x & 63)) & 1;
+    }
+
+    /**
+     * @brief Blocks or opens the edge to the right neighbor.
+     * @param _x Column, before the last one.
+     * @param _y Row.
+     * @param _blocked True to block the edge.
+     */
+    void set_right(int _x, int _y, bool _blocked)
+    {
+        set_bit(right[(size_t)_y * words_per_row + (_x >> 6)], _x & 63, _blocked);
+    }
+
+    /**
+     * @brief Blocks or opens the edge to the neighbor below.
+     * @param _x Column.
+     * @param _y Row, before the last one.
+     * @param _blocked True to block the edge.
+     */
+    void set_down(int _x, int _y, bool _blocked)
+    {
+        set_bit(down[(size_t)_y * words_per_row + (_x >> 6)], _x & 63, _blocked);
+    }
+
+    /**
+     * @brief Checks whether the edge to the left neighbor is blocked.
+     * @param _x Column.
+     * @param _y Row.
+     * @return True if diffusion to the left is blocked.
+     */
+    bool blocked_left(int _x, int _y) const
+    {
+        return _x == 0 || blocked_right(_x - 1, _y);
+    }
+
+    /**
+     * @brief Checks whether the edge to the neighbor above is blocked.
+     * @param _x Column.
+     * @param _y Row.
+     * @return True if diffusion upwards is blocked.
+     */
+    bool blocked_up(int _x, int _y) const
+    {
+        return _y == 0 || blocked_down(_x, _y - 1);
+    }
+
+    /**
+     * @brief Blocked right edges of 64 consecutive pixels.
+     * @param _word Word index within the row, i.e., pixels 64 _word to 64 _word + 63.
+     * @param _y Row.
+     * @return One bit per pixel.
+     */
+    uint64_t right_word(int _word, int _y) const
+    {
+        return right[(size_t)_y * words_per_row + _word];
+    }
+
+    /**
+     * @brief Blocked left edges of 64 consecutive pixels, assembled from the right edges of the pixels one to the left.
+     * @param _word Word index within the row.
+     * @param _y Row.
+     * @return One bit per pixel.
+     */
+    uint64_t left_word(int _word, int _y) const
+    {
+        uint64_t carry = _word == 0 ? 1 : right_word(_word - 1, _y) >> 63;
+        return (right_word(_word, _y) << 1) | carry;
+    }
+
+    /**
+     * @brief Blocked edges to the pixels below of 64 consecutive pixels.
+     * @param _word Word index within the row.
+     * @param _y Row.
+     * @return One bit per pixel.
+     */
+    uint64_t down_word(int _word, int _y) const
+    {
+        return down[(size_t)_y * words_per_row + _word];
+    }
+
+    /**
+     * @brief Blocked edges to the pixels above of 64 consecutive pixels.
+     * @param _word Word index within the row.
+     * @param _y Row.
+     * @return One bit per pixel.
+     */
+    uint64_t up_word(int _word, int _y) const
+    {
+        return _y == 0 ? ~(uint64_t)0 : down_word(_word, _y - 1);
+    }
+
+    /**
+     * @brief Number of open edges of a pixel, i.e., the diagonal of the five-point Laplacian with barriers.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Number of neighbors that the pixel exchanges with, in [0,4].
+     */
+    int degree(int _x, int _y) const
+    {
+        return 4 - (int)blocked_left(_x, _y) - (int)blocked_right(_x, _y) - (int)blocked_up(_x, _y) - (int)blocked_down(_x, _y);
+    }
+
+    /**
+     * @brief Counts the blocked interior edges, i.e., without the image border.
+     * @return Number of blocked edges.
+     */
+    long long num_blocked_edges() const
+    {
+        long long count = 0;
+        for (int y = 0; y < height; y++)
+        {
+            for (int w = 0; w < words_per_row; w++)
+            {
+                count += popcount(right_word(w, y) & ~columns_from(width - 1, w));
+                if (y + 1 < height)
+                    count += popcount(down_word(w, y) & ~columns_from(width, w));
+            }
+        }
+        return count;
+    }
+
+    /**
+     * @brief Size of the packed bitsets.
+     * @return Number of bytes.
+     */
+    size_t memory_bytes() const
+    {
+        return (right.size() + down.size()) * sizeof(uint64_t);
+    }
+
+private:
+    /**
+     * @brief Bits of a word that belong to a pixel column or any column after it.
+     * @param _x First pixel column.
+     * @param _word Word index within the row.
+     * @return Mask of the bits of the columns from _x on.
+     */
+    static uint64_t columns_from(int _x, int _word)
+    {
+        int first = _x - 64 * _word;
+        if (first >= 64)
+            return 0;
+        return first <= 0 ? ~(uint64_t)0 : ~(uint64_t)0 << first;
+    }
+
+    /**
+     * @brief Sets or clears one bit of a word.
+     * @param _word Word to modify.
+     * @param _bit Index of the bit.
+     * @param _value New value of the bit.
+     */
+    static void set_bit(uint64_t& _word, int _bit, bool _value)
+    {
+        uint64_t mask = (uint64_t)1 << _bit;
+        _word         = _value ? _word | mask : _word & ~mask;
+    }
+
+    /**
+     * @brief Counts the set bits of a word.
+     * @param _bits Word.
+     * @return Number of set bits.
+     */
+    static int popcount(uint64_t _bits)
+    {
+        int count = 0;
+        for (; _bits != 0; _bits &= _bits - 1)
+            count++;
+        return count;
+    }
+
+    /**
+     * @brief Blocks the edges that leave the image and the padding bits.
+     */
+    void block_border()
+    {
+        for (int y = 0; y < height; y++)
+        {
+            for (int w = 0; w < words_per_row; w++)
+            {
+                right[(size_t)y * words_per_row + w] |= columns_from(width - 1, w);
+                down[(size_t)y * words_per_row + w] |= y + 1 == height ? ~(uint64_t)0 : columns_from(width, w);
+            }
+        }
+    }
+
+    /**
+     * @brief Blocks the edges of one tile that are crossed by the binned segments.
+     * @param _curves Curves that block.
+     * @param _bins Bins of the segments with tiles of 64 pixels.
+     * @param _tile Linear tile index.
+     */
+    void block_tile(const flattened_scene& _curves, const tile_bins& _bins, int _tile)
+    {
+        int x0 = (_tile % _bins.tiles_x) * _bins.tile_size, y0 = (_tile / _bins.tiles_x) * _bins.tile_size;
+        int x1 = std::min(width, x0 + _bins.tile_size), y1 = std::min(height, y0 + _bins.tile_size);
+        for (const int* entry = _bins.begin(_tile); entry != _bins.end(_tile); entry++)
+        {
+            const primitive_ref& ref = _bins.primitives[*entry];
+            const polyline& line     = _curves.diffusion_curves[ref.index];
+            point_type p0 = { line.points[ref.element][0] * _bins.scale_x, line.points[ref.element][1] * _bins.scale_y };
+            point_type p1 = { line.points[ref.element + 1][0] * _bins.scale_x, line.points[ref.element + 1][1] * _bins.scale_y };
+
+            // crossings with the rows of pixel centers block the edges to the right neighbor
+            int first = std::max(y0, (int)std::ceil(std::min(p0[1], p1[1]) - 0.5)), last = std::min(y1 - 1, (int)std::floor(std::max(p0[1], p1[1]) - 0.5));
+            for (int y = first; y <= last; y++)
+            {
+                double center = y + 0.5;
+                if ((p0[1] <= center) == (p1[1] <= center))
+                    continue;
+                int x = (int)std::floor(p0[0] + (center - p0[1]) * (p1[0] - p0[0]) / (p1[1] - p0[1]) - 0.5);
+                if (x >= x0 && x < x1)
+                    right[(size_t)y * words_per_row + (x >> 6)] |= (uint64_t)1 << (x & 63);
+            }
+
+            // crossings with the columns of pixel centers block the edges to the neighbor below
+            first = std::max(x0, (int)std::ceil(std::min(p0[0], p1[0]) - 0.5)), last = std::min(x1 - 1, (int)std::floor(std::max(p0[0], p1[0]) - 0.5));
+            for (int x = first; x <= last; x++)
+            {
+                double center = x + 0.5;
+                if ((p0[0] <= center) == (p1[0] <= center))
+                    continue;
+                int y = (int)std::floor(p0[1] + (center - p0[0]) * (p1[1] - p0[1]) / (p1[0] - p0[0]) - 0.5);
+                if (y >= y0 && y < y1)
+                    down[(size_t)y * words_per_row + (x >> 6)] |= (uint64_t)1 << (x & 63);
+            }
+        }
+    }
+};
@@ -0,0 +1,1483 @@
+#include "barriers.hpp"
+#include "binning.hpp"
+#include "constraints.hpp"
+#include "distance_field.hpp"
+#include "incremental.hpp"
+#include "intersections.hpp"
+#include "laplacian_source.hpp"
+#include "inverse_mapping.hpp"
+#include "mesh_evaluator.hpp"
+#include "multigrid.hpp"
+#include "pcg.hpp"
+#include "poisson.hpp"
+#include "pyramid.hpp"
+#include "quadtree.hpp"
+#include "render.hpp"
+#include "solver.hpp"
+#include "sor.hpp"
+#include "spectral.hpp"
+#include "sparse_constraints.hpp"
+#include "tessellation.hpp"
+#include "viewport.hpp"
+#include "walk_on_spheres.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief All bundled scenes, relative to the scene directory.
+ */
+static const char* scene_files[] = {
+    "curve_only/poivron_orzan.xml",
+    "curve_only/test_curve.xml",
+    "mesh_backgrounds/blue_sky.xml",
+    "mesh_backgrounds/mondrian.xml",
+    "mesh_backgrounds/orange_sky.xml",
+    "mesh_backgrounds/pink_sky.xml",
+    "mesh_backgrounds/sea.xml",
+    "mesh_backgrounds/snow_sky.xml",
+    "mesh_backgrounds/sunset.xml",
+    "unified/bubble.xml",
+    "unified/crane.xml",
+    "unified/crane_ribbons.xml",
+    "unified/drape.xml",
+    "unified/ladybug.xml",
+    "unified/pepper.xml",
+    "unified/portal.xml",
+    "unified/sunset.xml",
+    "unified/sunset_illustration.xml",
+};
+
+/**
+ * @brief Simple wall clock timer.
+ */
+class stopwatch
+{
+public:
+    /**
+     * @brief Starts the timer.
+     */
+    stopwatch()
+        : start(std::chrono::steady_clock::now())
+    {
+    }
+
+    /**
+     * @brief Time since the timer was started.
+     * @return Elapsed time in milliseconds.
+     */
+    double elapsed_ms() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    /**
+     * @brief Time point at which the timer was started.
+     */
+    std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * @brief Reports the bin occupancy for a range of tile sizes on every bundled scene.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_binning(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Tile binning" << std::endl;
+    const int tile_sizes[] = { 8, 16, 32, 64 };
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        flattened_scene curves(s, 0.25);
+        std::vector<mesh_patch> patches = mesh_patches(s);
+        std::cout << file << " (" << curves.num_diffusion_segments() << " diffusion segments, " << curves.num_poisson_segments()
+                  << " Poisson segments, " << patches.size() << " patches)" << std::endl;
+        for (int tile_size : tile_sizes)
+        {
+            binning_options options;
+            options.tile_size = tile_size;
+            stopwatch timer;
+            tile_bins bins(curves, patches, s.width, s.height, options);
+            double time = timer.elapsed_ms();
+            bin_statistics stats = bins.statistics();
+            std::cout << "  tile " << std::setw(2) << tile_size
+                      << ": " << std::setw(6) << stats.num_tiles << " tiles, "
+                      << std::setw(6) << stats.num_empty_tiles << " empty, mean " << std::fixed << std::setprecision(2) << stats.mean_entries
+                      << " (stddev " << stats.stddev_entries << ", max " << stats.max_entries << "), replication " << stats.replication
+                      << ", " << std::setprecision(3) << time << " ms" << std::defaultfloat << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Compares the grid evaluation of all patches with per-sample evaluation in Hermite form.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_mesh_evaluation(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Gradient mesh patch evaluation (64 x 64 samples per patch, bicubic colors)" << std::endl;
+    const int num_samples = 64;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name != "mesh_backgrounds/mondrian.xml" && name != "mesh_backgrounds/sea.xml" && name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        std::vector<mesh_patch> patches = mesh_patches(s);
+        if (patches.empty())
+            continue;
+
+        const int repetitions = 10;
+        stopwatch reference_timer;
+        double checksum = 0;
+        for (int repetition = 0; repetition < repetitions; repetition++)
+        {
+            for (const mesh_patch& patch : patches)
+            {
+                for (int iv = 0; iv < num_samples; iv++)
+                {
+                    for (int iu = 0; iu < num_samples; iu++)
+                    {
+                        point_type position;
+                        color_type color;
+                        evaluate_patch(patch, (double)iu / (num_samples - 1), (double)iv / (num_samples - 1), color_interpolation::bicubic, position, color);
+                        checksum += position[0] + color[0];
+                    }
+                }
+            }
+        }
+        double reference_time = reference_timer.elapsed_ms();
+
+        // the first evaluation allocates the sample buffers, which are reused afterwards
+        std::vector<patch_coefficients> coefficients = make_patch_coefficients(patches, color_interpolation::bicubic);
+        patch_grid_samples samples;
+        evaluate_patch_grid(coefficients, num_samples, num_samples, samples);
+        stopwatch grid_timer;
+        for (int repetition = 0; repetition < repetitions; repetition++)
+            evaluate_patch_grid(coefficients, num_samples, num_samples, samples);
+        double grid_time = grid_timer.elapsed_ms();
+
+        double total = (double)repetitions * patches.size() * num_samples * num_samples;
+        std::cout << file << " (" << patches.size() << " patches): reference " << std::fixed << std::setprecision(1) << total / reference_time / 1000
+                  << " Msamples/s, grid " << total / grid_time / 1000 << " Msamples/s (checksum " << std::setprecision(3) << checksum / total << ")" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Compares the adaptive tessellation with a uniform tessellation that meets the same tolerances.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_tessellation(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Adaptive gradient mesh tessellation (0.25 px, 1/255 color tolerance)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        std::vector<mesh_patch> patches = mesh_patches(s);
+        if (patches.empty())
+            continue;
+
+        tessellation_options options;
+        stopwatch timer;
+        triangle_mesh mesh = tessellate_patches(patches, options);
+        double time = timer.elapsed_ms();
+
+        // a uniform tessellation needs the finest level of any patch everywhere
+        int uniform_u = 1, uniform_v = 1;
+        for (const mesh_patch& patch : patches)
+        {
+            patch_tessellation_levels levels = patch_levels(patch, patch_coefficients(patch, options.colors), options);
+            uniform_u = std::max(uniform_u, levels.inner_u);
+            uniform_v = std::max(uniform_v, levels.inner_v);
+        }
+        long long uniform_triangles = 2LL * uniform_u * uniform_v * (long long)patches.size();
+        std::cout << file << " (" << patches.size() << " patches): " << mesh.num_triangles() << " triangles, " << mesh.vertices.size()
+                  << " vertices, uniform " << uniform_u << " x " << uniform_v << " would need " << uniform_triangles << " triangles, "
+                  << std::fixed << std::setprecision(3) << time << " ms" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Maps every pixel to its gradient mesh patch and compares with a search over all patches for a subset of the pixels.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_inverse_mapping(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Inverse mapping from pixels to gradient mesh patches" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        if (s.gradient_meshes.empty())
+            continue;
+
+        inverse_mapping_options options;
+        stopwatch setup_timer;
+        mesh_inverse_mapping mapping(s, s.width, s.height, options);
+        double setup_time = setup_timer.elapsed_ms();
+        std::vector<patch_location> locations;
+        stopwatch timer;
+        inverse_mapping_statistics stats = mapping.map_image(locations);
+        double time = timer.elapsed_ms();
+
+        // brute force: Newton on every patch whose bounding box contains the pixel, on every 8th pixel in each direction
+        const int stride = 8;
+        long long num_samples = 0;
+        stopwatch brute_force_timer;
+        for (int y = 0; y < s.height; y += stride)
+        {
+            for (int x = 0; x < s.width; x += stride)
+            {
+                point_type target = { x + 0.5, y + 0.5 };
+                for (size_t p = mapping.patches.size(); p-- > 0;)
+                {
+                    double u = 0.5, v = 0.5, distance = 0;
+                    for (int iteration = 0; iteration < options.max_iterations; iteration++)
+                    {
+                        point_type position;
+                        color_type color;
+                        mapping.coefficients[p].evaluate(u, v, position, color);
+                        std::array<double, 6> dx, dy;
+                        mapping.coefficients[p].evaluate_derivatives(0, u, v, dx);
+                        mapping.coefficients[p].evaluate_derivatives(1, u, v, dy);
+                        double rx = target[0] - position[0], ry = target[1] - position[1];
+                        double det = dx[1] * dy[2] - dx[2] * dy[1];
+                        distance = std::sqrt(rx * rx + ry * ry);
+                        if (distance < options.tolerance || std::abs(det) < 1e-12)
+                            break;
+                        u += (dy[2] * rx - dx[2] * ry) / det;
+                        v += (dx[1] * ry - dy[1] * rx) / det;
+                    }
+                    if (distance < options.tolerance && u >= 0 && u <= 1 && v >= 0 && v <= 1)
+                        break;
+                }
+                num_samples++;
+            }
+        }
+        double brute_force_time = brute_force_timer.elapsed_ms() * ((double)stats.num_pixels / num_samples);
+
+        std::cout << file << " (" << mapping.patches.size() << " patches): " << std::fixed << std::setprecision(1) << setup_time + time << " ms ("
+                  << stats.num_pixels / (time * 1000) << " Mpixels/s), brute force est. " << brute_force_time << " ms; covered " << stats.num_covered
+                  << ", seeded " << stats.num_seeded << ", searched " << stats.num_searched << ", failed iterations " << stats.num_failed_iterations
+                  << ", unresolved " << stats.num_unresolved << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Compares the sweep-line intersection test of the diffusion curves with a test of all pairs of segments.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_intersections(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Diffusion curve intersections (0.25 tolerance)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        flattened_scene curves(s, 0.25);
+        if (curves.diffusion_curves.empty())
+            continue;
+
+        stopwatch timer;
+        std::vector<curve_intersection> intersections = find_diffusion_curve_intersections(curves);
+        double time = timer.elapsed_ms();
+        int num_self = 0, num_endpoint = 0;
+        for (const curve_intersection& intersection : intersections)
+        {
+            num_self += intersection.is_self_intersection();
+            num_endpoint += intersection.at_endpoint;
+        }
+
+        // all pairs of segments, only counting proper crossings
+        std::vector<std::array<point_type, 2>> segments;
+        for (const polyline& curve : curves.diffusion_curves)
+            for (int i = 0; i < curve.num_segments(); i++)
+                segments.push_back({ { curve.points[i], curve.points[i + 1] } });
+        stopwatch brute_force_timer;
+        long long num_crossings = 0;
+        for (size_t a = 0; a < segments.size(); a++)
+        {
+            for (size_t b = a + 1; b < segments.size(); b++)
+            {
+                const point_type &p = segments[a][0], &q = segments[a][1], &r = segments[b][0], &t = segments[b][1];
+                double rx = q[0] - p[0], ry = q[1] - p[1], sx = t[0] - r[0], sy = t[1] - r[1];
+                double denominator = rx * sy - ry * sx;
+                if (denominator == 0)
+                    continue;
+                double ta = ((r[0] - p[0]) * sy - (r[1] - p[1]) * sx) / denominator;
+                double tb = ((r[0] - p[0]) * ry - (r[1] - p[1]) * rx) / denominator;
+                num_crossings += ta > 0 && ta < 1 && tb > 0 && tb < 1;
+            }
+        }
+        double brute_force_time = brute_force_timer.elapsed_ms();
+
+        std::cout << file << " (" << curves.num_diffusion_segments() << " segments): " << intersections.size() << " intersections ("
+                  << num_self << " self, " << num_endpoint << " at end points), " << std::fixed << std::setprecision(3) << time
+                  << " ms, all pairs " << brute_force_time << " ms (" << num_crossings << " crossings)" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Computes the distance field of all curves and compares it with the exact distances on a subset of the pixels.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_distance_field(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Distance field to all curves (jump flooding)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        flattened_scene curves(s, 0.25);
+        if (curves.diffusion_curves.empty() && curves.poisson_curves.empty())
+            continue;
+
+        distance_field_options options;
+        stopwatch timer;
+        curve_distance_field field(curves, s.width, s.height, options);
+        double time = timer.elapsed_ms();
+
+        // exact distances to all segments on every 8th pixel in each direction
+        const int stride = 8;
+        double max_error = 0;
+        long long num_samples = 0, num_exact = 0;
+        for (int y = 0; y < s.height; y += stride)
+        {
+            for (int x = 0; x < s.width; x += stride)
+            {
+                double best = std::numeric_limits<double>::infinity();
+                for (const std::vector<polyline>* list : { &curves.diffusion_curves, &curves.poisson_curves })
+                {
+                    for (const polyline& curve : *list)
+                    {
+                        for (int i = 0; i < curve.num_segments(); i++)
+                        {
+                            const point_type &p0 = curve.points[i], &p1 = curve.points[i + 1];
+                            double dx = p1[0] - p0[0], dy = p1[1] - p0[1], wx = x + 0.5 - p0[0], wy = y + 0.5 - p0[1];
+                            double length_squared = dx * dx + dy * dy;
+                            double t = length_squared > 0 ? std::min(1.0, std::max(0.0, (wx * dx + wy * dy) / length_squared)) : 0;
+                            best = std::min(best, std::hypot(wx - t * dx, wy - t * dy));
+                        }
+                    }
+                }
+                double error = field.distance(x, y) - best;
+                max_error = std::max(max_error, error);
+                num_exact += error < 1e-3;
+                num_samples++;
+            }
+        }
+
+        double megapixels = (double)s.width * s.height / 1e6;
+        std::cout << file << " (" << s.width << " x " << s.height << "): " << std::fixed << std::setprecision(3) << time << " ms, "
+                  << time / megapixels << " ms/Mpixel, seeds " << field.num_seeds << ", exact " << std::setprecision(1) << 100.0 * num_exact / num_samples
+                  << "%, max error " << std::setprecision(3) << max_error << " px" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Measures the throughput of the diffusion curve rasterization at the scene resolution and at twice the resolution.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_rasterization(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Diffusion curve constraint rasterization (" << num_worker_threads() << " threads)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        std::cout << file << " (" << s.diffusion_curves.size() << " curves):";
+        for (int factor = 1; factor <= 2; factor++)
+        {
+            int width = s.width * factor, height = s.height * factor;
+            flattened_scene curves(s, 0.25 / factor);
+            rasterization_options options;
+            diffusion_curve_rasterizer rasterizer(s, curves, options);
+            constraint_grid constraints(width, height);
+
+            const int repetitions = 5;
+            stopwatch timer;
+            for (int repetition = 0; repetition < repetitions; repetition++)
+                rasterizer.rasterize(constraints);
+            double time = timer.elapsed_ms() / repetitions;
+            std::cout << " " << width << " x " << height << ": " << std::fixed << std::setprecision(1) << (double)width * height / (time * 1000)
+                      << " Mpixels/s (" << std::setprecision(3) << time << " ms, " << constraints.num_constrained() << " constrained)" << std::defaultfloat
+                      << (factor == 1 ? "," : "");
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Compares binary and coverage-based constraint rasterization with a 4x supersampled reference, which is box-filtered down to the resolution of the output.
+ * @details The constraints are compared by their colors premultiplied by their weights, over the pixels that either raster constrains, at the resolution of the scene. The solved images are compared at a quarter of the resolution of the scene, against the multigrid solution at the full resolution, box-filtered by four.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_antialiasing(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Anti-aliased constraint rasterization (PSNR against 4x supersampling)" << std::endl;
+    for (const char* file : { "unified/crane.xml", "unified/ladybug.xml" })
+    {
+        scene s((_scene_dir + file).c_str());
+        const int factor = 4;
+        int width = s.width, height = s.height;
+
+        // reference: binary rasterization of the same band at 4x, box-filtered
+        rasterization_options fine_options;
+        fine_options.radius = factor * fine_options.radius;
+        stopwatch reference_timer;
+        constraint_grid fine = rasterize_diffusion_curves(s, width * factor, height * factor, fine_options);
+        double reference_time = reference_timer.elapsed_ms();
+        grid<float> reference_weight(width, height, 0.f);
+        grid<color_type> reference_color(width, height, color_type{ 0, 0, 0 });
+        for (int y = 0; y < height * factor; y++)
+        {
+            for (int x = 0; x < width * factor; x++)
+            {
+                size_t i = fine.mask.index(x, y);
+                if (!fine.mask.data[i])
+                    continue;
+                reference_weight(x / factor, y / factor) += 1.f / (factor * factor);
+                for (int c = 0; c < 3; c++)
+                    reference_color(x / factor, y / factor)[c] += fine.colors.data[i][c] / (factor * factor);
+            }
+        }
+
+        std::cout << file << " (" << width << " x " << height << ", reference " << std::fixed << std::setprecision(1) << reference_time << " ms, "
+                  << fine.memory_bytes() / 1024 << " KiB):" << std::defaultfloat << std::endl;
+        for (int antialiasing = 0; antialiasing <= 1; antialiasing++)
+        {
+            rasterization_options options;
+            options.antialiasing = antialiasing != 0;
+            stopwatch timer;
+            constraint_grid constraints = rasterize_diffusion_curves(s, width, height, options);
+            double time = timer.elapsed_ms();
+
+            double squared_error = 0;
+            long long count      = 0;
+            for (size_t i = 0; i < constraints.mask.data.size(); i++)
+            {
+                float weight = constraints.mask.data[i] ? constraints.weights.data[i] : 0.f;
+                if (weight == 0 && reference_weight.data[i] == 0)
+                    continue;
+                for (int c = 0; c < 3; c++)
+                {
+                    double difference = weight * constraints.colors.data[i][c] - reference_color.data[i][c];
+                    squared_error += difference * difference;
+                }
+                count++;
+            }
+            double psnr = 10 * std::log10(3.0 * count / std::max(squared_error, 1e-20));
+            std::cout << "  " << (antialiasing ? "coverage" : "binary  ") << ": " << std::fixed << std::setprecision(2) << psnr << " dB over " << count << " pixels, "
+                      << std::setprecision(1) << time << " ms, " << constraints.memory_bytes() / 1024 << " KiB" << std::defaultfloat << std::endl;
+        }
+
+        // solved images at a quarter of the resolution against the box-filtered solution at full resolution
+        render_options options;
+        options.method  = render_method::multigrid;
+        image full      = render(s, options);
+        int small_width = width / factor, small_height = height / factor;
+        image expected(small_width, small_height, color_type{ 0, 0, 0 });
+        for (int y = 0; y < small_height * factor; y++)
+            for (int x = 0; x < small_width * factor; x++)
+                for (int c = 0; c < 3; c++)
+                    expected(x / factor, y / factor)[c] += full(x, y)[c] / (factor * factor);
+        std::cout << "  solved at " << small_width << " x " << small_height << ":";
+        for (int antialiasing = 0; antialiasing <= 1; antialiasing++)
+        {
+            options.width                               = small_width;
+            options.height                              = small_height;
+            options.assembly.rasterization.antialiasing = antialiasing != 0;
+            std::cout << " " << (antialiasing ? "coverage " : "binary ") << std::fixed << std::setprecision(2) << psnr(render(s, options), expected) << " dB"
+                      << std::defaultfloat;
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Rasterizes the diffusion curves into sparse constraints at up to 8K and compares the memory with a dense grid, which is not allocated. Then renders with multigrid from the sparse assembly and compares it with the dense one.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_sparse_constraints(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Sparse constraint rasterization" << std::endl;
+    for (const char* file : { "curve_only/poivron_orzan.xml", "unified/crane.xml", "unified/ladybug.xml" })
+    {
+        scene s((_scene_dir + file).c_str());
+        std::cout << file << ":" << std::endl;
+        for (int size : { 1024, 4096, 8192 })
+        {
+            int width = size, height = (int)((long long)size * s.height / std::max(1, s.width));
+            stopwatch timer;
+            sparse_constraint_grid constraints = rasterize_sparse_diffusion_curves(s, width, height);
+            double time = timer.elapsed_ms();
+
+            // stencil-style sweep: walk every row word by word and consume the values in order
+            timer = stopwatch();
+            double sum = 0;
+            for (int y = 0; y < constraints.height; y++)
+            {
+                for (int w = 0; w < constraints.words_per_row; w++)
+                {
+                    size_t value = constraints.word_offset(w, y);
+                    for (uint64_t bits = constraints.word(w, y); bits != 0; bits &= bits - 1, value++)
+                        sum += constraints.weights[value] * constraints.colors[value][0];
+                }
+            }
+            double sweep_time = timer.elapsed_ms();
+
+            size_t dense_bytes = (size_t)width * height * (sizeof(unsigned char) + sizeof(color_type) + sizeof(float));
+            std::cout << "  " << width << " x " << height << ": " << std::fixed << std::setprecision(1) << time << " ms, sweep " << sweep_time << " ms, "
+                      << constraints.num_constrained() << " constrained (" << std::setprecision(2) << 100.0 * constraints.num_constrained() / ((double)width * height)
+                      << "%), " << constraints.memory_bytes() / 1024 << " KiB instead of " << dense_bytes / 1024 << " KiB (checksum " << std::setprecision(1) << sum << ")"
+                      << std::defaultfloat << std::endl;
+        }
+
+        // multigrid solve from the sparse assembly against the dense one
+        for (int size : { 1024, 2048 })
+        {
+            render_options options;
+            options.method = render_method::multigrid;
+            options.width  = size;
+            options.height = (int)((long long)size * s.height / std::max(1, s.width));
+            render_statistics dense_stats, sparse_stats;
+            image dense                         = render(s, options, &dense_stats);
+            options.assembly.sparse_constraints = true;
+            image sparse                        = render(s, options, &sparse_stats);
+            double max_difference               = 0;
+            for (size_t i = 0; i < dense.data.size(); i++)
+                for (int c = 0; c < 3; c++)
+                    max_difference = std::max(max_difference, std::abs(dense.data[i][c] - sparse.data[i][c]));
+            std::cout << "  multigrid " << options.width << " x " << options.height << ": dense assembly " << std::fixed << std::setprecision(1) << dense_stats.assembly_ms
+                      << " ms, total " << dense_stats.total_ms << " ms; sparse assembly " << sparse_stats.assembly_ms << " ms, total " << sparse_stats.total_ms
+                      << " ms, max difference " << std::scientific << std::setprecision(2) << max_difference << std::defaultfloat << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Builds resolution pyramids directly from the geometry and compares them with pyramids downsampled from the finest constraints.
+ * @details The downsampled pyramid constrains a coarse pixel if any of its four children is constrained, with the average color of the constrained children. The times are the best of three runs. Both variants map the gradient meshes to every pixel of every level, which dominates and varies by more from run to run than the direct pyramid saves, so the time of the curve stages, i.e., flattening or decimation, rasterization and splatting, is reported as well.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_pyramid(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Direct multi-resolution constraint pyramid (" << num_worker_threads() << " threads)" << std::endl;
+    for (const char* file : { "curve_only/poivron_orzan.xml", "unified/crane.xml", "unified/ladybug.xml" })
+    {
+        scene s((_scene_dir + file).c_str());
+        pyramid_options options;
+        pyramid_statistics stats;
+        std::vector<poisson_system> levels;
+        double time = 1e300, separate_time = 1e300, curves_time = 1e300, separate_curves_time = 1e300;
+        for (int run = 0; run < 3; run++)
+        {
+            stopwatch timer;
+            levels = build_poisson_pyramid(s, s.width, s.height, options, &stats);
+            time   = std::min(time, timer.elapsed_ms());
+            double curves = stats.preparation_ms + stats.decimation_ms;
+            for (const assembly_statistics& level : stats.levels)
+                curves += level.preparation_ms + level.diffusion_curves_ms + level.poisson_curves_ms;
+            curves_time = std::min(curves_time, curves);
+
+            timer  = stopwatch();
+            curves = 0;
+            for (size_t level = 0; level < levels.size(); level++)
+            {
+                assembly_statistics assembly;
+                assemble_poisson_system(s, levels[level].width, levels[level].height, options.assembly, &assembly);
+                curves += assembly.preparation_ms + assembly.diffusion_curves_ms + assembly.poisson_curves_ms;
+            }
+            separate_time        = std::min(separate_time, timer.elapsed_ms());
+            separate_curves_time = std::min(separate_curves_time, curves);
+        }
+        std::cout << file << ": " << levels.size() << " levels in " << std::fixed << std::setprecision(1) << time << " ms (preparation " << stats.preparation_ms
+                  << ", decimation " << stats.decimation_ms << ", assembly " << stats.assembly_ms << ", curves " << curves_time << "), separate assemblies "
+                  << separate_time << " ms (curves " << separate_curves_time << ")" << std::defaultfloat << std::endl;
+
+        constraint_grid downsampled = levels[0].constraints;
+        for (size_t level = 0; level < levels.size(); level++)
+        {
+            const constraint_grid& direct = levels[level].constraints;
+            if (level > 0)
+            {
+                constraint_grid coarse(direct.width, direct.height);
+                for (int y = 0; y < coarse.height; y++)
+                {
+                    for (int x = 0; x < coarse.width; x++)
+                    {
+                        color_type sum = { 0, 0, 0 };
+                        int count = 0;
+                        for (int child = 0; child < 4; child++)
+                        {
+                            int cx = 2 * x + child % 2, cy = 2 * y + child / 2;
+                            if (cx >= downsampled.width || cy >= downsampled.height || !downsampled.mask(cx, cy))
+                                continue;
+                            for (int c = 0; c < 3; c++)
+                                sum[c] += downsampled.colors(cx, cy)[c];
+                            count++;
+                        }
+                        if (count > 0)
+                            coarse.set(coarse.mask.index(x, y), color_type{ sum[0] / count, sum[1] / count, sum[2] / count });
+                    }
+                }
+                downsampled = coarse;
+            }
+
+            double squared_difference = 0;
+            long long common = 0;
+            for (size_t i = 0; i < direct.mask.data.size(); i++)
+            {
+                if (!direct.mask.data[i] || !downsampled.mask.data[i])
+                    continue;
+                for (int c = 0; c < 3; c++)
+                    squared_difference += (direct.colors.data[i][c] - downsampled.colors.data[i][c]) * (direct.colors.data[i][c] - downsampled.colors.data[i][c]);
+                common++;
+            }
+            std::cout << "  level " << level << " (" << direct.width << " x " << direct.height << ", " << stats.num_segments[level] << " segments): "
+                      << direct.num_constrained() << " constrained directly, " << downsampled.num_constrained() << " downsampled, RMS color difference "
+                      << std::fixed << std::setprecision(4) << std::sqrt(squared_difference / std::max(1LL, 3 * common)) << std::defaultfloat << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Assembles zoomed crops of the unified scenes with and without viewport culling and reports the primitive counts.
+ * @details The times are the best of three runs, since the culled primitives only take a few milliseconds of the assembly, which is dominated by mapping the gradient meshes to every pixel of the domain.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_culling(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Viewport culling (crop of a quarter of the width and height at 4x zoom, margin 8)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        viewport view;
+        view.x      = s.width * 3 / 8;
+        view.y      = s.height * 3 / 8;
+        view.width  = s.width / 4;
+        view.height = s.height / 4;
+        const int zoom = 4;
+
+        culling_options options;
+        options.margin = 8;
+        culling_statistics stats;
+        double times[2] = { 1e300, 1e300 }, curve_times[2] = { 1e300, 1e300 };
+        for (int run = 0; run < 3; run++)
+        {
+            for (int cull = 0; cull <= 1; cull++)
+            {
+                options.cull = cull != 0;
+                assembly_statistics assembly;
+                stopwatch timer;
+                cropped_scene crop = crop_scene(s, view, options, &stats);
+                assemble_poisson_system(crop.content, crop.content.width * zoom, crop.content.height * zoom, assembly_options(), &assembly);
+                times[cull]       = std::min(times[cull], timer.elapsed_ms());
+                curve_times[cull] = std::min(curve_times[cull], assembly.preparation_ms + assembly.diffusion_curves_ms + assembly.poisson_curves_ms);
+            }
+        }
+        std::cout << file << ": diffusion segments " << stats.before.diffusion_segments << " -> " << stats.after.diffusion_segments << ", Poisson segments "
+                  << stats.before.poisson_segments << " -> " << stats.after.poisson_segments << ", mesh patches " << stats.before.mesh_patches << " -> "
+                  << stats.after.mesh_patches << ", assembly " << std::fixed << std::setprecision(1) << times[0] << " ms -> " << times[1] << " ms, curves "
+                  << curve_times[0] << " ms -> " << curve_times[1] << " ms" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Builds the packed Neumann barriers and compares their size with two dense float grids.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_barriers(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Neumann barriers (2 bits per pixel)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        if (s.diffusion_curves.empty())
+            continue;
+        flattened_scene curves(s, 0.25);
+        int num_neumann = 0;
+        for (const diffusion_curve& curve : s.diffusion_curves)
+            num_neumann += curve.boundary_left == boundary_condition::Neumann || curve.boundary_right == boundary_condition::Neumann;
+
+        barrier_options options;
+        stopwatch timer;
+        edge_barriers barriers(s, curves, s.width, s.height, options);
+        double time = timer.elapsed_ms();
+        options.all_curves = true;
+        edge_barriers all_barriers(s, curves, s.width, s.height, options);
+        size_t dense_bytes = 2 * sizeof(float) * (size_t)s.width * s.height;
+
+        std::cout << file << " (" << num_neumann << " of " << s.diffusion_curves.size() << " curves with a Neumann side): " << barriers.num_blocked_edges()
+                  << " blocked edges (" << all_barriers.num_blocked_edges() << " for all curves), " << std::fixed << std::setprecision(3) << time << " ms, "
+                  << barriers.memory_bytes() / 1024 << " KiB instead of " << dense_bytes / 1024 << " KiB" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Splats the Poisson curves in single and double precision at two resolutions and compares the total source.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_splatting(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Poisson curve source splatting" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        flattened_scene curves(s, 0.25);
+        if (curves.num_poisson_segments() == 0)
+            continue;
+
+        splatting_options options;
+        std::cout << file << " (" << curves.num_poisson_segments() << " segments):";
+        for (int factor = 1; factor <= 2; factor++)
+        {
+            source_grid<float> single(s.width * factor, s.height * factor);
+            source_grid<double> dual(s.width * factor, s.height * factor);
+            stopwatch single_timer;
+            splat_poisson_curves(s, curves, options, single);
+            double single_time = single_timer.elapsed_ms();
+            stopwatch double_timer;
+            splat_poisson_curves(s, curves, options, dual);
+            double double_time = double_timer.elapsed_ms();
+            color_type total = total_source(dual);
+            std::cout << " " << single.width << " x " << single.height << ": float " << std::fixed << std::setprecision(3) << single_time << " ms, double "
+                      << double_time << " ms, total (" << std::setprecision(4) << total[0] << ", " << total[1] << ", " << total[2] << ")" << std::defaultfloat
+                      << (factor == 1 ? "," : "");
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Assembles the complete Poisson problem of the unified scenes and reports the time per stage.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_assembly(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Poisson system assembly" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+
+        assembly_options options;
+        assembly_statistics stats;
+        stopwatch timer;
+        poisson_system system = assemble_poisson_system(s, s.width, s.height, options, &stats);
+        double time = timer.elapsed_ms();
+        std::cout << file << " (" << system.width << " x " << system.height << "): " << std::fixed << std::setprecision(1) << time << " ms (preparation "
+                  << stats.preparation_ms << ", meshes " << stats.meshes_ms << ", diffusion curves " << stats.diffusion_curves_ms << ", Poisson curves "
+                  << stats.poisson_curves_ms << ", merge " << stats.merge_ms << "), " << system.num_unknowns() << " unknowns, " << stats.meshes.num_covered
+                  << " pixels covered by " << stats.meshes.num_active_patches << " patches, " << stats.meshes.num_border << " mesh border constraints"
+                  << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Renders every bundled scene with the reference solver and reports the convergence and the timings.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_render(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Reference solver (Gauss-Seidel with nested iteration, 256 pixels wide, relative residual 1e-4)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        render_options options;
+        options.width  = 256;
+        options.height = std::max(1, (int)std::lround(256.0 * s.height / s.width));
+        render_statistics stats;
+        render(s, options, &stats);
+        const std::vector<double>& residuals = stats.solver.residuals;
+        std::cout << file << " (" << options.width << " x " << options.height << "): " << stats.solver.iterations << " sweeps (" << stats.solver.coarse_iterations
+                  << " on coarser levels), residual " << std::scientific << std::setprecision(2) << (residuals.empty() ? 0.0 : residuals.front()) << " -> "
+                  << (residuals.empty() ? 0.0 : residuals.back()) << " in " << residuals.size() << " checks" << (stats.solver.converged ? "" : " (not converged)")
+                  << ", " << std::fixed << std::setprecision(1) << stats.total_ms << " ms (assembly " << stats.assembly_ms << ", solve " << stats.solver.solve_ms
+                  << ")" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Measures the bandwidth of copying a buffer that does not fit into the caches, as the memory roof of the smoothers.
+ * @return Bytes read and written per second.
+ */
+static double measure_copy_bandwidth()
+{
+    std::vector<float> source(16 << 20, 1.f), target(16 << 20);
+    double best = 0;
+    for (int repetition = 0; repetition < 5; repetition++)
+    {
+        stopwatch timer;
+        std::copy(source.begin(), source.end(), target.begin());
+        double seconds = timer.elapsed_ms() / 1000;
+        source[repetition] = target[source.size() - 1 - repetition];
+        best = std::max(best, 2.0 * sizeof(float) * source.size() / seconds);
+    }
+    return best;
+}
+
+/**
+ * @brief Compares the throughput of the red-black SOR sweeps with the reference Gauss-Seidel sweeps against the memory bandwidth, and their convergence.
+ * @param _scene_dir Directory that contains the scenes.
+ */
+static void benchmark_sor(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+#if defined(__AVX2__)
+    std::cout << "Red-black SOR (AVX2)" << std::endl;
+#else
+    std::cout << "Red-black SOR (scalar)" << std::endl;
+#endif
+    double copy_bandwidth = measure_copy_bandwidth();
+    std::cout << "copy bandwidth " << std::fixed << std::setprecision(2) << copy_bandwidth * 1e-9 << " GB/s" << std::defaultfloat << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        // twice the resolution of the scene, such that the planes of a channel do not fit into the last-level cache
+        poisson_system system = assemble_poisson_system(s, 2 * s.width, 2 * s.height, assembly_options());
+        double pixels         = (double)system.width * system.height;
+
+        image solution;
+        initialize_solution(system, solution);
+        const int reference_sweeps = 2;
+        stopwatch reference_timer;
+        for (int sweep = 0; sweep < reference_sweeps; sweep++)
+            gauss_seidel_sweep(system, solution);
+        double reference_ns = reference_timer.elapsed_ms() * 1e6 / (reference_sweeps * pixels);
+
+        red_black_sor sor(system);
+        sor.load(solution);
+        double omega = sor.optimal_omega();
+        std::cout << file << " (" << system.width << " x " << system.height << "): Gauss-Seidel " << std::fixed << std::setprecision(2) << reference_ns << " ns/pixel";
+        const int sweeps = 8;
+        for (int fused : { 1, 4, 8 })
+        {
+            stopwatch timer;
+            sor.sweep(sweeps, omega, fused);
+            double seconds = timer.elapsed_ms() / 1000;
+            double passes  = std::ceil((double)sweeps / fused);
+            // the memory traffic of the model drops with the number of fused sweeps, the work per sweep does not
+            std::cout << ", " << fused << " per pass " << seconds * 1e9 / (sweeps * pixels) << " ns/pixel (" << sor.bytes_per_pass() * sweeps / seconds * 1e-9
+                      << " GB/s effective, " << sor.bytes_per_pass() * passes / seconds * 1e-9 << " GB/s from memory, " << std::setprecision(0)
+                      << 100 * sor.bytes_per_pass() * passes / seconds / copy_bandwidth << "% of copy)" << std::setprecision(2);
+        }
+        std::cout << std::defaultfloat << std::endl;
+    }
+
+    std::cout << "Sweeps to a relative residual of 1e-4 with nested iteration, 256 pixels wide, PSNR to red-black SOR at 1e-5" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        render_options options;
+        options.width  = 256;
+        options.height = std::max(1, (int)std::lround(256.0 * s.height / s.width));
+        options.solver.method    = relaxation::red_black_sor;
+        options.solver.tolerance = 1e-5;
+        image expected           = render(s, options);
+        options.solver.tolerance = 1e-4;
+
+        const char* labels[] = { "Gauss-Seidel", "red-black omega 1", "optimal omega", "Chebyshev" };
+        std::cout << file << ":";
+        for (int variant = 0; variant < 4; variant++)
+        {
+            options.solver.method = variant == 0 ? relaxation::gauss_seidel : relaxation::red_black_sor;
+            options.solver.omega  = variant == 1 ? 1 : variant == 2 ? -1 : 0;
+            render_statistics stats;
+            image result = render(s, options, &stats);
+            std::cout << (variant == 0 ? " " : ", ") << labels[variant] << " " << stats.solver.iterations << " sweeps " << std::fixed << std::setprecision(1)
+                      << stats.solver.solve_ms << " ms " << psnr(result, expected) << " dB" << std::defaultfloat;
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Benchmarks the multigrid solver against red-black SOR with nested iteration on the unified scenes, and its scaling with the resolution.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_multigrid(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Multigrid at a relative residual of 1e-5 and red-black SOR at 1e-4, at the resolution of the scene, PSNR to a multigrid solution at 1e-7" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        render_options options;
+        options.method              = render_method::multigrid;
+        options.multigrid.tolerance = 1e-7;
+        image expected              = render(s, options);
+        options.multigrid.tolerance = 1e-5;
+        options.solver.method       = relaxation::red_black_sor;
+
+        std::cout << file << " (" << s.width << " x " << s.height << "):";
+        const char* labels[] = { "SOR", "V-cycle", "W-cycle", "V-cycle Jacobi" };
+        for (int variant = 0; variant < 4; variant++)
+        {
+            options.method             = variant == 0 ? render_method::reference : render_method::multigrid;
+            options.multigrid.cycle    = variant == 1 || variant == 3 ? multigrid_cycle::v : multigrid_cycle::w;
+            options.multigrid.smoother = variant == 3 ? multigrid_smoother::jacobi : multigrid_smoother::red_black_gauss_seidel;
+            render_statistics stats;
+            image result = render(s, options, &stats);
+            std::cout << (variant == 0 ? " " : ", ") << labels[variant] << " " << stats.solver.iterations << (variant == 0 ? " sweeps " : " cycles ") << std::fixed
+                      << std::setprecision(1) << stats.solver.solve_ms << " ms " << psnr(result, expected) << " dB" << std::defaultfloat;
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << "Scaling of the W-cycle with the resolution, including the setup of the levels" << std::endl;
+    scene s((_scene_dir + "unified/bubble.xml").c_str());
+    for (int width : { 256, 512, 1024, 2048 })
+    {
+        render_options options;
+        options.width  = width;
+        options.height = std::max(1, (int)std::lround((double)width * s.height / s.width));
+        options.method = render_method::multigrid;
+        render_statistics stats;
+        render(s, options, &stats);
+        double pixels = (double)options.width * options.height;
+        std::cout << "unified/bubble.xml (" << options.width << " x " << options.height << "): " << stats.solver.iterations << " cycles " << std::fixed
+                  << std::setprecision(1) << stats.solver.solve_ms << " ms, " << stats.solver.solve_ms * 1e6 / pixels << " ns/pixel" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Reports the time to quality of multigrid cycles from a black image and from a full multigrid pass on all scenes.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_full_multigrid(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Time to quality of W-cycles from black and after a full multigrid pass with one V-cycle per level, 512 pixels wide, PSNR to a multigrid solution at 1e-7" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        render_options options;
+        options.width               = 512;
+        options.height              = std::max(1, (int)std::lround(512.0 * s.height / s.width));
+        options.method              = render_method::multigrid;
+        options.multigrid.tolerance = 1e-7;
+        image expected              = render(s, options);
+        options.multigrid.tolerance = 0;
+
+        std::cout << file << ":";
+        for (int full = 0; full < 2; full++)
+        {
+            options.multigrid.full_multigrid = full != 0;
+            std::cout << (full ? ", full multigrid" : " from black");
+            for (int cycles = 1 - full; cycles <= 4 - full; cycles++)
+            {
+                options.multigrid.max_cycles = cycles;
+                render_statistics stats;
+                image result = render(s, options, &stats);
+                std::cout << " " << cycles << ": " << std::fixed << std::setprecision(1) << stats.solver.solve_ms << " ms " << psnr(result, expected) << " dB"
+                          << std::defaultfloat;
+            }
+        }
+        // stop at changes below a quarter of an 8-bit step
+        options.multigrid.max_cycles       = 100;
+        options.multigrid.max_color_change = 1.0 / 1024;
+        render_statistics stats;
+        image result = render(s, options, &stats);
+        std::cout << ", early exit " << stats.solver.iterations << " cycles " << std::fixed << std::setprecision(1) << stats.solver.solve_ms << " ms "
+                  << psnr(result, expected) << " dB" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Compares the iteration counts of the conjugate gradient solver with its preconditioners to standalone multigrid on the unified scenes.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_pcg(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Conjugate gradients and multigrid, relative residual of 1e-5, 512 pixels wide, PSNR to a multigrid solution at 1e-7" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        render_options options;
+        options.width               = 512;
+        options.height              = std::max(1, (int)std::lround(512.0 * s.height / s.width));
+        options.method              = render_method::multigrid;
+        options.multigrid.tolerance = 1e-7;
+        image expected              = render(s, options);
+        options.multigrid.tolerance = 1e-5;
+
+        render_statistics stats;
+        image result = render(s, options, &stats);
+        std::cout << file << ": multigrid " << stats.solver.iterations << " cycles " << std::fixed << std::setprecision(1) << stats.solver.solve_ms << " ms "
+                  << psnr(result, expected) << " dB" << std::defaultfloat;
+        options.method       = render_method::pcg;
+        const char* labels[] = { "Jacobi", "IC(0)", "multigrid" };
+        for (int preconditioner = 0; preconditioner < 3; preconditioner++)
+        {
+            options.pcg.preconditioner = (pcg_preconditioner)preconditioner;
+            result                     = render(s, options, &stats);
+            std::cout << ", CG " << labels[preconditioner] << " " << stats.solver.iterations << " iterations " << std::fixed << std::setprecision(1)
+                      << stats.solver.solve_ms << " ms " << psnr(result, expected) << " dB" << std::defaultfloat;
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Compares the spectral solver to multigrid on the scenes without diffusion curves at two resolutions.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_spectral(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Spectral solver and multigrid at a relative residual of 1e-5 on scenes without diffusion curves, PSNR to a multigrid solution at 1e-7" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        if (!s.diffusion_curves.empty())
+            continue;
+        std::cout << file << ":";
+        for (int width : { 512, 1024 })
+        {
+            int height            = std::max(1, (int)std::lround((double)width * s.height / s.width));
+            poisson_system system = assemble_poisson_system(s, width, height, assembly_options());
+            multigrid_options options;
+            options.tolerance = 1e-7;
+            image expected    = solve_multigrid(system, options);
+            options.tolerance = 1e-5;
+
+            solver_statistics stats;
+            image result = solve_multigrid(system, options, &stats);
+            std::cout << (width == 512 ? " " : ", ") << width << " wide multigrid " << stats.iterations << " cycles " << std::fixed << std::setprecision(1)
+                      << stats.solve_ms << " ms " << psnr(result, expected) << " dB";
+            if (solve_spectral(system, result, &stats))
+                std::cout << ", spectral " << stats.solve_ms << " ms " << psnr(result, expected) << " dB residual " << std::scientific << std::setprecision(2)
+                          << stats.residuals.back();
+            else
+                std::cout << ", spectral not applicable";
+            std::cout << std::defaultfloat;
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * @brief Replays a sequence of small edits of the unified scenes, each moving a diffusion curve and changing its color, and compares cold solves to warm starts from the solution cache.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_warm_start(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Warm starts over 4 edits that move a curve by 2 pixels and shift its color, multigrid at 1e-5 512 pixels wide and red-black SOR at 1e-4 256 pixels wide,"
+              << " PSNR of the last warm to the last cold solution" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        if (s.diffusion_curves.empty())
+            continue;
+        std::cout << file << ":";
+        for (int variant = 0; variant < 2; variant++)
+        {
+            render_options options;
+            options.width               = variant == 0 ? 512 : 256;
+            options.height              = std::max(1, (int)std::lround((double)options.width * s.height / s.width));
+            options.method              = variant == 0 ? render_method::multigrid : render_method::reference;
+            options.multigrid.tolerance = 1e-5;
+            options.solver.method       = relaxation::red_black_sor;
+            options.solver.tolerance    = 1e-4;
+
+            scene edited = s;
+            solution_cache cache;
+            render(edited, options, cache, name);
+            int cold_iterations = 0, warm_iterations = 0;
+            double cold_ms = 0, warm_ms = 0;
+            image cold, warm;
+            for (int edit = 0; edit < 4; edit++)
+            {
+                diffusion_curve& curve = edited.diffusion_curves[edited.diffusion_curves.size() / 2];
+                for (point_type& point : curve.control_points)
+                    point[0] += 2.0 * s.width / options.width;
+                for (color_point_type& color : curve.colors_left)
+                    color[0] = std::min(1.0, color[0] + 0.05);
+
+                render_statistics stats;
+                cold = render(edited, options, &stats);
+                cold_iterations += stats.solver.iterations;
+                cold_ms += stats.solver.solve_ms;
+                warm = render(edited, options, cache, name, &stats);
+                warm_iterations += stats.solver.iterations;
+                warm_ms += stats.solver.solve_ms;
+            }
+            std::cout << (variant == 0 ? " multigrid " : ", SOR ") << cold_iterations << " -> " << warm_iterations << (variant == 0 ? " cycles " : " sweeps ")
+                      << std::fixed << std::setprecision(1) << cold_ms << " -> " << warm_ms << " ms " << psnr(warm, cold) << " dB" << std::defaultfloat;
+        }
+
+        // a preview at half the resolution as warm start
+        render_options options;
+        options.width               = 512;
+        options.height              = std::max(1, (int)std::lround(512.0 * s.height / s.width));
+        options.method              = render_method::multigrid;
+        options.multigrid.tolerance = 1e-5;
+        render_statistics stats;
+        render(s, options, &stats);
+        int cold_cycles = stats.solver.iterations;
+        render_options preview = options;
+        preview.width          = options.width / 2;
+        preview.height         = std::max(1, options.height / 2);
+        image coarse           = render(s, preview);
+        render(s, options, &stats, &coarse);
+        std::cout << ", from half resolution " << cold_cycles << " -> " << stats.solver.iterations << " cycles" << std::endl;
+    }
+}
+
+/**
+ * @brief Reports the load of the workers of the thread pool during the assembly of the unified scenes at twice their resolution, whose curve density is very uneven.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_thread_pool(const std::string& _scene_dir)
+{
+    thread_pool_options pool;
+    pool.num_threads = std::max(4, num_worker_threads());
+    configure_thread_pool(pool);
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Work-stealing thread pool, assembly at twice the scene resolution (" << pool.num_threads << " threads)" << std::endl;
+    for (const char* file : scene_files)
+    {
+        std::string name = file;
+        if (name.compare(0, 8, "unified/") != 0)
+            continue;
+        scene s((_scene_dir + file).c_str());
+        default_thread_pool().reset_statistics();
+        stopwatch timer;
+        assemble_poisson_system(s, 2 * s.width, 2 * s.height, assembly_options());
+        double time = timer.elapsed_ms();
+
+        std::vector<worker_statistics> workers = default_thread_pool().statistics();
+        double total = 0, maximum = 0;
+        long long tasks = 0, steals = 0;
+        for (const worker_statistics& worker : workers)
+        {
+            total += worker.busy_ms;
+            maximum = std::max(maximum, worker.busy_ms);
+            tasks += worker.tasks;
+            steals += worker.steals;
+        }
+        std::cout << file << ": " << std::fixed << std::setprecision(1) << time << " ms, " << tasks << " tasks, " << steals << " stolen, busy ms per worker";
+        for (const worker_statistics& worker : workers)
+            std::cout << " " << worker.busy_ms;
+        std::cout << " (balance " << std::setprecision(2) << total / (workers.size() * std::max(maximum, 1e-9)) << ")" << std::defaultfloat << std::endl;
+    }
+    configure_thread_pool(thread_pool_options());
+}
+
+/**
+ * @brief Edits one diffusion curve of each unified scene at 1024, 2048 and 4096 pixels wide, moving it by 2 pixels and changing its color, updates the system around the edit, and compares the incremental solve to a warm-started global solve.
+ * @details At 4096 pixels, a multigrid solve of the whole image takes about 3.7 GB next to the 2 GB of the system and the previous solution, which the reference, the global solve and the global fallback of the incremental solves would need on top, so only the update of the system is compared with the whole assembly.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_incremental(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    for (int size : { 1024, 2048, 4096 })
+    {
+        bool solve = size <= 2048;
+        std::cout << "Incremental solve after moving a curve by 2 pixels and shifting its color, " << size << " pixels wide, "
+                  << (solve ? "multigrid at 1e-5, PSNR to a multigrid solution at 1e-7; an edit takes the update of the system and the solve from the scene diff"
+                            : "update of the system only")
+                  << std::endl;
+        for (const char* file : scene_files)
+        {
+            std::string name = file;
+            if (name.compare(0, 8, "unified/") != 0)
+                continue;
+            scene s((_scene_dir + file).c_str());
+            if (s.diffusion_curves.empty())
+                continue;
+            int width = size, height = std::max(1, (int)std::lround((double)size * s.height / s.width));
+            multigrid_options multigrid;
+            poisson_system system = assemble_poisson_system(s, width, height, assembly_options());
+            image previous        = solve ? solve_multigrid(system, multigrid) : image();
+
+            scene edited           = s;
+            diffusion_curve& curve = edited.diffusion_curves[edited.diffusion_curves.size() / 2];
+            for (point_type& point : curve.control_points)
+                point[0] += 2.0 * s.width / width;
+            for (color_point_type& color : curve.colors_left)
+                color[0] = std::min(1.0, color[0] + 0.05);
+            incremental_options options;
+            stopwatch timer;
+            pixel_rectangle region  = changed_region(s, edited, width, height);
+            pixel_rectangle updated = update_poisson_system(edited, region, assembly_options(), options.assembly_margin, system);
+            double update_ms        = timer.elapsed_ms();
+
+            // the whole assembly, to compare the time and the updated system
+            double assembly_ms = 0, max_difference = 0;
+            long long other_pixels = 0;
+            {
+                stopwatch assembly_timer;
+                poisson_system full = assemble_poisson_system(edited, width, height, assembly_options());
+                assembly_ms         = assembly_timer.elapsed_ms();
+                for (int y = 0; y < height; y++)
+                {
+                    for (int x = 0; x < width; x++)
+                    {
+                        size_t i = (size_t)y * width + x;
+                        other_pixels += system.constraints.mask.data[i] != full.constraints.mask.data[i] ||
+                                        system.barriers.blocked_right(x, y) != full.barriers.blocked_right(x, y) ||
+                                        system.barriers.blocked_down(x, y) != full.barriers.blocked_down(x, y);
+                        for (int c = 0; c < 3; c++)
+                            max_difference = std::max(max_difference, std::max(std::abs(system.source.data[i][c] - full.source.data[i][c]),
+                                                                               std::abs(system.constraints.colors.data[i][c] - full.constraints.colors.data[i][c])));
+                    }
+                }
+            }
+            std::cout << file << ": assembly " << std::fixed << std::setprecision(1) << assembly_ms << " ms, update " << updated.x1 - updated.x0 << " x "
+                      << updated.y1 - updated.y0 << " " << update_ms << " ms (" << std::scientific << std::setprecision(1) << max_difference << " max difference, "
+                      << other_pixels << " pixels with other constraints or barriers)" << std::fixed;
+
+            if (!solve)
+            {
+                std::cout << std::defaultfloat << std::endl;
+                continue;
+            }
+
+            multigrid_options exact;
+            exact.tolerance = 1e-7;
+            image expected  = solve_multigrid(system, exact);
+            {
+                solver_statistics global;
+                image warm = solve_multigrid(system, multigrid, &global, &previous);
+                std::cout << ", global " << global.iterations << " cycles " << global.solve_ms << " ms " << psnr(warm, expected) << " dB";
+            }
+            const char* labels[] = { ", residual", ", scene diff" };
+            double solve_ms      = 0;
+            for (int variant = 0; variant < 2; variant++)
+            {
+                incremental_statistics run;
+                image local = solve_incremental(system, previous, options, &run, variant == 1 ? &region : nullptr);
+                std::cout << labels[variant] << " " << run.changed.x1 - run.changed.x0 << " x " << run.changed.y1 - run.changed.y0 << " -> "
+                          << run.window.x1 - run.window.x0 << " x " << run.window.y1 - run.window.y0 << " in " << run.rounds << " rounds"
+                          << (run.global ? " (global)" : "") << " " << run.cycles << " cycles " << run.solve_ms << " ms " << psnr(local, expected) << " dB";
+                solve_ms = run.solve_ms;
+            }
+            std::cout << ", edit " << update_ms + solve_ms << " ms" << std::defaultfloat << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Compares the quadtree solver to the uniform multigrid at the resolution of the scenes, and reports its scaling with the resolution.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_quadtree(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Quadtree and uniform multigrid at a relative residual of 1e-5, at the resolution of the scene, PSNR to a multigrid solution at 1e-7" << std::endl;
+    for (const char* file : scene_files)
+    {
+        scene s((_scene_dir + file).c_str());
+        poisson_system system = assemble_poisson_system(s, s.width, s.height, assembly_options());
+        multigrid_options multigrid;
+        multigrid.tolerance = 1e-7;
+        image expected      = solve_multigrid(system, multigrid);
+        multigrid.tolerance = 1e-5;
+        solver_statistics uniform_stats;
+        image uniform = solve_multigrid(system, multigrid, &uniform_stats);
+
+        quadtree_options options;
+        stopwatch timer;
+        quadtree_solver solver(system, options);
+        double build_ms = timer.elapsed_ms();
+        image result;
+        solver_statistics stats;
+        solver.solve(result, &stats);
+        std::cout << file << " (" << s.width << " x " << s.height << "): multigrid " << uniform_stats.iterations << " cycles " << std::fixed << std::setprecision(1)
+                  << uniform_stats.solve_ms << " ms " << psnr(uniform, expected) << " dB, quadtree " << solver.cells.size() << " cells " << solver.num_unknowns()
+                  << " unknowns (" << 100.0 * solver.num_unknowns() / ((double)s.width * s.height) << "% of the pixels), build " << build_ms << " ms, "
+                  << stats.iterations << " cycles " << stats.solve_ms << " ms " << psnr(result, expected) << " dB" << std::defaultfloat << std::endl;
+    }
+
+    std::cout << "Scaling of the quadtree with the resolution, including its construction" << std::endl;
+    scene s((_scene_dir + "unified/bubble.xml").c_str());
+    for (int width : { 512, 1024, 2048 })
+    {
+        int height            = std::max(1, (int)std::lround((double)width * s.height / s.width));
+        poisson_system system = assemble_poisson_system(s, width, height, assembly_options());
+        solver_statistics uniform_stats;
+        solve_multigrid(system, multigrid_options(), &uniform_stats);
+        stopwatch timer;
+        quadtree_solver solver(system, quadtree_options());
+        image result;
+        solver.solve(result);
+        double quadtree_ms = timer.elapsed_ms();
+        std::cout << "unified/bubble.xml (" << width << " x " << height << "): multigrid " << std::fixed << std::setprecision(1) << uniform_stats.solve_ms
+                  << " ms, quadtree " << solver.num_unknowns() << " unknowns " << quadtree_ms << " ms" << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * @brief Renders a crop and a thumbnail of the scenes with curves progressively by walk on spheres and compares them to a multigrid solution.
+ * @param _scene_dir Directory with the scenes.
+ */
+static void benchmark_walk_on_spheres(const std::string& _scene_dir)
+{
+    std::cout << "----------------------------------------------------------------" << std::endl;
+    std::cout << "Walk on spheres in a 32 x 32 crop at the center and a thumbnail 64 pixels wide, cumulative time and PSNR to a multigrid solution at 1e-7" << std::endl;
+    const char* files[] = { "curve_only/poivron_orzan.xml", "curve_only/test_curve.xml", "mesh_backgrounds/sunset.xml", "unified/bubble.xml", "unified/pepper.xml", "unified/sunset.xml" };
+    for (const char* file : files)
+    {
+        scene s((_scene_dir + file).c_str());
+        poisson_system system = assemble_poisson_system(s, s.width, s.height, assembly_options());
+        multigrid_options multigrid;
+        multigrid.tolerance = 1e-7;
+        image expected      = solve_multigrid(system, multigrid);
+        multigrid.tolerance = 1e-5;
+        solver_statistics grid_stats;
+        solve_multigrid(system, multigrid, &grid_stats);
+
+        stopwatch timer;
+        walk_on_spheres evaluator(s, walk_on_spheres_options());
+        std::cout << file << " (" << s.width << " x " << s.height << "): multigrid " << std::fixed << std::setprecision(1) << grid_stats.solve_ms << " ms, setup "
+                  << timer.elapsed_ms() << " ms for " << evaluator.num_boundary_segments() << " boundary and " << evaluator.num_source_segments() << " source segments"
+                  << std::defaultfloat << std::endl;
+
+        viewport crop;
+        crop.x      = s.width / 2 - 16;
+        crop.y      = s.height / 2 - 16;
+        crop.width  = 32;
+        crop.height = 32;
+        image expected_crop(crop.width, crop.height);
+        for (int y = 0; y < crop.height; y++)
+            for (int x = 0; x < crop.width; x++)
+                expected_crop(x, y) = expected(crop.x + x, crop.y + y);
+
+        viewport whole;
+        whole.width  = s.width;
+        whole.height = s.height;
+        int thumbnail_height = std::max(1, (int)std::lround(64.0 * s.height / s.width));
+        image expected_thumbnail;
+        interpolate_solution(expected, 64, thumbnail_height, expected_thumbnail);
+
+        struct region
+        {
+            const char* name;
+            viewport view;
+            const image* expected;
+        };
+        for (const region& r : { region{ "crop", crop, &expected_crop }, region{ "thumbnail", whole, &expected_thumbnail } })
+        {
+            progressive_walk_on_spheres progressive(evaluator, r.view, r.expected->width, r.expected->height);
+            walk_statistics total;
+            std::cout << "  " << r.name << ":";
+            for (int walks : { 16, 48, 192 })
+            {
+                walk_statistics stats;
+                progressive.add_walks(walks, &stats);
+                total.add(stats);
+                std::cout << " " << progressive.walks_per_pixel << " walks " << std::fixed << std::setprecision(1) << total.walk_ms << " ms "
+                          << psnr(progressive.result(), *r.expected) << " dB," << std::defaultfloat;
+            }
+            std::cout << " " << std::fixed << std::setprecision(1) << (double)total.steps / std::max(1ll, total.walks) << " steps per walk, "
+                      << total.unfinished << " unfinished" << std::defaultfloat << std::endl;
+        }
+    }
+}
+
+/**
+ * @brief Runs the benchmarks.
+ * @param argc Number of arguments.
+ * @param argv Optional name of the benchmark to run (or "all") and optional path to the scene directory.
+ * @return 0 if the application terminated normally.
+ */
+int main(int argc, char** argv)
+{
+    std::string benchmark = argc > 1 ? argv[1] : "all";
+    std::string scene_dir = argc > 2 ? argv[2] : "../scenes/";
+    if (!scene_dir.empty() && scene_dir.back() != '/')
+        scene_dir += '/';
+
+    if (benchmark == "all" || benchmark == "binning")
+        benchmark_binning(scene_dir);
+    if (benchmark == "all" || benchmark == "mesh_evaluation")
+        benchmark_mesh_evaluation(scene_dir);
+    if (benchmark == "all" || benchmark == "tessellation")
+        benchmark_tessellation(scene_dir);
+    if (benchmark == "all" || benchmark == "inverse_mapping")
+        benchmark_inverse_mapping(scene_dir);
+    if (benchmark == "all" || benchmark == "intersections")
+        benchmark_intersections(scene_dir);
+    if (benchmark == "all" || benchmark == "distance_field")
+        benchmark_distance_field(scene_dir);
+    if (benchmark == "all" || benchmark == "rasterization")
+        benchmark_rasterization(scene_dir);
+    if (benchmark == "all" || benchmark == "antialiasing")
+        benchmark_antialiasing(scene_dir);
+    if (benchmark == "all" || benchmark == "sparse_constraints")
+        benchmark_sparse_constraints(scene_dir);
+    if (benchmark == "all" || benchmark == "barriers")
+        benchmark_barriers(scene_dir);
+    if (benchmark == "all" || benchmark == "splatting")
+        benchmark_splatting(scene_dir);
+    if (benchmark == "all" || benchmark == "assembly")
+        benchmark_assembly(scene_dir);
+    if (benchmark == "all" || benchmark == "pyramid")
+        benchmark_pyramid(scene_dir);
+    if (benchmark == "all" || benchmark == "culling")
+        benchmark_culling(scene_dir);
+    if (benchmark == "all" || benchmark == "render")
+        benchmark_render(scene_dir);
+    if (benchmark == "all" || benchmark == "sor")
+        benchmark_sor(scene_dir);
+    if (benchmark == "all" || benchmark == "multigrid")
+        benchmark_multigrid(scene_dir);
+    if (benchmark == "all" || benchmark == "full_multigrid")
+        benchmark_full_multigrid(scene_dir);
+    if (benchmark == "all" || benchmark == "pcg")
+        benchmark_pcg(scene_dir);
+    if (benchmark == "all" || benchmark == "spectral")
+        benchmark_spectral(scene_dir);
+    if (benchmark == "all" || benchmark == "thread_pool")
+        benchmark_thread_pool(scene_dir);
+    if (benchmark == "all" || benchmark == "warm_start")
+        benchmark_warm_start(scene_dir);
+    if (benchmark == "all" || benchmark == "incremental")
+        benchmark_incremental(scene_dir);
+    if (benchmark == "all" || benchmark == "quadtree")
+        benchmark_quadtree(scene_dir);
+    if (benchmark == "all" || benchmark == "walk_on_spheres")
+        benchmark_walk_on_spheres(scene_dir);
+    return 0;
+}
@@ -0,0 +1,472 @@
+#pragma once
+
+#include "curves.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Types of primitives that can be assigned to tiles.
+ */
+enum class primitive_kind
+{
+    /**
+     * @brief Line segment of a flattened diffusion curve.
+     */
+    diffusion_segment,
+    /**
+     * @brief Line segment of a flattened Poisson curve.
+     */
+    poisson_segment,
+    /**
+     * @brief Patch of a gradient mesh.
+     */
+    mesh_patch
+};
+
+/**
+ * @brief Reference to a primitive that was binned.
+ */
+struct primitive_ref
+{
+    /**
+     * @brief Type of the primitive.
+     */
+    primitive_kind kind;
+    /**
+     * @brief Index of the curve for segments, or index into the patch list for mesh patches.
+     */
+    int index;
+    /**
+     * @brief Index of the segment within its polyline, or zero for mesh patches.
+     */
+    int element;
+};
+
+/**
+ * @brief Occupancy statistics of the tile bins.
+ */
+struct bin_statistics
+{
+    /**
+     * @brief Total number of tiles.
+     */
+    int num_tiles;
+    /**
+     * @brief Number of tiles that have no primitive.
+     */
+    int num_empty_tiles;
+    /**
+     * @brief Number of binned primitives.
+     */
+    int num_primitives;
+    /**
+     * @brief Number of (tile, primitive) entries.
+     */
+    long long num_entries;
+    /**
+     * @brief Largest number of primitives in a tile.
+     */
+    int max_entries;
+    /**
+     * @brief Average number of primitives per non-empty tile.
+     */
+    double mean_entries;
+    /**
+     * @brief Standard deviation of the number of primitives per non-empty tile.
+     */
+    double stddev_entries;
+    /**
+     * @brief Average number of tiles a primitive is assigned to.
+     */
+    double replication;
+};
+
+/**
+ * @brief Parameters of the binning stage.
+ */
+struct binning_options
+{
+    /**
+     * @brief Edge length of the square tiles in pixels.
+     */
+    int tile_size = 32;
+    /**
+     * @brief Distance in pixels by which the tiles are enlarged when testing for overlap, e.g., for the footprint of a rasterization kernel.
+     */
+    double margin = 0;
+    /**
+     * @brief Bin the segments of the diffusion curves.
+     */
+    bool diffusion_curves = true;
+    /**
+     * @brief Bin the segments of the Poisson curves.
+     */
+    bool poisson_curves = true;
+    /**
+     * @brief Bin the gradient mesh patches.
+     */
+    bool mesh_patches = true;
+};
+
+/**
+ * @brief Compact per-tile lists of the primitives that overlap each tile of an image.
+ */
+class tile_bins
+{
+public:
+    /**
+     * @brief Assigns the flattened curves and mesh patches of a scene to the tiles of an image.
+     * @details Runs a count pass, a prefix sum, and a scatter pass over fixed chunks of primitives. No locks are needed and the primitives of each tile are sorted by their index in the primitive list, independent of the number of threads.
+     * @param _curves Flattened curves of the scene.
+     * @param _patches Gradient mesh patches of the scene.
+     * @param _width Width of the image in pixels.
+     * @param _height Height of the image in pixels.
+     * @param _options Binning parameters.
+     */
+    tile_bins(const flattened_scene& _curves, const std::vector<mesh_patch>& _patches, int _width, int _height, const binning_options& _options)
+        : width(_width)
+        , height(_height)
+        , tile_size(std::max(1, _options.tile_size))
+        , tiles_x((_width + tile_size - 1) / tile_size)
+        , tiles_y((_height + tile_size - 1) / tile_size)
+        , scale_x(_curves.width > 0 ? (double)_width / _curves.width : 1)
+        , scale_y(_curves.height > 0 ? (double)_height / _curves.height : 1)
+        , margin(_options.margin)
+    {
+        collect_primitives(_curves, _patches, _options);
+        bin(_curves, _patches);
+    }
+
+    /**
+     * @brief Width of the image in pixels.
+     */
+    int width;
+    /**
+     * @brief Height of the image in pixels.
+     */
+    int height;
+    /**
+     * @brief Edge length of the tiles in pixels.
+     */
+    int tile_size;
+    /**
+     * @brief Number of tiles in x direction.
+     */
+    int tiles_x;
+    /**
+     * @brief Number of tiles in y direction.
+     */
+    int tiles_y;
+    /**
+     * @brief Scale from scene units to pixels in x direction.
+     */
+    double scale_x;
+    /**
+     * @brief Scale from scene units to pixels in y direction.
+     */
+    double scale_y;
+    /**
+     * @brief Margin in pixels that was used for the overlap tests.
+     */
+    double margin;
+    /**
+     * @brief All primitives that were binned.
+     */
+    std::vector<primitive_ref> primitives;
+    /**
+     * @brief Start of the entries of each tile, plus the total number of entries at the end.
+     */
+    std::vector<int> offsets;
+    /**
+     * @brief Indices into the primitive list, stored consecutively per tile.
+     */
+    std::vector<int> entries;
+
+    /**
+     * @brief Number of tiles.
+     * @return Total number of tiles.
+     */
+    int num_tiles() const
+    {
+        return tiles_x * tiles_y;
+    }
+
+    /**
+     * @brief First entry of a tile.
+     * @param _tile Linear tile index (tile_y * tiles_x + tile_x).
+     * @return Pointer to the first primitive index of the tile.
+     */
+    const int* begin(int _tile) const
+    {
+        return entries.data() + offsets[_tile];
+    }
+
+    /**
+     * @brief One past the last entry of a tile.
+     * @param _tile Linear tile index (tile_y * tiles_x + tile_x).
+     * @return Pointer past the last primitive index of the tile.
+     */
+    const int* end(int _tile) const
+    {
+        return entries.data() + offsets[_tile + 1];
+    }
+
+    /**
+     * @brief Calls a function for every tile with entries on the default thread pool, one task per tile.
+     * @details The cost of a tile grows with its entries, which vary a lot between dense clusters of curves and empty regions. Tiles with more than twice the average number of entries are queued with high priority, so the workers start with them and the cheap tiles fill the gaps at the end.
+     * @param _body Function that is called as _body(tile) for each tile with entries.
+     */
+    template <typename Function>
+    void parallel_for_tiles(Function _body) const
+    {
+        thread_pool& pool = default_thread_pool();
+        if (pool.num_threads() == 1)
+        {
+            for (int tile = 0; tile < num_tiles(); tile++)
+                if (begin(tile) != end(tile))
+                    _body(tile);
+            return;
+        }
+        int num_occupied = 0;
+        for (int tile = 0; tile < num_tiles(); tile++)
+            num_occupied += offsets[tile + 1] > offsets[tile] ? 1 : 0;
+        double average = (double)entries.size() / std::max(1, num_occupied);
+
+        thread_pool::task_group group(pool);
+        for (int tile = 0; tile < num_tiles(); tile++)
+        {
+            int count = offsets[tile + 1] - offsets[tile];
+            if (count > 0)
+                group.run([&_body, tile]() { _body(tile); }, count > 2 * average ? task_priority::high : task_priority::normal);
+        }
+        group.wait();
+    }
+
+    /**
+     * @brief Computes the occupancy statistics of the bins.
+     * @return Statistics for tuning the tile size.
+     */
+    bin_statistics statistics() const
+    {
+        bin_statistics stats;
+        stats.num_tiles       = num_tiles();
+        stats.num_empty_tiles = 0;
+        stats.num_primitives  = (int)primitives.size();
+        stats.num_entries     = (long long)entries.size();
+        stats.max_entries     = 0;
+        double sum = 0, sum_squared = 0;
+        for (int tile = 0; tile < num_tiles(); tile++)
+        {
+            int count = offsets[tile + 1] - offsets[tile];
+            if (count == 0)
+            {
+                stats.num_empty_tiles++;
+                continue;
+            }
+            stats.max_entries = std::max(stats.max_entries, count);
+            sum += count;
+            sum_squared += (double)count * count;
+        }
+        int num_occupied     = stats.num_tiles - stats.num_empty_tiles;
+        stats.mean_entries   = num_occupied > 0 ? sum / num_occupied : 0;
+        stats.stddev_entries = num_occupied > 0 ? std::sqrt(std::max(0.0, sum_squared / num_occupied - stats.mean_entries * stats.mean_entries)) : 0;
+        stats.replication    = stats.num_primitives > 0 ? (double)stats.num_entries / stats.num_primitives : 0;
+        return stats;
+    }
+
+    /**
+     * @brief Looks up the end points of a binned curve segment.
+     * @param _curves Flattened curves that were binned.
+     * @param _ref Reference to a diffusion or Poisson segment.
+     * @param _p0 Output start point in scene units.
+     * @param _p1 Output end point in scene units.
+     */
+    static void segment_points(const flattened_scene& _curves, const primitive_ref& _ref, point_type& _p0, point_type& _p1)
+    {
+        const polyline& curve = _ref.kind == primitive_kind::diffusion_segment ? _curves.diffusion_curves[_ref.index] : _curves.poisson_curves[_ref.index];
+        _p0 = curve.points[_ref.element];
+        _p1 = curve.points[_ref.element + 1];
+    }
+
+private:
+    /**
+     * @brief Inclusive range of tiles covered by a primitive.
+     */
+    struct tile_range
+    {
+        int x0, y0, x1, y1;
+    };
+
+    /**
+     * @brief Builds the list of primitives to bin.
+     * @param _curves Flattened curves of the scene.
+     * @param _patches Gradient mesh patches of the scene.
+     * @param _options Binning parameters.
+     */
+    void collect_primitives(const flattened_scene& _curves, const std::vector<mesh_patch>& _patches, const binning_options& _options)
+    {
+        if (_options.diffusion_curves)
+        {
+            for (size_t c = 0; c < _curves.diffusion_curves.size(); c++)
+                for (int s = 0; s < _curves.diffusion_curves[c].num_segments(); s++)
+                    primitives.push_back(primitive_ref{ primitive_kind::diffusion_segment, (int)c, s });
+        }
+        if (_options.poisson_curves)
+        {
+            for (size_t c = 0; c < _curves.poisson_curves.size(); c++)
+                for (int s = 0; s < _curves.poisson_curves[c].num_segments(); s++)
+                    primitives.push_back(primitive_ref{ primitive_kind::poisson_segment, (int)c, s });
+        }
+        if (_options.mesh_patches)
+        {
+            for (size_t p = 0; p < _patches.size(); p++)
+                primitives.push_back(primitive_ref{ primitive_kind::mesh_patch, (int)p, 0 });
+        }
+    }
+
+    /**
+     * @brief Computes the range of tiles overlapped by a bounding box in pixels, enlarged by the margin.
+     * @param _min Minimum corner in pixels.
+     * @param _max Maximum corner in pixels.
+     * @param _range Output tile range.
+     * @return False if the box is outside of the image.
+     */
+    bool tiles_of_box(const point_type& _min, const point_type& _max, tile_range& _range) const
+    {
+        double x0 = _min[0] - margin, y0 = _min[1] - margin;
+        double x1 = _max[0] + margin, y1 = _max[1] + margin;
+        if (x1 < 0 || y1 < 0 || x0 > width || y0 > height)
+            return false;
+        _range.x0 = std::max(0, (int)std::floor(x0 / tile_size));
+        _range.y0 = std::max(0, (int)std::floor(y0 / tile_size));
+        _range.x1 = std::min(tiles_x - 1, (int)std::floor(x1 / tile_size));
+        _range.y1 = std::min(tiles_y - 1, (int)std::floor(y1 / tile_size));
+        return _range.x0 <= _range.x1 && _range.y0 <= _range.y1;
+    }
+
+    /**
+     * @brief Tests whether a line segment intersects a tile, enlarged by the margin (Liang-Barsky clipping).
+     * @param _p0 Start point in pixels.
+     * @param _p1 End point in pixels.
+     * @param _tile_x Tile column.
+     * @param _tile_y Tile row.
+     * @return True if the segment touches the tile.
+     */
+    bool segment_overlaps_tile(const point_type& _p0, const point_type& _p1, int _tile_x, int _tile_y) const
+    {
+        double bounds_min[2] = { (double)_tile_x * tile_size - margin, (double)_tile_y * tile_size - margin };
+        double bounds_max[2] = { (double)(_tile_x + 1) * tile_size + margin, (double)(_tile_y + 1) * tile_size + margin };
+        double t0 = 0, t1 = 1;
+        for (int d = 0; d < 2; d++)
+        {
+            double delta = _p1[d] - _p0[d];
+            if (std::abs(delta) < 1e-12)
+            {
+                if (_p0[d] < bounds_min[d] || _p0[d] > bounds_max[d])
+                    return false;
+                continue;
+            }
+            double ta = (bounds_min[d] - _p0[d]) / delta;
+            double tb = (bounds_max[d] - _p0[d]) / delta;
+            if (ta > tb)
+                std::swap(ta, tb);
+            t0 = std::max(t0, ta);
+            t1 = std::min(t1, tb);
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Calls a function for every tile that a primitive overlaps.
+     * @param _curves Flattened curves of the scene.
+     * @param _patches Gradient mesh patches of the scene.
+     * @param _primitive Primitive to process.
+     * @param _visit Function that is called with the linear tile index.
+     */
+    template <typename Visitor>
+    void for_each_tile(const flattened_scene& _curves, const std::vector<mesh_patch>& _patches, const primitive_ref& _primitive, Visitor _visit) const
+    {
+        tile_range range;
+        if (_primitive.kind == primitive_kind::mesh_patch)
+        {
+            point_type bounds_min, bounds_max;
+            patch_bounds(_patches[_primitive.index], bounds_min, bounds_max);
+            point_type pixel_min = { bounds_min[0] * scale_x, bounds_min[1] * scale_y };
+            point_type pixel_max = { bounds_max[0] * scale_x, bounds_max[1] * scale_y };
+            if (!tiles_of_box(pixel_min, pixel_max, range))
+                return;
+            for (int ty = range.y0; ty <= range.y1; ty++)
+                for (int tx = range.x0; tx <= range.x1; tx++)
+                    _visit(ty * tiles_x + tx);
+            return;
+        }
+
+        point_type p0, p1;
+        segment_points(_curves, _primitive, p0, p1);
+        p0 = point_type{ p0[0] * scale_x, p0[1] * scale_y };
+        p1 = point_type{ p1[0] * scale_x, p1[1] * scale_y };
+        point_type pixel_min = { std::min(p0[0], p1[0]), std::min(p0[1], p1[1]) };
+        point_type pixel_max = { std::max(p0[0], p1[0]), std::max(p0[1], p1[1]) };
+        if (!tiles_of_box(pixel_min, pixel_max, range))
+            return;
+        bool single_tile = range.x0 == range.x1 && range.y0 == range.y1;
+        for (int ty = range.y0; ty <= range.y1; ty++)
+            for (int tx = range.x0; tx <= range.x1; tx++)
+                if (single_tile || segment_overlaps_tile(p0, p1, tx, ty))
+                    _visit(ty * tiles_x + tx);
+    }
+
+    /**
+     * @brief Two-pass binning: count per chunk and tile, exclusive prefix sum in (tile, chunk) order, scatter per chunk.
+     * @param _curves Flattened curves of the scene.
+     * @param _patches Gradient mesh patches of the scene.
+     */
+    void bin(const flattened_scene& _curves, const std::vector<mesh_patch>& _patches)
+    {
+        int num_primitives = (int)primitives.size();
+        int tiles          = num_tiles();
+        int num_chunks     = std::max(1, std::min(num_primitives, 4 * num_worker_threads()));
+
+        // pass 1: count the entries of each chunk per tile
+        std::vector<int> counts((size_t)num_chunks * tiles, 0);
+        parallel_for(0, num_chunks, [&](int chunk) {
+            int* chunk_counts = counts.data() + (size_t)chunk * tiles;
+            int first         = (int)((long long)num_primitives * chunk / num_chunks);
+            int last          = (int)((long long)num_primitives * (chunk + 1) / num_chunks);
+            for (int p = first; p < last; p++)
+                for_each_tile(_curves, _patches, primitives[p], [chunk_counts](int tile) { chunk_counts[tile]++; });
+        });
+
+        // prefix sum: tiles are stored consecutively, and within a tile the chunks are in primitive order
+        offsets.resize(tiles + 1);
+        int total = 0;
+        for (int tile = 0; tile < tiles; tile++)
+        {
+            offsets[tile] = total;
+            for (int chunk = 0; chunk < num_chunks; chunk++)
+            {
+                int& count = counts[(size_t)chunk * tiles + tile];
+                int start  = total;
+                total += count;
+                count = start;
+            }
+        }
+        offsets[tiles] = total;
+
+        // pass 2: scatter the primitive indices to their write positions
+        entries.resize(total);
+        parallel_for(0, num_chunks, [&](int chunk) {
+            int* positions = counts.data() + (size_t)chunk * tiles;
+            int first      = (int)((long long)num_primitives * chunk / num_chunks);
+            int last       = (int)((long long)num_primitives * (chunk + 1) / num_chunks);
+            for (int p = first; p < last; p++)
+                for_each_tile(_curves, _patches, primitives[p], [this, positions, p](int tile) { entries[positions[tile]++] = p; });
+        });
+    }
+};
@@ -0,0 +1,531 @@
+#pragma once
+
+#include "binning.hpp"
+#include "curves.hpp"
+#include "grid.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Dirichlet constraints of the Poisson problem on a pixel grid: a mask of the constrained pixels, their colors and weights.
+ * @details A weight of one pins the pixel to its color. Smaller weights come from pixels that are only partially covered by a constraint, which blend the color into the solution instead.
+ */
+class constraint_grid
+{
+public:
+    /**
+     * @brief Creates an empty constraint grid.
+     */
+    constraint_grid()
+        : width(0)
+        , height(0)
+    {
+    }
+
+    /**
+     * @brief Creates a constraint grid without constrained pixels.
+     * @param _width Width in pixels.
+     * @param _height Height in pixels.
+     */
+    constraint_grid(int _width, int _height)
+        : width(_width)
+        , height(_height)
+        , mask(_width, _height, 0)
+        , colors(_width, _height, color_type{ 0, 0, 0 })
+        , weights(_width, _height, 0.0f)
+    {
+    }
+
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Non-zero for pixels with a Dirichlet constraint.
+     */
+    grid<unsigned char> mask;
+    /**
+     * @brief Color of the constrained pixels; black elsewhere.
+     */
+    grid<color_type> colors;
+    /**
+     * @brief Weight of the constraint in (0,1] for constrained pixels; zero elsewhere.
+     */
+    grid<float> weights;
+
+    /**
+     * @brief Removes all constraints.
+     */
+    void clear()
+    {
+        mask.assign(width, height, 0);
+        colors.assign(width, height, color_type{ 0, 0, 0 });
+        weights.assign(width, height, 0.0f);
+    }
+
+    /**
+     * @brief Constrains a pixel.
+     * @param _index Linear pixel index.
+     * @param _color Color of the constraint.
+     * @param _weight Weight of the constraint in (0,1].
+     */
+    void set(size_t _index, const color_type& _color, float _weight = 1)
+    {
+        mask.data[_index]    = 1;
+        colors.data[_index]  = _color;
+        weights.data[_index] = _weight;
+    }
+
+    /**
+     * @brief Counts the constrained pixels.
+     * @return Number of pixels with a Dirichlet constraint.
+     */
+    long long num_constrained() const
+    {
+        long long count = 0;
+        for (unsigned char m : mask.data)
+            count += m != 0;
+        return count;
+    }
+
+    /**
+     * @brief Size of the dense grids.
+     * @return Number of bytes.
+     */
+    size_t memory_bytes() const
+    {
+        return mask.data.size() * (sizeof(unsigned char) + sizeof(color_type) + sizeof(float));
+    }
+};
+
+/**
+ * @brief Parameters of the rasterization of the diffusion curves.
+ */
+struct rasterization_options
+{
+    /**
+     * @brief Pixels whose center is at most this distance in pixels away from a curve are constrained. The default of one pixel gives a closed band of pixels on either side. With anti-aliasing, this is the width of the band on each side.
+     */
+    double radius = 1;
+    /**
+     * @brief Computes the coverage of the pixels by the bands on either side of the curves, which gives weighted constraints at partially covered pixels.
+     */
+    bool antialiasing = false;
+    /**
+     * @brief Edge length in pixels of the tiles that are rasterized in parallel.
+     */
+    int tile_size = 32;
+};
+
+/**
+ * @brief Rasterizes the diffusion curves of a scene into Dirichlet constraints.
+ * @details Every pixel within the radius of a curve takes the color of the nearest curve on the side it lies on: colors_left or colors_right, interpolated at the parameter of the closest point. Left is the left side when walking along the curve on screen, i.e., with y pointing down. Sides with a Neumann boundary leave their pixels unconstrained. The segments are binned into tiles with the radius as margin, and the tiles are rasterized in parallel, each writing only its own pixels.
+ *
+ * With anti-aliasing, each segment instead spans one quadrilateral per Dirichlet side, extruded by the radius along the vertex normals so that consecutive quadrilaterals share their edges. The quadrilaterals are accumulated as signed areas per scanline, as in font rasterizers, together with their colors. A prefix sum along each row then gives the exact coverage of every pixel, which becomes the weight of the constraint, and the coverage-weighted average color. Pixels that are covered to at least 95% are pinned.
+ */
+class diffusion_curve_rasterizer
+{
+public:
+    /**
+     * @brief Prepares the rasterization of the diffusion curves of a scene.
+     * @param _scene Scene with the colors and boundary conditions of the curves.
+     * @param _curves Flattened curves of the scene.
+     * @param _options Parameters of the rasterization.
+     */
+    diffusion_curve_rasterizer(const scene& _scene, const flattened_scene& _curves, const rasterization_options& _options)
+        : source(_scene)
+        , curves(_curves)
+        , options(_options)
+    {
+    }
+
+    /**
+     * @brief Rasterizes the constraints at the resolution of the constraint grid, replacing its content.
+     * @param _constraints Constraint grid whose size defines the resolution.
+     */
+    void rasterize(constraint_grid& _constraints) const
+    {
+        _constraints.clear();
+        tile_bins bins = bin_segments(_constraints.width, _constraints.height);
+        bins.parallel_for_tiles([&](int tile) {
+            rasterize_tile(bins, tile, 0, _constraints);
+        });
+    }
+
+    /**
+     * @brief Bins the diffusion curve segments into the tiles of the rasterization, with the radius as margin.
+     * @param _width Width of the image in pixels.
+     * @param _height Height of the image in pixels.
+     * @return Bins of the segments.
+     */
+    tile_bins bin_segments(int _width, int _height) const
+    {
+        binning_options binning;
+        binning.tile_size      = options.tile_size;
+        binning.margin         = options.radius;
+        binning.poisson_curves = false;
+        binning.mesh_patches   = false;
+        return tile_bins(curves, std::vector<mesh_patch>(), _width, _height, binning);
+    }
+
+    /**
+     * @brief Rasterizes one row of tiles into a strip, so that large images can be rasterized without a dense grid of their full size.
+     * @param _bins Bins of the segments, as returned by bin_segments.
+     * @param _tile_row Index of the row of tiles.
+     * @param _strip Constraint grid with the width of the image and the height of a tile; its content is replaced. Row 0 of the strip is the first row of the tiles.
+     */
+    void rasterize_tile_row(const tile_bins& _bins, int _tile_row, constraint_grid& _strip) const
+    {
+        _strip.clear();
+        parallel_for(0, _bins.tiles_x, [&](int tile_x) {
+            rasterize_tile(_bins, _tile_row * _bins.tiles_x + tile_x, _tile_row * _bins.tile_size, _strip);
+        });
+    }
+
+    /**
+     * @brief Side of a point relative to a polyline at one of its segments, using the average direction of the adjacent segments if the closest point is a vertex.
+     * @param _line Polyline.
+     * @param _element Index of the segment.
+     * @param _t Parameter of the closest point on the segment in [0,1].
+     * @param _point Point in the same units as the polyline.
+     * @return Negative on the left side on screen (y down), positive on the right side.
+     */
+    static double side(const polyline& _line, int _element, double _t, const point_type& _point)
+    {
+        point_type direction = unit_direction(_line, _element);
+        int neighbor = -1;
+        bool closed  = _line.points.front() == _line.points.back();
+        if (_t <= 0)
+            neighbor = _element > 0 ? _element - 1 : (closed ? _line.num_segments() - 1 : -1);
+        else if (_t >= 1)
+            neighbor = _element + 1 < _line.num_segments() ? _element + 1 : (closed ? 0 : -1);
+        if (neighbor >= 0 && neighbor != _element)
+        {
+            point_type other = unit_direction(_line, neighbor);
+            direction        = point_type{ direction[0] + other[0], direction[1] + other[1] };
+        }
+        const point_type& origin = _line.points[_t >= 1 ? _element + 1 : _element];
+        return direction[0] * (_point[1] - origin[1]) - direction[1] * (_point[0] - origin[0]);
+    }
+
+private:
+    /**
+     * @brief Normalized direction of a segment.
+     * @param _line Polyline.
+     * @param _element Index of the segment.
+     * @return Unit direction, or zero for degenerate segments.
+     */
+    static point_type unit_direction(const polyline& _line, int _element)
+    {
+        double dx = _line.points[_element + 1][0] - _line.points[_element][0];
+        double dy = _line.points[_element + 1][1] - _line.points[_element][1];
+        double length = std::sqrt(dx * dx + dy * dy);
+        return length > 0 ? point_type{ dx / length, dy / length } : point_type{ 0, 0 };
+    }
+
+    /**
+     * @brief Rasterizes the pixels of one tile, with or without anti-aliasing.
+     * @param _bins Bins of the diffusion curve segments.
+     * @param _tile Linear tile index.
+     * @param _first_row Image row that corresponds to row 0 of the constraint grid.
+     * @param _constraints Constraint grid to write to.
+     */
+    void rasterize_tile(const tile_bins& _bins, int _tile, int _first_row, constraint_grid& _constraints) const
+    {
+        if (_bins.begin(_tile) == _bins.end(_tile))
+            return;
+        if (options.antialiasing)
+            rasterize_tile_coverage(_bins, _tile, _first_row, _constraints);
+        else
+            rasterize_tile_nearest(_bins, _tile, _first_row, _constraints);
+    }
+
+    /**
+     * @brief Rasterizes the pixels of one tile by their nearest segment.
+     * @param _bins Bins of the diffusion curve segments.
+     * @param _tile Linear tile index.
+     * @param _first_row Image row that corresponds to row 0 of the constraint grid.
+     * @param _constraints Constraint grid to write to.
+     */
+    void rasterize_tile_nearest(const tile_bins& _bins, int _tile, int _first_row, constraint_grid& _constraints) const
+    {
+        int x0 = (_tile % _bins.tiles_x) * _bins.tile_size, y0 = (_tile / _bins.tiles_x) * _bins.tile_size;
+        int x1 = std::min(_bins.width, x0 + _bins.tile_size), y1 = std::min(_bins.height, y0 + _bins.tile_size);
+        double radius_squared = options.radius * options.radius;
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                // pixel center in scene units
+                point_type point = { (x + 0.5) / _bins.scale_x, (y + 0.5) / _bins.scale_y };
+                double best = radius_squared, best_t = 0;
+                const primitive_ref* nearest = nullptr;
+                for (const int* entry = _bins.begin(_tile); entry != _bins.end(_tile); entry++)
+                {
+                    const primitive_ref& ref = _bins.primitives[*entry];
+                    const polyline& line     = curves.diffusion_curves[ref.index];
+                    const point_type& p0     = line.points[ref.element];
+                    const point_type& p1     = line.points[ref.element + 1];
+                    double dx = (p1[0] - p0[0]) * _bins.scale_x, dy = (p1[1] - p0[1]) * _bins.scale_y;
+                    double wx = (point[0] - p0[0]) * _bins.scale_x, wy = (point[1] - p0[1]) * _bins.scale_y;
+                    double length_squared = dx * dx + dy * dy;
+                    if (length_squared == 0)
+                        continue;
+                    double t  = std::min(1.0, std::max(0.0, (wx * dx + wy * dy) / length_squared));
+                    double ex = wx - t * dx, ey = wy - t * dy;
+                    double d  = ex * ex + ey * ey;
+                    if (d <= best)
+                        best = d, best_t = t, nearest = &ref;
+                }
+                if (nearest == nullptr)
+                    continue;
+
+                const polyline& line        = curves.diffusion_curves[nearest->index];
+                const diffusion_curve& curve = source.diffusion_curves[nearest->index];
+                bool left = side(line, nearest->element, best_t, point) < 0;
+                if ((left ? curve.boundary_left : curve.boundary_right) != boundary_condition::Dirichlet)
+                    continue;
+                double t = line.params[nearest->element] + best_t * (line.params[nearest->element + 1] - line.params[nearest->element]);
+                _constraints.set(_constraints.mask.index(x, y - _first_row), sample_color_points(left ? curve.colors_left : curve.colors_right, t));
+            }
+        }
+    }
+
+    /**
+     * @brief Normal of a polyline at a vertex, averaged over the adjacent segments, pointing to the left side on screen.
+     * @param _line Polyline.
+     * @param _vertex Index of the vertex.
+     * @param _scale_x Scale from scene units to pixels in x direction.
+     * @param _scale_y Scale from scene units to pixels in y direction.
+     * @return Unit normal in pixel coordinates.
+     */
+    static point_type vertex_normal(const polyline& _line, int _vertex, double _scale_x, double _scale_y)
+    {
+        point_type direction = { 0, 0 };
+        bool closed = _line.points.front() == _line.points.back();
+        int last    = _line.num_segments() - 1;
+        int before  = _vertex > 0 ? _vertex - 1 : (closed ? last : -1);
+        int after   = _vertex <= last ? _vertex : (closed ? 0 : -1);
+        for (int segment : { before, after })
+        {
+            if (segment < 0)
+                continue;
+            double dx = (_line.points[segment + 1][0] - _line.points[segment][0]) * _scale_x;
+            double dy = (_line.points[segment + 1][1] - _line.points[segment][1]) * _scale_y;
+            double length = std::sqrt(dx * dx + dy * dy);
+            if (length > 0)
+                direction = point_type{ direction[0] + dx / length, direction[1] + dy / length };
+        }
+        double length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1]);
+        return length > 0 ? point_type{ direction[1] / length, -direction[0] / length } : point_type{ 0, 0 };
+    }
+
+    /**
+     * @brief Accumulates the signed area of a line of a closed polygon into the cells of a tile, such that the prefix sum along each row gives the coverage.
+     * @param _p0 Start point relative to the tile.
+     * @param _p1 End point relative to the tile.
+     * @param _color Color that is accumulated along with the area.
+     * @param _stride Number of cells per row of the accumulation buffer.
+     * @param _accumulation Accumulation buffer with four values (area, r, g, b) per cell.
+     */
+    static void accumulate_line(const point_type& _p0, const point_type& _p1, const color_type& _color, int _stride, std::vector<double>& _accumulation)
+    {
+        if (_p0[1] == _p1[1])
+            return;
+        double direction = _p0[1] < _p1[1] ? 1 : -1;
+        const point_type& a = _p0[1] < _p1[1] ? _p0 : _p1;
+        const point_type& b = _p0[1] < _p1[1] ? _p1 : _p0;
+        double dxdy = (b[0] - a[0]) / (b[1] - a[1]);
+        double x    = a[0];
+        auto add = [&](int _cell, double _area) {
+            double* cell = &_accumulation[4 * (size_t)_cell];
+            cell[0] += _area;
+            for (int c = 0; c < 3; c++)
+                cell[1 + c] += _area * _color[c];
+        };
+        for (int y = (int)std::floor(a[1]); y < (int)std::ceil(b[1]); y++)
+        {
+            int row   = y * _stride;
+            double dy = std::min((double)y + 1, b[1]) - std::max((double)y, a[1]);
+            // stay within the extent of the line, which lies inside the tile, despite rounding
+            double next = std::min(std::max(a[0], b[0]), std::max(std::min(a[0], b[0]), x + dxdy * dy));
+            double d    = dy * direction;
+            double x0 = std::min(x, next), x1 = std::max(x, next);
+            double x0_floor = std::floor(x0), x1_ceil = std::ceil(x1);
+            int x0i = (int)x0_floor, x1i = (int)x1_ceil;
+            if (x1i <= x0i + 1)
+            {
+                // the line stays within one cell: split the area at its mean x
+                double xm = 0.5 * (x + next) - x0_floor;
+                add(row + x0i, d - d * xm);
+                add(row + x0i + 1, d * xm);
+            }
+            else
+            {
+                double s   = 1 / (x1 - x0);
+                double x0f = x0 - x0_floor;
+                double a0  = 0.5 * s * (1 - x0f) * (1 - x0f);
+                double x1f = x1 - x1_ceil + 1;
+                double am  = 0.5 * s * x1f * x1f;
+                add(row + x0i, d * a0);
+                if (x1i == x0i + 2)
+                    add(row + x0i + 1, d * (1 - a0 - am));
+                else
+                {
+                    double a1 = s * (1.5 - x0f);
+                    add(row + x0i + 1, d * (a1 - a0));
+                    for (int xi = x0i + 2; xi < x1i - 1; xi++)
+                        add(row + xi, d * s);
+                    double a2 = a1 + (x1i - x0i - 3) * s;
+                    add(row + x1i - 1, d * (1 - a2 - am));
+                }
+                add(row + x1i, d * am);
+            }
+            x = next;
+        }
+    }
+
+    /**
+     * @brief Clips a polygon to an axis-aligned rectangle (Sutherland-Hodgman).
+     * @param _polygon Polygon, replaced by the clipped polygon.
+     * @param _min Minimum corner of the rectangle.
+     * @param _max Maximum corner of the rectangle.
+     */
+    static void clip_polygon(std::vector<point_type>& _polygon, const point_type& _min, const point_type& _max)
+    {
+        std::vector<point_type> input;
+        for (int plane = 0; plane < 4 && !_polygon.empty(); plane++)
+        {
+            int d        = plane % 2;
+            bool upper   = plane >= 2;
+            double bound = upper ? _max[d] : _min[d];
+            auto inside  = [&](const point_type& _p) { return upper ? _p[d] <= bound : _p[d] >= bound; };
+            input.swap(_polygon);
+            _polygon.clear();
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                const point_type& current  = input[i];
+                const point_type& previous = input[(i + input.size() - 1) % input.size()];
+                if (inside(current) != inside(previous))
+                {
+                    double t = (bound - previous[d]) / (current[d] - previous[d]);
+                    _polygon.push_back(point_type{ previous[0] + t * (current[0] - previous[0]), previous[1] + t * (current[1] - previous[1]) });
+                    _polygon.back()[d] = bound;
+                }
+                if (inside(current))
+                    _polygon.push_back(current);
+            }
+        }
+        // interpolated coordinates may leave the rectangle by rounding
+        for (point_type& p : _polygon)
+            for (int d = 0; d < 2; d++)
+                p[d] = std::min(_max[d], std::max(_min[d], p[d]));
+    }
+
+    /**
+     * @brief Rasterizes the pixels of one tile with coverage-based anti-aliasing.
+     * @param _bins Bins of the diffusion curve segments.
+     * @param _tile Linear tile index.
+     * @param _first_row Image row that corresponds to row 0 of the constraint grid.
+     * @param _constraints Constraint grid to write to.
+     */
+    void rasterize_tile_coverage(const tile_bins& _bins, int _tile, int _first_row, constraint_grid& _constraints) const
+    {
+        int x0 = (_tile % _bins.tiles_x) * _bins.tile_size, y0 = (_tile / _bins.tiles_x) * _bins.tile_size;
+        int x1 = std::min(_bins.width, x0 + _bins.tile_size), y1 = std::min(_bins.height, y0 + _bins.tile_size);
+        int stride = x1 - x0 + 2;
+        std::vector<double> accumulation(4 * (size_t)stride * (y1 - y0), 0.0);
+        std::vector<point_type> polygon;
+        point_type tile_min = { 0, 0 }, tile_max = { (double)(x1 - x0), (double)(y1 - y0) };
+
+        for (const int* entry = _bins.begin(_tile); entry != _bins.end(_tile); entry++)
+        {
+            const primitive_ref& ref     = _bins.primitives[*entry];
+            const polyline& line         = curves.diffusion_curves[ref.index];
+            const diffusion_curve& curve = source.diffusion_curves[ref.index];
+            point_type p0 = { line.points[ref.element][0] * _bins.scale_x - x0, line.points[ref.element][1] * _bins.scale_y - y0 };
+            point_type p1 = { line.points[ref.element + 1][0] * _bins.scale_x - x0, line.points[ref.element + 1][1] * _bins.scale_y - y0 };
+            if (p0 == p1)
+                continue;
+            point_type n0 = vertex_normal(line, ref.element, _bins.scale_x, _bins.scale_y);
+            point_type n1 = vertex_normal(line, ref.element + 1, _bins.scale_x, _bins.scale_y);
+            double t = 0.5 * (line.params[ref.element] + line.params[ref.element + 1]);
+
+            for (int side_index = 0; side_index < 2; side_index++)
+            {
+                bool left = side_index == 0;
+                if ((left ? curve.boundary_left : curve.boundary_right) != boundary_condition::Dirichlet)
+                    continue;
+                double offset = left ? options.radius : -options.radius;
+                polygon.assign({ p0, p1, point_type{ p1[0] + offset * n1[0], p1[1] + offset * n1[1] }, point_type{ p0[0] + offset * n0[0], p0[1] + offset * n0[1] } });
+                // orient all quadrilaterals the same way, so that overlapping areas add up
+                double area = 0;
+                for (size_t i = 0; i < polygon.size(); i++)
+                {
+                    const point_type& a = polygon[i];
+                    const point_type& b = polygon[(i + 1) % polygon.size()];
+                    area += a[0] * b[1] - b[0] * a[1];
+                }
+                if (area < 0)
+                    std::reverse(polygon.begin(), polygon.end());
+                clip_polygon(polygon, tile_min, tile_max);
+                color_type color = sample_color_points(left ? curve.colors_left : curve.colors_right, t);
+                for (size_t i = 0; i < polygon.size(); i++)
+                    accumulate_line(polygon[i], polygon[(i + 1) % polygon.size()], color, stride, accumulation);
+            }
+        }
+
+        for (int y = y0; y < y1; y++)
+        {
+            double sum[4] = { 0, 0, 0, 0 };
+            const double* row = &accumulation[4 * (size_t)(y - y0) * stride];
+            for (int x = x0; x < x1; x++)
+            {
+                for (int c = 0; c < 4; c++)
+                    sum[c] += row[4 * (x - x0) + c];
+                double coverage = std::abs(sum[0]);
+                if (coverage < 1e-3)
+                    continue;
+                // a soft constraint enters its equation as w / (1 - w), so nearly covered pixels are pinned instead of dominating the right-hand side and the residual
+                double weight = coverage >= 0.95 ? 1.0 : coverage;
+                _constraints.set(_constraints.mask.index(x, y - _first_row), color_type{ sum[1] / sum[0], sum[2] / sum[0], sum[3] / sum[0] }, (float)weight);
+            }
+        }
+    }
+
+    /**
+     * @brief Scene with the colors and boundary conditions.
+     */
+    const scene& source;
+    /**
+     * @brief Flattened curves of the scene.
+     */
+    const flattened_scene& curves;
+    /**
+     * @brief Parameters of the rasterization.
+     */
+    rasterization_options options;
+};
+
+/**
+ * @brief Rasterizes the diffusion curves of a scene into Dirichlet constraints, flattening the curves with a quarter pixel tolerance.
+ * @param _scene Scene to rasterize.
+ * @param _width Width of the constraint grid in pixels.
+ * @param _height Height of the constraint grid in pixels.
+ * @param _options Parameters of the rasterization.
+ * @return Constraint mask and colors.
+ */
+inline constraint_grid rasterize_diffusion_curves(const scene& _scene, int _width, int _height, const rasterization_options& _options = rasterization_options())
+{
+    flattened_scene curves(_scene, 0.25 * _scene.width / std::max(1, _width));
+    constraint_grid constraints(_width, _height);
+    diffusion_curve_rasterizer(_scene, curves, _options).rasterize(constraints);
+    return constraints;
+}
@@ -0,0 +1,353 @@
+#pragma once
+
+#include "parallel.hpp"
+#include "reader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Piecewise linear approximation of a curve.
+ */
+struct polyline
+{
+    /**
+     * @brief Vertices of the polyline.
+     */
+    std::vector<point_type> points;
+    /**
+     * @brief Global curve parameter in [0,1] per vertex, i.e., the same parameterization as the normalized globalID of the color points.
+     */
+    std::vector<double> params;
+
+    /**
+     * @brief Number of line segments of the polyline.
+     * @return Number of segments.
+     */
+    int num_segments() const
+    {
+        return points.size() < 2 ? 0 : (int)points.size() - 1;
+    }
+};
+
+/**
+ * @brief Evaluates a cubic Bezier segment.
+ * @param _p0 First control point.
+ * @param _p1 Second control point.
+ * @param _p2 Third control point.
+ * @param _p3 Fourth control point.
+ * @param _t Curve parameter in [0,1].
+ * @return Point on the curve.
+ */
+inline point_type evaluate_bezier(const point_type& _p0, const point_type& _p1, const point_type& _p2, const point_type& _p3, double _t)
+{
+    double s  = 1 - _t;
+    double b0 = s * s * s;
+    double b1 = 3 * s * s * _t;
+    double b2 = 3 * s * _t * _t;
+    double b3 = _t * _t * _t;
+    return point_type{ b0 * _p0[0] + b1 * _p1[0] + b2 * _p2[0] + b3 * _p3[0],
+                       b0 * _p0[1] + b1 * _p1[1] + b2 * _p2[1] + b3 * _p3[1] };
+}
+
+/**
+ * @brief Number of cubic Bezier segments in a chain of control points, which are stored as 3n+1 points with shared end points.
+ * @param _control_points Control points of the chain.
+ * @return Number of cubic segments.
+ */
+inline int num_bezier_segments(const std::vector<point_type>& _control_points)
+{
+    return _control_points.size() < 4 ? 0 : ((int)_control_points.size() - 1) / 3;
+}
+
+/**
+ * @brief Interpolates piecewise linearly between color points that are sorted by their parameter location.
+ * @param _color_points Colors with parameter location (r, g, b, t).
+ * @param _t Parameter location to sample at.
+ * @return Interpolated color, or black if no color points are given.
+ */
+inline color_type sample_color_points(const std::vector<color_point_type>& _color_points, double _t)
+{
+    if (_color_points.empty())
+        return color_type{ 0, 0, 0 };
+    if (_t <= _color_points.front()[3])
+        return color_type{ _color_points.front()[0], _color_points.front()[1], _color_points.front()[2] };
+    if (_t >= _color_points.back()[3])
+        return color_type{ _color_points.back()[0], _color_points.back()[1], _color_points.back()[2] };
+
+    std::vector<color_point_type>::const_iterator upper = std::upper_bound(_color_points.begin(), _color_points.end(), _t,
+                                                                           [](double t, const color_point_type& cp) { return t < cp[3]; });
+    const color_point_type& c1 = *upper;
+    const color_point_type& c0 = *(upper - 1);
+    double span = c1[3] - c0[3];
+    double w    = span > 0 ? (_t - c0[3]) / span : 0;
+    return color_type{ (1 - w) * c0[0] + w * c1[0],
+                       (1 - w) * c0[1] + w * c1[1],
+                       (1 - w) * c0[2] + w * c1[2] };
+}
+
+/**
+ * @brief Approximates a chain of cubic Bezier segments by a polyline.
+ * @details Each segment is subdivided recursively until its control polygon deviates by at most the tolerance from its chord. The global parameter of the chain distributes uniformly over the Bezier segments.
+ * @param _control_points Control points of the chain, stored as 3n+1 points.
+ * @param _tolerance Maximum distance between the curve and the polyline.
+ * @return Polyline approximating the chain.
+ */
+inline polyline flatten_bezier_chain(const std::vector<point_type>& _control_points, double _tolerance)
+{
+    polyline result;
+    int num_segments = num_bezier_segments(_control_points);
+    if (num_segments == 0)
+    {
+        // degenerate chain: connect the control points directly
+        for (size_t i = 0; i < _control_points.size(); i++)
+        {
+            result.points.push_back(_control_points[i]);
+            result.params.push_back(_control_points.size() < 2 ? 0.0 : (double)i / (_control_points.size() - 1));
+        }
+        return result;
+    }
+
+    struct subdivision
+    {
+        point_type p[4];
+        double t0, t1;
+        int depth;
+    };
+    const int max_depth = 16;
+
+    result.points.push_back(_control_points[0]);
+    result.params.push_back(0.0);
+    std::vector<subdivision> stack;
+    for (int segment = 0; segment < num_segments; segment++)
+    {
+        subdivision root;
+        for (int i = 0; i < 4; i++)
+            root.p[i] = _control_points[3 * segment + i];
+        root.t0    = (double)segment / num_segments;
+        root.t1    = (double)(segment + 1) / num_segments;
+        root.depth = 0;
+        stack.push_back(root);
+
+        // depth-first traversal, pushing the right half first so that vertices are emitted in order
+        while (!stack.empty())
+        {
+            subdivision s = stack.back();
+            stack.pop_back();
+
+            double dx     = s.p[3][0] - s.p[0][0];
+            double dy     = s.p[3][1] - s.p[0][1];
+            double length = std::sqrt(dx * dx + dy * dy);
+            double d1, d2;
+            if (length > 1e-12)
+            {
+                d1 = std::abs((s.p[1][0] - s.p[0][0]) * dy - (s.p[1][1] - s.p[0][1]) * dx) / length;
+                d2 = std::abs((s.p[2][0] - s.p[0][0]) * dy - (s.p[2][1] - s.p[0][1]) * dx) / length;
+            }
+            else
+            {
+                d1 = std::hypot(s.p[1][0] - s.p[0][0], s.p[1][1] - s.p[0][1]);
+                d2 = std::hypot(s.p[2][0] - s.p[0][0], s.p[2][1] - s.p[0][1]);
+            }
+
+            if (std::max(d1, d2) <= _tolerance || s.depth >= max_depth)
+            {
+                result.points.push_back(s.p[3]);
+                result.params.push_back(s.t1);
+                continue;
+            }
+
+            // de Casteljau split at the half
+            point_type p01, p12, p23, p012, p123, mid;
+            for (int d = 0; d < 2; d++)
+            {
+                p01[d]  = 0.5 * (s.p[0][d] + s.p[1][d]);
+                p12[d]  = 0.5 * (s.p[1][d] + s.p[2][d]);
+                p23[d]  = 0.5 * (s.p[2][d] + s.p[3][d]);
+                p012[d] = 0.5 * (p01[d] + p12[d]);
+                p123[d] = 0.5 * (p12[d] + p23[d]);
+                mid[d]  = 0.5 * (p012[d] + p123[d]);
+            }
+            double t_mid = 0.5 * (s.t0 + s.t1);
+            subdivision left  = { { s.p[0], p01, p012, mid }, s.t0, t_mid, s.depth + 1 };
+            subdivision right = { { mid, p123, p23, s.p[3] }, t_mid, s.t1, s.depth + 1 };
+            stack.push_back(right);
+            stack.push_back(left);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Removes vertices of a polyline while staying within a tolerance (Douglas-Peucker).
+ * @details The first and last vertex are kept. Between two kept vertices, the vertex farthest from their segment is kept as well if its distance exceeds the tolerance, recursively. The remaining vertices keep their global parameters.
+ * @param _line Polyline to decimate.
+ * @param _tolerance Maximum distance between the removed vertices and the decimated polyline.
+ * @return Decimated polyline.
+ */
+inline polyline decimate_polyline(const polyline& _line, double _tolerance)
+{
+    int num_points = (int)_line.points.size();
+    if (num_points <= 2)
+        return _line;
+
+    std::vector<char> keep(num_points, 0);
+    keep.front() = keep.back() = 1;
+    std::vector<std::pair<int, int>> stack = { { 0, num_points - 1 } };
+    double tolerance_squared = _tolerance * _tolerance;
+    while (!stack.empty())
+    {
+        std::pair<int, int> range = stack.back();
+        stack.pop_back();
+        const point_type& a = _line.points[range.first];
+        const point_type& b = _line.points[range.second];
+        double dx = b[0] - a[0], dy = b[1] - a[1];
+        double length_squared = dx * dx + dy * dy;
+        double farthest = tolerance_squared;
+        int split       = -1;
+        for (int i = range.first + 1; i < range.second; i++)
+        {
+            double wx = _line.points[i][0] - a[0], wy = _line.points[i][1] - a[1];
+            double t  = length_squared > 0 ? std::min(1.0, std::max(0.0, (wx * dx + wy * dy) / length_squared)) : 0;
+            double ex = wx - t * dx, ey = wy - t * dy;
+            if (ex * ex + ey * ey > farthest)
+                farthest = ex * ex + ey * ey, split = i;
+        }
+        if (split < 0)
+            continue;
+        keep[split] = 1;
+        stack.push_back({ range.first, split });
+        stack.push_back({ split, range.second });
+    }
+
+    polyline result;
+    for (int i = 0; i < num_points; i++)
+    {
+        if (!keep[i])
+            continue;
+        result.points.push_back(_line.points[i]);
+        result.params.push_back(_line.params[i]);
+    }
+    return result;
+}
+
+/**
+ * @brief Polyline approximation of all curves of a scene.
+ */
+class flattened_scene
+{
+public:
+    /**
+     * @brief Creates an empty set of curves, e.g., to bin only the mesh patches of a scene.
+     * @param _width Width of the scene.
+     * @param _height Height of the scene.
+     */
+    flattened_scene(int _width, int _height)
+        : width(_width)
+        , height(_height)
+        , tolerance(0)
+    {
+    }
+
+    /**
+     * @brief Flattens the diffusion curves and Poisson curves of a scene.
+     * @param _scene Scene to flatten.
+     * @param _tolerance Maximum distance between the curves and their polylines in scene units.
+     */
+    flattened_scene(const scene& _scene, double _tolerance)
+        : width(_scene.width)
+        , height(_scene.height)
+        , tolerance(_tolerance)
+    {
+        diffusion_curves.resize(_scene.diffusion_curves.size());
+        poisson_curves.resize(_scene.poisson_curves.size());
+        parallel_flatten(_scene);
+    }
+
+    /**
+     * @brief Polylines of the diffusion curves, in the same order as in the scene.
+     */
+    std::vector<polyline> diffusion_curves;
+    /**
+     * @brief Polylines of the Poisson curves, in the same order as in the scene.
+     */
+    std::vector<polyline> poisson_curves;
+    /**
+     * @brief Width of the scene that was flattened.
+     */
+    int width;
+    /**
+     * @brief Height of the scene that was flattened.
+     */
+    int height;
+    /**
+     * @brief Tolerance that was used for flattening.
+     */
+    double tolerance;
+
+    /**
+     * @brief Total number of line segments of all diffusion curves.
+     * @return Number of segments.
+     */
+    int num_diffusion_segments() const
+    {
+        int count = 0;
+        for (const polyline& curve : diffusion_curves)
+            count += curve.num_segments();
+        return count;
+    }
+
+    /**
+     * @brief Total number of line segments of all Poisson curves.
+     * @return Number of segments.
+     */
+    int num_poisson_segments() const
+    {
+        int count = 0;
+        for (const polyline& curve : poisson_curves)
+            count += curve.num_segments();
+        return count;
+    }
+
+    /**
+     * @brief Coarsens the polylines to a larger tolerance without flattening the curves again.
+     * @details The polylines are decimated by the difference of the tolerances, such that the decimated polylines stay within the larger tolerance of the curves.
+     * @param _tolerance New tolerance in scene units, at least the current one.
+     * @return Decimated copy of the polylines.
+     */
+    flattened_scene decimated(double _tolerance) const
+    {
+        flattened_scene result(width, height);
+        result.tolerance = std::max(tolerance, _tolerance);
+        result.diffusion_curves.resize(diffusion_curves.size());
+        result.poisson_curves.resize(poisson_curves.size());
+        int num_diffusion = (int)diffusion_curves.size();
+        double budget     = result.tolerance - tolerance;
+        parallel_for(0, num_diffusion + (int)poisson_curves.size(), [&](int i) {
+            if (i < num_diffusion)
+                result.diffusion_curves[i] = decimate_polyline(diffusion_curves[i], budget);
+            else
+                result.poisson_curves[i - num_diffusion] = decimate_polyline(poisson_curves[i - num_diffusion], budget);
+        });
+        return result;
+    }
+
+private:
+    /**
+     * @brief Flattens all curves of the scene in parallel.
+     * @param _scene Scene to flatten.
+     */
+    void parallel_flatten(const scene& _scene)
+    {
+        int num_diffusion = (int)_scene.diffusion_curves.size();
+        int num_poisson   = (int)_scene.poisson_curves.size();
+        parallel_for(0, num_diffusion + num_poisson, [&](int i) {
+            if (i < num_diffusion)
+                diffusion_curves[i] = flatten_bezier_chain(_scene.diffusion_curves[i].control_points, tolerance);
+            else
+                poisson_curves[i - num_diffusion] = flatten_bezier_chain(_scene.poisson_curves[i - num_diffusion].control_points, tolerance);
+        });
+    }
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include "binning.hpp"
+#include "grid.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Parameters of the distance field computation.
+ */
+struct distance_field_options
+{
+    /**
+     * @brief Radius in pixels around the curves in which the distances are computed exactly from the binned segments.
+     */
+    double exact_radius = 2;
+    /**
+     * @brief Edge length in pixels of the tiles that are used for the exact distances.
+     */
+    int tile_size = 32;
+    /**
+     * @brief Include the diffusion curves.
+     */
+    bool diffusion_curves = true;
+    /**
+     * @brief Include the Poisson curves.
+     */
+    bool poisson_curves = true;
+};
+
+/**
+ * @brief Distance from every pixel center to the nearest curve of a scene, together with the nearest curve and its parameter.
+ * @details Pixels within the exact radius of a curve test all segments of their tile. The remaining pixels are filled by jump flooding with one additional pass of step one (JFA+1), where each pixel stores the nearest segment rather than the nearest point. Candidates are therefore compared by their exact distance to the segment, which keeps the error of the flooding small. All passes run in parallel over the image rows.
+ */
+class curve_distance_field
+{
+public:
+    /**
+     * @brief Computes the distance field of flattened curves.
+     * @param _curves Flattened curves of the scene.
+     * @param _width Width of the field in pixels.
+     * @param _height Height of the field in pixels.
+     * @param _options Parameters of the computation.
+     */
+    curve_distance_field(const flattened_scene& _curves, int _width, int _height, const distance_field_options& _options)
+        : distance(_width, _height, std::numeric_limits<float>::infinity())
+        , curve(_width, _height, -1)
+        , parameter(_width, _height, 0.0f)
+        , num_diffusion_curves(_options.diffusion_curves ? (int)_curves.diffusion_curves.size() : 0)
+        , num_seeds(0)
+    {
+        binning_options binning;
+        binning.tile_size        = _options.tile_size;
+        binning.margin           = _options.exact_radius;
+        binning.diffusion_curves = _options.diffusion_curves;
+        binning.poisson_curves   = _options.poisson_curves;
+        binning.mesh_patches     = false;
+        tile_bins bins(_curves, std::vector<mesh_patch>(), _width, _height, binning);
+        collect_segments(_curves, bins);
+
+        std::vector<int> nearest((size_t)_width * _height, -1);
+        seed(bins, _options.exact_radius, nearest);
+        flood(nearest);
+        resolve(nearest);
+    }
+
+    /**
+     * @brief Computes the distance field of the curves of a scene, flattened with a quarter pixel tolerance.
+     * @param _scene Scene with the curves.
+     * @param _width Width of the field in pixels.
+     * @param _height Height of the field in pixels.
+     * @param _options Parameters of the computation.
+     */
+    curve_distance_field(const scene& _scene, int _width, int _height, const distance_field_options& _options)
+        : curve_distance_field(flattened_scene(_scene, 0.25 * _scene.width / std::max(1, _width)), _width, _height, _options)
+    {
+    }
+
+    /**
+     * @brief Distance in pixels from each pixel center to the nearest curve, or infinity if there are no curves.
+     */
+    grid<float> distance;
+    /**
+     * @brief Nearest curve per pixel, or -1 if there are no curves. Diffusion curves come first, followed by the Poisson curves with an offset of num_diffusion_curves.
+     */
+    grid<int> curve;
+    /**
+     * @brief Global parameter of the closest point on the nearest curve.
+     */
+    grid<float> parameter;
+    /**
+     * @brief Number of diffusion curves, i.e., the offset of the Poisson curve ids.
+     */
+    int num_diffusion_curves;
+    /**
+     * @brief Number of pixels whose distance was computed exactly from the binned segments.
+     */
+    long long num_seeds;
+
+    /**
+     * @brief Checks whether a curve id refers to a Poisson curve.
+     * @param _curve Curve id as stored in the curve grid.
+     * @return True for Poisson curves.
+     */
+    bool is_poisson_curve(int _curve) const
+    {
+        return _curve >= num_diffusion_curves;
+    }
+
+    /**
+     * @brief Index of a curve in its list, i.e., the diffusion curves or the Poisson curves of the scene.
+     * @param _curve Curve id as stored in the curve grid.
+     * @return Index in the list of the scene.
+     */
+    int curve_index(int _curve) const
+    {
+        return is_poisson_curve(_curve) ? _curve - num_diffusion_curves : _curve;
+    }
+
+private:
+    /**
+     * @brief Line segment in pixel coordinates with the curve parameters at its end points.
+     */
+    struct segment
+    {
+        point_type p0, p1;
+        double inverse_length_squared;
+        double t0, t1;
+        int curve;
+    };
+
+    /**
+     * @brief Transforms the binned segments to pixel coordinates, keeping the order of the primitive list.
+     * @param _curves Flattened curves.
+     * @param _bins Bins of the segments.
+     */
+    void collect_segments(const flattened_scene& _curves, const tile_bins& _bins)
+    {
+        segments.resize(_bins.primitives.size());
+        for (size_t i = 0; i < _bins.primitives.size(); i++)
+        {
+            const primitive_ref& ref = _bins.primitives[i];
+            const polyline& line     = ref.kind == primitive_kind::diffusion_segment ? _curves.diffusion_curves[ref.index] : _curves.poisson_curves[ref.index];
+            segment& s = segments[i];
+            s.p0    = point_type{ line.points[ref.element][0] * _bins.scale_x, line.points[ref.element][1] * _bins.scale_y };
+            s.p1    = point_type{ line.points[ref.element + 1][0] * _bins.scale_x, line.points[ref.element + 1][1] * _bins.scale_y };
+            double length_squared = (s.p1[0] - s.p0[0]) * (s.p1[0] - s.p0[0]) + (s.p1[1] - s.p0[1]) * (s.p1[1] - s.p0[1]);
+            s.inverse_length_squared = length_squared > 0 ? 1 / length_squared : 0;
+            s.t0    = line.params[ref.element];
+            s.t1    = line.params[ref.element + 1];
+            s.curve = ref.kind == primitive_kind::diffusion_segment ? ref.index : num_diffusion_curves + ref.index;
+        }
+    }
+
+    /**
+     * @brief Squared distance from a point to a segment.
+     * @param _segment Segment index.
+     * @param _x Point in pixels.
+     * @param _y Point in pixels.
+     * @param _t Output parameter of the closest point on the segment in [0,1].
+     * @return Squared distance in pixels.
+     */
+    double squared_distance(int _segment, double _x, double _y, double& _t) const
+    {
+        const segment& s = segments[_segment];
+        double dx = s.p1[0] - s.p0[0], dy = s.p1[1] - s.p0[1];
+        double wx = _x - s.p0[0], wy = _y - s.p0[1];
+        _t = std::min(1.0, std::max(0.0, (wx * dx + wy * dy) * s.inverse_length_squared));
+        double ex = wx - _t * dx, ey = wy - _t * dy;
+        return ex * ex + ey * ey;
+    }
+
+    /**
+     * @brief Finds the nearest segment of all pixels within the exact radius of a curve, one tile per task.
+     * @param _bins Bins of the segments, enlarged by the exact radius.
+     * @param _radius Exact radius in pixels.
+     * @param _nearest Output nearest segment per pixel, or -1.
+     */
+    void seed(const tile_bins& _bins, double _radius, std::vector<int>& _nearest)
+    {
+        int width = distance.width, height = distance.height;
+        std::vector<long long> tile_seeds(_bins.num_tiles(), 0);
+        _bins.parallel_for_tiles([&](int tile) {
+            int x0 = (tile % _bins.tiles_x) * _bins.tile_size, y0 = (tile / _bins.tiles_x) * _bins.tile_size;
+            int x1 = std::min(width, x0 + _bins.tile_size), y1 = std::min(height, y0 + _bins.tile_size);
+            for (int y = y0; y < y1; y++)
+            {
+                for (int x = x0; x < x1; x++)
+                {
+                    double best = _radius * _radius, t;
+                    int best_segment = -1;
+                    for (const int* entry = _bins.begin(tile); entry != _bins.end(tile); entry++)
+                    {
+                        double d = squared_distance(*entry, x + 0.5, y + 0.5, t);
+                        if (d <= best)
+                            best = d, best_segment = *entry;
+                    }
+                    _nearest[(size_t)y * width + x] = best_segment;
+                    tile_seeds[tile] += best_segment >= 0;
+                }
+            }
+        });
+        for (long long count : tile_seeds)
+            num_seeds += count;
+    }
+
+    /**
+     * @brief Propagates the nearest segments to all pixels by jump flooding, followed by one pass with step one.
+     * @param _nearest Nearest segment per pixel, updated in place.
+     */
+    void flood(std::vector<int>& _nearest) const
+    {
+        int width = distance.width, height = distance.height;
+        if (segments.empty() || width == 0 || height == 0)
+            return;
+
+        int step = 1;
+        while (step * 2 < std::max(width, height))
+            step *= 2;
+        std::vector<int> steps;
+        for (; step >= 1; step /= 2)
+            steps.push_back(step);
+        steps.push_back(1);
+
+        std::vector<int> next(_nearest.size());
+        for (int jump : steps)
+        {
+            parallel_for(0, height, [&](int y) {
+                for (int x = 0; x < width; x++)
+                {
+                    double px = x + 0.5, py = y + 0.5, t;
+                    int best_segment = _nearest[(size_t)y * width + x];
+                    double best = best_segment >= 0 ? squared_distance(best_segment, px, py, t) : std::numeric_limits<double>::infinity();
+                    // neighbors far from the curves mostly share their segment, which is tested only once in a row
+                    int tested = best_segment;
+                    for (int dy = -jump; dy <= jump; dy += jump)
+                    {
+                        int ny = y + dy;
+                        if (ny < 0 || ny >= height)
+                            continue;
+                        for (int dx = -jump; dx <= jump; dx += jump)
+                        {
+                            int nx = x + dx;
+                            if (nx < 0 || nx >= width)
+                                continue;
+                            int candidate = _nearest[(size_t)ny * width + nx];
+                            if (candidate < 0 || candidate == tested)
+                                continue;
+                            tested   = candidate;
+                            double d = squared_distance(candidate, px, py, t);
+                            if (d < best)
+                                best = d, best_segment = candidate;
+                        }
+                    }
+                    next[(size_t)y * width + x] = best_segment;
+                }
+            });
+            _nearest.swap(next);
+        }
+    }
+
+    /**
+     * @brief Writes the distance, curve and parameter grids from the nearest segment of each pixel.
+     * @param _nearest Nearest segment per pixel, or -1.
+     */
+    void resolve(const std::vector<int>& _nearest)
+    {
+        int width = distance.width;
+        parallel_for(0, distance.height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                int nearest_segment = _nearest[(size_t)y * width + x];
+                if (nearest_segment < 0)
+                    continue;
+                double t;
+                double d       = squared_distance(nearest_segment, x + 0.5, y + 0.5, t);
+                const segment& s = segments[nearest_segment];
+                distance(x, y)  = (float)std::sqrt(d);
+                curve(x, y)     = s.curve;
+                parameter(x, y) = (float)(s.t0 + t * (s.t1 - s.t0));
+            }
+        });
+    }
+
+    /**
+     * @brief Segments of all included curves in pixel coordinates.
+     */
+    std::vector<segment> segments;
+};
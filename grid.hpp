@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Regular 2D grid of values, stored row by row.
+ * @tparam T Type of the values.
+ */
+template <typename T>
+class grid
+{
+public:
+    /**
+     * @brief Creates an empty grid.
+     */
+    grid()
+        : width(0)
+        , height(0)
+    {
+    }
+
+    /**
+     * @brief Creates a grid with all values set to the same value.
+     * @param _width Number of columns.
+     * @param _height Number of rows.
+     * @param _value Initial value.
+     */
+    grid(int _width, int _height, const T& _value = T())
+        : width(_width)
+        , height(_height)
+        , data((size_t)_width * _height, _value)
+    {
+    }
+
+    /**
+     * @brief Number of columns.
+     */
+    int width;
+    /**
+     * @brief Number of rows.
+     */
+    int height;
+    /**
+     * @brief Values in row-major order, i.e., the value at (x,y) is stored at y * width + x.
+     */
+    std::vector<T> data;
+
+    /**
+     * @brief Resizes the grid and sets all values.
+     * @param _width Number of columns.
+     * @param _height Number of rows.
+     * @param _value Value of all cells.
+     */
+    void assign(int _width, int _height, const T& _value = T())
+    {
+        width  = _width;
+        height = _height;
+        data.assign((size_t)_width * _height, _value);
+    }
+
+    /**
+     * @brief Number of cells.
+     * @return Width times height.
+     */
+    size_t size() const
+    {
+        return data.size();
+    }
+
+    /**
+     * @brief Linear index of a cell.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Index into the data.
+     */
+    size_t index(int _x, int _y) const
+    {
+        return (size_t)_y * width + _x;
+    }
+
+    /**
+     * @brief Accesses a cell.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Reference to the value.
+     */
+    T& operator()(int _x, int _y)
+    {
+        return data[index(_x, _y)];
+    }
+
+    /**
+     * @brief Accesses a cell.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Reference to the value.
+     */
+    const T& operator()(int _x, int _y) const
+    {
+        return data[index(_x, _y)];
+    }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "grid.hpp"
+#include "reader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <string>
+
+/**
+ * @brief Rendered RGB image with linear color values, nominally in [0,1].
+ */
+using image = grid<color_type>;
+
+/**
+ * @brief Writes an image as binary PPM, clamping the colors to [0,1].
+ * @param _image Image to write.
+ * @param _path Path of the file.
+ * @return True if the file was written.
+ */
+inline bool write_ppm(const image& _image, const std::string& _path)
+{
+    std::ofstream file(_path, std::ios::binary);
+    if (!file.good())
+        return false;
+    file << "P6\n" << _image.width << " " << _image.height << "\n255\n";
+    for (const color_type& color : _image.data)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            double value = std::min(1.0, std::max(0.0, color[c]));
+            file.put((char)(unsigned char)std::lround(255 * value));
+        }
+    }
+    return file.good();
+}
+
+/**
+ * @brief Root mean square difference of two images of the same size, over all pixels and channels.
+ * @param _a First image.
+ * @param _b Second image.
+ * @return RMS difference.
+ */
+inline double rms_difference(const image& _a, const image& _b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < _a.data.size(); i++)
+        for (int c = 0; c < 3; c++)
+            sum += (_a.data[i][c] - _b.data[i][c]) * (_a.data[i][c] - _b.data[i][c]);
+    return _a.data.empty() ? 0 : std::sqrt(sum / (3.0 * _a.data.size()));
+}
+
+/**
+ * @brief Peak signal-to-noise ratio of an image with respect to a reference, with a peak of one.
+ * @param _image Image to compare.
+ * @param _reference Reference image of the same size.
+ * @return PSNR in dB, or infinity for identical images.
+ */
+inline double psnr(const image& _image, const image& _reference)
+{
+    double rms = rms_difference(_image, _reference);
+    return rms > 0 ? -20 * std::log10(rms) : std::numeric_limits<double>::infinity();
+}
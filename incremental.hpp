@@ -0,0 +1,565 @@
+#pragma once
+
+#include "image.hpp"
+#include "multigrid.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "solver.hpp"
+#include "viewport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Axis-aligned rectangle of pixels, [x0, x1) x [y0, y1).
+ */
+struct pixel_rectangle
+{
+    /**
+     * @brief First column.
+     */
+    int x0 = 0;
+    /**
+     * @brief First row.
+     */
+    int y0 = 0;
+    /**
+     * @brief One past the last column.
+     */
+    int x1 = 0;
+    /**
+     * @brief One past the last row.
+     */
+    int y1 = 0;
+
+    /**
+     * @brief Checks whether the rectangle contains no pixels.
+     * @return True if empty.
+     */
+    bool empty() const
+    {
+        return x1 <= x0 || y1 <= y0;
+    }
+
+    /**
+     * @brief Number of pixels.
+     * @return Width times height.
+     */
+    long long area() const
+    {
+        return empty() ? 0 : (long long)(x1 - x0) * (y1 - y0);
+    }
+
+    /**
+     * @brief Extends the rectangle to the bounding box of itself and another one.
+     * @param _other Rectangle to include.
+     */
+    void include(const pixel_rectangle& _other)
+    {
+        if (_other.empty())
+            return;
+        if (empty())
+        {
+            *this = _other;
+            return;
+        }
+        x0 = std::min(x0, _other.x0);
+        y0 = std::min(y0, _other.y0);
+        x1 = std::max(x1, _other.x1);
+        y1 = std::max(y1, _other.y1);
+    }
+
+    /**
+     * @brief Grows the rectangle on all sides, clamped to an image.
+     * @param _margin Pixels to add on every side.
+     * @param _width Width of the image.
+     * @param _height Height of the image.
+     * @return Grown rectangle.
+     */
+    pixel_rectangle grown(int _margin, int _width, int _height) const
+    {
+        pixel_rectangle result;
+        result.x0 = std::max(0, x0 - _margin);
+        result.y0 = std::max(0, y0 - _margin);
+        result.x1 = std::min(_width, x1 + _margin);
+        result.y1 = std::min(_height, y1 + _margin);
+        return result;
+    }
+};
+
+/**
+ * @brief Parameters of the incremental solve.
+ */
+struct incremental_options
+{
+    /**
+     * @brief Residual of the previous solution in the edited system, per pixel and channel, above which a pixel counts as changed.
+     */
+    double change_threshold = 1e-3;
+    /**
+     * @brief Pixels around the changed region in the first window; doubled in every further round.
+     */
+    int margin = 16;
+    /**
+     * @brief Largest change of the solution next to the border of the window that ends the growth: a quarter of an 8-bit step.
+     */
+    double max_color_change = 1.0 / 1024;
+    /**
+     * @brief Fraction of the image that the windows of all rounds may cover together before the whole image is solved instead.
+     */
+    double max_fraction = 0.25;
+    /**
+     * @brief Relative residual of the solves of the correction, which replaces the tolerance in the multigrid options; the correction is only a part of the solution, so a loose tolerance suffices.
+     */
+    double tolerance = 1e-3;
+    /**
+     * @brief Pixels around a changed region whose equations update_poisson_system assembles again, which must cover the reach of the rasterization, the splatting and the mesh borders.
+     */
+    int assembly_margin = 4;
+    /**
+     * @brief Parameters of the multigrid solves of the windows and of the fallback.
+     */
+    multigrid_options multigrid;
+};
+
+/**
+ * @brief Outcome of an incremental solve.
+ */
+struct incremental_statistics
+{
+    /**
+     * @brief Pixels whose equations changed.
+     */
+    pixel_rectangle changed;
+    /**
+     * @brief Last window that was solved; the whole image after a fallback.
+     */
+    pixel_rectangle window;
+    /**
+     * @brief Number of windows that were solved.
+     */
+    int rounds = 0;
+    /**
+     * @brief True if the window grew too large and the whole image was solved.
+     */
+    bool global = false;
+    /**
+     * @brief Largest change of the solution next to the border of the last window.
+     */
+    double border_change = 0;
+    /**
+     * @brief Multigrid cycles over all rounds.
+     */
+    int cycles = 0;
+    /**
+     * @brief Time for the whole incremental solve, in milliseconds.
+     */
+    double solve_ms = 0;
+};
+
+/**
+ * @brief Finds the pixels whose equations changed since a solution was computed, by the residual of the solution in the edited system.
+ * @details Where the system did not change, the residual is that of the previous solve, i.e., tiny. Pinned pixels count as changed if their color differs from the previous solution.
+ * @param _system Edited Poisson system.
+ * @param _previous Solution of the system before the edit.
+ * @param _threshold Residual per pixel and channel above which a pixel counts as changed.
+ * @return Bounding box of the changed pixels; empty if nothing changed.
+ */
+inline pixel_rectangle changed_pixels(const poisson_system& _system, const image& _previous, double _threshold)
+{
+    const int width = _system.width, height = _system.height;
+    std::vector<pixel_rectangle> rows(height);
+    parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; x++)
+        {
+            size_t i = (size_t)y * width + x;
+            double change = 0;
+            if (is_pinned(_system, i))
+            {
+                for (int c = 0; c < 3; c++)
+                    change = std::max(change, std::abs(_system.constraints.colors.data[i][c] - _previous.data[i][c]));
+            }
+            else
+            {
+                color_type rhs;
+                double diagonal = pixel_equation(_system, x, y, rhs);
+                if (diagonal == 0)
+                    continue;
+                color_type sum = neighbor_sum(_system, _previous, x, y);
+                for (int c = 0; c < 3; c++)
+                    change = std::max(change, std::abs(rhs[c] + sum[c] - diagonal * _previous.data[i][c]));
+            }
+            if (change <= _threshold)
+                continue;
+            pixel_rectangle pixel;
+            pixel.x0 = x;
+            pixel.y0 = y;
+            pixel.x1 = x + 1;
+            pixel.y1 = y + 1;
+            rows[y].include(pixel);
+        }
+    });
+    pixel_rectangle result;
+    for (const pixel_rectangle& row : rows)
+        result.include(row);
+    return result;
+}
+
+/**
+ * @brief Finds the pixels that the primitives which differ between two versions of a scene may affect, without assembling the old version.
+ * @details Primitives are matched by their index. The region is the bounding box of the control points of the changed, added and removed primitives in both versions, where the tangents of the gradient meshes extend the boxes of their vertices. Unlike changed_pixels, it misses effects that reach beyond the primitives, such as the rebalancing of a floating region that an edit opens or closes, so a margin should cover the rasterization radius at least.
+ * @param _old Scene before the edit.
+ * @param _new Scene after the edit, with the same size.
+ * @param _width Width of the image in pixels.
+ * @param _height Height of the image in pixels.
+ * @return Bounding box in pixels, clamped to the image; empty if nothing changed.
+ */
+inline pixel_rectangle changed_region(const scene& _old, const scene& _new, int _width, int _height)
+{
+    double sx = _new.width > 0 ? (double)_width / _new.width : 1, sy = _new.height > 0 ? (double)_height / _new.height : 1;
+    pixel_rectangle result;
+    auto include = [&](const point_type& _point, double _extent) {
+        pixel_rectangle box;
+        box.x0 = std::max(0, std::min(_width, (int)std::floor((_point[0] - _extent) * sx)));
+        box.y0 = std::max(0, std::min(_height, (int)std::floor((_point[1] - _extent) * sy)));
+        box.x1 = std::max(0, std::min(_width, (int)std::ceil((_point[0] + _extent) * sx) + 1));
+        box.y1 = std::max(0, std::min(_height, (int)std::ceil((_point[1] + _extent) * sy) + 1));
+        result.include(box);
+    };
+    auto include_points = [&](const std::vector<point_type>& _points) {
+        for (const point_type& point : _points)
+            include(point, 0);
+    };
+    auto include_mesh = [&](const gradient_mesh& _mesh) {
+        for (size_t v = 0; v < _mesh.positions.size(); v++)
+        {
+            double extent = 0;
+            if (v < _mesh.tangents_u.size())
+                extent = std::max(extent, std::hypot(_mesh.tangents_u[v][0], _mesh.tangents_u[v][1]));
+            if (v < _mesh.tangents_v.size())
+                extent = std::max(extent, std::hypot(_mesh.tangents_v[v][0], _mesh.tangents_v[v][1]));
+            include(_mesh.positions[v], extent);
+        }
+    };
+
+    for (size_t i = 0; i < std::max(_old.diffusion_curves.size(), _new.diffusion_curves.size()); i++)
+    {
+        const diffusion_curve* before = i < _old.diffusion_curves.size() ? &_old.diffusion_curves[i] : nullptr;
+        const diffusion_curve* after  = i < _new.diffusion_curves.size() ? &_new.diffusion_curves[i] : nullptr;
+        if (before != nullptr && after != nullptr && before->control_points == after->control_points && before->colors_left == after->colors_left &&
+            before->colors_right == after->colors_right && before->boundary_left == after->boundary_left && before->boundary_right == after->boundary_right)
+            continue;
+        if (before != nullptr)
+            include_points(before->control_points);
+        if (after != nullptr)
+            include_points(after->control_points);
+    }
+    for (size_t i = 0; i < std::max(_old.poisson_curves.size(), _new.poisson_curves.size()); i++)
+    {
+        const poisson_curve* before = i < _old.poisson_curves.size() ? &_old.poisson_curves[i] : nullptr;
+        const poisson_curve* after  = i < _new.poisson_curves.size() ? &_new.poisson_curves[i] : nullptr;
+        if (before != nullptr && after != nullptr && before->control_points == after->control_points && before->weights == after->weights)
+            continue;
+        if (before != nullptr)
+            include_points(before->control_points);
+        if (after != nullptr)
+            include_points(after->control_points);
+    }
+    for (size_t i = 0; i < std::max(_old.gradient_meshes.size(), _new.gradient_meshes.size()); i++)
+    {
+        const gradient_mesh* before = i < _old.gradient_meshes.size() ? &_old.gradient_meshes[i] : nullptr;
+        const gradient_mesh* after  = i < _new.gradient_meshes.size() ? &_new.gradient_meshes[i] : nullptr;
+        if (before != nullptr && after != nullptr && before->num_rows == after->num_rows && before->num_cols == after->num_cols &&
+            before->positions == after->positions && before->colors == after->colors && before->tangents_u == after->tangents_u &&
+            before->tangents_v == after->tangents_v)
+            continue;
+        if (before != nullptr)
+            include_mesh(*before);
+        if (after != nullptr)
+            include_mesh(*after);
+    }
+    return result;
+}
+
+/**
+ * @brief Balances the floating regions of a Poisson system that reach into a rectangle, as balance_floating_regions does for the whole image, e.g., after update_poisson_system.
+ * @details The flood fills start at the pixels of the rectangle and visit the pixels breadth-first, so that the fill of a region with constraints ends at its nearest constrained pixel, and only the floating regions are filled completely. A floating region gets the mean of its source subtracted, and its first pixel in scan order is pinned to the mean color of the constraints right across its closed edges. A region that a pin of an earlier balancing outside of the rectangle still holds counts as constrained and keeps its source.
+ * @param _system Poisson system, modified in place.
+ * @param _rectangle Pixels whose regions are balanced.
+ * @return Number of balanced regions.
+ */
+inline int balance_floating_regions(poisson_system& _system, const pixel_rectangle& _rectangle)
+{
+    // fill state of every pixel: not visited, in the current fill, in a region with constraints, or balanced
+    enum fill_state : unsigned char
+    {
+        unvisited,
+        filling,
+        constrained,
+        balanced
+    };
+    const int width = _system.width, height = _system.height;
+    std::vector<unsigned char> state((size_t)width * height, unvisited);
+    std::vector<size_t> members;
+    auto pinned = [&](size_t _i) { return _system.constraints.mask.data[_i] && _system.constraints.weights.data[_i] > 0; };
+    int num_floating = 0;
+    for (int sy = _rectangle.y0; sy < _rectangle.y1; sy++)
+    {
+        for (int sx = _rectangle.x0; sx < _rectangle.x1; sx++)
+        {
+            size_t start = (size_t)sy * width + sx;
+            if (state[start] != unvisited)
+                continue;
+            members.assign(1, start);
+            state[start]       = filling;
+            bool has_pin       = false;
+            int num_outside    = 0;
+            color_type outside = { 0, 0, 0 };
+            for (size_t next = 0; next < members.size() && !has_pin; next++)
+            {
+                size_t i = members[next];
+                has_pin  = pinned(i);
+                int x = (int)(i % width), y = (int)(i / width);
+                auto visit = [&](bool _inside, bool _blocked, size_t _neighbor) {
+                    if (!_inside)
+                        return;
+                    if (_blocked)
+                    {
+                        if (pinned(_neighbor))
+                        {
+                            for (int c = 0; c < 3; c++)
+                                outside[c] += _system.constraints.colors.data[_neighbor][c];
+                            num_outside++;
+                        }
+                    }
+                    else if (state[_neighbor] == constrained)
+                        has_pin = true;
+                    else if (state[_neighbor] == unvisited)
+                    {
+                        state[_neighbor] = filling;
+                        members.push_back(_neighbor);
+                    }
+                };
+                visit(x > 0, _system.barriers.blocked_left(x, y), i - 1);
+                visit(x + 1 < width, _system.barriers.blocked_right(x, y), i + 1);
+                visit(y > 0, _system.barriers.blocked_up(x, y), i - width);
+                visit(y + 1 < height, _system.barriers.blocked_down(x, y), i + width);
+            }
+            for (size_t i : members)
+                state[i] = has_pin ? constrained : balanced;
+            if (has_pin)
+                continue;
+
+            std::array<double, 3> sum = { { 0, 0, 0 } };
+            for (size_t i : members)
+                for (int c = 0; c < 3; c++)
+                    sum[c] += _system.source.data[i][c];
+            for (size_t i : members)
+                for (int c = 0; c < 3; c++)
+                    _system.source.data[i][c] -= sum[c] / members.size();
+            for (int c = 0; c < 3; c++)
+                outside[c] = num_outside > 0 ? outside[c] / num_outside : 0;
+            _system.constraints.set(*std::min_element(members.begin(), members.end()), outside);
+            num_floating++;
+        }
+    }
+    return num_floating;
+}
+
+/**
+ * @brief Assembles the part of a Poisson system again that an edit of its scene within a region can change, instead of the whole image.
+ * @details The region grows by the margin to the pixels whose equations may change, and by the margin again to a window, whose border is far enough from them that it does not change their equations. The window is snapped to pixels at whole scene units, such that its pixels are those of the whole image. The scene is cropped to the window with crop_scene and assembled at the resolution of the system without balancing, and the pixels of the grown region, with the edges to their right and lower neighbors, are copied into the system. Their floating regions are then balanced again. The gradient meshes are only mapped in the window, which is what dominates the assembly of the whole image. If no scene unit falls on a whole pixel, the whole system is assembled again.
+ * @param _scene Edited scene.
+ * @param _region Region in pixels whose primitives changed, e.g., from changed_region.
+ * @param _options Parameters of the assembly, as for the whole system.
+ * @param _margin Pixels around the region whose equations may change, see incremental_options::assembly_margin.
+ * @param _system Poisson system before the edit, updated in place.
+ * @return Pixels that were assembled again; the whole image if the system was assembled again.
+ */
+inline pixel_rectangle update_poisson_system(const scene& _scene, const pixel_rectangle& _region, const assembly_options& _options, int _margin, poisson_system& _system)
+{
+    const int width = _system.width, height = _system.height;
+    pixel_rectangle copied = _region.grown(_margin, width, height);
+    if (copied.empty())
+        return copied;
+    pixel_rectangle window = copied.grown(_margin, width, height);
+    const int lower[2] = { window.x0, window.y0 }, upper[2] = { window.x1, window.y1 }, extent[2] = { _scene.width, _scene.height };
+    const double scale[2] = { (double)width / std::max(1, _scene.width), (double)height / std::max(1, _scene.height) };
+    int first[2], last[2];
+    for (int d = 0; d < 2; d++)
+    {
+        int step = 1;
+        while (step <= extent[d] && std::abs(step * scale[d] - std::round(step * scale[d])) > 1e-9)
+            step++;
+        if (step > extent[d])
+        {
+            _system = assemble_poisson_system(_scene, width, height, _options);
+            pixel_rectangle all;
+            all.x1 = width;
+            all.y1 = height;
+            return all;
+        }
+        first[d] = (int)std::floor(lower[d] / scale[d] / step) * step;
+        last[d]  = std::min(extent[d], (int)std::ceil(upper[d] / scale[d] / step) * step);
+    }
+
+    viewport domain;
+    domain.x                 = first[0];
+    domain.y                 = first[1];
+    domain.width             = last[0] - first[0];
+    domain.height            = last[1] - first[1];
+    // clipped segments would be flattened to other vertices than in the whole image
+    culling_options culling;
+    culling.clip             = false;
+    cropped_scene crop       = crop_scene(_scene, domain, culling);
+    assembly_options options = _options;
+    options.balance_floating = false;
+    const int x0 = (int)std::lround(first[0] * scale[0]), y0 = (int)std::lround(first[1] * scale[1]);
+    const int local_width = (int)std::lround(last[0] * scale[0]) - x0, local_height = (int)std::lround(last[1] * scale[1]) - y0;
+    poisson_system local = assemble_poisson_system(crop.content, local_width, local_height, options);
+
+    parallel_for(copied.y0, copied.y1, [&](int y) {
+        for (int x = copied.x0; x < copied.x1; x++)
+        {
+            size_t i = (size_t)y * width + x, li = (size_t)(y - y0) * local_width + (x - x0);
+            _system.constraints.mask.data[i]    = local.constraints.mask.data[li];
+            _system.constraints.colors.data[i]  = local.constraints.colors.data[li];
+            _system.constraints.weights.data[i] = local.constraints.weights.data[li];
+            _system.source.data[i]              = local.source.data[li];
+            if (x + 1 < width)
+                _system.barriers.set_right(x, y, local.barriers.blocked_right(x - x0, y - y0));
+            if (y + 1 < height)
+                _system.barriers.set_down(x, y, local.barriers.blocked_down(x - x0, y - y0));
+        }
+    });
+    if (_options.balance_floating)
+        balance_floating_regions(_system, copied);
+    return copied;
+}
+
+/**
+ * @brief Cuts the equations of the correction of a solution out of a Poisson system, restricted to a window.
+ * @details The correction d of a solution u satisfies A d = b - A u with d = 0 at the pinned pixels. It keeps the barriers and the constraint weights of the system, while the residual takes the place of the source and all constraint colors are zero. The pixels at the border of the window are pinned as well unless they are at the border of the image, i.e., outside of the window the solution is taken as it is. Since the right-hand side is the residual, the relative tolerance of a solver applies to the change rather than to the whole image.
+ * @param _system Poisson system.
+ * @param _window Window in pixels.
+ * @param _solution Current solution of the whole image, with the pinned pixels set.
+ * @return Poisson system of the correction in the window.
+ */
+inline poisson_system correction_system(const poisson_system& _system, const pixel_rectangle& _window, const image& _solution)
+{
+    const int width = _window.x1 - _window.x0, height = _window.y1 - _window.y0;
+    poisson_system local(width, height, _system.cell_size);
+    parallel_for(0, height, [&](int y) {
+        int gy = _window.y0 + y;
+        for (int x = 0; x < width; x++)
+        {
+            int gx     = _window.x0 + x;
+            size_t i   = (size_t)y * width + x;
+            size_t gi  = (size_t)gy * _system.width + gx;
+            bool frame = (x == 0 && gx > 0) || (y == 0 && gy > 0) || (x + 1 == width && gx + 1 < _system.width) || (y + 1 == height && gy + 1 < _system.height);
+            if (frame || is_pinned(_system, gi))
+            {
+                local.constraints.set(i, color_type{ 0, 0, 0 });
+            }
+            else
+            {
+                if (_system.constraints.mask.data[gi])
+                    local.constraints.set(i, color_type{ 0, 0, 0 }, _system.constraints.weights.data[gi]);
+                color_type rhs;
+                double diagonal  = pixel_equation(_system, gx, gy, rhs);
+                color_type sum   = neighbor_sum(_system, _solution, gx, gy);
+                for (int c = 0; c < 3; c++)
+                    local.source.data[i][c] = diagonal * _solution.data[gi][c] - sum[c] - rhs[c];
+            }
+            // the border of the window is blocked already
+            if (x + 1 < width && _system.barriers.blocked_right(gx, gy))
+                local.barriers.set_right(x, y, true);
+            if (y + 1 < height && _system.barriers.blocked_down(gx, gy))
+                local.barriers.set_down(x, y, true);
+        }
+    });
+    return local;
+}
+
+/**
+ * @brief Updates the solution of a Poisson system after an edit by solving only a window around the change.
+ * @details The window starts as the changed region plus a margin. Multigrid solves for the correction in the window, with the solution outside as Dirichlet boundary. The effect of a local edit decays away from it, so the window is large enough once the correction near its border is below a fraction of an 8-bit step. Since the pinned border forces the correction to zero, it is measured on a band of half the margin rather than next to the border, which also catches corrections that do not decay, e.g., along a channel between barriers. Otherwise, the margin doubles and the grown window is solved again, starting from the last update. Once the windows of all rounds together exceed a fraction of the image, which bounds the work lost on edits with a far reach, it falls back to solving the correction on the whole image.
+ * @param _system Edited Poisson system.
+ * @param _previous Solution before the edit; a global solve is used if its size differs.
+ * @param _options Parameters of the incremental solve.
+ * @param _stats Optional output of the windows and timings.
+ * @param _changed Optional changed region, e.g., from changed_region, instead of the residual of the previous solution.
+ * @return Updated solution.
+ */
+inline image solve_incremental(const poisson_system& _system, const image& _previous, const incremental_options& _options, incremental_statistics* _stats = nullptr,
+                               const pixel_rectangle* _changed = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    const int width = _system.width, height = _system.height;
+    incremental_statistics stats;
+    solver_statistics solve;
+    image solution;
+    if (_previous.width != width || _previous.height != height)
+    {
+        stats.global    = true;
+        stats.window.x1 = width;
+        stats.window.y1 = height;
+        solution        = solve_multigrid(_system, _options.multigrid, &solve, &_previous);
+        stats.cycles   = solve.iterations;
+        stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (_stats != nullptr)
+            *_stats = stats;
+        return solution;
+    }
+
+    stats.changed = _changed != nullptr ? *_changed : changed_pixels(_system, _previous, _options.change_threshold);
+    solution      = _previous;
+    initialize_solution(_system, solution);
+    multigrid_options multigrid = _options.multigrid;
+    multigrid.tolerance         = _options.tolerance;
+    long long solved            = 0;
+    for (int margin = _options.margin; !stats.changed.empty(); margin *= 2)
+    {
+        stats.window = stats.changed.grown(margin, width, height);
+        solved += stats.window.area();
+        if (solved > _options.max_fraction * width * height)
+        {
+            stats.global    = true;
+            stats.window    = pixel_rectangle();
+            stats.window.x1 = width;
+            stats.window.y1 = height;
+        }
+        poisson_system local = correction_system(_system, stats.window, solution);
+        image correction     = solve_multigrid(local, multigrid, &solve);
+        stats.rounds += stats.global ? 0 : 1;
+        stats.cycles += solve.iterations;
+
+        const int local_width = local.width, local_height = local.height;
+        int band = std::max(2, margin / 2);
+        stats.border_change = 0;
+        for (int y = 0; y < local_height; y++)
+        {
+            for (int x = 0; x < local_width; x++)
+            {
+                bool near = (x < band && stats.window.x0 > 0) || (y < band && stats.window.y0 > 0) || (x >= local_width - band && stats.window.x1 < width) ||
+                            (y >= local_height - band && stats.window.y1 < height);
+                color_type& value = solution(stats.window.x0 + x, stats.window.y0 + y);
+                for (int c = 0; c < 3; c++)
+                {
+                    value[c] += correction(x, y)[c];
+                    if (near)
+                        stats.border_change = std::max(stats.border_change, std::abs(correction(x, y)[c]));
+                }
+            }
+        }
+        if (stats.global || stats.border_change <= _options.max_color_change)
+            break;
+    }
+    stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if (_stats != nullptr)
+        *_stats = stats;
+    return solution;
+}
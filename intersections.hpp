@@ -0,0 +1,468 @@
+#pragma once
+
+#include "curves.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <queue>
+#include <set>
+#include <vector>
+
+/**
+ * @brief Intersection between two curves, or of a curve with itself.
+ */
+struct curve_intersection
+{
+    /**
+     * @brief Index of the first curve.
+     */
+    int curve_a;
+    /**
+     * @brief Index of the second curve; equals curve_a for self-intersections.
+     */
+    int curve_b;
+    /**
+     * @brief Global parameter of the intersection on the first curve.
+     */
+    double t_a;
+    /**
+     * @brief Global parameter of the intersection on the second curve.
+     */
+    double t_b;
+    /**
+     * @brief Location of the intersection in scene units.
+     */
+    point_type position;
+    /**
+     * @brief True if the intersection lies at the start or end of one of the curves, i.e., the curves touch rather than cross.
+     */
+    bool at_endpoint;
+
+    /**
+     * @brief Checks whether this is a self-intersection.
+     * @return True if both parameters belong to the same curve.
+     */
+    bool is_self_intersection() const
+    {
+        return curve_a == curve_b;
+    }
+};
+
+/**
+ * @brief Sweep-line (Bentley-Ottmann) detection of all intersections between polylines.
+ * @details Runs in O((n+k) log n) for n segments and k intersections. All events at the same point are handled together, so that curves which only touch at shared end points are found as well. The sweep runs in a slightly rotated frame to avoid vertical segments. Neighboring segments of the same polyline, which share a vertex by construction, are not reported; neither are collinear overlaps.
+ */
+class sweep_line_intersector
+{
+public:
+    /**
+     * @brief Finds all intersections of a set of polylines.
+     * @param _curves Polylines, e.g., the flattened diffusion curves of a scene.
+     * @return Intersections, sorted by curve_a, curve_b, t_a.
+     */
+    static std::vector<curve_intersection> intersect(const std::vector<polyline>& _curves)
+    {
+        sweep_line_intersector sweep(_curves);
+        sweep.run();
+        std::sort(sweep.result.begin(), sweep.result.end(), [](const curve_intersection& a, const curve_intersection& b) {
+            if (a.curve_a != b.curve_a)
+                return a.curve_a < b.curve_a;
+            if (a.curve_b != b.curve_b)
+                return a.curve_b < b.curve_b;
+            return a.t_a < b.t_a;
+        });
+        return sweep.result;
+    }
+
+private:
+    /**
+     * @brief Line segment in the sweep frame, oriented from its lexicographically smaller to its larger end point.
+     */
+    struct segment
+    {
+        point_type a, b;
+        point_type p, q;
+        int curve, index;
+        bool flipped;
+        double slope;
+    };
+
+    /**
+     * @brief Types of sweep events.
+     */
+    enum event_type
+    {
+        start_event,
+        end_event,
+        cross_event
+    };
+
+    /**
+     * @brief Event of the sweep.
+     */
+    struct event
+    {
+        point_type position;
+        event_type type;
+        int a, b;
+
+        bool operator>(const event& _other) const
+        {
+            return position > _other.position;
+        }
+    };
+
+    /**
+     * @brief Probe ids that sort below and above all segments at the height of the sweep point.
+     */
+    enum probe
+    {
+        lower_probe = -1,
+        upper_probe = -2
+    };
+
+    /**
+     * @brief Orders the segments in the sweep status by their height at the sweep position, and just after it for equal heights.
+     */
+    struct status_order
+    {
+        const sweep_line_intersector* sweep;
+
+        bool operator()(int _a, int _b) const
+        {
+            if (_a == _b)
+                return false;
+            double ya = _a < 0 ? sweep->sweep_position[1] : sweep->height_at_sweep(_a);
+            double yb = _b < 0 ? sweep->sweep_position[1] : sweep->height_at_sweep(_b);
+            if (std::abs(ya - yb) > sweep->epsilon)
+                return ya < yb;
+            if (_a == lower_probe || _b == upper_probe)
+                return true;
+            if (_b == lower_probe || _a == upper_probe)
+                return false;
+            const segment& sa = sweep->segments[_a];
+            const segment& sb = sweep->segments[_b];
+            if (sa.slope != sb.slope)
+                return sa.slope < sb.slope;
+            return _a < _b;
+        }
+    };
+
+    typedef std::set<int, status_order> status_type;
+
+    /**
+     * @brief Prepares the segments in the sweep frame.
+     * @param _curves Polylines.
+     */
+    sweep_line_intersector(const std::vector<polyline>& _curves)
+        : curves(_curves)
+        , status(status_order{ this })
+        , sweep_position{ { -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() } }
+        , epsilon(0)
+    {
+        const double cos_angle = std::cos(0.3), sin_angle = std::sin(0.3);
+        double extent = 0;
+        for (size_t c = 0; c < _curves.size(); c++)
+        {
+            const polyline& curve = _curves[c];
+            for (int i = 0; i < curve.num_segments(); i++)
+            {
+                const point_type& a = curve.points[i];
+                const point_type& b = curve.points[i + 1];
+                if (a == b)
+                    continue;
+                segment s;
+                s.a       = a;
+                s.b       = b;
+                s.p       = point_type{ cos_angle * a[0] - sin_angle * a[1], sin_angle * a[0] + cos_angle * a[1] };
+                s.q       = point_type{ cos_angle * b[0] - sin_angle * b[1], sin_angle * b[0] + cos_angle * b[1] };
+                s.curve   = (int)c;
+                s.index   = i;
+                s.flipped = s.q < s.p;
+                if (s.flipped)
+                    std::swap(s.p, s.q);
+                double dx = s.q[0] - s.p[0];
+                s.slope   = dx > 0 ? (s.q[1] - s.p[1]) / dx : std::numeric_limits<double>::infinity();
+                extent    = std::max(extent, std::max(std::abs(a[0]), std::abs(a[1])));
+                segments.push_back(s);
+            }
+        }
+        epsilon = 1e-9 * std::max(1.0, extent);
+        positions.assign(segments.size(), status.end());
+    }
+
+    /**
+     * @brief Height of a segment at the current sweep position; vertical segments take the height of the sweep point, clamped to the segment.
+     * @param _segment Segment index.
+     * @return Height at the sweep position.
+     */
+    double height_at_sweep(int _segment) const
+    {
+        const segment& s = segments[_segment];
+        if (s.q[0] == s.p[0])
+            return std::min(std::max(sweep_position[1], s.p[1]), s.q[1]);
+        double x = std::min(std::max(sweep_position[0], s.p[0]), s.q[0]);
+        return s.p[1] + (x - s.p[0]) * s.slope;
+    }
+
+    /**
+     * @brief Tests whether two segments are consecutive in the same polyline, i.e., they share a vertex by construction.
+     * @param _a First segment.
+     * @param _b Second segment.
+     * @return True if the segments are neighbors.
+     */
+    bool are_adjacent(const segment& _a, const segment& _b) const
+    {
+        if (_a.curve != _b.curve)
+            return false;
+        if (std::abs(_a.index - _b.index) == 1)
+            return true;
+        // closed polylines: the first and the last segment meet at the shared end point
+        const polyline& curve = curves[_a.curve];
+        int last = curve.num_segments() - 1;
+        return ((_a.index == 0 && _b.index == last) || (_a.index == last && _b.index == 0)) && curve.points.front() == curve.points.back();
+    }
+
+    /**
+     * @brief Intersects two segments in the original frame, so that the result does not depend on the rotation of the sweep.
+     * @param _a First segment index.
+     * @param _b Second segment index.
+     * @param _ta Output parameter on the first oriented segment.
+     * @param _tb Output parameter on the second oriented segment.
+     * @return True if the segments intersect in a single point.
+     */
+    bool intersect_segments(int _a, int _b, double& _ta, double& _tb) const
+    {
+        // fixed argument order, so that touching end points are classified the same way regardless of the event order
+        if (_b < _a)
+            return intersect_segments(_b, _a, _tb, _ta);
+        const segment& sa = segments[_a];
+        const segment& sb = segments[_b];
+        double rx = sa.b[0] - sa.a[0], ry = sa.b[1] - sa.a[1];
+        double sx = sb.b[0] - sb.a[0], sy = sb.b[1] - sb.a[1];
+        double denominator = rx * sy - ry * sx;
+        if (denominator == 0)
+            return false;
+        double wx = sb.a[0] - sa.a[0], wy = sb.a[1] - sa.a[1];
+        double ta = (wx * sy - wy * sx) / denominator;
+        double tb = (wx * ry - wy * rx) / denominator;
+        if (ta < 0 || ta > 1 || tb < 0 || tb > 1)
+            return false;
+        _ta = sa.flipped ? 1 - ta : ta;
+        _tb = sb.flipped ? 1 - tb : tb;
+        return true;
+    }
+
+    /**
+     * @brief Schedules the crossing of two segments if it lies after the current event point.
+     * @param _a First segment index.
+     * @param _b Second segment index.
+     */
+    void check(int _a, int _b)
+    {
+        double ta, tb;
+        if (are_adjacent(segments[_a], segments[_b]) || !intersect_segments(_a, _b, ta, tb))
+            return;
+        const segment& sa = segments[_a];
+        point_type position = { sa.p[0] + ta * (sa.q[0] - sa.p[0]), sa.p[1] + ta * (sa.q[1] - sa.p[1]) };
+        if (position > sweep_position && scheduled.insert(std::make_pair(std::min(_a, _b), std::max(_a, _b))).second)
+            events.push(event{ position, cross_event, _a, _b });
+    }
+
+    /**
+     * @brief Records the intersection of two segments that meet at the current event point.
+     * @param _a First segment index.
+     * @param _b Second segment index.
+     */
+    void report(int _a, int _b)
+    {
+        const segment& sa = segments[_a];
+        const segment& sb = segments[_b];
+        if (are_adjacent(sa, sb) || !found.insert(std::make_pair(std::min(_a, _b), std::max(_a, _b))).second)
+            return;
+        double ta, tb;
+        if (!intersect_segments(_a, _b, ta, tb))
+        {
+            // segments that share an end point, which rounding or parallel directions may hide
+            if (sa.p == sb.p || sa.p == sb.q)
+                ta = 0, tb = sa.p == sb.p ? 0 : 1;
+            else if (sa.q == sb.p || sa.q == sb.q)
+                ta = 1, tb = sa.q == sb.p ? 0 : 1;
+            else
+                return;
+        }
+
+        curve_intersection intersection;
+        intersection.curve_a = sa.curve;
+        intersection.curve_b = sb.curve;
+        intersection.t_a     = curve_parameter(sa, ta);
+        intersection.t_b     = curve_parameter(sb, tb);
+        const polyline& curve = curves[sa.curve];
+        double s = sa.flipped ? 1 - ta : ta;
+        for (int d = 0; d < 2; d++)
+            intersection.position[d] = curve.points[sa.index][d] + s * (curve.points[sa.index + 1][d] - curve.points[sa.index][d]);
+        intersection.at_endpoint = intersection.t_a <= 0 || intersection.t_a >= 1 || intersection.t_b <= 0 || intersection.t_b >= 1;
+        if (intersection.curve_b < intersection.curve_a || (intersection.curve_a == intersection.curve_b && intersection.t_b < intersection.t_a))
+        {
+            std::swap(intersection.curve_a, intersection.curve_b);
+            std::swap(intersection.t_a, intersection.t_b);
+        }
+        result.push_back(intersection);
+    }
+
+    /**
+     * @brief Converts a parameter on an oriented segment to the global curve parameter.
+     * @param _segment Segment.
+     * @param _t Parameter on the oriented segment in [0,1].
+     * @return Global parameter of the curve.
+     */
+    double curve_parameter(const segment& _segment, double _t) const
+    {
+        const polyline& curve = curves[_segment.curve];
+        double s = _segment.flipped ? 1 - _t : _t;
+        return curve.params[_segment.index] + s * (curve.params[_segment.index + 1] - curve.params[_segment.index]);
+    }
+
+    /**
+     * @brief Handles all events at one point: reports all pairs of segments through the point, then removes the segments that end there and re-inserts the others in their order after the point.
+     * @param _starting Segments that start at the point.
+     * @param _ending Segments that end at the point.
+     * @param _crossing Segments of crossings scheduled at the point.
+     */
+    void handle_point(const std::vector<int>& _starting, const std::vector<int>& _ending, const std::vector<int>& _crossing)
+    {
+        std::vector<int> through;
+        for (status_type::iterator it = status.lower_bound(lower_probe); it != status.end() && status.key_comp()(*it, upper_probe); ++it)
+            through.push_back(*it);
+        for (int s : _ending)
+            through.push_back(s);
+        for (int s : _crossing)
+            if (positions[s] != status.end())
+                through.push_back(s);
+        std::sort(through.begin(), through.end());
+        through.erase(std::unique(through.begin(), through.end()), through.end());
+
+        std::vector<int> involved(through);
+        involved.insert(involved.end(), _starting.begin(), _starting.end());
+        for (size_t i = 0; i < involved.size(); i++)
+            for (size_t j = i + 1; j < involved.size(); j++)
+                report(involved[i], involved[j]);
+
+        for (int s : through)
+        {
+            status.erase(positions[s]);
+            positions[s] = status.end();
+        }
+        std::vector<int> inserted;
+        for (int s : through)
+            if (!(segments[s].q == sweep_position) && std::find(_ending.begin(), _ending.end(), s) == _ending.end())
+                inserted.push_back(s);
+        inserted.insert(inserted.end(), _starting.begin(), _starting.end());
+        for (int s : inserted)
+            positions[s] = status.insert(s).first;
+
+        if (inserted.empty())
+        {
+            status_type::iterator above = status.lower_bound(lower_probe);
+            if (above != status.begin() && above != status.end())
+                check(*std::prev(above), *above);
+            return;
+        }
+        status_type::iterator lowest = positions[inserted[0]], highest = positions[inserted[0]];
+        for (int s : inserted)
+        {
+            if (status.key_comp()(s, *lowest))
+                lowest = positions[s];
+            if (status.key_comp()(*highest, s))
+                highest = positions[s];
+        }
+        if (lowest != status.begin())
+            check(*std::prev(lowest), *lowest);
+        if (std::next(highest) != status.end())
+            check(*highest, *std::next(highest));
+    }
+
+    /**
+     * @brief Processes all events.
+     */
+    void run()
+    {
+        for (size_t s = 0; s < segments.size(); s++)
+        {
+            events.push(event{ segments[s].p, start_event, (int)s, -1 });
+            events.push(event{ segments[s].q, end_event, (int)s, -1 });
+        }
+
+        std::vector<int> starting, ending, crossing;
+        while (!events.empty())
+        {
+            sweep_position = events.top().position;
+            starting.clear(), ending.clear(), crossing.clear();
+            while (!events.empty() && events.top().position == sweep_position)
+            {
+                event e = events.top();
+                events.pop();
+                if (e.type == start_event)
+                    starting.push_back(e.a);
+                else if (e.type == end_event)
+                    ending.push_back(e.a);
+                else
+                    crossing.push_back(e.a), crossing.push_back(e.b);
+            }
+            handle_point(starting, ending, crossing);
+        }
+    }
+
+    /**
+     * @brief Polylines that are intersected.
+     */
+    const std::vector<polyline>& curves;
+    /**
+     * @brief All non-degenerate segments.
+     */
+    std::vector<segment> segments;
+    /**
+     * @brief Segments that intersect the sweep line, ordered from bottom to top.
+     */
+    status_type status;
+    /**
+     * @brief Position of each segment in the status, or the end of the status if it is not in it.
+     */
+    std::vector<status_type::iterator> positions;
+    /**
+     * @brief Pending events, smallest position first.
+     */
+    std::priority_queue<event, std::vector<event>, std::greater<event>> events;
+    /**
+     * @brief Pairs of segments whose crossing was scheduled.
+     */
+    std::set<std::pair<int, int>> scheduled;
+    /**
+     * @brief Pairs of segments whose intersection was reported.
+     */
+    std::set<std::pair<int, int>> found;
+    /**
+     * @brief Current event point of the sweep.
+     */
+    point_type sweep_position;
+    /**
+     * @brief Tolerance for equal heights in the status order.
+     */
+    double epsilon;
+    /**
+     * @brief Intersections that were found.
+     */
+    std::vector<curve_intersection> result;
+};
+
+/**
+ * @brief Finds all crossings and self-intersections of the diffusion curves of a scene, e.g., as a validation pass after loading.
+ * @param _curves Flattened curves of the scene.
+ * @return Intersections, sorted by curve_a, curve_b, t_a.
+ */
+inline std::vector<curve_intersection> find_diffusion_curve_intersections(const flattened_scene& _curves)
+{
+    return sweep_line_intersector::intersect(_curves.diffusion_curves);
+}
@@ -0,0 +1,738 @@
+#pragma once
+
+#include "binning.hpp"
+#include "mesh_evaluator.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Location on a gradient mesh: the patch and its (u,v) parameters.
+ */
+struct patch_location
+{
+    /**
+     * @brief Index of the patch, or -1 if no patch covers the point.
+     */
+    int patch = -1;
+    /**
+     * @brief Parameter along the columns of the patch.
+     */
+    double u = 0;
+    /**
+     * @brief Parameter along the rows of the patch.
+     */
+    double v = 0;
+};
+
+/**
+ * @brief Parameters of the inverse mapping.
+ */
+struct inverse_mapping_options
+{
+    /**
+     * @brief Edge length in pixels of the cells of the patch index.
+     */
+    int cell_size = 16;
+    /**
+     * @brief Maximum distance in pixels between the target and the mapped point.
+     */
+    double tolerance = 1e-3;
+    /**
+     * @brief Maximum number of Newton iterations per start.
+     */
+    int max_iterations = 12;
+    /**
+     * @brief Number of image rows that are processed as one band by a thread.
+     */
+    int band_height = 32;
+    /**
+     * @brief Interpolation scheme of the patch colors, used when the mapped colors are evaluated.
+     */
+    color_interpolation colors = color_interpolation::bicubic;
+};
+
+/**
+ * @brief Counters of the inverse mapping of an image.
+ */
+struct inverse_mapping_statistics
+{
+    /**
+     * @brief Number of pixels that were mapped.
+     */
+    long long num_pixels = 0;
+    /**
+     * @brief Number of pixels that are covered by a patch.
+     */
+    long long num_covered = 0;
+    /**
+     * @brief Number of pixels that were resolved by the Newton iteration seeded from the pixel above or to the left.
+     */
+    long long num_seeded = 0;
+    /**
+     * @brief Number of pixels that needed a search over the candidates of the patch index.
+     */
+    long long num_searched = 0;
+    /**
+     * @brief Number of Newton runs that did not converge.
+     */
+    long long num_failed_iterations = 0;
+    /**
+     * @brief Number of pixels that were inside the bounding box of a candidate patch, but no patch iteration converged inside its domain.
+     */
+    long long num_unresolved = 0;
+
+    /**
+     * @brief Adds the counters of another run.
+     * @param _other Counters to add.
+     */
+    void add(const inverse_mapping_statistics& _other)
+    {
+        num_pixels += _other.num_pixels;
+        num_covered += _other.num_covered;
+        num_seeded += _other.num_seeded;
+        num_searched += _other.num_searched;
+        num_failed_iterations += _other.num_failed_iterations;
+        num_unresolved += _other.num_unresolved;
+    }
+};
+
+/**
+ * @brief Maps image points to the gradient mesh patch and (u,v) parameters that cover them.
+ * @details Overlapping meshes are resolved in drawing order: the mesh with the highest index is on top.
+ */
+class mesh_inverse_mapping
+{
+public:
+    /**
+     * @brief Builds the patch index for an image of the given size.
+     * @param _scene Scene with gradient meshes.
+     * @param _width Width of the image in pixels.
+     * @param _height Height of the image in pixels.
+     * @param _options Parameters of the inverse mapping.
+     */
+    mesh_inverse_mapping(const scene& _scene, int _width, int _height, const inverse_mapping_options& _options)
+        : mesh_inverse_mapping(mesh_patches(_scene), _scene.width, _scene.height, _width, _height, _options)
+    {
+    }
+
+    /**
+     * @brief Builds the patch index for an image of the given size.
+     * @param _patches Gradient mesh patches.
+     * @param _scene_width Width of the scene in scene units.
+     * @param _scene_height Height of the scene in scene units.
+     * @param _width Width of the image in pixels.
+     * @param _height Height of the image in pixels.
+     * @param _options Parameters of the inverse mapping.
+     */
+    mesh_inverse_mapping(const std::vector<mesh_patch>& _patches, int _scene_width, int _scene_height, int _width, int _height, const inverse_mapping_options& _options)
+        : patches(_patches)
+        , coefficients(make_patch_coefficients(_patches, _options.colors))
+        , options(_options)
+        , index(flattened_scene(_scene_width, _scene_height), _patches, _width, _height, index_options(_options))
+    {
+        bounds.resize(patches.size());
+        for (size_t p = 0; p < patches.size(); p++)
+            patch_bounds(patches[p], bounds[p][0], bounds[p][1]);
+    }
+
+    /**
+     * @brief Patches of all gradient meshes.
+     */
+    std::vector<mesh_patch> patches;
+    /**
+     * @brief Patches in power basis.
+     */
+    std::vector<patch_coefficients> coefficients;
+
+    /**
+     * @brief Width of the image in pixels.
+     * @return Image width.
+     */
+    int width() const
+    {
+        return index.width;
+    }
+
+    /**
+     * @brief Height of the image in pixels.
+     * @return Image height.
+     */
+    int height() const
+    {
+        return index.height;
+    }
+
+    /**
+     * @brief Finds the location of a single point.
+     * @param _x Horizontal coordinate in pixels.
+     * @param _y Vertical coordinate in pixels.
+     * @param _seed Optional location of a nearby point that is tried first, or nullptr.
+     * @param _stats Counters to update.
+     * @return Location of the point; patch is -1 if no patch covers it.
+     */
+    patch_location locate(double _x, double _y, const patch_location* _seed, inverse_mapping_statistics& _stats) const
+    {
+        point_type target = { _x / index.scale_x, _y / index.scale_y };
+        patch_location result;
+        if (_seed != nullptr && _seed->patch >= 0)
+        {
+            result = *_seed;
+            if (newton(target, result, _stats) && is_topmost(target, result, _stats))
+            {
+                _stats.num_seeded++;
+                return result;
+            }
+        }
+        _stats.num_searched++;
+        return search(target, _stats);
+    }
+
+    /**
+     * @brief Maps the centers of all pixels of the image.
+     * @details Bands of rows are processed in parallel. Within a band, all pixels of a row first run a fixed number of Newton steps together, each seeded with the result of the pixel above; this batch is laid out as structure of arrays with an active mask, and the steps run branch-free over runs of pixels that share a patch, with four pixels per AVX2 instruction if the compiler targets AVX2. Pixels that did not converge are then resolved one by one, seeded from the left neighbor, and finally by a search over the patch index.
+     * @param _locations Output location per pixel, row by row.
+     * @return Counters of the mapping.
+     */
+    inverse_mapping_statistics map_image(std::vector<patch_location>& _locations) const
+    {
+        int w = width(), h = height();
+        _locations.assign((size_t)w * h, patch_location());
+        int band_height = std::max(1, options.band_height);
+        int num_bands   = (h + band_height - 1) / band_height;
+        std::vector<inverse_mapping_statistics> band_stats(num_bands);
+        parallel_for(0, num_bands, [&](int band) {
+            row_batch batch(w);
+            int y_end = std::min(h, (band + 1) * band_height);
+            for (int y = band * band_height; y < y_end; y++)
+            {
+                const patch_location* above = y > band * band_height ? &_locations[(size_t)(y - 1) * w] : nullptr;
+                map_row(y, above, &_locations[(size_t)y * w], batch, band_stats[band]);
+            }
+        });
+
+        inverse_mapping_statistics stats;
+        for (const inverse_mapping_statistics& s : band_stats)
+            stats.add(s);
+        return stats;
+    }
+
+private:
+    /**
+     * @brief Parameters of the inverse mapping.
+     */
+    inverse_mapping_options options;
+    /**
+     * @brief Uniform grid of candidate patches per cell.
+     */
+    tile_bins index;
+    /**
+     * @brief Bounding box per patch in scene units.
+     */
+    std::vector<std::array<point_type, 2>> bounds;
+
+    /**
+     * @brief Structure of arrays for the Newton iterations of an image row.
+     */
+    struct row_batch
+    {
+        row_batch(int _width)
+            : u(_width)
+            , v(_width)
+            , patch(_width)
+            , active(_width)
+        {
+        }
+        std::vector<double> u, v;
+        std::vector<int> patch;
+        std::vector<int> active;
+    };
+
+    /**
+     * @brief Binning parameters for the patch index.
+     * @param _options Parameters of the inverse mapping.
+     * @return Options that bin only the mesh patches.
+     */
+    static binning_options index_options(const inverse_mapping_options& _options)
+    {
+        binning_options result;
+        result.tile_size        = _options.cell_size;
+        result.diffusion_curves = false;
+        result.poisson_curves   = false;
+        result.mesh_patches     = true;
+        return result;
+    }
+
+    /**
+     * @brief Evaluates the position of a patch and its Jacobian.
+     * @param _patch Patch in power basis.
+     * @param _u Parameter along the columns.
+     * @param _v Parameter along the rows.
+     * @param _position Output position.
+     * @param _jacobian Output derivatives (x_u, x_v, y_u, y_v).
+     */
+    static void evaluate_jacobian(const patch_coefficients& _patch, double _u, double _v, point_type& _position, std::array<double, 4>& _jacobian)
+    {
+        double pu[4]  = { 1, _u, _u * _u, _u * _u * _u };
+        double pv[4]  = { 1, _v, _v * _v, _v * _v * _v };
+        double dpu[4] = { 0, 1, 2 * _u, 3 * _u * _u };
+        double dpv[4] = { 0, 1, 2 * _v, 3 * _v * _v };
+        for (int d = 0; d < 2; d++)
+        {
+            const std::array<double, 16>& a = _patch.coefficients[d];
+            double f = 0, fu = 0, fv = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                double row  = a[4 * k] + a[4 * k + 1] * pv[1] + a[4 * k + 2] * pv[2] + a[4 * k + 3] * pv[3];
+                double drow = a[4 * k + 1] * dpv[1] + a[4 * k + 2] * dpv[2] + a[4 * k + 3] * dpv[3];
+                f += pu[k] * row;
+                fu += dpu[k] * row;
+                fv += pu[k] * drow;
+            }
+            _position[d]        = f;
+            _jacobian[2 * d]     = fu;
+            _jacobian[2 * d + 1] = fv;
+        }
+    }
+
+    /**
+     * @brief One damped Newton step towards the target, with the parameters clamped to a band around the unit square.
+     * @param _patch Patch in power basis.
+     * @param _target Target position in scene units.
+     * @param _u In/out parameter along the columns.
+     * @param _v In/out parameter along the rows.
+     * @return Distance between the target and the patch at the parameters before the step, in scene units.
+     */
+    static double newton_step(const patch_coefficients& _patch, const point_type& _target, double& _u, double& _v)
+    {
+        point_type position;
+        std::array<double, 4> J;
+        evaluate_jacobian(_patch, _u, _v, position, J);
+        double rx = _target[0] - position[0], ry = _target[1] - position[1];
+        double det = J[0] * J[3] - J[1] * J[2];
+        if (std::abs(det) > 1e-12)
+        {
+            _u = std::min(1.5, std::max(-0.5, _u + (J[3] * rx - J[1] * ry) / det));
+            _v = std::min(1.5, std::max(-0.5, _v + (J[0] * ry - J[2] * rx) / det));
+        }
+        return std::sqrt(rx * rx + ry * ry);
+    }
+
+    /**
+     * @brief Evaluates one coordinate of a patch and its derivatives, unrolled for the batched Newton steps.
+     * @param _a Coefficients of the coordinate in power basis.
+     * @param _u Parameter along the columns.
+     * @param _v Parameter along the rows.
+     * @param _v2 Square of _v.
+     * @param _v3 Cube of _v.
+     * @param _f Output coordinate.
+     * @param _fu Output derivative with respect to u.
+     * @param _fv Output derivative with respect to v.
+     */
+    static void evaluate_rows(const double* _a, double _u, double _v, double _v2, double _v3, double& _f, double& _fu, double& _fv)
+    {
+        double r0 = _a[0] + _a[1] * _v + _a[2] * _v2 + _a[3] * _v3;
+        double r1 = _a[4] + _a[5] * _v + _a[6] * _v2 + _a[7] * _v3;
+        double r2 = _a[8] + _a[9] * _v + _a[10] * _v2 + _a[11] * _v3;
+        double r3 = _a[12] + _a[13] * _v + _a[14] * _v2 + _a[15] * _v3;
+        double d0 = _a[1] + 2 * _a[2] * _v + 3 * _a[3] * _v2;
+        double d1 = _a[5] + 2 * _a[6] * _v + 3 * _a[7] * _v2;
+        double d2 = _a[9] + 2 * _a[10] * _v + 3 * _a[11] * _v2;
+        double d3 = _a[13] + 2 * _a[14] * _v + 3 * _a[15] * _v2;
+        _f  = r0 + _u * (r1 + _u * (r2 + _u * r3));
+        _fu = r1 + _u * (2 * r2 + _u * 3 * r3);
+        _fv = d0 + _u * (d1 + _u * (d2 + _u * d3));
+    }
+
+#if defined(__AVX2__)
+    /**
+     * @brief Evaluates one coordinate of a patch and its derivatives at four parameter pairs, as evaluate_rows.
+     */
+    static void evaluate_rows(const double* _a, __m256d _u, __m256d _v, __m256d _v2, __m256d _v3, __m256d& _f, __m256d& _fu, __m256d& _fv)
+    {
+        __m256d r[4], d[4];
+        const __m256d two = _mm256_set1_pd(2), three = _mm256_set1_pd(3);
+        for (int k = 0; k < 4; k++)
+        {
+            const double* a = _a + 4 * k;
+            r[k] = _mm256_add_pd(_mm256_add_pd(_mm256_set1_pd(a[0]), _mm256_mul_pd(_mm256_set1_pd(a[1]), _v)),
+                                 _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(a[2]), _v2), _mm256_mul_pd(_mm256_set1_pd(a[3]), _v3)));
+            d[k] = _mm256_add_pd(_mm256_set1_pd(a[1]),
+                                 _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(2 * a[2]), _v), _mm256_mul_pd(_mm256_set1_pd(3 * a[3]), _v2)));
+        }
+        _f  = _mm256_add_pd(r[0], _mm256_mul_pd(_u, _mm256_add_pd(r[1], _mm256_mul_pd(_u, _mm256_add_pd(r[2], _mm256_mul_pd(_u, r[3]))))));
+        _fu = _mm256_add_pd(r[1], _mm256_mul_pd(_u, _mm256_add_pd(_mm256_mul_pd(two, r[2]), _mm256_mul_pd(_mm256_mul_pd(_u, three), r[3]))));
+        _fv = _mm256_add_pd(d[0], _mm256_mul_pd(_u, _mm256_add_pd(d[1], _mm256_mul_pd(_u, _mm256_add_pd(d[2], _mm256_mul_pd(_u, d[3]))))));
+    }
+#endif
+
+    /**
+     * @brief One Newton step of all active pixels in a run of a row that share a patch, as in newton_step.
+     * @details Every pixel of the run computes a step, and blends keep the parameters of the pixels that are inactive, converged or at a singular Jacobian, so the loop is free of branches. If the compiler targets AVX2, four pixels step per instruction, and the scalar loop handles the rest of the run.
+     * @param _patch Patch in power basis.
+     * @param _begin First pixel of the run.
+     * @param _end Pixel after the run.
+     * @param _y Vertical position of the row in scene units.
+     * @param _tolerance Distance in scene units at which a pixel has converged.
+     * @param _batch Parameters and state of the pixels of the row (0 inactive, 1 active, 2 converged).
+     * @return Number of pixels of the run that are still active.
+     */
+    int newton_run(const patch_coefficients& _patch, int _begin, int _end, double _y, double _tolerance, row_batch& _batch) const
+    {
+        const double* ax    = _patch.coefficients[0].data();
+        const double* ay    = _patch.coefficients[1].data();
+        double* u           = _batch.u.data();
+        double* v           = _batch.v.data();
+        int* active         = _batch.active.data();
+        double scale        = 1 / index.scale_x;
+        double tolerance2   = _tolerance * _tolerance;
+        int num_active      = 0;
+        int x               = _begin;
+#if defined(__AVX2__)
+        const __m256d lower     = _mm256_set1_pd(-0.5);
+        const __m256d upper     = _mm256_set1_pd(1.5);
+        const __m256d one       = _mm256_set1_pd(1);
+        const __m256d magnitude = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffll));
+        const __m256d singular  = _mm256_set1_pd(1e-12);
+        const __m256d offsets   = _mm256_set_pd(3.5, 2.5, 1.5, 0.5);
+        const __m256i running_state   = _mm256_set1_epi64x(1);
+        const __m256i converged_state = _mm256_set1_epi64x(2);
+        const __m256i even_lanes      = _mm256_set_epi32(7, 7, 7, 7, 6, 4, 2, 0);
+        for (; x + 4 <= _end; x += 4)
+        {
+            __m256d pu1 = _mm256_loadu_pd(u + x);
+            __m256d pv1 = _mm256_loadu_pd(v + x);
+            __m256d pv2 = _mm256_mul_pd(pv1, pv1);
+            __m256d pv3 = _mm256_mul_pd(pv2, pv1);
+            __m256d fx, fxu, fxv, fy, fyu, fyv;
+            evaluate_rows(ax, pu1, pv1, pv2, pv3, fx, fxu, fxv);
+            evaluate_rows(ay, pu1, pv1, pv2, pv3, fy, fyu, fyv);
+            __m256d rx      = _mm256_sub_pd(_mm256_mul_pd(_mm256_add_pd(_mm256_set1_pd(x), offsets), _mm256_set1_pd(scale)), fx);
+            __m256d ry      = _mm256_sub_pd(_mm256_set1_pd(_y), fy);
+            __m256d det     = _mm256_sub_pd(_mm256_mul_pd(fxu, fyv), _mm256_mul_pd(fxv, fyu));
+            __m256d regular = _mm256_cmp_pd(_mm256_and_pd(det, magnitude), singular, _CMP_GT_OQ);
+            __m256d inverse = _mm256_div_pd(one, _mm256_blendv_pd(one, det, regular));
+            __m256d un = _mm256_add_pd(pu1, _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(fyv, rx), _mm256_mul_pd(fxv, ry)), inverse));
+            __m256d vn = _mm256_add_pd(pv1, _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(fxu, ry), _mm256_mul_pd(fyu, rx)), inverse));
+            un         = _mm256_min_pd(upper, _mm256_max_pd(lower, un));
+            vn         = _mm256_min_pd(upper, _mm256_max_pd(lower, vn));
+
+            __m256i state     = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)(active + x)));
+            __m256d running   = _mm256_castsi256_pd(_mm256_cmpeq_epi64(state, running_state));
+            __m256d residual  = _mm256_add_pd(_mm256_mul_pd(rx, rx), _mm256_mul_pd(ry, ry));
+            __m256d converged = _mm256_and_pd(running, _mm256_cmp_pd(residual, _mm256_set1_pd(tolerance2), _CMP_LE_OQ));
+            __m256d step      = _mm256_and_pd(_mm256_andnot_pd(converged, running), regular);
+            _mm256_storeu_pd(u + x, _mm256_blendv_pd(pu1, un, step));
+            _mm256_storeu_pd(v + x, _mm256_blendv_pd(pv1, vn, step));
+            state = _mm256_blendv_epi8(state, converged_state, _mm256_castpd_si256(converged));
+            _mm_storeu_si128((__m128i*)(active + x), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(state, even_lanes)));
+            int still = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(state, running_state)));
+            num_active += (still & 1) + ((still >> 1) & 1) + ((still >> 2) & 1) + ((still >> 3) & 1);
+        }
+#endif
+        for (; x < _end; x++)
+        {
+            double pu1 = u[x];
+            double pv1 = v[x], pv2 = pv1 * pv1, pv3 = pv2 * pv1;
+            double fx, fxu, fxv, fy, fyu, fyv;
+            evaluate_rows(ax, pu1, pv1, pv2, pv3, fx, fxu, fxv);
+            evaluate_rows(ay, pu1, pv1, pv2, pv3, fy, fyu, fyv);
+            double rx = (x + 0.5) * scale - fx, ry = _y - fy;
+            double det      = fxu * fyv - fxv * fyu;
+            bool regular    = std::abs(det) > 1e-12;
+            double inverse  = 1 / (regular ? det : 1.0);
+            double un       = std::min(1.5, std::max(-0.5, pu1 + (fyv * rx - fxv * ry) * inverse));
+            double vn       = std::min(1.5, std::max(-0.5, pv1 + (fxu * ry - fyu * rx) * inverse));
+            bool running    = active[x] == 1;
+            // non-short-circuit operators keep the loop free of branches
+            bool converged  = running & (rx * rx + ry * ry <= tolerance2);
+            bool step       = running & !converged & regular;
+            // converged pixels keep the parameters at which the residual was measured
+            u[x]      = step ? un : pu1;
+            v[x]      = step ? vn : pv1;
+            active[x] = converged ? 2 : active[x];
+            num_active += active[x] == 1 ? 1 : 0;
+        }
+        return num_active;
+    }
+
+    /**
+     * @brief Checks whether converged parameters lie in the patch domain, and clamps them to it.
+     * @param _location In/out location.
+     * @return True if the parameters are inside the unit square up to a small slack.
+     */
+    static bool inside_domain(patch_location& _location)
+    {
+        const double slack = 1e-6;
+        if (_location.u < -slack || _location.u > 1 + slack || _location.v < -slack || _location.v > 1 + slack)
+            return false;
+        _location.u = std::min(1.0, std::max(0.0, _location.u));
+        _location.v = std::min(1.0, std::max(0.0, _location.v));
+        return true;
+    }
+
+    /**
+     * @brief Runs the Newton iteration on the patch of a location.
+     * @details Iterations that stay clamped at the border of the parameter band are stopped early, since the point then lies outside of the patch. They do not count as convergence failures.
+     * @param _target Target position in scene units.
+     * @param _location In/out location with the start parameters.
+     * @param _stats Counters to update.
+     * @return True if the iteration converged inside the patch domain.
+     */
+    bool newton(const point_type& _target, patch_location& _location, inverse_mapping_statistics& _stats) const
+    {
+        const patch_coefficients& patch = coefficients[_location.patch];
+        double tolerance = options.tolerance / std::max(index.scale_x, index.scale_y);
+        int num_clamped  = 0;
+        for (int iteration = 0; iteration < options.max_iterations; iteration++)
+        {
+            double u = _location.u, v = _location.v;
+            double distance = newton_step(patch, _target, _location.u, _location.v);
+            if (distance <= tolerance)
+            {
+                _location.u = u, _location.v = v;
+                return inside_domain(_location);
+            }
+            if (is_clamped(_location.u) || is_clamped(_location.v))
+            {
+                if (++num_clamped == 2)
+                    return false;
+            }
+            else
+            {
+                num_clamped = 0;
+            }
+        }
+        _stats.num_failed_iterations++;
+        return false;
+    }
+
+    /**
+     * @brief Tests whether a parameter was clamped by newton_step.
+     * @param _t Parameter.
+     * @return True if the parameter is at the border of the allowed band.
+     */
+    static bool is_clamped(double _t)
+    {
+        return _t <= -0.5 || _t >= 1.5;
+    }
+
+    /**
+     * @brief Initial guess by inverting the bilinear interpolation of the patch corners.
+     * @param _patch Patch in Hermite form.
+     * @param _target Target position in scene units.
+     * @param _u Output parameter along the columns.
+     * @param _v Output parameter along the rows.
+     */
+    static void bilinear_guess(const mesh_patch& _patch, const point_type& _target, double& _u, double& _v)
+    {
+        const point_type& p00 = _patch.positions[0];
+        const point_type& p10 = _patch.positions[1];
+        const point_type& p01 = _patch.positions[2];
+        const point_type& p11 = _patch.positions[3];
+        double ex = p10[0] - p00[0], ey = p10[1] - p00[1];
+        double fx = p01[0] - p00[0], fy = p01[1] - p00[1];
+        double gx = p00[0] - p10[0] - p01[0] + p11[0], gy = p00[1] - p10[1] - p01[1] + p11[1];
+        double hx = _target[0] - p00[0], hy = _target[1] - p00[1];
+
+        // solve the quadratic k2 v^2 + k1 v + k0 = 0 of the bilinear inverse
+        double k2 = gx * fy - gy * fx;
+        double k1 = ex * fy - ey * fx + hx * gy - hy * gx;
+        double k0 = hx * ey - hy * ex;
+        double v  = 0.5;
+        if (std::abs(k2) < 1e-12)
+        {
+            if (std::abs(k1) > 1e-12)
+                v = -k0 / k1;
+        }
+        else
+        {
+            double discriminant = k1 * k1 - 4 * k0 * k2;
+            if (discriminant >= 0)
+            {
+                double root = std::sqrt(discriminant);
+                double v0 = (-k1 - root) / (2 * k2), v1 = (-k1 + root) / (2 * k2);
+                v = std::abs(v0 - 0.5) < std::abs(v1 - 0.5) ? v0 : v1;
+            }
+        }
+        double denominator_x = ex + gx * v, denominator_y = ey + gy * v;
+        double u = std::abs(denominator_x) > std::abs(denominator_y) ? (hx - fx * v) / denominator_x : (std::abs(denominator_y) > 1e-12 ? (hy - fy * v) / denominator_y : 0.5);
+        _u = std::min(1.0, std::max(0.0, u));
+        _v = std::min(1.0, std::max(0.0, v));
+    }
+
+    /**
+     * @brief Tests whether a point lies in the bounding box of a patch.
+     * @param _patch Patch index.
+     * @param _target Point in scene units.
+     * @return True if inside.
+     */
+    bool inside_bounds(int _patch, const point_type& _target) const
+    {
+        return _target[0] >= bounds[_patch][0][0] && _target[0] <= bounds[_patch][1][0] && _target[1] >= bounds[_patch][0][1] && _target[1] <= bounds[_patch][1][1];
+    }
+
+    /**
+     * @brief Linear index of the index cell that contains a point.
+     * @param _target Point in scene units.
+     * @return Cell index, or -1 if outside of the image.
+     */
+    int cell_of(const point_type& _target) const
+    {
+        int cx = (int)std::floor(_target[0] * index.scale_x / index.tile_size);
+        int cy = (int)std::floor(_target[1] * index.scale_y / index.tile_size);
+        if (cx < 0 || cy < 0 || cx >= index.tiles_x || cy >= index.tiles_y)
+            return -1;
+        return cy * index.tiles_x + cx;
+    }
+
+    /**
+     * @brief Tries to locate a point on one patch, starting from the bilinear guess and then from a few fixed parameters.
+     * @param _patch Patch index.
+     * @param _target Point in scene units.
+     * @param _location Output location.
+     * @param _stats Counters to update.
+     * @return True if the point lies on the patch.
+     */
+    bool locate_on_patch(int _patch, const point_type& _target, patch_location& _location, inverse_mapping_statistics& _stats) const
+    {
+        static const double starts[5][2] = { { 0.5, 0.5 }, { 0.25, 0.25 }, { 0.75, 0.25 }, { 0.25, 0.75 }, { 0.75, 0.75 } };
+        _location.patch = _patch;
+        bilinear_guess(patches[_patch], _target, _location.u, _location.v);
+        if (newton(_target, _location, _stats))
+            return true;
+        for (const double* start : starts)
+        {
+            _location.u = start[0], _location.v = start[1];
+            if (newton(_target, _location, _stats))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Searches the candidates of the index cell, from the topmost patch down.
+     * @param _target Point in scene units.
+     * @param _stats Counters to update.
+     * @return Location of the point; patch is -1 if no patch covers it.
+     */
+    patch_location search(const point_type& _target, inverse_mapping_statistics& _stats) const
+    {
+        patch_location result;
+        int cell = cell_of(_target);
+        if (cell < 0)
+            return result;
+        bool inside_any = false;
+        for (const int* entry = index.end(cell); entry != index.begin(cell);)
+        {
+            int patch = index.primitives[*--entry].index;
+            if (!inside_bounds(patch, _target))
+                continue;
+            inside_any = true;
+            if (locate_on_patch(patch, _target, result, _stats))
+                return result;
+        }
+        if (inside_any)
+            _stats.num_unresolved++;
+        result.patch = -1;
+        return result;
+    }
+
+    /**
+     * @brief Checks that no patch of a mesh drawn later covers the point.
+     * @param _target Point in scene units.
+     * @param _location Location that was found.
+     * @param _stats Counters to update.
+     * @return True if the location is on top.
+     */
+    bool is_topmost(const point_type& _target, const patch_location& _location, inverse_mapping_statistics& _stats) const
+    {
+        int cell = cell_of(_target);
+        if (cell < 0)
+            return true;
+        int mesh = patches[_location.patch].mesh;
+        for (const int* entry = index.end(cell); entry != index.begin(cell);)
+        {
+            int patch = index.primitives[*--entry].index;
+            if (patches[patch].mesh <= mesh)
+                break;
+            patch_location other;
+            if (inside_bounds(patch, _target) && locate_on_patch(patch, _target, other, _stats))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Maps the pixel centers of one row.
+     * @param _y Row index.
+     * @param _above Locations of the row above, or nullptr for the first row of a band.
+     * @param _row Output locations of the row.
+     * @param _batch Scratch arrays.
+     * @param _stats Counters to update.
+     */
+    void map_row(int _y, const patch_location* _above, patch_location* _row, row_batch& _batch, inverse_mapping_statistics& _stats) const
+    {
+        int w = width();
+        double ty = (_y + 0.5) / index.scale_y;
+        double tolerance = options.tolerance / std::max(index.scale_x, index.scale_y);
+        _stats.num_pixels += w;
+
+        // batched Newton iterations seeded from the row above
+        if (_above != nullptr)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                _batch.patch[x]  = _above[x].patch;
+                _batch.u[x]      = _above[x].u;
+                _batch.v[x]      = _above[x].v;
+                _batch.active[x] = _above[x].patch >= 0 ? 1 : 0;
+            }
+            for (int iteration = 0; iteration < options.max_iterations; iteration++)
+            {
+                // neighboring pixels mostly share their patch, so the steps run over runs of equal patches
+                int num_active = 0;
+                for (int begin = 0, end = 0; begin < w; begin = end)
+                {
+                    for (end = begin + 1; end < w && _batch.patch[end] == _batch.patch[begin];)
+                        end++;
+                    if (_batch.patch[begin] >= 0)
+                        num_active += newton_run(coefficients[_batch.patch[begin]], begin, end, ty, tolerance, _batch);
+                }
+                if (num_active == 0)
+                    break;
+            }
+        }
+
+        // resolve the remaining pixels one by one
+        for (int x = 0; x < w; x++)
+        {
+            point_type target = { (x + 0.5) / index.scale_x, ty };
+            patch_location location;
+            bool resolved = false;
+            if (_above != nullptr && _batch.active[x] == 2)
+            {
+                location.patch = _batch.patch[x], location.u = _batch.u[x], location.v = _batch.v[x];
+                resolved = inside_domain(location) && is_topmost(target, location, _stats);
+            }
+            else if (_above != nullptr && _batch.active[x] == 1 && !is_clamped(_batch.u[x]) && !is_clamped(_batch.v[x]))
+            {
+                _stats.num_failed_iterations++;
+            }
+            if (resolved)
+                _stats.num_seeded++;
+            else
+                location = locate(x + 0.5, _y + 0.5, x > 0 ? &_row[x - 1] : nullptr, _stats);
+            _row[x] = location;
+            if (location.patch >= 0)
+                _stats.num_covered++;
+        }
+    }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "binning.hpp"
+#include "curves.hpp"
+#include "grid.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Per-pixel Laplacian source of the Poisson problem, i.e., the integral of the Laplacian over each pixel cell in scene units.
+ * @tparam T Floating point type of the accumulation.
+ */
+template <typename T>
+using source_grid = grid<std::array<T, 3>>;
+
+/**
+ * @brief Parameters of the source splatting.
+ */
+struct splatting_options
+{
+    /**
+     * @brief Edge length in pixels of the tiles that are accumulated in parallel.
+     */
+    int tile_size = 32;
+};
+
+/**
+ * @brief Splats the Laplacian weights of the Poisson curves into a source grid.
+ * @details A Poisson curve prescribes a Laplacian that is concentrated on the curve, with a density per unit length that is interpolated from the weights along the global curve parameter. The weights are given in coordinates normalized by the width of the scene, which is how the scenes are authored, so each pixel receives the line integral of this density over the part of the curve inside the pixel cell, with the length measured in units of the scene width. The sum over all pixels therefore does not depend on the resolution, and the discrete five-point Laplacian of the solution equals the source without further scaling. The segments are binned into tiles. Each tile clips its segments to its area, walks the cells they cross, and accumulates in the order of the bins into its own pixels, which makes the result independent of the number of threads.
+ * @tparam T Floating point type of the accumulation, float or double.
+ * @param _scene Scene with the weights of the Poisson curves.
+ * @param _curves Flattened curves of the scene.
+ * @param _options Parameters of the splatting.
+ * @param _source Source grid whose size defines the resolution; its content is replaced.
+ */
+template <typename T>
+void splat_poisson_curves(const scene& _scene, const flattened_scene& _curves, const splatting_options& _options, source_grid<T>& _source)
+{
+    std::array<T, 3> zero = { 0, 0, 0 };
+    _source.assign(_source.width, _source.height, zero);
+
+    binning_options binning;
+    binning.tile_size        = _options.tile_size;
+    binning.diffusion_curves = false;
+    binning.mesh_patches     = false;
+    tile_bins bins(_curves, std::vector<mesh_patch>(), _source.width, _source.height, binning);
+
+    bins.parallel_for_tiles([&](int tile) {
+        int x0 = (tile % bins.tiles_x) * bins.tile_size, y0 = (tile / bins.tiles_x) * bins.tile_size;
+        int x1 = std::min(_source.width, x0 + bins.tile_size), y1 = std::min(_source.height, y0 + bins.tile_size);
+        std::vector<double> crossings;
+        for (const int* entry = bins.begin(tile); entry != bins.end(tile); entry++)
+        {
+            const primitive_ref& ref   = bins.primitives[*entry];
+            const polyline& line       = _curves.poisson_curves[ref.index];
+            const poisson_curve& curve = _scene.poisson_curves[ref.index];
+            const point_type& a        = line.points[ref.element];
+            const point_type& b        = line.points[ref.element + 1];
+            point_type p0 = { a[0] * bins.scale_x, a[1] * bins.scale_y };
+            point_type p1 = { b[0] * bins.scale_x, b[1] * bins.scale_y };
+            double dx = p1[0] - p0[0], dy = p1[1] - p0[1];
+            double length = std::hypot(b[0] - a[0], b[1] - a[1]);
+            if (length == 0)
+                continue;
+
+            // clip to the tile (Liang-Barsky)
+            double s0 = 0, s1 = 1;
+            double delta[2] = { dx, dy }, start[2] = { p0[0], p0[1] }, lower[2] = { (double)x0, (double)y0 }, upper[2] = { (double)x1, (double)y1 };
+            for (int d = 0; d < 2 && s0 < s1; d++)
+            {
+                if (delta[d] == 0)
+                {
+                    if (start[d] < lower[d] || start[d] >= upper[d])
+                        s1 = s0;
+                    continue;
+                }
+                double enter = (lower[d] - start[d]) / delta[d], leave = (upper[d] - start[d]) / delta[d];
+                if (enter > leave)
+                    std::swap(enter, leave);
+                s0 = std::max(s0, enter);
+                s1 = std::min(s1, leave);
+            }
+            if (s0 >= s1)
+                continue;
+
+            // parameters at which the clipped segment crosses pixel borders
+            crossings.clear();
+            crossings.push_back(s0);
+            crossings.push_back(s1);
+            for (int d = 0; d < 2; d++)
+            {
+                if (delta[d] == 0)
+                    continue;
+                double c0 = start[d] + s0 * delta[d], c1 = start[d] + s1 * delta[d];
+                for (int border = (int)std::floor(std::min(c0, c1)) + 1; border < std::max(c0, c1); border++)
+                    crossings.push_back((border - start[d]) / delta[d]);
+            }
+            std::sort(crossings.begin(), crossings.end());
+
+            double t0 = line.params[ref.element], t1 = line.params[ref.element + 1];
+            for (size_t i = 0; i + 1 < crossings.size(); i++)
+            {
+                double sa = crossings[i], sb = crossings[i + 1];
+                if (sb <= sa)
+                    continue;
+                double middle = 0.5 * (sa + sb);
+                int x = std::min(x1 - 1, std::max(x0, (int)std::floor(p0[0] + middle * dx)));
+                int y = std::min(y1 - 1, std::max(y0, (int)std::floor(p0[1] + middle * dy)));
+                // trapezoidal rule, exact for weights that are linear within the piece
+                color_type wa = sample_color_points(curve.weights, t0 + sa * (t1 - t0));
+                color_type wb = sample_color_points(curve.weights, t0 + sb * (t1 - t0));
+                double piece  = (sb - sa) * length / _scene.width;
+                std::array<T, 3>& value = _source(x, y);
+                for (int c = 0; c < 3; c++)
+                    value[c] += (T)(0.5 * piece * (wa[c] + wb[c]));
+            }
+        }
+    });
+}
+
+/**
+ * @brief Sums the source over all pixels, e.g., to check that the splatting is independent of the resolution.
+ * @tparam T Floating point type of the source.
+ * @param _source Source grid.
+ * @return Total source per color channel.
+ */
+template <typename T>
+color_type total_source(const source_grid<T>& _source)
+{
+    color_type total = { 0, 0, 0 };
+    for (const std::array<T, 3>& value : _source.data)
+        for (int c = 0; c < 3; c++)
+            total[c] += value[c];
+    return total;
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "reader.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+/**
+ * @brief Single bicubic patch of a gradient mesh, spanned between four neighboring control points.
+ * @details The corners are ordered (u,v) = (0,0), (1,0), (0,1), (1,1), where u runs along the columns and v along the rows of the mesh.
+ */
+struct mesh_patch
+{
+    /**
+     * @brief Index of the gradient mesh in the scene.
+     */
+    int mesh;
+    /**
+     * @brief Row of the patch in the mesh.
+     */
+    int row;
+    /**
+     * @brief Column of the patch in the mesh.
+     */
+    int col;
+    /**
+     * @brief Corner positions.
+     */
+    std::array<point_type, 4> positions;
+    /**
+     * @brief Derivatives with respect to u at the corners.
+     */
+    std::array<point_type, 4> tangents_u;
+    /**
+     * @brief Derivatives with respect to v at the corners.
+     */
+    std::array<point_type, 4> tangents_v;
+    /**
+     * @brief Corner colors.
+     */
+    std::array<color_type, 4> colors;
+    /**
+     * @brief Finite difference derivatives of the colors with respect to u at the corners.
+     */
+    std::array<color_type, 4> color_tangents_u;
+    /**
+     * @brief Finite difference derivatives of the colors with respect to v at the corners.
+     */
+    std::array<color_type, 4> color_tangents_v;
+};
+
+/**
+ * @brief Linear index of a control point in a gradient mesh.
+ * @param _mesh Gradient mesh.
+ * @param _row Row of the control point in [0, num_rows].
+ * @param _col Column of the control point in [0, num_cols].
+ * @return Index into the positions, colors, and tangents.
+ */
+inline int mesh_index(const gradient_mesh& _mesh, int _row, int _col)
+{
+    return _row * (_mesh.num_cols + 1) + _col;
+}
+
+/**
+ * @brief Finite difference derivative of control point values along one grid direction.
+ * @details Uses central differences in the interior and one-sided differences at the border, both in units of the patch parameter.
+ * @param _values Linear list of values per control point.
+ * @param _mesh Gradient mesh that defines the grid.
+ * @param _row Row of the control point.
+ * @param _col Column of the control point.
+ * @param _along_rows True to differentiate along v (across rows), false to differentiate along u (across columns).
+ * @return Derivative estimate.
+ */
+template <typename T>
+T mesh_finite_difference(const std::vector<T>& _values, const gradient_mesh& _mesh, int _row, int _col, bool _along_rows)
+{
+    int count = _along_rows ? _mesh.num_rows : _mesh.num_cols;
+    int pos   = _along_rows ? _row : _col;
+    int lo    = std::max(pos - 1, 0);
+    int hi    = std::min(pos + 1, count);
+    const T& a = _values[_along_rows ? mesh_index(_mesh, lo, _col) : mesh_index(_mesh, _row, lo)];
+    const T& b = _values[_along_rows ? mesh_index(_mesh, hi, _col) : mesh_index(_mesh, _row, hi)];
+    T result;
+    for (size_t d = 0; d < result.size(); d++)
+        result[d] = hi > lo ? (b[d] - a[d]) / (hi - lo) : 0;
+    return result;
+}
+
+/**
+ * @brief Returns the position tangents of a gradient mesh, estimating them by finite differences if the mesh has no pos_tangent_set.
+ * @param _mesh Gradient mesh.
+ * @param _tangents_u Output vector that receives the U tangent per control point.
+ * @param _tangents_v Output vector that receives the V tangent per control point.
+ */
+inline void mesh_tangents(const gradient_mesh& _mesh, std::vector<point_type>& _tangents_u, std::vector<point_type>& _tangents_v)
+{
+    size_t num_points = _mesh.positions.size();
+    if (_mesh.tangents_u.size() == num_points && _mesh.tangents_v.size() == num_points)
+    {
+        _tangents_u = _mesh.tangents_u;
+        _tangents_v = _mesh.tangents_v;
+        return;
+    }
+
+    _tangents_u.resize(num_points);
+    _tangents_v.resize(num_points);
+    for (int row = 0; row <= _mesh.num_rows; row++)
+    {
+        for (int col = 0; col <= _mesh.num_cols; col++)
+        {
+            _tangents_u[mesh_index(_mesh, row, col)] = mesh_finite_difference(_mesh.positions, _mesh, row, col, false);
+            _tangents_v[mesh_index(_mesh, row, col)] = mesh_finite_difference(_mesh.positions, _mesh, row, col, true);
+        }
+    }
+}
+
+/**
+ * @brief Splits all gradient meshes of a scene into their patches.
+ * @param _scene Scene with gradient meshes.
+ * @return Patches of all meshes, ordered by mesh, then row, then column.
+ */
+inline std::vector<mesh_patch> mesh_patches(const scene& _scene)
+{
+    std::vector<mesh_patch> patches;
+    std::vector<point_type> tangents_u, tangents_v;
+    for (size_t m = 0; m < _scene.gradient_meshes.size(); m++)
+    {
+        const gradient_mesh& mesh = _scene.gradient_meshes[m];
+        mesh_tangents(mesh, tangents_u, tangents_v);
+        for (int row = 0; row < mesh.num_rows; row++)
+        {
+            for (int col = 0; col < mesh.num_cols; col++)
+            {
+                mesh_patch patch;
+                patch.mesh = (int)m;
+                patch.row  = row;
+                patch.col  = col;
+                int corners[4] = { mesh_index(mesh, row, col), mesh_index(mesh, row, col + 1), mesh_index(mesh, row + 1, col), mesh_index(mesh, row + 1, col + 1) };
+                for (int c = 0; c < 4; c++)
+                {
+                    patch.positions[c]  = mesh.positions[corners[c]];
+                    patch.tangents_u[c] = tangents_u[corners[c]];
+                    patch.tangents_v[c] = tangents_v[corners[c]];
+                    patch.colors[c]     = mesh.colors[corners[c]];
+                }
+                for (int c = 0; c < 4; c++)
+                {
+                    int corner_row = row + (c >> 1);
+                    int corner_col = col + (c & 1);
+                    patch.color_tangents_u[c] = mesh_finite_difference(mesh.colors, mesh, corner_row, corner_col, false);
+                    patch.color_tangents_v[c] = mesh_finite_difference(mesh.colors, mesh, corner_row, corner_col, true);
+                }
+                patches.push_back(patch);
+            }
+        }
+    }
+    return patches;
+}
+
+/**
+ * @brief Computes a conservative bounding box of a patch from the Bezier control points of its boundary curves.
+ * @details With a zero twist, the interior Bezier control points of the Ferguson patch are combinations of the boundary control points, so the hull of the boundary is sufficient.
+ * @param _patch Patch to bound.
+ * @param _min Output minimum corner.
+ * @param _max Output maximum corner.
+ */
+inline void patch_bounds(const mesh_patch& _patch, point_type& _min, point_type& _max)
+{
+    _min = _patch.positions[0];
+    _max = _patch.positions[0];
+    for (int c = 0; c < 4; c++)
+    {
+        // the corners at u=1 / v=1 have their Bezier neighbors in negative tangent direction
+        double su = (c & 1) ? -1.0 / 3.0 : 1.0 / 3.0;
+        double sv = (c & 2) ? -1.0 / 3.0 : 1.0 / 3.0;
+        for (int d = 0; d < 2; d++)
+        {
+            double values[4] = { _patch.positions[c][d],
+                                 _patch.positions[c][d] + su * _patch.tangents_u[c][d],
+                                 _patch.positions[c][d] + sv * _patch.tangents_v[c][d],
+                                 _patch.positions[c][d] + su * _patch.tangents_u[c][d] + sv * _patch.tangents_v[c][d] };
+            for (double value : values)
+            {
+                _min[d] = std::min(_min[d], value);
+                _max[d] = std::max(_max[d], value);
+            }
+        }
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "constraints.hpp"
+#include "inverse_mapping.hpp"
+#include "laplacian_source.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Counters of the conversion of gradient meshes into Poisson constraints.
+ */
+struct mesh_constraint_statistics
+{
+    /**
+     * @brief Number of pixels covered by a gradient mesh.
+     */
+    long long num_covered = 0;
+    /**
+     * @brief Number of covered pixels at the border of their mesh, which received a Dirichlet constraint.
+     */
+    long long num_border = 0;
+    /**
+     * @brief Number of patches that cover at least one pixel.
+     */
+    int num_active_patches = 0;
+};
+
+/**
+ * @brief Laplacian of the color of a patch with respect to the scene coordinates.
+ * @details The patch maps (u,v) to (x,y). With the Jacobian J of this map, the gradient of a color channel c in scene coordinates is g = J^-T (c_u, c_v), and the Laplacian is the trace of J^-T (H_c - g_x H_x - g_y H_y) J^-1, where H are the Hessians with respect to (u,v).
+ * @param _patch Patch in power basis.
+ * @param _u Parameter along the columns.
+ * @param _v Parameter along the rows.
+ * @return Laplacian of the color channels, or zero where the patch is degenerate.
+ */
+inline color_type patch_laplacian(const patch_coefficients& _patch, double _u, double _v)
+{
+    std::array<double, 6> x, y, c;
+    _patch.evaluate_derivatives(0, _u, _v, x);
+    _patch.evaluate_derivatives(1, _u, _v, y);
+    double det = x[1] * y[2] - x[2] * y[1];
+    if (std::abs(det) < 1e-12)
+        return color_type{ 0, 0, 0 };
+
+    // inverse Jacobian: rows are the gradients of u and v in scene coordinates
+    double ux = y[2] / det, uy = -x[2] / det;
+    double vx = -y[1] / det, vy = x[1] / det;
+    double guu = ux * ux + uy * uy, guv = ux * vx + uy * vy, gvv = vx * vx + vy * vy;
+    color_type result;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        _patch.evaluate_derivatives(2 + channel, _u, _v, c);
+        double gx = c[1] * ux + c[2] * vx, gy = c[1] * uy + c[2] * vy;
+        double muu = c[3] - gx * x[3] - gy * y[3];
+        double muv = c[4] - gx * x[4] - gy * y[4];
+        double mvv = c[5] - gx * x[5] - gy * y[5];
+        result[channel] = muu * guu + 2 * muv * guv + mvv * gvv;
+    }
+    return result;
+}
+
+/**
+ * @brief Converts the gradient meshes of a scene into Poisson constraints on a pixel grid.
+ * @details Every covered pixel receives the Laplacian of the color interpolant of its patch, integrated over the pixel cell, as source. Covered pixels at the image border or with a 4-neighbor that is not covered by the same mesh get a Dirichlet constraint with the color of the mesh at the pixel center, so that the solution reproduces the mesh inside and the meshes are separated from each other and from the background. The pixels are grouped by the patch that covers them and the patches are processed in parallel, each writing only its own pixels.
+ * @param _mapping Inverse mapping of the gradient meshes at the resolution of the grids.
+ * @param _locations Location of every pixel, as computed by the inverse mapping.
+ * @param _cell_area Area of a pixel in squared scene units.
+ * @param _constraints Constraint grid that receives the Dirichlet constraints at the mesh borders.
+ * @param _source Source grid that receives the Laplacian of the meshes.
+ * @return Counters of the conversion.
+ */
+inline mesh_constraint_statistics convert_gradient_meshes(const mesh_inverse_mapping& _mapping, const std::vector<patch_location>& _locations, double _cell_area,
+                                                          constraint_grid& _constraints, source_grid<double>& _source)
+{
+    int width = _mapping.width(), height = _mapping.height();
+    int num_patches = (int)_mapping.patches.size();
+
+    // counting sort of the pixels by patch
+    std::vector<int> offsets(num_patches + 1, 0);
+    for (const patch_location& location : _locations)
+        if (location.patch >= 0)
+            offsets[location.patch + 1]++;
+    for (int p = 0; p < num_patches; p++)
+        offsets[p + 1] += offsets[p];
+    std::vector<int> pixels(offsets[num_patches]);
+    std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < _locations.size(); i++)
+        if (_locations[i].patch >= 0)
+            pixels[cursor[_locations[i].patch]++] = (int)i;
+
+    std::vector<long long> num_border(num_patches, 0);
+    parallel_for(0, num_patches, [&](int p) {
+        const patch_coefficients& patch = _mapping.coefficients[p];
+        int mesh = _mapping.patches[p].mesh;
+        auto same_mesh = [&](int _x, int _y) {
+            int neighbor = _locations[(size_t)_y * width + _x].patch;
+            return neighbor >= 0 && _mapping.patches[neighbor].mesh == mesh;
+        };
+        for (int k = offsets[p]; k < offsets[p + 1]; k++)
+        {
+            int i = pixels[k], x = i % width, y = i / width;
+            const patch_location& location = _locations[i];
+            color_type laplacian         = patch_laplacian(patch, location.u, location.v);
+            std::array<double, 3>& value = _source.data[i];
+            for (int c = 0; c < 3; c++)
+                value[c] += _cell_area * laplacian[c];
+
+            // the image border counts as mesh border: the mesh colors do not satisfy the zero flux of the Neumann border in general
+            bool border = x == 0 || x + 1 == width || y == 0 || y + 1 == height || !same_mesh(x - 1, y) || !same_mesh(x + 1, y) || !same_mesh(x, y - 1) ||
+                          !same_mesh(x, y + 1);
+            if (border)
+            {
+                point_type position;
+                color_type color;
+                patch.evaluate(location.u, location.v, position, color);
+                _constraints.set(i, color);
+                num_border[p]++;
+            }
+        }
+    });
+
+    mesh_constraint_statistics stats;
+    stats.num_covered = offsets[num_patches];
+    for (int p = 0; p < num_patches; p++)
+    {
+        stats.num_border += num_border[p];
+        stats.num_active_patches += offsets[p + 1] > offsets[p];
+    }
+    return stats;
+}
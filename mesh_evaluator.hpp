@@ -0,0 +1,310 @@
+#pragma once
+
+#include "mesh.hpp"
+#include "parallel.hpp"
+
+#include <array>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Interpolation schemes for the colors of a gradient mesh patch.
+ */
+enum class color_interpolation
+{
+    /**
+     * @brief Bilinear interpolation of the corner colors.
+     */
+    bilinear,
+    /**
+     * @brief Bicubic Hermite interpolation with finite difference color derivatives.
+     */
+    bicubic
+};
+
+/**
+ * @brief Cubic Hermite basis functions h0, h1 (values) and h2, h3 (derivatives) at a parameter.
+ * @param _t Parameter in [0,1].
+ * @return Basis function values.
+ */
+inline std::array<double, 4> hermite_basis(double _t)
+{
+    double t2 = _t * _t;
+    double t3 = t2 * _t;
+    return std::array<double, 4>{ 1 - 3 * t2 + 2 * t3, 3 * t2 - 2 * t3, _t - 2 * t2 + t3, t3 - t2 };
+}
+
+/**
+ * @brief Evaluates a patch directly in Hermite form, i.e., the Ferguson patch with zero twist.
+ * @details This is the straightforward reference; use patch_coefficients for repeated evaluations.
+ * @param _patch Patch to evaluate.
+ * @param _u Parameter along the columns in [0,1].
+ * @param _v Parameter along the rows in [0,1].
+ * @param _interpolation Interpolation scheme of the colors.
+ * @param _position Output position.
+ * @param _color Output color.
+ */
+inline void evaluate_patch(const mesh_patch& _patch, double _u, double _v, color_interpolation _interpolation, point_type& _position, color_type& _color)
+{
+    std::array<double, 4> hu = hermite_basis(_u);
+    std::array<double, 4> hv = hermite_basis(_v);
+    for (int d = 0; d < 2; d++)
+    {
+        _position[d] = hu[0] * hv[0] * _patch.positions[0][d] + hu[1] * hv[0] * _patch.positions[1][d] + hu[0] * hv[1] * _patch.positions[2][d] + hu[1] * hv[1] * _patch.positions[3][d]
+                       + hu[2] * hv[0] * _patch.tangents_u[0][d] + hu[3] * hv[0] * _patch.tangents_u[1][d] + hu[2] * hv[1] * _patch.tangents_u[2][d] + hu[3] * hv[1] * _patch.tangents_u[3][d]
+                       + hu[0] * hv[2] * _patch.tangents_v[0][d] + hu[1] * hv[2] * _patch.tangents_v[1][d] + hu[0] * hv[3] * _patch.tangents_v[2][d] + hu[1] * hv[3] * _patch.tangents_v[3][d];
+    }
+    for (int d = 0; d < 3; d++)
+    {
+        if (_interpolation == color_interpolation::bilinear)
+        {
+            _color[d] = (1 - _u) * (1 - _v) * _patch.colors[0][d] + _u * (1 - _v) * _patch.colors[1][d] + (1 - _u) * _v * _patch.colors[2][d] + _u * _v * _patch.colors[3][d];
+        }
+        else
+        {
+            _color[d] = hu[0] * hv[0] * _patch.colors[0][d] + hu[1] * hv[0] * _patch.colors[1][d] + hu[0] * hv[1] * _patch.colors[2][d] + hu[1] * hv[1] * _patch.colors[3][d]
+                        + hu[2] * hv[0] * _patch.color_tangents_u[0][d] + hu[3] * hv[0] * _patch.color_tangents_u[1][d] + hu[2] * hv[1] * _patch.color_tangents_u[2][d] + hu[3] * hv[1] * _patch.color_tangents_u[3][d]
+                        + hu[0] * hv[2] * _patch.color_tangents_v[0][d] + hu[1] * hv[2] * _patch.color_tangents_v[1][d] + hu[0] * hv[3] * _patch.color_tangents_v[2][d] + hu[1] * hv[3] * _patch.color_tangents_v[3][d];
+        }
+    }
+}
+
+/**
+ * @brief Bicubic patch in power basis: each channel is sum_{k,l} a[4k+l] u^k v^l.
+ * @details The channels are x, y, r, g, b.
+ */
+struct patch_coefficients
+{
+    /**
+     * @brief Number of channels (x, y, r, g, b).
+     */
+    static const int num_channels = 5;
+
+    /**
+     * @brief Converts a patch from Hermite form to power basis.
+     * @param _patch Patch to convert.
+     * @param _interpolation Interpolation scheme of the colors.
+     */
+    patch_coefficients(const mesh_patch& _patch, color_interpolation _interpolation)
+    {
+        for (int d = 0; d < 2; d++)
+        {
+            double geometry[16] = { _patch.positions[0][d], _patch.positions[2][d], _patch.tangents_v[0][d], _patch.tangents_v[2][d],
+                                    _patch.positions[1][d], _patch.positions[3][d], _patch.tangents_v[1][d], _patch.tangents_v[3][d],
+                                    _patch.tangents_u[0][d], _patch.tangents_u[2][d], 0, 0,
+                                    _patch.tangents_u[1][d], _patch.tangents_u[3][d], 0, 0 };
+            hermite_to_power(geometry, coefficients[d]);
+        }
+        for (int d = 0; d < 3; d++)
+        {
+            std::array<double, 16>& a = coefficients[2 + d];
+            if (_interpolation == color_interpolation::bilinear)
+            {
+                a.fill(0);
+                a[0]     = _patch.colors[0][d];
+                a[4 * 1] = _patch.colors[1][d] - _patch.colors[0][d];
+                a[1]     = _patch.colors[2][d] - _patch.colors[0][d];
+                a[4 + 1] = _patch.colors[0][d] - _patch.colors[1][d] - _patch.colors[2][d] + _patch.colors[3][d];
+            }
+            else
+            {
+                double geometry[16] = { _patch.colors[0][d], _patch.colors[2][d], _patch.color_tangents_v[0][d], _patch.color_tangents_v[2][d],
+                                        _patch.colors[1][d], _patch.colors[3][d], _patch.color_tangents_v[1][d], _patch.color_tangents_v[3][d],
+                                        _patch.color_tangents_u[0][d], _patch.color_tangents_u[2][d], 0, 0,
+                                        _patch.color_tangents_u[1][d], _patch.color_tangents_u[3][d], 0, 0 };
+                hermite_to_power(geometry, a);
+            }
+        }
+    }
+
+    /**
+     * @brief Power basis coefficients per channel.
+     */
+    std::array<std::array<double, 16>, num_channels> coefficients;
+
+    /**
+     * @brief Evaluates one channel.
+     * @param _channel Channel index (0: x, 1: y, 2: r, 3: g, 4: b).
+     * @param _u Parameter along the columns.
+     * @param _v Parameter along the rows.
+     * @return Value of the channel.
+     */
+    double evaluate(int _channel, double _u, double _v) const
+    {
+        const std::array<double, 16>& a = coefficients[_channel];
+        double result = 0;
+        for (int k = 3; k >= 0; k--)
+            result = result * _u + (((a[4 * k + 3] * _v + a[4 * k + 2]) * _v + a[4 * k + 1]) * _v + a[4 * k]);
+        return result;
+    }
+
+    /**
+     * @brief Evaluates the position and color.
+     * @param _u Parameter along the columns.
+     * @param _v Parameter along the rows.
+     * @param _position Output position.
+     * @param _color Output color.
+     */
+    void evaluate(double _u, double _v, point_type& _position, color_type& _color) const
+    {
+        _position = point_type{ evaluate(0, _u, _v), evaluate(1, _u, _v) };
+        _color    = color_type{ evaluate(2, _u, _v), evaluate(3, _u, _v), evaluate(4, _u, _v) };
+    }
+
+    /**
+     * @brief Evaluates one channel and its first and second partial derivatives.
+     * @param _channel Channel index (0: x, 1: y, 2: r, 3: g, 4: b).
+     * @param _u Parameter along the columns.
+     * @param _v Parameter along the rows.
+     * @param _derivatives Output value and derivatives (f, f_u, f_v, f_uu, f_uv, f_vv).
+     */
+    void evaluate_derivatives(int _channel, double _u, double _v, std::array<double, 6>& _derivatives) const
+    {
+        const std::array<double, 16>& a = coefficients[_channel];
+        double pu[4]   = { 1, _u, _u * _u, _u * _u * _u };
+        double pv[4]   = { 1, _v, _v * _v, _v * _v * _v };
+        double dpu[4]  = { 0, 1, 2 * _u, 3 * _u * _u };
+        double dpv[4]  = { 0, 1, 2 * _v, 3 * _v * _v };
+        double ddpu[4] = { 0, 0, 2, 6 * _u };
+        double ddpv[4] = { 0, 0, 2, 6 * _v };
+        _derivatives.fill(0);
+        for (int k = 0; k < 4; k++)
+        {
+            for (int l = 0; l < 4; l++)
+            {
+                double c = a[4 * k + l];
+                _derivatives[0] += c * pu[k] * pv[l];
+                _derivatives[1] += c * dpu[k] * pv[l];
+                _derivatives[2] += c * pu[k] * dpv[l];
+                _derivatives[3] += c * ddpu[k] * pv[l];
+                _derivatives[4] += c * dpu[k] * dpv[l];
+                _derivatives[5] += c * pu[k] * ddpv[l];
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Converts a Hermite geometry matrix G[4i+j] (i: u basis, j: v basis) to power basis a[4k+l] = sum_ij M[i][k] M[j][l] G[4i+j].
+     * @param _geometry Hermite geometry matrix.
+     * @param _coefficients Output power basis coefficients.
+     */
+    static void hermite_to_power(const double* _geometry, std::array<double, 16>& _coefficients)
+    {
+        // rows: h0 = 1 - 3t^2 + 2t^3, h1 = 3t^2 - 2t^3, h2 = t - 2t^2 + t^3, h3 = -t^2 + t^3
+        static const double M[4][4] = { { 1, 0, -3, 2 }, { 0, 0, 3, -2 }, { 0, 1, -2, 1 }, { 0, 0, -1, 1 } };
+        double temp[16];
+        for (int i = 0; i < 4; i++)
+            for (int l = 0; l < 4; l++)
+                temp[4 * i + l] = M[0][l] * _geometry[4 * i + 0] + M[1][l] * _geometry[4 * i + 1] + M[2][l] * _geometry[4 * i + 2] + M[3][l] * _geometry[4 * i + 3];
+        for (int k = 0; k < 4; k++)
+            for (int l = 0; l < 4; l++)
+                _coefficients[4 * k + l] = M[0][k] * temp[l] + M[1][k] * temp[4 + l] + M[2][k] * temp[8 + l] + M[3][k] * temp[12 + l];
+    }
+};
+
+/**
+ * @brief Converts a list of patches to power basis.
+ * @param _patches Patches to convert.
+ * @param _interpolation Interpolation scheme of the colors.
+ * @return Power basis coefficients per patch.
+ */
+inline std::vector<patch_coefficients> make_patch_coefficients(const std::vector<mesh_patch>& _patches, color_interpolation _interpolation)
+{
+    std::vector<patch_coefficients> result;
+    result.reserve(_patches.size());
+    for (const mesh_patch& patch : _patches)
+        result.push_back(patch_coefficients(patch, _interpolation));
+    return result;
+}
+
+/**
+ * @brief Samples of all patches on a regular (u,v) grid, stored as structure of arrays.
+ */
+struct patch_grid_samples
+{
+    /**
+     * @brief Number of samples along u, including both ends.
+     */
+    int num_u = 0;
+    /**
+     * @brief Number of samples along v, including both ends.
+     */
+    int num_v = 0;
+    /**
+     * @brief Number of patches.
+     */
+    int num_patches = 0;
+    /**
+     * @brief Sample values per channel (x, y, r, g, b), indexed by sample_index.
+     */
+    std::array<std::vector<double>, patch_coefficients::num_channels> channels;
+
+    /**
+     * @brief Linear index of a sample.
+     * @param _patch Patch index.
+     * @param _iu Sample index along u.
+     * @param _iv Sample index along v.
+     * @return Index into the channel arrays.
+     */
+    size_t sample_index(int _patch, int _iu, int _iv) const
+    {
+        return ((size_t)_patch * num_v + _iv) * num_u + _iu;
+    }
+};
+
+/**
+ * @brief Evaluates all patches on a regular (u,v) grid at once.
+ * @details For each row of samples, the v polynomial is collapsed into four u coefficients per channel and the remaining cubic is evaluated with Horner's scheme across the row, four samples at a time with AVX2 if available. Patches are processed in parallel.
+ * @param _patches Patches in power basis.
+ * @param _num_u Number of samples along u, at least two.
+ * @param _num_v Number of samples along v, at least two.
+ * @param _samples Output samples.
+ */
+inline void evaluate_patch_grid(const std::vector<patch_coefficients>& _patches, int _num_u, int _num_v, patch_grid_samples& _samples)
+{
+    _samples.num_u       = _num_u;
+    _samples.num_v       = _num_v;
+    _samples.num_patches = (int)_patches.size();
+    size_t num_samples   = (size_t)_num_u * _num_v * _patches.size();
+    for (std::vector<double>& channel : _samples.channels)
+        channel.resize(num_samples);
+
+    std::vector<double> us(_num_u);
+    for (int iu = 0; iu < _num_u; iu++)
+        us[iu] = (double)iu / (_num_u - 1);
+
+    parallel_for(0, (int)_patches.size(), [&](int p) {
+        const patch_coefficients& patch = _patches[p];
+        for (int iv = 0; iv < _num_v; iv++)
+        {
+            double v = (double)iv / (_num_v - 1);
+            for (int channel = 0; channel < patch_coefficients::num_channels; channel++)
+            {
+                const std::array<double, 16>& a = patch.coefficients[channel];
+                double b[4];
+                for (int k = 0; k < 4; k++)
+                    b[k] = ((a[4 * k + 3] * v + a[4 * k + 2]) * v + a[4 * k + 1]) * v + a[4 * k];
+
+                double* out = _samples.channels[channel].data() + _samples.sample_index(p, 0, iv);
+                int iu      = 0;
+#if defined(__AVX2__)
+                __m256d b0 = _mm256_set1_pd(b[0]), b1 = _mm256_set1_pd(b[1]), b2 = _mm256_set1_pd(b[2]), b3 = _mm256_set1_pd(b[3]);
+                for (; iu + 4 <= _num_u; iu += 4)
+                {
+                    __m256d u     = _mm256_loadu_pd(us.data() + iu);
+                    __m256d value = _mm256_add_pd(_mm256_mul_pd(b3, u), b2);
+                    value         = _mm256_add_pd(_mm256_mul_pd(value, u), b1);
+                    value         = _mm256_add_pd(_mm256_mul_pd(value, u), b0);
+                    _mm256_storeu_pd(out + iu, value);
+                }
+#endif
+                for (; iu < _num_u; iu++)
+                    out[iu] = ((b[3] * us[iu] + b[2]) * us[iu] + b[1]) * us[iu] + b[0];
+            }
+        }
+    });
+}
@@ -0,0 +1,883 @@
+#pragma once
+
+#include "image.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "solver.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Smoother of the multigrid solver.
+ */
+enum class multigrid_smoother
+{
+    /**
+     * @brief Red-black Gauss-Seidel, parallel over the rows of each color.
+     */
+    red_black_gauss_seidel,
+    /**
+     * @brief Damped Jacobi, parallel over rows.
+     */
+    jacobi
+};
+
+/**
+ * @brief Recursion pattern of a multigrid cycle.
+ */
+enum class multigrid_cycle
+{
+    /**
+     * @brief One coarse-grid correction per level.
+     */
+    v,
+    /**
+     * @brief Two coarse-grid corrections per level.
+     */
+    w
+};
+
+/**
+ * @brief Parameters of the multigrid solver.
+ */
+struct multigrid_options
+{
+    /**
+     * @brief Recursion pattern of the cycles.
+     * @details W-cycles cost about as much as V-cycles until convergence, since they need fewer cycles, but leave much smaller errors in the regions that are mostly enclosed by barriers.
+     */
+    multigrid_cycle cycle = multigrid_cycle::w;
+    /**
+     * @brief Smoother on every level but the coarsest.
+     */
+    multigrid_smoother smoother = multigrid_smoother::red_black_gauss_seidel;
+    /**
+     * @brief Number of smoothing sweeps before the coarse-grid correction.
+     */
+    int pre_smoothing = 2;
+    /**
+     * @brief Number of smoothing sweeps after the coarse-grid correction.
+     */
+    int post_smoothing = 2;
+    /**
+     * @brief Damping of the Jacobi smoother.
+     */
+    double jacobi_weight = 0.8;
+    /**
+     * @brief Levels are coarsened until neither side is longer than this number of cells.
+     */
+    int coarsest_size = 8;
+    /**
+     * @brief Number of red-black Gauss-Seidel sweeps that solve the coarsest level.
+     */
+    int coarsest_sweeps = 200;
+    /**
+     * @brief The solver stops once the residual norm relative to the norm of the right-hand side falls below this value.
+     * @details Tighter than for relaxation, since the cycles leave smooth errors in regions that are mostly enclosed by barriers, which have small residuals.
+     */
+    double tolerance = 1e-5;
+    /**
+     * @brief Maximum number of cycles.
+     */
+    int max_cycles = 100;
+    /**
+     * @brief Starts without an initial guess from a full multigrid pass, which solves the coarsest level and runs one cycle on each finer level, starting from the interpolated solution of the level below.
+     */
+    bool full_multigrid = false;
+    /**
+     * @brief Recursion pattern of the cycles in the full multigrid pass.
+     * @details The interpolated solution of the level below is already accurate up to the discretization error of that level, so one V-cycle per level suffices to carry it over, while the cycles on the finest level that follow use the pattern above.
+     */
+    multigrid_cycle full_multigrid_cycle = multigrid_cycle::v;
+    /**
+     * @brief If positive, the solver also stops once a cycle changes no color channel by more than this value, which estimates the visible error of the result. During a full multigrid pass, this skips the cycles on all finer levels and only interpolates the solution.
+     */
+    double max_color_change = 0;
+};
+
+/**
+ * @brief Discrete Poisson problem of one level of the multigrid hierarchy.
+ * @details The unknowns of a level are nodes that lie in the cells of a regular grid, where a cell can hold any number of nodes. The nodes are numbered by cell in row-major order. On the finest level, the cells are the pixels and every free pixel is a node. Node i satisfies d_i u_i - sum_j c_ij u_j = b_i, where c_ij are the couplings to its neighbors, which lie in horizontally or vertically adjacent cells, and the diagonal d_i is their sum plus the Dirichlet and mass terms. On the finest level, the Dirichlet term counts the open edges to pinned pixels, whose colors are moved to the right-hand side, and the mass term is the weight a = w / (1 - w) of a soft constraint.
+ */
+struct multigrid_level
+{
+    /**
+     * @brief Width in cells.
+     */
+    int width = 0;
+    /**
+     * @brief Height in cells.
+     */
+    int height = 0;
+    /**
+     * @brief Index of the first node of every cell, followed by the number of nodes.
+     */
+    std::vector<int> first;
+    /**
+     * @brief Index of the first coupling of every node, followed by the number of couplings.
+     */
+    std::vector<int> offsets;
+    /**
+     * @brief Neighbor node of every coupling.
+     */
+    std::vector<int> neighbors;
+    /**
+     * @brief Weight of every coupling.
+     */
+    std::vector<float> couplings;
+    /**
+     * @brief Coupling of every node to Dirichlet values, which scales with the edge length.
+     */
+    std::vector<float> dirichlet;
+    /**
+     * @brief Coupling of every node to soft constraints, which scales with the area.
+     */
+    std::vector<float> mass;
+    /**
+     * @brief Sum of all couplings of every node.
+     */
+    std::vector<double> diagonal;
+    /**
+     * @brief Node of the next coarser level that contains a node; empty on the coarsest level.
+     */
+    std::vector<int> parent;
+    /**
+     * @brief Solution on the finest level, correction on the coarser levels.
+     */
+    std::vector<color_type> solution;
+    /**
+     * @brief Right-hand side.
+     */
+    std::vector<color_type> rhs;
+    /**
+     * @brief Residual of the current solution.
+     */
+    std::vector<color_type> residual;
+    /**
+     * @brief Correction prolongated from the next coarser level.
+     */
+    std::vector<color_type> correction;
+
+    /**
+     * @brief Number of nodes.
+     * @return Number of nodes over all cells.
+     */
+    int num_nodes() const
+    {
+        return first.empty() ? 0 : first.back();
+    }
+
+    /**
+     * @brief First node of a cell.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Index of the first node.
+     */
+    int cell_begin(int _x, int _y) const
+    {
+        return first[(size_t)_y * width + _x];
+    }
+
+    /**
+     * @brief End of the nodes of a cell.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Index after the last node.
+     */
+    int cell_end(int _x, int _y) const
+    {
+        return first[(size_t)_y * width + _x + 1];
+    }
+
+    /**
+     * @brief Resizes the arrays of the nodes to the number of nodes and clears them.
+     */
+    void allocate()
+    {
+        size_t size = (size_t)num_nodes();
+        offsets.assign(size + 1, 0);
+        dirichlet.assign(size, 0.f);
+        mass.assign(size, 0.f);
+        diagonal.assign(size, 0.0);
+        solution.assign(size, color_type{ 0, 0, 0 });
+        rhs.assign(size, color_type{ 0, 0, 0 });
+        residual.assign(size, color_type{ 0, 0, 0 });
+        correction.assign(size, color_type{ 0, 0, 0 });
+    }
+
+    /**
+     * @brief Sums the couplings of every node into its diagonal.
+     */
+    void update_diagonal()
+    {
+        for (size_t i = 0; i < diagonal.size(); i++)
+        {
+            diagonal[i] = (double)mass[i] + dirichlet[i];
+            for (int k = offsets[i]; k < offsets[i + 1]; k++)
+                diagonal[i] += couplings[k];
+        }
+    }
+
+    /**
+     * @brief Weighted sum of the values of the neighbors of a node.
+     * @param _values Values of the level.
+     * @param _node Node.
+     * @return Sum per channel.
+     */
+    color_type neighbor_sum(const std::vector<color_type>& _values, int _node) const
+    {
+        color_type sum = { 0, 0, 0 };
+        for (int k = offsets[_node]; k < offsets[_node + 1]; k++)
+            for (int c = 0; c < 3; c++)
+                sum[c] += couplings[k] * _values[neighbors[k]][c];
+        return sum;
+    }
+};
+
+/**
+ * @brief Geometric multigrid solver for the Poisson system of a scene.
+ * @details The finest level eliminates the pinned pixels of the system. Every coarser level merges blocks of 2 x 2 cells, but instead of one unknown per block, it has one node per connected component of the fine nodes in the block. Nodes on both sides of a closed edge thus stay apart on all levels, and so do the pixels separated by Neumann barriers, which a plain 2 x 2 coarsening blurs together; these are exactly the error modes that otherwise converge slowest. The couplings between two coarse nodes are half the sum of the fine couplings between their members, which rescales the Galerkin product with piecewise constant interpolation to the coarse grid spacing. The Dirichlet terms, i.e., the couplings to pinned neighbors, and the mass terms of the soft constraints are the unscaled sums over the members, as in the Galerkin product. The mass terms carry no derivatives, which piecewise constant interpolation represents exactly. Halving the Dirichlet terms like the couplings, as a rediscretization at the coarse spacing would, lets the coarse levels underestimate how firmly the constraints hold the error next to them: on the unified scenes, the W-cycles to a relative residual of 1e-5 then rise from 5 to 6 and the V-cycles on sunset from 9 to 37. The residual is restricted by summing over the members of a coarse node. The correction is prolongated bilinearly from the coarse node of a fine node and the coarse nodes that its fine neighbors belong to, so it never leaks across closed edges. It is added with the step that minimizes the error in the energy norm, which keeps the cycles convergent where the coarse problems are poor approximations.
+ */
+class multigrid_solver
+{
+public:
+    /**
+     * @brief Builds the hierarchy of a Poisson system.
+     * @param _system Poisson system.
+     * @param _options Parameters of the solver.
+     */
+    multigrid_solver(const poisson_system& _system, const multigrid_options& _options)
+        : options(_options)
+    {
+        levels.emplace_back();
+        build_finest(_system, levels.back());
+        while (std::max(levels.back().width, levels.back().height) > std::max(1, _options.coarsest_size))
+        {
+            multigrid_level coarse;
+            build_coarse(levels.back(), coarse);
+            levels.push_back(std::move(coarse));
+        }
+    }
+
+    /**
+     * @brief Runs cycles until the relative residual reaches the tolerance.
+     * @param _solution Initial guess on input (ignored if it does not match the size of the system), solution with the pinned colors on output.
+     * @param _stats Optional output of the number of cycles, the relative residual before every cycle on the finest level and after the last, the color changes and the solve time.
+     */
+    void solve(image& _solution, solver_statistics* _stats = nullptr)
+    {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now();
+        multigrid_level& finest = levels.front();
+        bool warm = _solution.width == finest.width && _solution.height == finest.height;
+        if (warm)
+            for (size_t i = 0; i < _solution.data.size(); i++)
+                for (int node = finest.first[i]; node < finest.first[i + 1]; node++)
+                    finest.solution[node] = _solution.data[i];
+
+        solver_statistics stats;
+        double norm = std::sqrt(squared_norm(finest, finest.rhs));
+        if (norm == 0)
+            norm = 1;
+        bool settled = options.full_multigrid && !warm && full_multigrid(stats);
+        std::vector<color_type> previous;
+        for (;; stats.iterations++)
+        {
+            compute_residual(finest);
+            double relative = std::sqrt(squared_norm(finest, finest.residual)) / norm;
+            stats.residuals.push_back(relative);
+            stats.converged = relative <= options.tolerance;
+            if (stats.converged || settled || stats.iterations >= options.max_cycles)
+                break;
+            previous = finest.solution;
+            cycle(0, options.cycle);
+            stats.color_changes.push_back(max_change(finest, previous));
+            settled = stats.color_changes.back() <= options.max_color_change;
+        }
+        _solution = pinned;
+        for (size_t i = 0; i < _solution.data.size(); i++)
+            for (int node = finest.first[i]; node < finest.first[i + 1]; node++)
+                _solution.data[i] = finest.solution[node];
+        stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (_stats != nullptr)
+            *_stats = stats;
+    }
+
+    /**
+     * @brief Applies one cycle to a right-hand side from a zero initial guess, which approximates the inverse of the system as a preconditioner.
+     * @details Replaces the right-hand side of the finest level, so the solver cannot be used for solve() afterwards.
+     * @param _rhs Right-hand side per pixel, ignored at pinned pixels.
+     * @param _result Output approximate solution per pixel, with the size of the image and zero at pinned pixels.
+     */
+    void precondition(const std::vector<color_type>& _rhs, std::vector<color_type>& _result)
+    {
+        multigrid_level& finest = levels.front();
+        for_rows(finest, [&](int y) {
+            for (int x = 0; x < finest.width; x++)
+                for (int i = finest.cell_begin(x, y); i < finest.cell_end(x, y); i++)
+                    finest.rhs[i] = _rhs[(size_t)y * finest.width + x];
+        });
+        std::fill(finest.solution.begin(), finest.solution.end(), color_type{ 0, 0, 0 });
+        cycle(0, options.cycle);
+        _result.assign(_rhs.size(), color_type{ 0, 0, 0 });
+        for_rows(finest, [&](int y) {
+            for (int x = 0; x < finest.width; x++)
+                for (int i = finest.cell_begin(x, y); i < finest.cell_end(x, y); i++)
+                    _result[(size_t)y * finest.width + x] = finest.solution[i];
+        });
+    }
+
+    /**
+     * @brief Runs one cycle on a level and all coarser ones, i.e., improves the solution of the level for its right-hand side.
+     * @param _level Index of the level, zero being the finest.
+     * @param _cycle Recursion pattern.
+     */
+    void cycle(int _level, multigrid_cycle _cycle)
+    {
+        multigrid_level& level = levels[_level];
+        if (_level + 1 == (int)levels.size())
+        {
+            for (int sweep = 0; sweep < options.coarsest_sweeps; sweep++)
+                red_black_sweep(level);
+            return;
+        }
+        smooth(level, options.pre_smoothing);
+        compute_residual(level);
+        multigrid_level& coarse = levels[_level + 1];
+        restrict_to_rhs(level, level.residual, coarse);
+        std::fill(coarse.solution.begin(), coarse.solution.end(), color_type{ 0, 0, 0 });
+        int corrections = _cycle == multigrid_cycle::w ? 2 : 1;
+        for (int k = 0; k < corrections; k++)
+            cycle(_level + 1, _cycle);
+        prolongate_correction(coarse, level);
+        apply_correction(level);
+        smooth(level, options.post_smoothing);
+    }
+
+    /**
+     * @brief Full multigrid pass up to the finest level, whose cycles are left to the caller.
+     * @details The right-hand side is restricted to all levels, so that every coarse level approximates the whole problem instead of an error equation. The coarsest level is solved, and every finer level starts from the interpolated solution of the level below and runs one cycle of options.full_multigrid_cycle. Since the solutions of consecutive levels differ less and less, the pass stops early once a cycle changes the colors by at most options.max_color_change, and then only interpolates the solution to the finest level.
+     * @param _stats Statistics, to which the number of cycles on the coarser levels and their color changes are added.
+     * @return True if the pass stopped early.
+     */
+    bool full_multigrid(solver_statistics& _stats)
+    {
+        int coarsest = (int)levels.size() - 1;
+        for (int level = 0; level < coarsest; level++)
+            restrict_to_rhs(levels[level], levels[level].rhs, levels[level + 1]);
+        std::fill(levels[coarsest].solution.begin(), levels[coarsest].solution.end(), color_type{ 0, 0, 0 });
+        cycle(coarsest, options.full_multigrid_cycle);
+        bool settled = false;
+        std::vector<color_type> interpolated;
+        for (int level = coarsest - 1; level >= 0; level--)
+        {
+            prolongate_correction(levels[level + 1], levels[level]);
+            levels[level].solution = levels[level].correction;
+            if (level == 0 || settled)
+                continue;
+            interpolated = levels[level].solution;
+            cycle(level, options.full_multigrid_cycle);
+            _stats.coarse_iterations++;
+            _stats.color_changes.push_back(max_change(levels[level], interpolated));
+            settled = _stats.color_changes.back() <= options.max_color_change;
+        }
+        return settled;
+    }
+
+    /**
+     * @brief Parameters of the solver.
+     */
+    multigrid_options options;
+    /**
+     * @brief Levels from the finest to the coarsest.
+     */
+    std::vector<multigrid_level> levels;
+    /**
+     * @brief Image with the colors of the pinned pixels and zero elsewhere.
+     */
+    image pinned;
+
+private:
+    /**
+     * @brief Calls a function for every row of cells of a level, in parallel unless the level is small.
+     * @param _level Level.
+     * @param _body Function that is called as _body(y).
+     */
+    template <typename Function>
+    static void for_rows(const multigrid_level& _level, Function _body)
+    {
+        if (_level.num_nodes() >= (1 << 16))
+            parallel_for(0, _level.height, _body);
+        else
+            for (int y = 0; y < _level.height; y++)
+                _body(y);
+    }
+
+    /**
+     * @brief Sets up the finest level, eliminating the pinned pixels.
+     * @param _system Poisson system.
+     * @param _level Output level.
+     */
+    void build_finest(const poisson_system& _system, multigrid_level& _level)
+    {
+        const int width = _system.width, height = _system.height;
+        const edge_barriers& barriers = _system.barriers;
+        _level.width  = width;
+        _level.height = height;
+        _level.first.assign((size_t)width * height + 1, 0);
+        pinned.assign(width, height, color_type{ 0, 0, 0 });
+        for (size_t i = 0; i < pinned.data.size(); i++)
+        {
+            bool free           = !is_pinned(_system, i);
+            _level.first[i + 1] = _level.first[i] + (free ? 1 : 0);
+            if (!free)
+                pinned.data[i] = _system.constraints.colors.data[i];
+        }
+        _level.allocate();
+
+        // open edges of a pixel as pairs of the neighbor index and whether it is blocked
+        auto edges = [&](int _x, int _y, size_t _i) {
+            return std::array<std::pair<size_t, bool>, 4>{ { { _i - 1, barriers.blocked_left(_x, _y) },
+                                                              { _i + 1, barriers.blocked_right(_x, _y) },
+                                                              { _i - width, barriers.blocked_up(_x, _y) },
+                                                              { _i + width, barriers.blocked_down(_x, _y) } } };
+        };
+        auto is_free = [&](size_t _i) { return _level.first[_i + 1] > _level.first[_i]; };
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                size_t i = (size_t)y * width + x;
+                if (is_free(i))
+                    for (const std::pair<size_t, bool>& edge : edges(x, y, i))
+                        if (!edge.second && is_free(edge.first))
+                            _level.offsets[_level.first[i] + 1]++;
+            }
+        });
+        for (size_t node = 0; node + 1 < _level.offsets.size(); node++)
+            _level.offsets[node + 1] += _level.offsets[node];
+        _level.neighbors.assign(_level.offsets.back(), 0);
+        _level.couplings.assign(_level.offsets.back(), 1.f);
+
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                size_t i = (size_t)y * width + x;
+                if (!is_free(i))
+                    continue;
+                int node = _level.first[i], k = _level.offsets[node];
+                color_type rhs;
+                double diagonal   = pixel_equation(_system, x, y, rhs);
+                _level.mass[node] = (float)(diagonal - barriers.degree(x, y));
+                for (const std::pair<size_t, bool>& edge : edges(x, y, i))
+                {
+                    if (edge.second)
+                        continue;
+                    if (is_free(edge.first))
+                    {
+                        _level.neighbors[k++] = _level.first[edge.first];
+                        continue;
+                    }
+                    _level.dirichlet[node] += 1;
+                    for (int c = 0; c < 3; c++)
+                        rhs[c] += _system.constraints.colors.data[edge.first][c];
+                }
+                _level.rhs[node] = rhs;
+            }
+        });
+        _level.update_diagonal();
+    }
+
+    /**
+     * @brief Ranges of the nodes of the fine cells in a block of 2 x 2 cells, one per row of the block.
+     * @param _fine Fine level.
+     * @param _X Column of the block.
+     * @param _Y Row of the block.
+     * @param _ranges Output begin and end of the nodes per row.
+     * @return Number of rows of the block.
+     */
+    static int block_ranges(const multigrid_level& _fine, int _X, int _Y, std::array<std::pair<int, int>, 2>& _ranges)
+    {
+        int num_rows = std::min(_fine.height, 2 * _Y + 2) - 2 * _Y;
+        int last     = std::min(_fine.width, 2 * _X + 2) - 1;
+        for (int r = 0; r < num_rows; r++)
+            _ranges[r] = std::make_pair(_fine.cell_begin(2 * _X, 2 * _Y + r), _fine.cell_end(last, 2 * _Y + r));
+        return num_rows;
+    }
+
+    /**
+     * @brief Merges the connected components of the nodes in blocks of 2 x 2 cells of a level into the nodes of the next coarser level.
+     * @param _fine Fine level, whose parents are set.
+     * @param _coarse Output coarse level.
+     */
+    static void build_coarse(multigrid_level& _fine, multigrid_level& _coarse)
+    {
+        _coarse.width  = (_fine.width + 1) / 2;
+        _coarse.height = (_fine.height + 1) / 2;
+        _coarse.first.assign((size_t)_coarse.width * _coarse.height + 1, 0);
+        _fine.parent.assign(_fine.num_nodes(), 0);
+
+        // union-find over the nodes of every block, numbering the components in the order of their first node
+        for_rows(_fine, [&](int y) {
+            if (y % 2 != 0)
+                return;
+            int Y = y / 2;
+            std::vector<int> root, label;
+            for (int X = 0; X < _coarse.width; X++)
+            {
+                std::array<std::pair<int, int>, 2> ranges;
+                int num_rows = block_ranges(_fine, X, Y, ranges);
+                auto local   = [&](int _node) {
+                    int base = 0;
+                    for (int r = 0; r < num_rows; r++)
+                    {
+                        if (_node >= ranges[r].first && _node < ranges[r].second)
+                            return base + _node - ranges[r].first;
+                        base += ranges[r].second - ranges[r].first;
+                    }
+                    return -1;
+                };
+                auto find = [&](int _k) {
+                    while (root[_k] != _k)
+                        _k = root[_k] = root[root[_k]];
+                    return _k;
+                };
+                int num_local = 0;
+                for (int r = 0; r < num_rows; r++)
+                    num_local += ranges[r].second - ranges[r].first;
+                root.resize(num_local);
+                for (int k = 0; k < num_local; k++)
+                    root[k] = k;
+                for (int r = 0; r < num_rows; r++)
+                {
+                    for (int node = ranges[r].first; node < ranges[r].second; node++)
+                    {
+                        for (int k = _fine.offsets[node]; k < _fine.offsets[node + 1]; k++)
+                        {
+                            int other = local(_fine.neighbors[k]);
+                            if (other >= 0)
+                                root[find(local(node))] = find(other);
+                        }
+                    }
+                }
+                label.assign(num_local, -1);
+                int num_components = 0;
+                for (int r = 0; r < num_rows; r++)
+                {
+                    for (int node = ranges[r].first; node < ranges[r].second; node++)
+                    {
+                        int component = find(local(node));
+                        if (label[component] < 0)
+                            label[component] = num_components++;
+                        _fine.parent[node] = label[component];
+                    }
+                }
+                _coarse.first[(size_t)Y * _coarse.width + X + 1] = num_components;
+            }
+        });
+        for (size_t cell = 0; cell + 1 < _coarse.first.size(); cell++)
+            _coarse.first[cell + 1] += _coarse.first[cell];
+        _coarse.allocate();
+
+        for_rows(_fine, [&](int y) {
+            for (int x = 0; x < _fine.width; x++)
+                for (int node = _fine.cell_begin(x, y); node < _fine.cell_end(x, y); node++)
+                    _fine.parent[node] += _coarse.cell_begin(x / 2, y / 2);
+        });
+
+        // terms of the coarse nodes and their couplings, collected per row of blocks
+        struct coupling
+        {
+            int from, to;
+            float weight;
+        };
+        std::vector<std::vector<int>> row_neighbors(_coarse.height);
+        std::vector<std::vector<float>> row_couplings(_coarse.height);
+        for_rows(_fine, [&](int y) {
+            if (y % 2 != 0)
+                return;
+            int Y = y / 2;
+            std::vector<coupling> block;
+            for (int X = 0; X < _coarse.width; X++)
+            {
+                std::array<std::pair<int, int>, 2> ranges;
+                int num_rows = block_ranges(_fine, X, Y, ranges);
+                block.clear();
+                for (int r = 0; r < num_rows; r++)
+                {
+                    for (int node = ranges[r].first; node < ranges[r].second; node++)
+                    {
+                        int from = _fine.parent[node];
+                        _coarse.mass[from] += _fine.mass[node];
+                        _coarse.dirichlet[from] += _fine.dirichlet[node];
+                        for (int k = _fine.offsets[node]; k < _fine.offsets[node + 1]; k++)
+                        {
+                            int to = _fine.parent[_fine.neighbors[k]];
+                            if (to != from)
+                                block.push_back(coupling{ from, to, 0.5f * _fine.couplings[k] });
+                        }
+                    }
+                }
+                std::sort(block.begin(), block.end(), [](const coupling& _a, const coupling& _b) {
+                    return _a.from != _b.from ? _a.from < _b.from : _a.to < _b.to;
+                });
+                for (size_t k = 0; k < block.size(); k++)
+                {
+                    if (k > 0 && block[k].from == block[k - 1].from && block[k].to == block[k - 1].to)
+                    {
+                        row_couplings[Y].back() += block[k].weight;
+                        continue;
+                    }
+                    row_neighbors[Y].push_back(block[k].to);
+                    row_couplings[Y].push_back(block[k].weight);
+                    _coarse.offsets[block[k].from + 1]++;
+                }
+            }
+        });
+        for (size_t node = 0; node + 1 < _coarse.offsets.size(); node++)
+            _coarse.offsets[node + 1] += _coarse.offsets[node];
+        _coarse.neighbors.reserve(_coarse.offsets.back());
+        _coarse.couplings.reserve(_coarse.offsets.back());
+        for (int Y = 0; Y < _coarse.height; Y++)
+        {
+            _coarse.neighbors.insert(_coarse.neighbors.end(), row_neighbors[Y].begin(), row_neighbors[Y].end());
+            _coarse.couplings.insert(_coarse.couplings.end(), row_couplings[Y].begin(), row_couplings[Y].end());
+        }
+        _coarse.update_diagonal();
+    }
+
+    /**
+     * @brief Squared norm of a field of a level.
+     * @param _level Level.
+     * @param _field Field of the level.
+     * @return Sum of the squares over all nodes and channels.
+     */
+    static double squared_norm(const multigrid_level& _level, const std::vector<color_type>& _field)
+    {
+        std::vector<double> row_sums(_level.height, 0.0);
+        for_rows(_level, [&](int y) {
+            for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+                for (int c = 0; c < 3; c++)
+                    row_sums[y] += _field[i][c] * _field[i][c];
+        });
+        double total = 0;
+        for (double sum : row_sums)
+            total += sum;
+        return total;
+    }
+
+    /**
+     * @brief Computes the residual b - A u of a level.
+     * @param _level Level.
+     */
+    static void compute_residual(multigrid_level& _level)
+    {
+        for_rows(_level, [&](int y) {
+            for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+            {
+                color_type sum = _level.neighbor_sum(_level.solution, i);
+                for (int c = 0; c < 3; c++)
+                    _level.residual[i][c] = _level.rhs[i][c] + sum[c] - _level.diagonal[i] * _level.solution[i][c];
+            }
+        });
+    }
+
+    /**
+     * @brief One red-black Gauss-Seidel sweep over a level, where the color of a node is the parity of its cell.
+     * @param _level Level.
+     */
+    static void red_black_sweep(multigrid_level& _level)
+    {
+        for (int color = 0; color < 2; color++)
+        {
+            for_rows(_level, [&](int y) {
+                for (int x = (y + color) & 1; x < _level.width; x += 2)
+                {
+                    for (int i = _level.cell_begin(x, y); i < _level.cell_end(x, y); i++)
+                    {
+                        if (_level.diagonal[i] == 0)
+                            continue;
+                        color_type sum = _level.neighbor_sum(_level.solution, i);
+                        for (int c = 0; c < 3; c++)
+                            _level.solution[i][c] = (_level.rhs[i][c] + sum[c]) / _level.diagonal[i];
+                    }
+                }
+            });
+        }
+    }
+
+    /**
+     * @brief Smooths the solution of a level with the configured smoother.
+     * @param _level Level.
+     * @param _sweeps Number of sweeps.
+     */
+    void smooth(multigrid_level& _level, int _sweeps)
+    {
+        for (int sweep = 0; sweep < _sweeps; sweep++)
+        {
+            if (options.smoother == multigrid_smoother::red_black_gauss_seidel)
+            {
+                red_black_sweep(_level);
+                continue;
+            }
+            // the residual buffer holds the previous values
+            _level.residual = _level.solution;
+            for_rows(_level, [&](int y) {
+                for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+                {
+                    if (_level.diagonal[i] == 0)
+                        continue;
+                    color_type sum = _level.neighbor_sum(_level.residual, i);
+                    for (int c = 0; c < 3; c++)
+                        _level.solution[i][c] = (1 - options.jacobi_weight) * _level.residual[i][c] +
+                                                options.jacobi_weight * (_level.rhs[i][c] + sum[c]) / _level.diagonal[i];
+                }
+            });
+        }
+    }
+
+    /**
+     * @brief Sums a field of the fine level over the members of every coarse node into its right-hand side.
+     * @param _fine Fine level.
+     * @param _values Field of the fine level, usually its residual.
+     * @param _coarse Coarse level.
+     */
+    static void restrict_to_rhs(const multigrid_level& _fine, const std::vector<color_type>& _values, multigrid_level& _coarse)
+    {
+        for_rows(_coarse, [&](int Y) {
+            std::fill(_coarse.rhs.begin() + _coarse.cell_begin(0, Y), _coarse.rhs.begin() + _coarse.cell_end(_coarse.width - 1, Y), color_type{ 0, 0, 0 });
+            for (int y = 2 * Y; y < std::min(_fine.height, 2 * Y + 2); y++)
+                for (int i = _fine.cell_begin(0, y); i < _fine.cell_end(_fine.width - 1, y); i++)
+                    for (int c = 0; c < 3; c++)
+                        _coarse.rhs[_fine.parent[i]][c] += _values[i][c];
+        });
+    }
+
+    /**
+     * @brief Largest change of a color channel between the solution of a level and earlier values.
+     * @param _level Level.
+     * @param _previous Earlier values of the solution.
+     * @return Maximum absolute difference over all nodes and channels.
+     */
+    static double max_change(const multigrid_level& _level, const std::vector<color_type>& _previous)
+    {
+        std::vector<double> row_maxima(_level.height, 0.0);
+        for_rows(_level, [&](int y) {
+            for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+                for (int c = 0; c < 3; c++)
+                    row_maxima[y] = std::max(row_maxima[y], std::abs(_level.solution[i][c] - _previous[i][c]));
+        });
+        return row_maxima.empty() ? 0 : *std::max_element(row_maxima.begin(), row_maxima.end());
+    }
+
+    /**
+     * @brief Interpolates the correction of the coarse level bilinearly to the nodes of the fine level.
+     * @details A fine node in cell (x,y) interpolates between its coarse node (1/2) and the coarse nodes towards its side horizontally and vertically (1/4 each), where the diagonal coarse node of the usual 9/16, 3/16, 3/16, 1/16 stencil is extrapolated from the other three. The horizontal coarse value is the average of the coarse nodes of the fine neighbors in cell (x+-1,y), weighted by their couplings, and likewise vertically. If a node has no such neighbors, its coarse node takes over their weight.
+     * @param _coarse Coarse level with the correction.
+     * @param _fine Fine level, whose correction is set.
+     */
+    static void prolongate_correction(const multigrid_level& _coarse, multigrid_level& _fine)
+    {
+        for_rows(_fine, [&](int y) {
+            int dy = (y & 1) ? 1 : -1;
+            for (int x = 0; x < _fine.width; x++)
+            {
+                int dx = (x & 1) ? 1 : -1;
+                for (int i = _fine.cell_begin(x, y); i < _fine.cell_end(x, y); i++)
+                {
+                    color_type correction = _coarse.solution[_fine.parent[i]];
+                    color_type center     = correction;
+                    for (int c = 0; c < 3; c++)
+                        correction[c] *= 0.5;
+                    // average coarse value of the fine neighbors in a cell, or the center if there are none
+                    auto side = [&](int _x, int _y) {
+                        if (_x < 0 || _x >= _fine.width || _y < 0 || _y >= _fine.height)
+                            return center;
+                        int begin = _fine.cell_begin(_x, _y), end = _fine.cell_end(_x, _y);
+                        color_type sum = { 0, 0, 0 };
+                        double total   = 0;
+                        for (int k = _fine.offsets[i]; k < _fine.offsets[i + 1]; k++)
+                        {
+                            int j = _fine.neighbors[k];
+                            if (j < begin || j >= end)
+                                continue;
+                            for (int c = 0; c < 3; c++)
+                                sum[c] += _fine.couplings[k] * _coarse.solution[_fine.parent[j]][c];
+                            total += _fine.couplings[k];
+                        }
+                        if (total == 0)
+                            return center;
+                        for (int c = 0; c < 3; c++)
+                            sum[c] /= total;
+                        return sum;
+                    };
+                    color_type horizontal = side(x + dx, y), vertical = side(x, y + dy);
+                    for (int c = 0; c < 3; c++)
+                        _fine.correction[i][c] = correction[c] + 0.25 * (horizontal[c] + vertical[c]);
+                }
+            }
+        });
+    }
+
+    /**
+     * @brief Adds the prolongated correction to the solution of a level, scaled per channel to minimize the energy norm of the error.
+     * @details The coarse operators approximate the Galerkin products, so the correction can overshoot where the coarsening is poor, e.g., in channels between barriers that are one pixel wide, where the blocks do not merge any nodes and halving the couplings makes the coarse problem twice as soft. With the residual r and the correction e, the step s = (r . e) / (e . A e) is the best multiple of e in the energy norm, so a correction never increases the error in that norm.
+     * @param _level Level with the residual and the correction.
+     */
+    static void apply_correction(multigrid_level& _level)
+    {
+        std::vector<color_type> row_numerators(_level.height, color_type{ 0, 0, 0 }), row_denominators(_level.height, color_type{ 0, 0, 0 });
+        for_rows(_level, [&](int y) {
+            for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+            {
+                color_type sum = _level.neighbor_sum(_level.correction, i);
+                for (int c = 0; c < 3; c++)
+                {
+                    row_numerators[y][c] += _level.residual[i][c] * _level.correction[i][c];
+                    row_denominators[y][c] += _level.correction[i][c] * (_level.diagonal[i] * _level.correction[i][c] - sum[c]);
+                }
+            }
+        });
+        color_type step = { 0, 0, 0 };
+        for (int c = 0; c < 3; c++)
+        {
+            double numerator = 0, denominator = 0;
+            for (int y = 0; y < _level.height; y++)
+            {
+                numerator += row_numerators[y][c];
+                denominator += row_denominators[y][c];
+            }
+            step[c] = denominator > 0 ? numerator / denominator : 0;
+        }
+        for_rows(_level, [&](int y) {
+            for (int i = _level.cell_begin(0, y); i < _level.cell_end(_level.width - 1, y); i++)
+                for (int c = 0; c < 3; c++)
+                    _level.solution[i][c] += step[c] * _level.correction[i][c];
+        });
+    }
+};
+
+/**
+ * @brief Solves a Poisson system with geometric multigrid.
+ * @param _system Poisson system.
+ * @param _options Parameters of the solver.
+ * @param _stats Optional output of the number of cycles, the residual history and the solve time.
+ * @param _initial_guess Optional warm start, see warm_start_solution, which also skips the full multigrid pass.
+ * @return Solution.
+ */
+inline image solve_multigrid(const poisson_system& _system, const multigrid_options& _options, solver_statistics* _stats = nullptr, const image* _initial_guess = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    multigrid_solver solver(_system, _options);
+    image solution;
+    if (_initial_guess != nullptr)
+        warm_start_solution(_system, *_initial_guess, solution);
+    solver.solve(solution, _stats);
+    if (_stats != nullptr)
+        _stats->solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    return solution;
+}
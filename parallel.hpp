@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * @brief Order in which the workers pick up queued tasks.
+ */
+enum class task_priority
+{
+    /**
+     * @brief Taken before all normal tasks, e.g., the most expensive tiles, so that they do not end up last on a single worker.
+     */
+    high,
+    /**
+     * @brief Default priority.
+     */
+    normal
+};
+
+/**
+ * @brief Parameters of the thread pool.
+ */
+struct thread_pool_options
+{
+    /**
+     * @brief Number of threads that run tasks, including the thread that waits for them; zero uses the number of hardware threads.
+     */
+    int num_threads = 0;
+    /**
+     * @brief Pins each worker thread to one CPU, round robin over the hardware threads; only supported on Linux.
+     */
+    bool pin_threads = false;
+    /**
+     * @brief First CPU for the pinned worker threads.
+     */
+    int first_cpu = 0;
+};
+
+/**
+ * @brief Load of one worker of the thread pool since the last reset.
+ */
+struct worker_statistics
+{
+    /**
+     * @brief Time spent running tasks, in milliseconds.
+     */
+    double busy_ms = 0;
+    /**
+     * @brief Time spent searching for tasks or sleeping, in milliseconds.
+     */
+    double idle_ms = 0;
+    /**
+     * @brief Number of tasks run.
+     */
+    long long tasks = 0;
+    /**
+     * @brief Number of tasks that were taken from the queue of another worker.
+     */
+    long long steals = 0;
+};
+
+/**
+ * @brief Work-stealing thread pool that runs the parallel algorithms.
+ * @details Every worker owns a double-ended queue per priority. Tasks that a worker submits go to the back of its own queue, and it takes them back from there, which keeps the most recently touched data in its cache. Idle workers steal from the front of the queues of the others, where the oldest and usually largest tasks wait, so uneven work such as dense clusters of curves next to empty regions balances out. Threads that are not workers, e.g., the main thread, submit to an extra queue and help to run tasks while they wait for them. Workers that find nothing to do spin briefly and then sleep until new tasks arrive.
+ */
+class thread_pool
+{
+public:
+    /**
+     * @brief Group of tasks that can be waited for.
+     */
+    class task_group
+    {
+    public:
+        /**
+         * @brief Creates an empty group.
+         * @param _pool Pool that runs the tasks.
+         */
+        explicit task_group(thread_pool& _pool)
+            : pool(_pool)
+            , pending(0)
+        {
+        }
+
+        /**
+         * @brief Waits for the remaining tasks; exceptions that were not rethrown by wait are dropped.
+         */
+        ~task_group()
+        {
+            wait_all();
+        }
+
+        /**
+         * @brief Queues a task.
+         * @param _task Function to run.
+         * @param _priority Priority of the task.
+         */
+        void run(std::function<void()> _task, task_priority _priority = task_priority::normal)
+        {
+            pending++;
+            pool.submit([this, _task]() {
+                try
+                {
+                    _task();
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(exception_mutex);
+                    if (!exception)
+                        exception = std::current_exception();
+                }
+                pending--;
+            }, _priority);
+        }
+
+        /**
+         * @brief Runs queued tasks on the calling thread until all tasks of the group are done, and rethrows the first exception that a task threw.
+         */
+        void wait()
+        {
+            wait_all();
+            std::exception_ptr thrown;
+            {
+                std::lock_guard<std::mutex> lock(exception_mutex);
+                std::swap(thrown, exception);
+            }
+            if (thrown)
+                std::rethrow_exception(thrown);
+        }
+
+    private:
+        /**
+         * @brief Pool that runs the tasks.
+         */
+        thread_pool& pool;
+        /**
+         * @brief Number of tasks that were queued and did not finish yet, including those that threw.
+         */
+        std::atomic<int> pending;
+        /**
+         * @brief First exception thrown by a task since the last wait.
+         */
+        std::exception_ptr exception;
+        /**
+         * @brief Guards the exception.
+         */
+        std::mutex exception_mutex;
+
+        /**
+         * @brief Runs queued tasks on the calling thread until all tasks of the group are done.
+         */
+        void wait_all()
+        {
+            while (pending.load() > 0)
+                if (!pool.run_one())
+                    std::this_thread::yield();
+        }
+    };
+
+    /**
+     * @brief Starts the worker threads.
+     * @param _options Parameters of the pool.
+     */
+    explicit thread_pool(const thread_pool_options& _options = thread_pool_options())
+        : options(_options)
+        , queued(0)
+        , sleeping(0)
+        , stop(false)
+    {
+        if (options.num_threads <= 0)
+        {
+            unsigned int hardware = std::thread::hardware_concurrency();
+            options.num_threads   = hardware == 0 ? 1 : (int)hardware;
+        }
+        // one queue per worker and a last one for the threads outside the pool
+        for (int q = 0; q < options.num_threads; q++)
+            queues.emplace_back(new queue);
+        for (int w = 0; w + 1 < options.num_threads; w++)
+            workers.emplace_back([this, w]() { work(w); });
+    }
+
+    /**
+     * @brief Stops the worker threads after they finished their current tasks; queued tasks are dropped.
+     */
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    /**
+     * @brief Number of threads that run tasks, including the waiting thread.
+     * @return Number of worker threads plus one.
+     */
+    int num_threads() const
+    {
+        return options.num_threads;
+    }
+
+    /**
+     * @brief Queues a task without a way to wait for it; see task_group.
+     * @param _task Function to run.
+     * @param _priority Priority of the task.
+     */
+    void submit(std::function<void()> _task, task_priority _priority = task_priority::normal)
+    {
+        queue& own = *queues[own_queue()];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.tasks[(int)_priority].push_back(std::move(_task));
+        }
+        queued++;
+        if (sleeping.load() > 0)
+        {
+            // the lock orders the increment before the check of a worker that is about to sleep
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+            }
+            wake.notify_one();
+        }
+    }
+
+    /**
+     * @brief Runs one queued task on the calling thread, if there is one.
+     * @return True if a task was run.
+     */
+    bool run_one()
+    {
+        std::function<void()> task;
+        int index = own_queue();
+        bool stolen;
+        if (!take(index, task, stolen))
+            return false;
+        run(index, task, stolen);
+        return true;
+    }
+
+    /**
+     * @brief Load of the workers since the last reset; the last entry accumulates the tasks that threads outside the pool ran while waiting, without idle time.
+     * @return Statistics per worker.
+     */
+    std::vector<worker_statistics> statistics() const
+    {
+        std::vector<worker_statistics> result(queues.size());
+        for (size_t q = 0; q < queues.size(); q++)
+        {
+            result[q].busy_ms = queues[q]->busy_ns.load() * 1e-6;
+            result[q].idle_ms = queues[q]->idle_ns.load() * 1e-6;
+            result[q].tasks   = queues[q]->num_tasks.load();
+            result[q].steals  = queues[q]->num_steals.load();
+        }
+        return result;
+    }
+
+    /**
+     * @brief Clears the statistics of all workers.
+     */
+    void reset_statistics()
+    {
+        for (std::unique_ptr<queue>& q : queues)
+        {
+            q->busy_ns    = 0;
+            q->idle_ns    = 0;
+            q->num_tasks  = 0;
+            q->num_steals = 0;
+        }
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * @brief Tasks and statistics of one worker, allocated separately to keep the workers apart in memory.
+     */
+    struct queue
+    {
+        /**
+         * @brief Guards the tasks.
+         */
+        std::mutex mutex;
+        /**
+         * @brief Tasks per priority.
+         */
+        std::deque<std::function<void()>> tasks[2];
+        /**
+         * @brief Time spent running tasks, in nanoseconds.
+         */
+        std::atomic<long long> busy_ns{ 0 };
+        /**
+         * @brief Time spent without a task, in nanoseconds.
+         */
+        std::atomic<long long> idle_ns{ 0 };
+        /**
+         * @brief Number of tasks run.
+         */
+        std::atomic<long long> num_tasks{ 0 };
+        /**
+         * @brief Number of stolen tasks.
+         */
+        std::atomic<long long> num_steals{ 0 };
+    };
+
+    /**
+     * @brief Index of the worker that runs on the calling thread in the pool it belongs to, or -1.
+     */
+    static int& worker_index()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    /**
+     * @brief Pool of the calling worker thread, if any.
+     */
+    static thread_pool*& worker_pool()
+    {
+        static thread_local thread_pool* pool = nullptr;
+        return pool;
+    }
+
+    /**
+     * @brief Queue of the calling thread: its own for workers of this pool, the shared last one otherwise.
+     * @return Index of the queue.
+     */
+    int own_queue() const
+    {
+        return worker_pool() == this ? worker_index() : (int)queues.size() - 1;
+    }
+
+    /**
+     * @brief Takes the next task: high priority before normal, the own queue from the back before the others from the front.
+     * @param _index Queue of the calling thread.
+     * @param _task Output task.
+     * @param _stolen Output whether the task came from another queue.
+     * @return False if all queues are empty.
+     */
+    bool take(int _index, std::function<void()>& _task, bool& _stolen)
+    {
+        if (queued.load() == 0)
+            return false;
+        const int num_queues = (int)queues.size();
+        for (int priority = 0; priority < 2; priority++)
+        {
+            for (int offset = 0; offset < num_queues; offset++)
+            {
+                queue& q = *queues[(_index + offset) % num_queues];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                std::deque<std::function<void()>>& tasks = q.tasks[priority];
+                if (tasks.empty())
+                    continue;
+                if (offset == 0)
+                {
+                    _task = std::move(tasks.back());
+                    tasks.pop_back();
+                }
+                else
+                {
+                    _task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                queued--;
+                _stolen = offset != 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Runs a task and records it in the statistics of a queue.
+     * @param _index Queue of the calling thread.
+     * @param _task Task to run.
+     * @param _stolen Whether the task came from another queue.
+     */
+    void run(int _index, std::function<void()>& _task, bool _stolen)
+    {
+        clock::time_point start = clock::now();
+        _task();
+        queue& q = *queues[_index];
+        q.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        q.num_tasks++;
+        if (_stolen)
+            q.num_steals++;
+    }
+
+    /**
+     * @brief Main loop of a worker thread.
+     * @param _index Index of the worker.
+     */
+    void work(int _index)
+    {
+        worker_index() = _index;
+        worker_pool()  = this;
+#ifdef __linux__
+        if (options.pin_threads)
+        {
+            unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            // worker 0 takes the CPU after the one of the calling thread
+            CPU_SET((options.first_cpu + _index + 1) % hardware, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+#endif
+        queue& own = *queues[_index];
+        std::function<void()> task;
+        clock::time_point idle_start = clock::now();
+        for (;;)
+        {
+            bool stolen;
+            int spins = 0;
+            while (!take(_index, task, stolen) && ++spins < 64)
+                std::this_thread::yield();
+            if (spins < 64)
+            {
+                own.idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - idle_start).count();
+                run(_index, task, stolen);
+                task       = nullptr;
+                idle_start = clock::now();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping++;
+            wake.wait(lock, [this]() { return stop || queued.load() > 0; });
+            sleeping--;
+            if (stop)
+                return;
+        }
+    }
+
+    /**
+     * @brief Parameters of the pool, with the resolved number of threads.
+     */
+    thread_pool_options options;
+    /**
+     * @brief Queues of the workers, followed by the queue of the threads outside the pool.
+     */
+    std::vector<std::unique_ptr<queue>> queues;
+    /**
+     * @brief Worker threads; one less than the number of threads, since the waiting thread helps.
+     */
+    std::vector<std::thread> workers;
+    /**
+     * @brief Number of tasks in all queues.
+     */
+    std::atomic<int> queued;
+    /**
+     * @brief Number of sleeping workers.
+     */
+    std::atomic<int> sleeping;
+    /**
+     * @brief Set when the pool shuts down.
+     */
+    bool stop;
+    /**
+     * @brief Guards sleeping and waking up.
+     */
+    std::mutex sleep_mutex;
+    /**
+     * @brief Wakes up sleeping workers.
+     */
+    std::condition_variable wake;
+};
+
+/**
+ * @brief Holder of the pool that the parallel algorithms use.
+ * @return Pointer to the pool, created on first use.
+ */
+inline std::unique_ptr<thread_pool>& default_thread_pool_holder()
+{
+    static std::unique_ptr<thread_pool> pool;
+    return pool;
+}
+
+/**
+ * @brief Pool that the parallel algorithms use, with the number of hardware threads unless configured otherwise.
+ * @return Default thread pool.
+ */
+inline thread_pool& default_thread_pool()
+{
+    std::unique_ptr<thread_pool>& pool = default_thread_pool_holder();
+    if (!pool)
+        pool.reset(new thread_pool());
+    return *pool;
+}
+
+/**
+ * @brief Replaces the default thread pool, e.g., to change the number of threads or to pin them; must not be called while parallel algorithms run.
+ * @param _options Parameters of the new pool.
+ */
+inline void configure_thread_pool(const thread_pool_options& _options)
+{
+    std::unique_ptr<thread_pool>& pool = default_thread_pool_holder();
+    pool.reset();
+    pool.reset(new thread_pool(_options));
+}
+
+/**
+ * @brief Number of threads used by the parallel algorithms.
+ * @return Number of threads of the default thread pool.
+ */
+inline int num_worker_threads()
+{
+    return default_thread_pool().num_threads();
+}
+
+/**
+ * @brief Calls a function for every index in a range on the default thread pool.
+ * @details The range is split into contiguous chunks, several per thread, which idle workers steal from each other when the cost per index is uneven. The calling thread runs chunks as well until all are done, so nested calls do not block workers. If a call throws, the remaining indices of its chunk are skipped, the other chunks still run, and the first exception is rethrown on the calling thread.
+ * @param _begin First index of the range.
+ * @param _end One past the last index of the range.
+ * @param _body Function that is called as _body(i) for each index i.
+ * @param _priority Priority of the chunks.
+ */
+template <typename Function>
+void parallel_for(int _begin, int _end, Function _body, task_priority _priority = task_priority::normal)
+{
+    int num_indices = _end - _begin;
+    if (num_indices <= 0)
+        return;
+
+    thread_pool& pool = default_thread_pool();
+    int num_chunks    = std::min(num_indices, 8 * pool.num_threads());
+    if (pool.num_threads() == 1 || num_indices == 1)
+    {
+        for (int i = _begin; i < _end; i++)
+            _body(i);
+        return;
+    }
+
+    thread_pool::task_group group(pool);
+    for (int chunk = 0; chunk < num_chunks; chunk++)
+    {
+        int chunk_begin = _begin + (int)((long long)num_indices * chunk / num_chunks);
+        int chunk_end   = _begin + (int)((long long)num_indices * (chunk + 1) / num_chunks);
+        group.run([chunk_begin, chunk_end, &_body]() {
+            for (int i = chunk_begin; i < chunk_end; i++)
+                _body(i);
+        }, _priority);
+    }
+    group.wait();
+}
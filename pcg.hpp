@@ -0,0 +1,399 @@
+#pragma once
+
+#include "image.hpp"
+#include "multigrid.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "solver.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Preconditioner of the conjugate gradient solver.
+ */
+enum class pcg_preconditioner
+{
+    /**
+     * @brief Division by the diagonal.
+     */
+    jacobi,
+    /**
+     * @brief Incomplete Cholesky factorization without fill-in, IC(0).
+     */
+    incomplete_cholesky,
+    /**
+     * @brief One multigrid cycle from a zero initial guess.
+     */
+    multigrid
+};
+
+/**
+ * @brief Parameters of the preconditioned conjugate gradient solver.
+ */
+struct pcg_options
+{
+    /**
+     * @brief Preconditioner.
+     */
+    pcg_preconditioner preconditioner = pcg_preconditioner::multigrid;
+    /**
+     * @brief The solver stops once the residual norm relative to the norm of the right-hand side falls below this value.
+     */
+    double tolerance = 1e-5;
+    /**
+     * @brief Maximum number of iterations.
+     */
+    int max_iterations = 5000;
+    /**
+     * @brief Parameters of the cycles of the multigrid preconditioner; the tolerance and the number of cycles are not used.
+     */
+    multigrid_options multigrid;
+};
+
+/**
+ * @brief Matrix-free operator of a Poisson system, restricted to the pixels that are solved for.
+ * @details The pinned pixels are eliminated, and so are the pixels that are neither connected nor constrained, which leaves a symmetric positive definite system. Instead of a sparse matrix, every pixel stores the mask of its open edges to free neighbors and its diagonal, which is all that the five-point stencil needs. The vectors of the solver have one color per pixel and are zero at the pixels that are not free.
+ */
+class poisson_operator
+{
+public:
+    /**
+     * @brief Bit of the mask that marks a pixel that is solved for; the lower four bits mark the open edges to the left, right, upper and lower neighbor.
+     */
+    static const unsigned char free_bit = 16;
+
+    /**
+     * @brief Extracts the stencil of a Poisson system.
+     * @param _system Poisson system.
+     */
+    explicit poisson_operator(const poisson_system& _system)
+        : width(_system.width)
+        , height(_system.height)
+    {
+        size_t size = (size_t)width * height;
+        masks.assign(size, 0);
+        diagonal.assign(size, 0.0);
+        rhs.assign(size, color_type{ 0, 0, 0 });
+        pinned.assign(width, height, color_type{ 0, 0, 0 });
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                size_t i = (size_t)y * width + x;
+                if (is_pinned(_system, i))
+                {
+                    pinned.data[i] = _system.constraints.colors.data[i];
+                    continue;
+                }
+                diagonal[i] = pixel_equation(_system, x, y, rhs[i]);
+                if (diagonal[i] != 0)
+                    masks[i] = free_bit;
+            }
+        });
+        parallel_for(0, height, [&](int y) {
+            const edge_barriers& barriers = _system.barriers;
+            for (int x = 0; x < width; x++)
+            {
+                size_t i = (size_t)y * width + x;
+                if (!(masks[i] & free_bit))
+                    continue;
+                auto connect = [&](bool _blocked, size_t _j, unsigned char _bit) {
+                    if (_blocked)
+                        return;
+                    if (masks[_j] & free_bit)
+                        masks[i] |= _bit;
+                    else
+                        for (int c = 0; c < 3; c++)
+                            rhs[i][c] += pinned.data[_j][c];
+                };
+                connect(barriers.blocked_left(x, y), i - 1, 1);
+                connect(barriers.blocked_right(x, y), i + 1, 2);
+                connect(barriers.blocked_up(x, y), i - width, 4);
+                connect(barriers.blocked_down(x, y), i + width, 8);
+            }
+        });
+    }
+
+    /**
+     * @brief Multiplies a vector with the operator.
+     * @param _x Input vector.
+     * @param _y Output vector of the same size.
+     */
+    void apply(const std::vector<color_type>& _x, std::vector<color_type>& _y) const
+    {
+        parallel_for(0, height, [&](int y) {
+            for (size_t i = (size_t)y * width; i < (size_t)(y + 1) * width; i++)
+            {
+                unsigned char mask = masks[i];
+                if (!(mask & free_bit))
+                {
+                    _y[i] = color_type{ 0, 0, 0 };
+                    continue;
+                }
+                color_type sum = { 0, 0, 0 };
+                auto add = [&](size_t _j) {
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += _x[_j][c];
+                };
+                if (mask & 1)
+                    add(i - 1);
+                if (mask & 2)
+                    add(i + 1);
+                if (mask & 4)
+                    add(i - width);
+                if (mask & 8)
+                    add(i + width);
+                for (int c = 0; c < 3; c++)
+                    _y[i][c] = diagonal[i] * _x[i][c] - sum[c];
+            }
+        });
+    }
+
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Open edges to free neighbors and the free bit of every pixel.
+     */
+    std::vector<unsigned char> masks;
+    /**
+     * @brief Diagonal of every free pixel.
+     */
+    std::vector<double> diagonal;
+    /**
+     * @brief Right-hand side with the colors of the pinned neighbors moved into it; zero at the pixels that are not free.
+     */
+    std::vector<color_type> rhs;
+    /**
+     * @brief Image with the colors of the pinned pixels and zero elsewhere.
+     */
+    image pinned;
+};
+
+/**
+ * @brief Dot products of two vectors of a Poisson operator, per channel, summed per row in parallel.
+ * @param _operator Operator, which provides the size of the image.
+ * @param _a First vector.
+ * @param _b Second vector.
+ * @return Dot product of every channel.
+ */
+inline color_type channel_dots(const poisson_operator& _operator, const std::vector<color_type>& _a, const std::vector<color_type>& _b)
+{
+    std::vector<color_type> row_sums(_operator.height, color_type{ 0, 0, 0 });
+    parallel_for(0, _operator.height, [&](int y) {
+        for (size_t i = (size_t)y * _operator.width; i < (size_t)(y + 1) * _operator.width; i++)
+            for (int c = 0; c < 3; c++)
+                row_sums[y][c] += _a[i][c] * _b[i][c];
+    });
+    color_type total = { 0, 0, 0 };
+    for (const color_type& sum : row_sums)
+        for (int c = 0; c < 3; c++)
+            total[c] += sum[c];
+    return total;
+}
+
+/**
+ * @brief Incomplete Cholesky factorization without fill-in of a Poisson operator.
+ * @details The factorization M = (D + L) D^-1 (D + L^T) keeps the strictly lower part L of the operator and only computes the diagonal D, such that M matches the operator on its diagonal: d_i = a_ii - sum_j 1 / d_j over the free left and upper neighbors j. Both triangular solves run sequentially in the order of the pixels, so only the three channels are processed in parallel.
+ */
+class incomplete_cholesky
+{
+public:
+    /**
+     * @brief Factorizes a Poisson operator.
+     * @param _operator Operator, which must outlive the factorization.
+     */
+    explicit incomplete_cholesky(const poisson_operator& _operator)
+        : op(_operator)
+        , factor(_operator.diagonal.size(), 0.0)
+    {
+        const int width = op.width;
+        for (size_t i = 0; i < factor.size(); i++)
+        {
+            unsigned char mask = op.masks[i];
+            if (!(mask & poisson_operator::free_bit))
+                continue;
+            factor[i] = op.diagonal[i];
+            if (mask & 1)
+                factor[i] -= 1 / factor[i - 1];
+            if (mask & 4)
+                factor[i] -= 1 / factor[i - width];
+        }
+    }
+
+    /**
+     * @brief Solves M z = r.
+     * @param _r Right-hand side.
+     * @param _z Output solution of the same size.
+     */
+    void apply(const std::vector<color_type>& _r, std::vector<color_type>& _z) const
+    {
+        const size_t width = op.width;
+        parallel_for(0, 3, [&](int c) {
+            // forward substitution with D + L
+            for (size_t i = 0; i < factor.size(); i++)
+            {
+                unsigned char mask = op.masks[i];
+                if (!(mask & poisson_operator::free_bit))
+                {
+                    _z[i][c] = 0;
+                    continue;
+                }
+                double sum = _r[i][c];
+                if (mask & 1)
+                    sum += _z[i - 1][c];
+                if (mask & 4)
+                    sum += _z[i - width][c];
+                _z[i][c] = sum / factor[i];
+            }
+            // backward substitution with I + D^-1 L^T
+            for (size_t i = factor.size(); i-- > 0;)
+            {
+                unsigned char mask = op.masks[i];
+                if (!(mask & poisson_operator::free_bit))
+                    continue;
+                double sum = 0;
+                if (mask & 2)
+                    sum += _z[i + 1][c];
+                if (mask & 8)
+                    sum += _z[i + width][c];
+                _z[i][c] += sum / factor[i];
+            }
+        });
+    }
+
+private:
+    /**
+     * @brief Factorized operator.
+     */
+    const poisson_operator& op;
+    /**
+     * @brief Diagonal D of the factorization.
+     */
+    std::vector<double> factor;
+};
+
+/**
+ * @brief Solves a Poisson system with the preconditioned conjugate gradient method.
+ * @details The three channels are independent systems with the same operator, which are iterated together with separate step sizes. The multigrid preconditioner scales its coarse-grid corrections adaptively, so it is not a fixed linear operator, which breaks the orthogonality that the standard update relies on. The direction update therefore uses the flexible form beta = r_k+1 . (z_k+1 - z_k) / r_k . z_k, which reduces to the standard one for the fixed Jacobi and incomplete Cholesky preconditioners and keeps the multigrid variant convergent.
+ * @param _system Poisson system.
+ * @param _options Parameters of the solver.
+ * @param _stats Optional output of the number of iterations, the relative residual before every iteration and after the last, and the solve time.
+ * @param _initial_guess Optional warm start, see warm_start_solution.
+ * @return Solution.
+ */
+inline image solve_pcg(const poisson_system& _system, const pcg_options& _options, solver_statistics* _stats = nullptr, const image* _initial_guess = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    poisson_operator op(_system);
+    const size_t size = op.diagonal.size();
+
+    std::unique_ptr<incomplete_cholesky> factorization;
+    std::unique_ptr<multigrid_solver> cycles;
+    if (_options.preconditioner == pcg_preconditioner::incomplete_cholesky)
+        factorization.reset(new incomplete_cholesky(op));
+    else if (_options.preconditioner == pcg_preconditioner::multigrid)
+        cycles.reset(new multigrid_solver(_system, _options.multigrid));
+    auto precondition = [&](const std::vector<color_type>& _r, std::vector<color_type>& _z) {
+        if (factorization)
+            factorization->apply(_r, _z);
+        else if (cycles)
+        {
+            cycles->precondition(_r, _z);
+            // the cycles also relax the pixels that the operator leaves out
+            for (size_t i = 0; i < size; i++)
+                if (!(op.masks[i] & poisson_operator::free_bit))
+                    _z[i] = color_type{ 0, 0, 0 };
+        }
+        else
+            parallel_for(0, op.height, [&](int y) {
+                for (size_t i = (size_t)y * op.width; i < (size_t)(y + 1) * op.width; i++)
+                    for (int c = 0; c < 3; c++)
+                        _z[i][c] = op.diagonal[i] != 0 ? _r[i][c] / op.diagonal[i] : 0;
+            });
+    };
+
+    // without an initial guess, x is zero and the residual is the right-hand side
+    std::vector<color_type> x(size, color_type{ 0, 0, 0 }), r = op.rhs, z(size), previous_z, p, q(size);
+    color_type rr = channel_dots(op, r, r);
+    double norm   = std::sqrt(rr[0] + rr[1] + rr[2]);
+    if (norm == 0)
+        norm = 1;
+    if (_initial_guess != nullptr)
+    {
+        image guess;
+        warm_start_solution(_system, *_initial_guess, guess);
+        for (size_t i = 0; i < size; i++)
+            if (op.masks[i] & poisson_operator::free_bit)
+                x[i] = guess.data[i];
+        op.apply(x, q);
+        for (size_t i = 0; i < size; i++)
+            for (int c = 0; c < 3; c++)
+                r[i][c] -= q[i][c];
+        rr = channel_dots(op, r, r);
+    }
+    precondition(r, z);
+    p = z;
+    color_type rz = channel_dots(op, r, z);
+
+    solver_statistics stats;
+    for (;; stats.iterations++)
+    {
+        double relative = std::sqrt(rr[0] + rr[1] + rr[2]) / norm;
+        stats.residuals.push_back(relative);
+        stats.converged = relative <= _options.tolerance;
+        if (stats.converged || stats.iterations >= _options.max_iterations)
+            break;
+
+        op.apply(p, q);
+        color_type pq = channel_dots(op, p, q), alpha;
+        for (int c = 0; c < 3; c++)
+            alpha[c] = pq[c] > 0 ? rz[c] / pq[c] : 0;
+        std::vector<color_type> row_sums(op.height, color_type{ 0, 0, 0 });
+        parallel_for(0, op.height, [&](int y) {
+            for (size_t i = (size_t)y * op.width; i < (size_t)(y + 1) * op.width; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    x[i][c] += alpha[c] * p[i][c];
+                    r[i][c] -= alpha[c] * q[i][c];
+                    row_sums[y][c] += r[i][c] * r[i][c];
+                }
+            }
+        });
+        rr = color_type{ 0, 0, 0 };
+        for (const color_type& sum : row_sums)
+            for (int c = 0; c < 3; c++)
+                rr[c] += sum[c];
+
+        previous_z.swap(z);
+        z.resize(size);
+        precondition(r, z);
+        color_type rz_new = channel_dots(op, r, z), rz_previous = channel_dots(op, r, previous_z), beta;
+        for (int c = 0; c < 3; c++)
+            beta[c] = rz[c] > 0 ? (rz_new[c] - rz_previous[c]) / rz[c] : 0;
+        rz = rz_new;
+        parallel_for(0, op.height, [&](int y) {
+            for (size_t i = (size_t)y * op.width; i < (size_t)(y + 1) * op.width; i++)
+                for (int c = 0; c < 3; c++)
+                    p[i][c] = z[i][c] + beta[c] * p[i][c];
+        });
+    }
+
+    image solution = op.pinned;
+    for (size_t i = 0; i < size; i++)
+        if (op.masks[i] & poisson_operator::free_bit)
+            solution.data[i] = x[i];
+    stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if (_stats != nullptr)
+        *_stats = stats;
+    return solution;
+}
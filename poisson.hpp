@@ -0,0 +1,396 @@
+#pragma once
+
+#include "barriers.hpp"
+#include "constraints.hpp"
+#include "curves.hpp"
+#include "laplacian_source.hpp"
+#include "mesh_constraints.hpp"
+#include "parallel.hpp"
+#include "sparse_constraints.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <vector>
+
+/**
+ * @brief Discrete Poisson problem of a scene on a pixel grid.
+ * @details Each pixel is either constrained to a color (Dirichlet) or free. A free pixel u with the open neighbors N satisfies |N| u - sum_N u_n = -F, where F is the integral of the Laplacian over the pixel cell in scene units. Edges in the barriers are closed, which includes the image border (Neumann). A constraint with a weight w < 1 is soft: with a = w / (1 - w), the pixel satisfies (|N| + a) u - sum_N u_n = a c - F, which blends the constraint color c into its neighborhood.
+ */
+class poisson_system
+{
+public:
+    /**
+     * @brief Creates an empty system.
+     */
+    poisson_system()
+        : width(0)
+        , height(0)
+        , cell_size(1)
+    {
+    }
+
+    /**
+     * @brief Creates a system without constraints, sources and barriers.
+     * @param _width Width in pixels.
+     * @param _height Height in pixels.
+     * @param _cell_size Edge length of a pixel in scene units.
+     */
+    poisson_system(int _width, int _height, double _cell_size)
+        : width(_width)
+        , height(_height)
+        , cell_size(_cell_size)
+        , constraints(_width, _height)
+        , source(_width, _height, std::array<double, 3>{ { 0, 0, 0 } })
+        , barriers(_width, _height)
+    {
+    }
+
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Edge length of a pixel in scene units.
+     */
+    double cell_size;
+    /**
+     * @brief Dirichlet constraints.
+     */
+    constraint_grid constraints;
+    /**
+     * @brief Integral of the Laplacian over each pixel cell.
+     */
+    source_grid<double> source;
+    /**
+     * @brief Closed grid edges.
+     */
+    edge_barriers barriers;
+
+    /**
+     * @brief Number of free pixels, i.e., the unknowns of the system.
+     * @return Number of pixels without Dirichlet constraint.
+     */
+    long long num_unknowns() const
+    {
+        return (long long)width * height - constraints.num_constrained();
+    }
+};
+
+/**
+ * @brief Parameters of the assembly of a Poisson system.
+ */
+struct assembly_options
+{
+    /**
+     * @brief Maximum distance in pixels between the curves and their polylines.
+     */
+    double tolerance = 0.25;
+    /**
+     * @brief Include the diffusion curves as constraints and barriers.
+     */
+    bool diffusion_curves = true;
+    /**
+     * @brief Include the Poisson curves as sources.
+     */
+    bool poisson_curves = true;
+    /**
+     * @brief Include the gradient meshes as sources and border constraints.
+     */
+    bool gradient_meshes = true;
+    /**
+     * @brief Parameters of the diffusion curve rasterization.
+     */
+    rasterization_options rasterization;
+    /**
+     * @brief Rasterize the diffusion curves strip by strip into sparse constraints and merge them from there, instead of through a dense grid of the full resolution.
+     */
+    bool sparse_constraints = false;
+    /**
+     * @brief Balance the floating regions at the end, see balance_floating_regions; without, they stay singular, e.g., to find them with find_floating_regions.
+     */
+    bool balance_floating = true;
+    /**
+     * @brief Parameters of the barriers.
+     */
+    barrier_options barriers;
+    /**
+     * @brief Parameters of the Poisson curve splatting.
+     */
+    splatting_options splatting;
+    /**
+     * @brief Parameters of the inverse mapping of the gradient meshes.
+     */
+    inverse_mapping_options mapping;
+};
+
+/**
+ * @brief Time spent in the stages of the assembly, and counters.
+ */
+struct assembly_statistics
+{
+    /**
+     * @brief Time for flattening the curves and splitting the meshes, in milliseconds.
+     */
+    double preparation_ms = 0;
+    /**
+     * @brief Time for the inverse mapping and conversion of the gradient meshes, in milliseconds.
+     */
+    double meshes_ms = 0;
+    /**
+     * @brief Time for rasterizing the diffusion curves and their barriers, in milliseconds.
+     */
+    double diffusion_curves_ms = 0;
+    /**
+     * @brief Time for splatting the Poisson curves, in milliseconds.
+     */
+    double poisson_curves_ms = 0;
+    /**
+     * @brief Time for merging the stages and balancing the floating regions, in milliseconds.
+     */
+    double merge_ms = 0;
+    /**
+     * @brief Number of regions without constraints, whose source was balanced.
+     */
+    int num_floating_regions = 0;
+    /**
+     * @brief Counters of the gradient mesh conversion.
+     */
+    mesh_constraint_statistics meshes;
+};
+
+/**
+ * @brief Regions of a Poisson system without any constraint, which are only defined up to a constant.
+ */
+struct floating_regions
+{
+    /**
+     * @brief Floating region of every pixel, or -1 for the pixels of regions with constraints.
+     */
+    grid<int> labels;
+    /**
+     * @brief First pixel of every floating region in scan order.
+     */
+    std::vector<size_t> seeds;
+    /**
+     * @brief Mean color of the constraints right across the closed edges of every floating region, i.e., of the curves that enclose it, or black if there are none.
+     */
+    std::vector<color_type> colors;
+};
+
+/**
+ * @brief Finds the floating regions of a Poisson system.
+ * @details A floating region is a set of pixels connected by open edges without any constraint, e.g., a pocket that is enclosed by Neumann curves. The regions are found by a flood fill.
+ * @param _system Poisson system.
+ * @param _regions Output regions.
+ * @return Number of floating regions.
+ */
+inline int find_floating_regions(const poisson_system& _system, floating_regions& _regions)
+{
+    const int width = _system.width, height = _system.height;
+    _regions.labels.assign(width, height, -1);
+    _regions.seeds.clear();
+    _regions.colors.clear();
+    std::vector<int> region((size_t)width * height, -1);
+    std::vector<size_t> stack, members;
+    int num_regions = 0;
+    for (size_t seed = 0; seed < region.size(); seed++)
+    {
+        if (region[seed] >= 0)
+            continue;
+        bool constrained = false;
+        int num_outside  = 0;
+        color_type outside = { 0, 0, 0 };
+        members.clear();
+        stack.push_back(seed);
+        region[seed] = num_regions;
+        while (!stack.empty())
+        {
+            size_t i = stack.back();
+            stack.pop_back();
+            members.push_back(i);
+            constrained |= _system.constraints.mask.data[i] && _system.constraints.weights.data[i] > 0;
+            int x = (int)(i % width), y = (int)(i / width);
+            auto visit = [&](bool _inside, bool _blocked, size_t _neighbor) {
+                if (!_inside)
+                    return;
+                if (_blocked)
+                {
+                    if (_system.constraints.mask.data[_neighbor] && _system.constraints.weights.data[_neighbor] > 0)
+                    {
+                        for (int c = 0; c < 3; c++)
+                            outside[c] += _system.constraints.colors.data[_neighbor][c];
+                        num_outside++;
+                    }
+                }
+                else if (region[_neighbor] < 0)
+                {
+                    region[_neighbor] = num_regions;
+                    stack.push_back(_neighbor);
+                }
+            };
+            visit(x > 0, _system.barriers.blocked_left(x, y), i - 1);
+            visit(x + 1 < width, _system.barriers.blocked_right(x, y), i + 1);
+            visit(y > 0, _system.barriers.blocked_up(x, y), i - width);
+            visit(y + 1 < height, _system.barriers.blocked_down(x, y), i + width);
+        }
+        num_regions++;
+        if (constrained)
+            continue;
+        for (size_t i : members)
+            _regions.labels.data[i] = (int)_regions.seeds.size();
+        for (int c = 0; c < 3; c++)
+            outside[c] = num_outside > 0 ? outside[c] / num_outside : 0;
+        _regions.seeds.push_back(seed);
+        _regions.colors.push_back(outside);
+    }
+    return (int)_regions.seeds.size();
+}
+
+/**
+ * @brief Makes the Neumann problems of floating regions well-posed by removing the mean of their source and pinning one pixel.
+ * @details The solution of a floating region, see find_floating_regions, only exists if the source sums to zero over the region, which rounding in the rasterization does not guarantee; otherwise, every iterative solver drifts forever. Even then, it is only defined up to a constant, which each solver would choose differently. The mean source of each floating region is therefore subtracted from its pixels, and its first pixel in scan order is pinned to the mean color of the constraints right across the closed edges of the region, i.e., of the curves that enclose it, or to black if there are none.
+ * @param _system Poisson system, modified in place.
+ * @return Number of floating regions.
+ */
+inline int balance_floating_regions(poisson_system& _system)
+{
+    floating_regions regions;
+    const int num_floating = find_floating_regions(_system, regions);
+    if (num_floating == 0)
+        return 0;
+    std::vector<std::array<double, 3>> sums(num_floating, std::array<double, 3>{ { 0, 0, 0 } });
+    std::vector<size_t> sizes(num_floating, 0);
+    for (size_t i = 0; i < regions.labels.data.size(); i++)
+    {
+        int label = regions.labels.data[i];
+        if (label < 0)
+            continue;
+        for (int c = 0; c < 3; c++)
+            sums[label][c] += _system.source.data[i][c];
+        sizes[label]++;
+    }
+    for (size_t i = 0; i < regions.labels.data.size(); i++)
+    {
+        int label = regions.labels.data[i];
+        if (label >= 0)
+            for (int c = 0; c < 3; c++)
+                _system.source.data[i][c] -= sums[label][c] / sizes[label];
+    }
+    for (int r = 0; r < num_floating; r++)
+        _system.constraints.set(regions.seeds[r], regions.colors[r]);
+    return num_floating;
+}
+
+/**
+ * @brief Assembles the Poisson problem of a scene from curves and meshes that were prepared already, e.g., to share them between several resolutions.
+ * @details The gradient meshes contribute their Laplacian as source and Dirichlet constraints at their borders. The diffusion curves are rasterized on top, i.e., their constraints replace those of the meshes, optionally through sparse constraints, and the curves with a Neumann side close the grid edges they cross. The Poisson curves add their splatted source. Every stage runs in parallel, except for the final balancing of the floating regions.
+ * @param _scene Scene to assemble.
+ * @param _curves Flattened curves of the scene, at a tolerance that suits the resolution.
+ * @param _patches Gradient mesh patches of the scene.
+ * @param _width Width of the grid in pixels.
+ * @param _height Height of the grid in pixels.
+ * @param _options Parameters of the stages; the tolerance is ignored.
+ * @param _stats Optional output of the stage timings, without preparation.
+ * @return Poisson system of the scene.
+ */
+inline poisson_system assemble_poisson_system(const scene& _scene, const flattened_scene& _curves, const std::vector<mesh_patch>& _patches, int _width, int _height,
+                                              const assembly_options& _options, assembly_statistics* _stats = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    assembly_statistics stats;
+    clock::time_point start = clock::now();
+    auto lap = [&start]() {
+        clock::time_point now = clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - start).count();
+        start     = now;
+        return ms;
+    };
+
+    double scale = _scene.width > 0 ? (double)_width / _scene.width : 1;
+    poisson_system system(_width, _height, 1 / scale);
+    if (_options.gradient_meshes && !_patches.empty())
+    {
+        mesh_inverse_mapping mapping(_patches, _scene.width, _scene.height, _width, _height, _options.mapping);
+        std::vector<patch_location> locations;
+        mapping.map_image(locations);
+        stats.meshes = convert_gradient_meshes(mapping, locations, system.cell_size * system.cell_size, system.constraints, system.source);
+    }
+    stats.meshes_ms = lap();
+
+    constraint_grid curve_constraints;
+    sparse_constraint_grid sparse_curve_constraints;
+    if (_options.diffusion_curves && !_curves.diffusion_curves.empty())
+    {
+        if (_options.sparse_constraints)
+            sparse_curve_constraints = rasterize_sparse_diffusion_curves(_scene, _curves, _width, _height, _options.rasterization);
+        else
+        {
+            curve_constraints = constraint_grid(_width, _height);
+            diffusion_curve_rasterizer(_scene, _curves, _options.rasterization).rasterize(curve_constraints);
+        }
+        system.barriers = edge_barriers(_scene, _curves, _width, _height, _options.barriers);
+    }
+    stats.diffusion_curves_ms = lap();
+
+    source_grid<double> curve_source;
+    if (_options.poisson_curves && !_curves.poisson_curves.empty())
+    {
+        curve_source = source_grid<double>(_width, _height);
+        splat_poisson_curves(_scene, _curves, _options.splatting, curve_source);
+    }
+    stats.poisson_curves_ms = lap();
+
+    if (!curve_constraints.mask.data.empty() || sparse_curve_constraints.num_rows > 0 || !curve_source.data.empty())
+    {
+        parallel_for(0, _height, [&](int y) {
+            if (sparse_curve_constraints.num_rows > 0)
+                sparse_curve_constraints.merge_row(y, system.constraints);
+            for (size_t i = (size_t)y * _width; i < (size_t)(y + 1) * _width; i++)
+            {
+                if (!curve_constraints.mask.data.empty() && curve_constraints.mask.data[i])
+                    system.constraints.set(i, curve_constraints.colors.data[i], curve_constraints.weights.data[i]);
+                if (!curve_source.data.empty())
+                    for (int c = 0; c < 3; c++)
+                        system.source.data[i][c] += curve_source.data[i][c];
+            }
+        });
+    }
+    if (_options.balance_floating)
+        stats.num_floating_regions = balance_floating_regions(system);
+    stats.merge_ms             = lap();
+
+    if (_stats != nullptr)
+        *_stats = stats;
+    return system;
+}
+
+/**
+ * @brief Assembles the Poisson problem of a scene with diffusion curves, Poisson curves and gradient meshes.
+ * @details The curves are flattened and the meshes are split once, then the stages run as in the assembly from prepared geometry.
+ * @param _scene Scene to assemble.
+ * @param _width Width of the grid in pixels.
+ * @param _height Height of the grid in pixels.
+ * @param _options Parameters of the stages.
+ * @param _stats Optional output of the stage timings.
+ * @return Poisson system of the scene.
+ */
+inline poisson_system assemble_poisson_system(const scene& _scene, int _width, int _height, const assembly_options& _options, assembly_statistics* _stats = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    double scale = _scene.width > 0 ? (double)_width / _scene.width : 1;
+    flattened_scene curves = _options.diffusion_curves || _options.poisson_curves ? flattened_scene(_scene, _options.tolerance / scale)
+                                                                                   : flattened_scene(_scene.width, _scene.height);
+    std::vector<mesh_patch> patches = _options.gradient_meshes ? mesh_patches(_scene) : std::vector<mesh_patch>();
+    double preparation_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    poisson_system system = assemble_poisson_system(_scene, curves, patches, _width, _height, _options, _stats);
+    if (_stats != nullptr)
+        _stats->preparation_ms = preparation_ms;
+    return system;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "curves.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+/**
+ * @brief Parameters of a resolution pyramid of Poisson systems.
+ */
+struct pyramid_options
+{
+    /**
+     * @brief Maximum number of levels including the finest one; zero adds levels until the minimum size is reached.
+     */
+    int max_levels = 0;
+    /**
+     * @brief No level is coarser than this number of pixels along its shorter side, unless the finest level is already smaller.
+     */
+    int min_size = 16;
+    /**
+     * @brief Parameters of the assembly of every level. The tolerance is given in pixels of the respective level.
+     */
+    assembly_options assembly;
+};
+
+/**
+ * @brief Time spent building a pyramid.
+ */
+struct pyramid_statistics
+{
+    /**
+     * @brief Time for flattening the curves at the finest tolerance and splitting the meshes, in milliseconds.
+     */
+    double preparation_ms = 0;
+    /**
+     * @brief Time for decimating the polylines of the coarser levels, in milliseconds.
+     */
+    double decimation_ms = 0;
+    /**
+     * @brief Time for assembling all levels, in milliseconds.
+     */
+    double assembly_ms = 0;
+    /**
+     * @brief Number of diffusion and Poisson curve segments per level.
+     */
+    std::vector<int> num_segments;
+    /**
+     * @brief Stage timings per level.
+     */
+    std::vector<assembly_statistics> levels;
+};
+
+/**
+ * @brief Size of a level of a resolution pyramid, halving and rounding up per level.
+ * @param _size Size of the finest level in pixels.
+ * @param _level Level index, zero being the finest.
+ * @return Size of the level in pixels.
+ */
+inline int pyramid_level_size(int _size, int _level)
+{
+    return (int)(((long long)_size + (1LL << _level) - 1) >> _level);
+}
+
+/**
+ * @brief Builds the Poisson systems of a scene at a sequence of resolutions, each half the size of the previous one, directly from the geometry.
+ * @details Coarse levels are not downsampled from the finest grid, which would average the constraint colors of both sides of a curve and thin features away. Instead, every level rasterizes the curves and meshes at its own resolution. The curves are flattened once at the tolerance of the finest level, and each coarser level decimates these polylines to its own, larger tolerance. The levels are assembled in parallel, and each assembly is itself parallel.
+ * @param _scene Scene to assemble.
+ * @param _width Width of the finest level in pixels.
+ * @param _height Height of the finest level in pixels.
+ * @param _options Parameters of the pyramid.
+ * @param _stats Optional output of the timings.
+ * @return Poisson systems from the finest to the coarsest level.
+ */
+inline std::vector<poisson_system> build_poisson_pyramid(const scene& _scene, int _width, int _height, const pyramid_options& _options, pyramid_statistics* _stats = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    pyramid_statistics stats;
+    clock::time_point start = clock::now();
+    auto lap = [&start]() {
+        clock::time_point now = clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - start).count();
+        start     = now;
+        return ms;
+    };
+
+    int num_levels = 1;
+    while ((_options.max_levels <= 0 || num_levels < _options.max_levels) &&
+           std::min(pyramid_level_size(_width, num_levels), pyramid_level_size(_height, num_levels)) >= std::max(1, _options.min_size))
+        num_levels++;
+
+    const assembly_options& assembly = _options.assembly;
+    double scale = _scene.width > 0 ? (double)_width / _scene.width : 1;
+    flattened_scene fine = assembly.diffusion_curves || assembly.poisson_curves ? flattened_scene(_scene, assembly.tolerance / scale)
+                                                                                 : flattened_scene(_scene.width, _scene.height);
+    std::vector<mesh_patch> patches = assembly.gradient_meshes ? mesh_patches(_scene) : std::vector<mesh_patch>();
+    stats.preparation_ms = lap();
+
+    std::vector<flattened_scene> curves(num_levels, flattened_scene(_scene.width, _scene.height));
+    curves[0] = fine;
+    for (int level = 1; level < num_levels; level++)
+        curves[level] = fine.decimated(assembly.tolerance * _scene.width / std::max(1, pyramid_level_size(_width, level)));
+    stats.decimation_ms = lap();
+
+    std::vector<poisson_system> levels(num_levels);
+    stats.levels.resize(num_levels);
+    parallel_for(0, num_levels, [&](int level) {
+        levels[level] = assemble_poisson_system(_scene, curves[level], patches, pyramid_level_size(_width, level), pyramid_level_size(_height, level), assembly,
+                                                &stats.levels[level]);
+    });
+    stats.assembly_ms = lap();
+
+    for (const flattened_scene& level : curves)
+        stats.num_segments.push_back(level.num_diffusion_segments() + level.num_poisson_segments());
+    if (_stats != nullptr)
+        *_stats = stats;
+    return levels;
+}
@@ -0,0 +1,771 @@
+#pragma once
+
+#include "grid.hpp"
+#include "image.hpp"
+#include "multigrid.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "solver.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Parameters of the quadtree solver.
+ */
+struct quadtree_options
+{
+    /**
+     * @brief Largest side length of a cell in pixels, a power of two.
+     */
+    int max_cell_size = 32;
+    /**
+     * @brief Largest deviation from a linear function that the source may cause within a cell, estimated as the largest magnitude of the source times the squared size of the cell over eight; a quarter of an 8-bit step by default.
+     */
+    double max_source_error = 1.0 / 1024;
+    /**
+     * @brief Number of rings of blocks of the same size around a cell that must be smooth as well, which keeps the cells at least that many times their size away from the curves.
+     */
+    int guard_rings = 2;
+    /**
+     * @brief Largest number of nodes of the coarsest level that is factorized with a dense Cholesky factor, which takes n^2 doubles and about n^3 / 6 multiply-adds. Larger coarsest levels, e.g., when the coarsening stalls on many small components, are relaxed with multigrid.coarsest_sweeps symmetric Gauss-Seidel sweeps instead.
+     */
+    int max_direct_nodes = 1024;
+    /**
+     * @brief Parameters of the cycles: the cycle type, the numbers of pre- and post-smoothing sweeps, the size of the coarsest level, whose square is the number of nodes at which the coarsening stops, the tolerance and the maximum number of cycles. The smoother is always Gauss-Seidel in the order of the cells.
+     */
+    multigrid_options multigrid;
+};
+
+/**
+ * @brief Leaf of the quadtree, a square block of pixels.
+ */
+struct quadtree_cell
+{
+    /**
+     * @brief First column.
+     */
+    int x;
+    /**
+     * @brief First row.
+     */
+    int y;
+    /**
+     * @brief Side length in pixels.
+     */
+    int size;
+};
+
+/**
+ * @brief Poisson solver on an adaptive quadtree, with pixels along the curves and mesh borders and large cells in the smooth regions between them.
+ * @details A block of pixels becomes one cell if none of its pixels is constrained, none of its edges is blocked and the source is small enough to bend the solution only slightly within the block, i.e., far from the curves. Neighboring cells differ in size by at most a factor of two. Each cell has one unknown at its center, coupled to the neighbors across its sides by finite volumes: the flux through a shared face of length l between cells of size a and b has the conductance l / ((a + b) / 2), which reduces to the five-point stencil between pixels, and the source is summed over the pixels of a cell. The cells are solved with multigrid cycles, where every coarser level merges the connected components of the nodes in aligned blocks of twice the size, as the uniform multigrid does with its cells, down to a coarsest level that is factorized once and solved directly, or relaxed if it stays too large to factorize. Finally, the cells are resampled to the pixels.
+ */
+class quadtree_solver
+{
+public:
+    /**
+     * @brief Builds the quadtree and the multigrid hierarchy of a Poisson system.
+     * @param _system Poisson system.
+     * @param _options Parameters of the solver.
+     */
+    quadtree_solver(const poisson_system& _system, const quadtree_options& _options)
+        : options(_options)
+        , width(_system.width)
+        , height(_system.height)
+    {
+        build_cells(_system);
+        levels.emplace_back();
+        corners.emplace_back();
+        build_finest(_system);
+        // as many nodes on the coarsest level as the uniform multigrid has cells on its coarsest level
+        const int coarsest = std::max(1, options.multigrid.coarsest_size * options.multigrid.coarsest_size);
+        for (int level = 1; level < 31 && levels.back().num_nodes() > coarsest; level++)
+        {
+            multigrid_level coarse;
+            std::vector<std::array<int, 2>> coarse_corners;
+            build_coarse(level, levels.back(), corners.back(), coarse, coarse_corners);
+            if (coarse.num_nodes() == levels.back().num_nodes())
+            {
+                levels.back().parent.clear();
+                break;
+            }
+            levels.push_back(std::move(coarse));
+            corners.push_back(std::move(coarse_corners));
+        }
+        factorize_coarsest();
+    }
+
+    /**
+     * @brief Number of unknowns, i.e., the cells that are neither pinned nor isolated.
+     * @return Number of nodes of the finest level.
+     */
+    int num_unknowns() const
+    {
+        return levels.front().num_nodes();
+    }
+
+    /**
+     * @brief Runs cycles until the relative residual reaches the tolerance and resamples the cells to the pixels.
+     * @param _solution Initial guess on input (ignored if it does not match the size of the system), solution with the pinned colors on output.
+     * @param _stats Optional output of the number of cycles, the relative residual before every cycle and after the last, and the solve time.
+     */
+    void solve(image& _solution, solver_statistics* _stats = nullptr)
+    {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now();
+        multigrid_level& finest = levels.front();
+        std::fill(finest.solution.begin(), finest.solution.end(), color_type{ 0, 0, 0 });
+        if (_solution.width == width && _solution.height == height)
+            for (size_t cell = 0; cell < cells.size(); cell++)
+                if (nodes[cell] >= 0)
+                    finest.solution[nodes[cell]] = _solution(cells[cell].x + cells[cell].size / 2, cells[cell].y + cells[cell].size / 2);
+
+        solver_statistics stats;
+        double norm = std::sqrt(squared_norm(finest.rhs));
+        if (norm == 0)
+            norm = 1;
+        for (;; stats.iterations++)
+        {
+            compute_residual(finest);
+            double relative = std::sqrt(squared_norm(finest.residual)) / norm;
+            stats.residuals.push_back(relative);
+            stats.converged = relative <= options.multigrid.tolerance;
+            if (stats.converged || stats.iterations >= options.multigrid.max_cycles)
+                break;
+            cycle(0);
+        }
+        resample(_solution);
+        stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (_stats != nullptr)
+            *_stats = stats;
+    }
+
+    /**
+     * @brief Interpolates the values of the cells to the pixels.
+     * @details Pixels that are cells of their own take its value. The pixels of a larger cell interpolate bilinearly between its center and the centers of the neighbors in the quadrant of the pixel: horizontally and vertically the cells across the sides, in the row and column of the pixel, and diagonally the cell across the corner. The result is continuous across the sides of cells of the same size and nearly so between cells of different sizes.
+     * @param _image Output image, resized to the system.
+     */
+    void resample(image& _image) const
+    {
+        const multigrid_level& finest = levels.front();
+        std::vector<color_type> values(cells.size());
+        for (size_t cell = 0; cell < cells.size(); cell++)
+            values[cell] = nodes[cell] >= 0 ? finest.solution[nodes[cell]] : pinned(cells[cell].x, cells[cell].y);
+        _image.assign(width, height, color_type{ 0, 0, 0 });
+        parallel_for(0, (int)cells.size(), [&](int cell) {
+            const quadtree_cell& block = cells[cell];
+            if (block.size == 1)
+            {
+                _image(block.x, block.y) = values[cell];
+                return;
+            }
+            double cx = block.x + 0.5 * block.size, cy = block.y + 0.5 * block.size;
+            for (int y = block.y; y < block.y + block.size; y++)
+            {
+                // row of the vertical neighbor and the weight of its center, which stays with the cell at the border of the image
+                int ny    = y + 0.5 < cy ? block.y - 1 : block.y + block.size;
+                bool up   = ny >= 0 && ny < height;
+                for (int x = block.x; x < block.x + block.size; x++)
+                {
+                    int nx      = x + 0.5 < cx ? block.x - 1 : block.x + block.size;
+                    bool across = nx >= 0 && nx < width;
+                    int horizontal = across ? cell_of(nx, y) : cell, vertical = up ? cell_of(x, ny) : cell, diagonal = across && up ? cell_of(nx, ny) : cell;
+                    double tx = across ? (x + 0.5 - cx) / (cells[horizontal].x + 0.5 * cells[horizontal].size - cx) : 0;
+                    double ty = up ? (y + 0.5 - cy) / (cells[vertical].y + 0.5 * cells[vertical].size - cy) : 0;
+                    color_type& pixel = _image(x, y);
+                    for (int c = 0; c < 3; c++)
+                        pixel[c] = (1 - ty) * ((1 - tx) * values[cell][c] + tx * values[horizontal][c]) + ty * ((1 - tx) * values[vertical][c] + tx * values[diagonal][c]);
+                }
+            }
+        });
+    }
+
+    /**
+     * @brief Parameters of the solver.
+     */
+    quadtree_options options;
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Leaves of the quadtree in the row-major order of their first pixel.
+     */
+    std::vector<quadtree_cell> cells;
+    /**
+     * @brief Cell of every pixel.
+     */
+    grid<int> cell_of;
+    /**
+     * @brief Node of the finest level of every cell; -1 for pinned and isolated pixels.
+     */
+    std::vector<int> nodes;
+    /**
+     * @brief Levels from the finest to the coarsest, each with a single cell that holds all nodes, since the leaves do not form a regular grid.
+     */
+    std::vector<multigrid_level> levels;
+    /**
+     * @brief Image with the colors of the pinned pixels and zero elsewhere.
+     */
+    image pinned;
+
+private:
+    /**
+     * @brief First pixel of a cell that contains every node, per level, which locates the blocks of the coarsening.
+     */
+    std::vector<std::vector<std::array<int, 2>>> corners;
+    /**
+     * @brief Dense Cholesky factor of the coarsest level, row by row; rows of zero pivots are left out of the solve. Empty if the coarsest level is too large and is relaxed instead.
+     */
+    std::vector<double> factor;
+
+    /**
+     * @brief Factorizes the coarsest level, which the W-cycles visit twice per level of the hierarchy, too often for relaxation, unless it has more than options.max_direct_nodes nodes.
+     */
+    void factorize_coarsest()
+    {
+        const multigrid_level& level = levels.back();
+        const int n                  = level.num_nodes();
+        factor.clear();
+        if (n > options.max_direct_nodes)
+            return;
+        factor.assign((size_t)n * n, 0.0);
+        for (int i = 0; i < n; i++)
+        {
+            factor[(size_t)i * n + i] = level.diagonal[i];
+            for (int k = level.offsets[i]; k < level.offsets[i + 1]; k++)
+                factor[(size_t)i * n + level.neighbors[k]] -= level.couplings[k];
+        }
+        for (int j = 0; j < n; j++)
+        {
+            double pivot = factor[(size_t)j * n + j];
+            for (int k = 0; k < j; k++)
+                pivot -= factor[(size_t)j * n + k] * factor[(size_t)j * n + k];
+            pivot                     = pivot > 1e-12 * std::max(1.0, level.diagonal[j]) ? std::sqrt(pivot) : 0;
+            factor[(size_t)j * n + j] = pivot;
+            for (int i = j + 1; i < n; i++)
+            {
+                double sum = factor[(size_t)i * n + j];
+                for (int k = 0; k < j; k++)
+                    sum -= factor[(size_t)i * n + k] * factor[(size_t)j * n + k];
+                factor[(size_t)i * n + j] = pivot > 0 ? sum / pivot : 0;
+            }
+        }
+    }
+
+    /**
+     * @brief Solves the coarsest level directly with its Cholesky factor, or relaxes it if it was too large to factorize.
+     */
+    void solve_coarsest()
+    {
+        multigrid_level& level = levels.back();
+        const int n            = level.num_nodes();
+        if (factor.empty())
+        {
+            for (int sweep = 0; sweep < options.multigrid.coarsest_sweeps; sweep++)
+                gauss_seidel(level, 1, sweep % 2 == 0);
+            return;
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                double sum = level.rhs[i][c];
+                for (int k = 0; k < i; k++)
+                    sum -= factor[(size_t)i * n + k] * level.solution[k][c];
+                level.solution[i][c] = factor[(size_t)i * n + i] > 0 ? sum / factor[(size_t)i * n + i] : 0;
+            }
+            for (int i = n - 1; i >= 0; i--)
+            {
+                double sum = level.solution[i][c];
+                for (int k = i + 1; k < n; k++)
+                    sum -= factor[(size_t)k * n + i] * level.solution[k][c];
+                level.solution[i][c] = factor[(size_t)i * n + i] > 0 ? sum / factor[(size_t)i * n + i] : 0;
+            }
+        }
+    }
+
+    /**
+     * @brief Subdivides the image into cells and balances their sizes.
+     * @param _system Poisson system.
+     */
+    void build_cells(const poisson_system& _system)
+    {
+        const edge_barriers& barriers = _system.barriers;
+        int max_level = 0;
+        while ((2 << max_level) <= options.max_cell_size)
+            max_level++;
+
+        // blocks of 2^k pixels without constraints and blocked edges whose source bends the solution little, bottom up
+        std::vector<grid<unsigned char>> smooth(max_level + 1);
+        std::vector<grid<float>> max_source(max_level + 1);
+        smooth[0].assign(width, height, 0);
+        max_source[0].assign(width, height, 0.f);
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                int open = (x > 0) + (x + 1 < width) + (y > 0) + (y + 1 < height);
+                smooth[0](x, y) = !_system.constraints.mask(x, y) && barriers.degree(x, y) == open;
+                const color_type& source = _system.source(x, y);
+                max_source[0](x, y)      = (float)std::max(std::abs(source[0]), std::max(std::abs(source[1]), std::abs(source[2])));
+            }
+        });
+        for (int k = 1; k <= max_level; k++)
+        {
+            smooth[k].assign(width >> k, height >> k, 0);
+            max_source[k].assign(width >> k, height >> k, 0.f);
+            double size = 1 << k;
+            parallel_for(0, smooth[k].height, [&](int Y) {
+                for (int X = 0; X < smooth[k].width; X++)
+                {
+                    bool children = true;
+                    for (int d = 0; d < 4; d++)
+                    {
+                        children            = children && smooth[k - 1](2 * X + (d & 1), 2 * Y + (d >> 1));
+                        max_source[k](X, Y) = std::max(max_source[k](X, Y), max_source[k - 1](2 * X + (d & 1), 2 * Y + (d >> 1)));
+                    }
+                    smooth[k](X, Y) = children && max_source[k](X, Y) * size * size / 8 <= options.max_source_error;
+                }
+            });
+        }
+
+        // blocks whose rings of neighbors are smooth as well, where blocks outside of the image count as smooth and partial ones at its border do not
+        std::vector<grid<unsigned char>> allowed(max_level + 1);
+        for (int k = 1; k <= max_level; k++)
+        {
+            allowed[k].assign(smooth[k].width, smooth[k].height, 0);
+            const int rings = std::max(0, options.guard_rings);
+            parallel_for(0, smooth[k].height, [&](int Y) {
+                for (int X = 0; X < smooth[k].width; X++)
+                {
+                    bool clear = true;
+                    for (int dy = -rings; dy <= rings && clear; dy++)
+                    {
+                        for (int dx = -rings; dx <= rings && clear; dx++)
+                        {
+                            int nx = X + dx, ny = Y + dy;
+                            if (nx < 0 || ny < 0 || (nx << k) >= width || (ny << k) >= height)
+                                continue;
+                            clear = nx < smooth[k].width && ny < smooth[k].height && smooth[k](nx, ny);
+                        }
+                    }
+                    allowed[k](X, Y) = clear;
+                }
+            });
+        }
+
+        // largest allowed blocks top down, as the base 2 logarithm of the size of the cell of every pixel
+        grid<unsigned char> levels_of(width, height, 0);
+        std::vector<std::array<int, 3>> stack;
+        for (int Y = 0; Y << max_level < height; Y++)
+            for (int X = 0; X << max_level < width; X++)
+                stack.push_back(std::array<int, 3>{ { X << max_level, Y << max_level, max_level } });
+        while (!stack.empty())
+        {
+            std::array<int, 3> block = stack.back();
+            stack.pop_back();
+            int x = block[0], y = block[1], k = block[2], size = 1 << k;
+            if (x >= width || y >= height)
+                continue;
+            if (k == 0 || ((x >> k) < allowed[k].width && (y >> k) < allowed[k].height && allowed[k](x >> k, y >> k)))
+            {
+                for (int dy = 0; dy < size; dy++)
+                    std::fill(levels_of.data.begin() + levels_of.index(x, y + dy), levels_of.data.begin() + levels_of.index(x, y + dy) + size, (unsigned char)k);
+                continue;
+            }
+            for (int d = 0; d < 4; d++)
+                stack.push_back(std::array<int, 3>{ { x + (d & 1) * size / 2, y + (d >> 1) * size / 2, k - 1 } });
+        }
+
+        // splits cells with a neighbor of less than half their size until no such pair is left
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    int k = levels_of(x, y), size = 1 << k;
+                    if (k < 2 || x % size != 0 || y % size != 0)
+                        continue;
+                    bool split = false;
+                    for (int t = 0; t < size && !split; t++)
+                        split = (x > 0 && levels_of(x - 1, y + t) + 1 < k) || (x + size < width && levels_of(x + size, y + t) + 1 < k) ||
+                                (y > 0 && levels_of(x + t, y - 1) + 1 < k) || (y + size < height && levels_of(x + t, y + size) + 1 < k);
+                    if (!split)
+                        continue;
+                    for (int dy = 0; dy < size; dy++)
+                        std::fill(levels_of.data.begin() + levels_of.index(x, y + dy), levels_of.data.begin() + levels_of.index(x, y + dy) + size, (unsigned char)(k - 1));
+                    changed = true;
+                }
+            }
+        }
+
+        cell_of.assign(width, height, 0);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int size = 1 << levels_of(x, y);
+                if (x % size != 0 || y % size != 0)
+                    continue;
+                for (int dy = 0; dy < size; dy++)
+                    std::fill(cell_of.data.begin() + cell_of.index(x, y + dy), cell_of.data.begin() + cell_of.index(x, y + dy) + size, (int)cells.size());
+                cells.push_back(quadtree_cell{ x, y, size });
+            }
+        }
+    }
+
+    /**
+     * @brief Calls a function for every neighbor of a cell across its sides.
+     * @param _system Poisson system with the barriers between pixels.
+     * @param _cell Cell.
+     * @param _body Function that is called as _body(neighbor, conductance) for every shared face.
+     */
+    template <typename Function>
+    void for_faces(const poisson_system& _system, int _cell, Function _body) const
+    {
+        const quadtree_cell& block = cells[_cell];
+        const int x0 = block.x, y0 = block.y, size = block.size;
+        // the pixel outside of the cell at step t along each side
+        auto outside = [&](int _side, int _t) {
+            switch (_side)
+            {
+            case 0:
+                return std::make_pair(x0 - 1, y0 + _t);
+            case 1:
+                return std::make_pair(x0 + size, y0 + _t);
+            case 2:
+                return std::make_pair(x0 + _t, y0 - 1);
+            default:
+                return std::make_pair(x0 + _t, y0 + size);
+            }
+        };
+        for (int side = 0; side < 4; side++)
+        {
+            for (int t = 0; t < size;)
+            {
+                std::pair<int, int> pixel = outside(side, t);
+                if (pixel.first < 0 || pixel.first >= width || pixel.second < 0 || pixel.second >= height)
+                    break;
+                int neighbor = cell_of(pixel.first, pixel.second), other = cells[neighbor].size, face = std::min(size, other);
+                t += face;
+                if (size == 1 && other == 1)
+                {
+                    const edge_barriers& barriers = _system.barriers;
+                    bool blocked = side == 0 ? barriers.blocked_left(x0, y0) : side == 1 ? barriers.blocked_right(x0, y0) : side == 2 ? barriers.blocked_up(x0, y0) : barriers.blocked_down(x0, y0);
+                    if (blocked)
+                        continue;
+                }
+                _body(neighbor, 2.0 * face / (size + other));
+            }
+        }
+    }
+
+    /**
+     * @brief Sets up the finite volume equations of the cells, eliminating the pinned pixels.
+     * @param _system Poisson system.
+     */
+    void build_finest(const poisson_system& _system)
+    {
+        multigrid_level& level = levels.front();
+        pinned.assign(width, height, color_type{ 0, 0, 0 });
+        nodes.assign(cells.size(), -1);
+        int num_nodes = 0;
+        for (size_t cell = 0; cell < cells.size(); cell++)
+        {
+            const quadtree_cell& block = cells[cell];
+            size_t i                   = (size_t)block.y * width + block.x;
+            if (block.size == 1 && is_pinned(_system, i))
+            {
+                pinned.data[i] = _system.constraints.colors.data[i];
+                continue;
+            }
+            color_type rhs;
+            if (block.size > 1 || pixel_equation(_system, block.x, block.y, rhs) != 0)
+                nodes[cell] = num_nodes++;
+        }
+        level.width  = 1;
+        level.height = 1;
+        level.first  = { 0, num_nodes };
+        level.allocate();
+        corners.front().resize(num_nodes);
+
+        parallel_for(0, (int)cells.size(), [&](int cell) {
+            int node = nodes[cell];
+            if (node < 0)
+                return;
+            for_faces(_system, cell, [&](int _neighbor, double) {
+                if (nodes[_neighbor] >= 0)
+                    level.offsets[node + 1]++;
+            });
+        });
+        for (size_t node = 0; node + 1 < level.offsets.size(); node++)
+            level.offsets[node + 1] += level.offsets[node];
+        level.neighbors.assign(level.offsets.back(), 0);
+        level.couplings.assign(level.offsets.back(), 0.f);
+
+        parallel_for(0, (int)cells.size(), [&](int cell) {
+            int node = nodes[cell];
+            if (node < 0)
+                return;
+            const quadtree_cell& block = cells[cell];
+            corners.front()[node]      = std::array<int, 2>{ { block.x, block.y } };
+            color_type rhs;
+            if (block.size == 1)
+            {
+                level.mass[node] = (float)(pixel_equation(_system, block.x, block.y, rhs) - _system.barriers.degree(block.x, block.y));
+            }
+            else
+            {
+                rhs = color_type{ 0, 0, 0 };
+                for (int y = block.y; y < block.y + block.size; y++)
+                    for (int x = block.x; x < block.x + block.size; x++)
+                        for (int c = 0; c < 3; c++)
+                            rhs[c] -= _system.source(x, y)[c];
+            }
+            int k = level.offsets[node];
+            for_faces(_system, cell, [&](int _neighbor, double _conductance) {
+                if (nodes[_neighbor] >= 0)
+                {
+                    level.neighbors[k]   = nodes[_neighbor];
+                    level.couplings[k++] = (float)_conductance;
+                    return;
+                }
+                level.dirichlet[node] += (float)_conductance;
+                const color_type& color = pinned(cells[_neighbor].x, cells[_neighbor].y);
+                for (int c = 0; c < 3; c++)
+                    rhs[c] += _conductance * color[c];
+            });
+            level.rhs[node] = rhs;
+        });
+        level.update_diagonal();
+    }
+
+    /**
+     * @brief Merges the connected components of the nodes in aligned blocks of 2^_level pixels into the nodes of the next coarser level.
+     * @details The couplings between two coarse nodes are half the sum of the fine couplings between their members, as in multigrid_solver.
+     * @param _level Index of the coarse level.
+     * @param _fine Fine level, whose parents are set.
+     * @param _fine_corners First pixels of the fine nodes.
+     * @param _coarse Output coarse level.
+     * @param _coarse_corners Output first pixels of the coarse nodes.
+     */
+    static void build_coarse(int _level, multigrid_level& _fine, const std::vector<std::array<int, 2>>& _fine_corners, multigrid_level& _coarse,
+                             std::vector<std::array<int, 2>>& _coarse_corners)
+    {
+        const int num_fine = _fine.num_nodes();
+        auto same_block    = [&](int _a, int _b) {
+            return (_fine_corners[_a][0] >> _level) == (_fine_corners[_b][0] >> _level) && (_fine_corners[_a][1] >> _level) == (_fine_corners[_b][1] >> _level);
+        };
+        std::vector<int> root(num_fine);
+        for (int node = 0; node < num_fine; node++)
+            root[node] = node;
+        auto find = [&](int _k) {
+            while (root[_k] != _k)
+                _k = root[_k] = root[root[_k]];
+            return _k;
+        };
+        for (int node = 0; node < num_fine; node++)
+            for (int k = _fine.offsets[node]; k < _fine.offsets[node + 1]; k++)
+                if (same_block(node, _fine.neighbors[k]))
+                    root[find(node)] = find(_fine.neighbors[k]);
+
+        std::vector<int> label(num_fine, -1);
+        _fine.parent.assign(num_fine, 0);
+        int num_coarse = 0;
+        for (int node = 0; node < num_fine; node++)
+        {
+            int component = find(node);
+            if (label[component] < 0)
+            {
+                label[component] = num_coarse++;
+                _coarse_corners.push_back(_fine_corners[node]);
+            }
+            _fine.parent[node] = label[component];
+        }
+        _coarse.width  = 1;
+        _coarse.height = 1;
+        _coarse.first  = { 0, num_coarse };
+        _coarse.allocate();
+
+        // members of every coarse node by counting sort
+        std::vector<int> member_offsets(num_coarse + 1, 0), members(num_fine);
+        for (int node = 0; node < num_fine; node++)
+            member_offsets[_fine.parent[node] + 1]++;
+        for (int node = 0; node < num_coarse; node++)
+            member_offsets[node + 1] += member_offsets[node];
+        std::vector<int> next(member_offsets.begin(), member_offsets.end() - 1);
+        for (int node = 0; node < num_fine; node++)
+            members[next[_fine.parent[node]]++] = node;
+
+        std::vector<std::pair<int, float>> couplings;
+        for (int node = 0; node < num_coarse; node++)
+        {
+            couplings.clear();
+            for (int m = member_offsets[node]; m < member_offsets[node + 1]; m++)
+            {
+                int member = members[m];
+                _coarse.mass[node] += _fine.mass[member];
+                _coarse.dirichlet[node] += _fine.dirichlet[member];
+                for (int k = _fine.offsets[member]; k < _fine.offsets[member + 1]; k++)
+                {
+                    int to = _fine.parent[_fine.neighbors[k]];
+                    if (to != node)
+                        couplings.push_back(std::make_pair(to, 0.5f * _fine.couplings[k]));
+                }
+            }
+            std::sort(couplings.begin(), couplings.end());
+            for (size_t k = 0; k < couplings.size(); k++)
+            {
+                if (k > 0 && couplings[k].first == couplings[k - 1].first)
+                {
+                    _coarse.couplings.back() += couplings[k].second;
+                    continue;
+                }
+                _coarse.neighbors.push_back(couplings[k].first);
+                _coarse.couplings.push_back(couplings[k].second);
+            }
+            _coarse.offsets[node + 1] = (int)_coarse.neighbors.size();
+        }
+        _coarse.update_diagonal();
+    }
+
+    /**
+     * @brief Sum of the squares of a field over all nodes and channels.
+     * @param _field Field of a level.
+     * @return Squared norm.
+     */
+    static double squared_norm(const std::vector<color_type>& _field)
+    {
+        double total = 0;
+        for (const color_type& value : _field)
+            for (int c = 0; c < 3; c++)
+                total += value[c] * value[c];
+        return total;
+    }
+
+    /**
+     * @brief Computes the residual b - A u of a level.
+     * @param _level Level.
+     */
+    static void compute_residual(multigrid_level& _level)
+    {
+        parallel_for(0, _level.num_nodes(), [&](int i) {
+            color_type sum = _level.neighbor_sum(_level.solution, i);
+            for (int c = 0; c < 3; c++)
+                _level.residual[i][c] = _level.rhs[i][c] + sum[c] - _level.diagonal[i] * _level.solution[i][c];
+        });
+    }
+
+    /**
+     * @brief Gauss-Seidel sweeps over a level in the order of the nodes, forward before and backward after the coarse-grid correction, which keeps the cycle symmetric.
+     * @param _level Level.
+     * @param _sweeps Number of sweeps.
+     * @param _forward Direction of the sweeps.
+     */
+    static void gauss_seidel(multigrid_level& _level, int _sweeps, bool _forward)
+    {
+        const int num_nodes = _level.num_nodes();
+        for (int sweep = 0; sweep < _sweeps; sweep++)
+        {
+            for (int k = 0; k < num_nodes; k++)
+            {
+                int i = _forward ? k : num_nodes - 1 - k;
+                if (_level.diagonal[i] == 0)
+                    continue;
+                color_type sum = _level.neighbor_sum(_level.solution, i);
+                for (int c = 0; c < 3; c++)
+                    _level.solution[i][c] = (_level.rhs[i][c] + sum[c]) / _level.diagonal[i];
+            }
+        }
+    }
+
+    /**
+     * @brief Runs one cycle on a level and all coarser ones.
+     * @details The correction is prolongated from the coarse nodes of every fine node and its neighbors and added with the step that minimizes the error in the energy norm, see multigrid_solver::apply_correction.
+     * @param _level Index of the level, zero being the finest.
+     */
+    void cycle(int _level)
+    {
+        multigrid_level& level = levels[_level];
+        if (_level + 1 == (int)levels.size())
+        {
+            solve_coarsest();
+            return;
+        }
+        gauss_seidel(level, options.multigrid.pre_smoothing, true);
+        compute_residual(level);
+        multigrid_level& coarse = levels[_level + 1];
+        std::fill(coarse.rhs.begin(), coarse.rhs.end(), color_type{ 0, 0, 0 });
+        for (int i = 0; i < level.num_nodes(); i++)
+            for (int c = 0; c < 3; c++)
+                coarse.rhs[level.parent[i]][c] += level.residual[i][c];
+        std::fill(coarse.solution.begin(), coarse.solution.end(), color_type{ 0, 0, 0 });
+        int corrections = options.multigrid.cycle == multigrid_cycle::w ? 2 : 1;
+        for (int k = 0; k < corrections; k++)
+            cycle(_level + 1);
+
+        // half the coarse value of the node and half the average over its neighbors in other coarse nodes, weighted by their couplings
+        parallel_for(0, level.num_nodes(), [&](int i) {
+            const color_type& center = coarse.solution[level.parent[i]];
+            color_type sum           = { 0, 0, 0 };
+            double total             = 0;
+            for (int k = level.offsets[i]; k < level.offsets[i + 1]; k++)
+            {
+                int other = level.parent[level.neighbors[k]];
+                if (other == level.parent[i])
+                    continue;
+                for (int c = 0; c < 3; c++)
+                    sum[c] += level.couplings[k] * coarse.solution[other][c];
+                total += level.couplings[k];
+            }
+            for (int c = 0; c < 3; c++)
+                level.correction[i][c] = total > 0 ? 0.5 * center[c] + 0.5 * sum[c] / total : center[c];
+        });
+        color_type numerator = { 0, 0, 0 }, denominator = { 0, 0, 0 };
+        for (int i = 0; i < level.num_nodes(); i++)
+        {
+            color_type sum = level.neighbor_sum(level.correction, i);
+            for (int c = 0; c < 3; c++)
+            {
+                numerator[c] += level.residual[i][c] * level.correction[i][c];
+                denominator[c] += level.correction[i][c] * (level.diagonal[i] * level.correction[i][c] - sum[c]);
+            }
+        }
+        for (int i = 0; i < level.num_nodes(); i++)
+            for (int c = 0; c < 3; c++)
+                level.solution[i][c] += (denominator[c] > 0 ? numerator[c] / denominator[c] : 0) * level.correction[i][c];
+        gauss_seidel(level, options.multigrid.post_smoothing, false);
+    }
+};
+
+/**
+ * @brief Solves a Poisson system on an adaptive quadtree, see quadtree_solver.
+ * @param _system Poisson system.
+ * @param _options Parameters of the solver.
+ * @param _stats Optional output of the number of cycles, the residual history on the cells and the time including the construction of the quadtree.
+ * @param _initial_guess Optional warm start, sampled at the centers of the cells; resampled first if its size differs.
+ * @return Solution.
+ */
+inline image solve_quadtree(const poisson_system& _system, const quadtree_options& _options, solver_statistics* _stats = nullptr, const image* _initial_guess = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    quadtree_solver solver(_system, _options);
+    image solution;
+    if (_initial_guess != nullptr)
+        warm_start_solution(_system, *_initial_guess, solution);
+    solver.solve(solution, _stats);
+    if (_stats != nullptr)
+        _stats->solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    return solution;
+}
@@ -120,6 +120,15 @@ struct gradient_mesh
 class scene
 {
 public:
+    /**
+     * @brief Creates an empty scene, e.g., to fill it programmatically.
+     */
+    scene()
+        : height(0)
+        , width(0)
+    {
+    }
+
     /**
      * @brief Read XML file with diffusion curves, Poisson curves, and gradient meshes.
      * @param _path Path to the file to read.
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "image.hpp"
+#include "multigrid.hpp"
+#include "pcg.hpp"
+#include "poisson.hpp"
+#include "pyramid.hpp"
+#include "quadtree.hpp"
+#include "solution_cache.hpp"
+#include "solver.hpp"
+#include "spectral.hpp"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Solver of the Poisson system of a rendering.
+ */
+enum class render_method
+{
+    /**
+     * @brief Relaxation with nested iteration, see solve_reference.
+     */
+    reference,
+    /**
+     * @brief Geometric multigrid cycles, see solve_multigrid.
+     */
+    multigrid,
+    /**
+     * @brief Preconditioned conjugate gradients, see solve_pcg.
+     */
+    pcg,
+    /**
+     * @brief Fast trigonometric transforms for rectangular systems, see solve_spectral; falls back to multigrid for other systems.
+     */
+    spectral,
+    /**
+     * @brief Multigrid on an adaptive quadtree that merges the pixels far from the curves, see solve_quadtree; approximate, with errors of a few 8-bit steps next to the curves.
+     */
+    quadtree,
+    /**
+     * @brief Spectral solver for scenes without diffusion curves whose systems are rectangles, such as plain gradient mesh backgrounds, and multigrid otherwise.
+     */
+    automatic
+};
+
+/**
+ * @brief Parameters of the rendering of a scene.
+ */
+struct render_options
+{
+    /**
+     * @brief Width of the image in pixels; zero uses the width of the scene.
+     */
+    int width = 0;
+    /**
+     * @brief Height of the image in pixels; zero uses the height of the scene.
+     */
+    int height = 0;
+    /**
+     * @brief Parameters of the assembly of the Poisson systems.
+     */
+    assembly_options assembly;
+    /**
+     * @brief Solver of the Poisson system.
+     */
+    render_method method = render_method::reference;
+    /**
+     * @brief Parameters of the reference solver.
+     */
+    solver_options solver;
+    /**
+     * @brief Parameters of the multigrid solver.
+     */
+    multigrid_options multigrid;
+    /**
+     * @brief Parameters of the conjugate gradient solver.
+     */
+    pcg_options pcg;
+    /**
+     * @brief Parameters of the quadtree solver.
+     */
+    quadtree_options quadtree;
+};
+
+/**
+ * @brief Timings and convergence of a rendering.
+ */
+struct render_statistics
+{
+    /**
+     * @brief Time for assembling the Poisson systems, in milliseconds.
+     */
+    double assembly_ms = 0;
+    /**
+     * @brief Time for the whole rendering, in milliseconds.
+     */
+    double total_ms = 0;
+    /**
+     * @brief Convergence history and solve time; the iterations are cycles for multigrid and the quadtree and iterations for conjugate gradients, and zero for the spectral solver.
+     */
+    solver_statistics solver;
+    /**
+     * @brief True if the solver started from an initial guess instead of black.
+     */
+    bool warm_start = false;
+};
+
+/**
+ * @brief Renders a scene with diffusion curves, Poisson curves and gradient meshes into an image.
+ * @details Assembles the Poisson system of the scene and solves it until the relative residual reaches the tolerance. The reference solver relaxes a pyramid of systems with nested iteration, which is slow, but simple enough to serve as ground truth for faster solvers. The multigrid, conjugate gradient, spectral and quadtree solvers only work on the finest system.
+ * @param _scene Scene to render.
+ * @param _options Parameters of the rendering.
+ * @param _stats Optional output of the timings and the convergence history.
+ * @param _initial_guess Optional warm start of the iterative solvers, e.g., the rendering before an edit of the scene, at any resolution; it replaces the nested iteration of the reference solver, and the spectral solver ignores it.
+ * @return Rendered image.
+ */
+inline image render(const scene& _scene, const render_options& _options, render_statistics* _stats = nullptr, const image* _initial_guess = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    int width  = _options.width > 0 ? _options.width : _scene.width;
+    int height = _options.height > 0 ? _options.height : _scene.height;
+
+    render_statistics stats;
+    std::vector<poisson_system> levels;
+    if (_options.method == render_method::reference && _options.solver.nested && _initial_guess == nullptr)
+    {
+        pyramid_options pyramid;
+        pyramid.min_size = _options.solver.min_level_size;
+        pyramid.assembly = _options.assembly;
+        levels = build_poisson_pyramid(_scene, width, height, pyramid);
+    }
+    else
+        levels.push_back(assemble_poisson_system(_scene, width, height, _options.assembly));
+    stats.assembly_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    image result;
+    bool spectral = _options.method == render_method::spectral || (_options.method == render_method::automatic && _scene.diffusion_curves.empty());
+    stats.warm_start = _initial_guess != nullptr;
+    if (spectral && solve_spectral(levels.front(), result, &stats.solver))
+        stats.warm_start = false;
+    else if (_options.method == render_method::reference)
+        result = solve_reference(levels, _options.solver, &stats.solver, _initial_guess);
+    else if (_options.method == render_method::pcg)
+        result = solve_pcg(levels.front(), _options.pcg, &stats.solver, _initial_guess);
+    else if (_options.method == render_method::quadtree)
+        result = solve_quadtree(levels.front(), _options.quadtree, &stats.solver, _initial_guess);
+    else
+        result = solve_multigrid(levels.front(), _options.multigrid, &stats.solver, _initial_guess);
+    stats.total_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if (_stats != nullptr)
+        *_stats = stats;
+    return result;
+}
+
+/**
+ * @brief Renders a scene, warm-starting the solver from the last rendering under the same key and storing the result for the next one.
+ * @param _scene Scene to render.
+ * @param _options Parameters of the rendering.
+ * @param _cache Solutions of previous renderings.
+ * @param _key Identity of the scene, e.g., the path of its file; edits of a scene keep the key.
+ * @param _stats Optional output of the timings and the convergence history.
+ * @return Rendered image.
+ */
+inline image render(const scene& _scene, const render_options& _options, solution_cache& _cache, const std::string& _key, render_statistics* _stats = nullptr)
+{
+    image result = render(_scene, _options, _stats, _cache.find(_key));
+    _cache.store(_key, result);
+    return result;
+}
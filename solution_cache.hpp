@@ -0,0 +1,109 @@
+#pragma once
+
+#include "image.hpp"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Least recently used solutions of the Poisson solvers, keyed by the identity of a scene, e.g., the path of its file or the name of a document.
+ * @details An interactive editor or a sequence of similar scenes renders under the same key repeatedly. The solution of the last rendering is close to the next one, so it serves as the initial guess of the solver, which then only has to remove the error of the change instead of building the whole image up from black. Solutions at another resolution are resampled by the solvers.
+ */
+class solution_cache
+{
+public:
+    /**
+     * @brief Creates an empty cache.
+     * @param _capacity Maximum number of solutions; the least recently used one is evicted beyond.
+     */
+    explicit solution_cache(size_t _capacity = 16)
+        : capacity(_capacity)
+        , hits(0)
+        , misses(0)
+    {
+    }
+
+    /**
+     * @brief Looks up the last solution of a scene and marks it as recently used.
+     * @param _key Identity of the scene.
+     * @return Pointer to the solution, valid until the next call to store or clear; null if the scene is not cached.
+     */
+    const image* find(const std::string& _key)
+    {
+        auto entry = index.find(_key);
+        if (entry == index.end())
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, entry->second);
+        return &entry->second->second;
+    }
+
+    /**
+     * @brief Stores the solution of a scene, replacing the previous one.
+     * @param _key Identity of the scene.
+     * @param _solution Solution.
+     */
+    void store(const std::string& _key, const image& _solution)
+    {
+        auto entry = index.find(_key);
+        if (entry != index.end())
+        {
+            entry->second->second = _solution;
+            entries.splice(entries.begin(), entries, entry->second);
+            return;
+        }
+        entries.emplace_front(_key, _solution);
+        index[_key] = entries.begin();
+        while (entries.size() > capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    /**
+     * @brief Removes all solutions.
+     */
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+
+    /**
+     * @brief Number of cached solutions.
+     * @return Number of entries.
+     */
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    /**
+     * @brief Maximum number of solutions.
+     */
+    size_t capacity;
+    /**
+     * @brief Number of lookups that found a solution.
+     */
+    long long hits;
+    /**
+     * @brief Number of lookups that found nothing.
+     */
+    long long misses;
+
+private:
+    /**
+     * @brief Keys and solutions from the most to the least recently used.
+     */
+    std::list<std::pair<std::string, image>> entries;
+    /**
+     * @brief Position of every key in the list.
+     */
+    std::unordered_map<std::string, std::list<std::pair<std::string, image>>::iterator> index;
+};
@@ -0,0 +1,416 @@
+#pragma once
+
+#include "image.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "sor.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Relaxation method of the reference solver.
+ */
+enum class relaxation
+{
+    /**
+     * @brief Lexicographic Gauss-Seidel, serial.
+     */
+    gauss_seidel,
+    /**
+     * @brief Damped Jacobi, parallel over rows.
+     */
+    jacobi,
+    /**
+     * @brief Red-black successive over-relaxation in single precision, vectorized, cache-blocked and parallel over the channels.
+     */
+    red_black_sor
+};
+
+/**
+ * @brief Parameters of the reference solver.
+ */
+struct solver_options
+{
+    /**
+     * @brief Relaxation method.
+     */
+    relaxation method = relaxation::gauss_seidel;
+    /**
+     * @brief The solver stops once the residual norm relative to the norm of the right-hand side falls below this value.
+     */
+    double tolerance = 1e-4;
+    /**
+     * @brief Maximum number of sweeps per level.
+     */
+    int max_iterations = 20000;
+    /**
+     * @brief Number of sweeps between two residual evaluations.
+     */
+    int check_interval = 10;
+    /**
+     * @brief Damping of the Jacobi sweeps.
+     */
+    double jacobi_weight = 0.8;
+    /**
+     * @brief Relaxation factor of the red-black SOR sweeps; zero follows the Chebyshev schedule towards the optimal factor of the spectral radius that red_black_sor::jacobi_radius estimates for each level, and a negative value uses that optimal factor throughout.
+     */
+    double omega = 0;
+    /**
+     * @brief Number of red-black SOR sweeps that are fused into one pass over the rows.
+     */
+    int sweeps_per_pass = 4;
+    /**
+     * @brief Solve a pyramid of coarser systems first and use their interpolated solutions as initial guesses (nested iteration).
+     */
+    bool nested = true;
+    /**
+     * @brief Size in pixels of the shorter side of the coarsest level of the nested iteration.
+     */
+    int min_level_size = 16;
+};
+
+/**
+ * @brief Convergence history of a solve.
+ */
+struct solver_statistics
+{
+    /**
+     * @brief Number of sweeps on the finest level.
+     */
+    int iterations = 0;
+    /**
+     * @brief Number of sweeps on the coarser levels of the nested iteration.
+     */
+    int coarse_iterations = 0;
+    /**
+     * @brief Relative residual of the finest level after every check, starting with the initial guess.
+     */
+    std::vector<double> residuals;
+    /**
+     * @brief Largest change of a color channel by every multigrid cycle, including the cycles of a full multigrid pass on the coarser levels.
+     */
+    std::vector<double> color_changes;
+    /**
+     * @brief True if the tolerance was reached on the finest level.
+     */
+    bool converged = false;
+    /**
+     * @brief Time for solving, in milliseconds.
+     */
+    double solve_ms = 0;
+};
+
+/**
+ * @brief Checks whether a pixel is pinned to its constraint color, i.e., has a constraint of full weight.
+ * @param _system Poisson system.
+ * @param _index Linear pixel index.
+ * @return True for a hard Dirichlet pixel.
+ */
+inline bool is_pinned(const poisson_system& _system, size_t _index)
+{
+    return _system.constraints.mask.data[_index] && _system.constraints.weights.data[_index] >= 1;
+}
+
+/**
+ * @brief Diagonal and right-hand side of the equation of a pixel that is not pinned.
+ * @details With the open neighbors N, the weight w of a soft constraint (zero without constraint) and a = w / (1 - w), the equation reads (|N| + a) u - sum_N u_n = a c - F.
+ * @param _system Poisson system.
+ * @param _x Column.
+ * @param _y Row.
+ * @param _rhs Output right-hand side per channel.
+ * @return Diagonal of the equation; zero for pixels that are neither connected nor constrained.
+ */
+inline double pixel_equation(const poisson_system& _system, int _x, int _y, color_type& _rhs)
+{
+    size_t i = _system.constraints.mask.index(_x, _y);
+    double alpha = 0;
+    if (_system.constraints.mask.data[i])
+    {
+        double weight = _system.constraints.weights.data[i];
+        alpha         = weight / (1 - weight);
+    }
+    for (int c = 0; c < 3; c++)
+        _rhs[c] = alpha * _system.constraints.colors.data[i][c] - _system.source.data[i][c];
+    return _system.barriers.degree(_x, _y) + alpha;
+}
+
+/**
+ * @brief Sum of the values of the open neighbors of a pixel.
+ * @param _system Poisson system with the barriers.
+ * @param _solution Current solution.
+ * @param _x Column.
+ * @param _y Row.
+ * @return Sum per channel.
+ */
+inline color_type neighbor_sum(const poisson_system& _system, const image& _solution, int _x, int _y)
+{
+    color_type sum = { 0, 0, 0 };
+    const edge_barriers& barriers = _system.barriers;
+    auto add = [&](int _nx, int _ny) {
+        const color_type& value = _solution(_nx, _ny);
+        for (int c = 0; c < 3; c++)
+            sum[c] += value[c];
+    };
+    if (!barriers.blocked_left(_x, _y))
+        add(_x - 1, _y);
+    if (!barriers.blocked_right(_x, _y))
+        add(_x + 1, _y);
+    if (!barriers.blocked_up(_x, _y))
+        add(_x, _y - 1);
+    if (!barriers.blocked_down(_x, _y))
+        add(_x, _y + 1);
+    return sum;
+}
+
+/**
+ * @brief Prepares a solution for the iteration: resizes it to the system if needed (black) and sets the pinned pixels to their colors.
+ * @param _system Poisson system.
+ * @param _solution Initial guess, modified in place.
+ */
+inline void initialize_solution(const poisson_system& _system, image& _solution)
+{
+    if (_solution.width != _system.width || _solution.height != _system.height)
+        _solution.assign(_system.width, _system.height, color_type{ 0, 0, 0 });
+    for (size_t i = 0; i < _solution.data.size(); i++)
+        if (is_pinned(_system, i))
+            _solution.data[i] = _system.constraints.colors.data[i];
+}
+
+/**
+ * @brief Squared norm of the residual b - A u over the pixels that are not pinned.
+ * @param _system Poisson system.
+ * @param _solution Current solution, with the pinned pixels set.
+ * @param _residual Optional output of the residual per pixel; zero at pinned pixels.
+ * @return Sum of the squared residuals over all channels.
+ */
+inline double residual_squared_norm(const poisson_system& _system, const image& _solution, image* _residual = nullptr)
+{
+    if (_residual != nullptr)
+        _residual->assign(_system.width, _system.height, color_type{ 0, 0, 0 });
+    std::vector<double> row_sums(_system.height, 0.0);
+    parallel_for(0, _system.height, [&](int y) {
+        for (int x = 0; x < _system.width; x++)
+        {
+            size_t i = _solution.index(x, y);
+            if (is_pinned(_system, i))
+                continue;
+            color_type rhs;
+            double diagonal = pixel_equation(_system, x, y, rhs);
+            if (diagonal == 0)
+                continue;
+            color_type sum = neighbor_sum(_system, _solution, x, y);
+            for (int c = 0; c < 3; c++)
+            {
+                double r = rhs[c] + sum[c] - diagonal * _solution.data[i][c];
+                row_sums[y] += r * r;
+                if (_residual != nullptr)
+                    _residual->data[i][c] = r;
+            }
+        }
+    });
+    double total = 0;
+    for (double sum : row_sums)
+        total += sum;
+    return total;
+}
+
+/**
+ * @brief Norm of the right-hand side, i.e., the residual of the solution that is zero except at the pinned pixels.
+ * @param _system Poisson system.
+ * @return Norm over all channels.
+ */
+inline double right_hand_side_norm(const poisson_system& _system)
+{
+    image zero;
+    initialize_solution(_system, zero);
+    return std::sqrt(residual_squared_norm(_system, zero));
+}
+
+/**
+ * @brief One lexicographic Gauss-Seidel sweep over the pixels that are not pinned.
+ * @param _system Poisson system.
+ * @param _solution Solution, updated in place.
+ */
+inline void gauss_seidel_sweep(const poisson_system& _system, image& _solution)
+{
+    for (int y = 0; y < _system.height; y++)
+    {
+        for (int x = 0; x < _system.width; x++)
+        {
+            size_t i = _solution.index(x, y);
+            if (is_pinned(_system, i))
+                continue;
+            color_type rhs;
+            double diagonal = pixel_equation(_system, x, y, rhs);
+            if (diagonal == 0)
+                continue;
+            color_type sum = neighbor_sum(_system, _solution, x, y);
+            for (int c = 0; c < 3; c++)
+                _solution.data[i][c] = (rhs[c] + sum[c]) / diagonal;
+        }
+    }
+}
+
+/**
+ * @brief One damped Jacobi sweep over the pixels that are not pinned, parallel over rows.
+ * @param _system Poisson system.
+ * @param _solution Solution, updated in place.
+ * @param _buffer Buffer for the previous solution.
+ * @param _weight Damping weight in (0,1].
+ */
+inline void jacobi_sweep(const poisson_system& _system, image& _solution, image& _buffer, double _weight)
+{
+    _buffer = _solution;
+    parallel_for(0, _system.height, [&](int y) {
+        for (int x = 0; x < _system.width; x++)
+        {
+            size_t i = _solution.index(x, y);
+            if (is_pinned(_system, i))
+                continue;
+            color_type rhs;
+            double diagonal = pixel_equation(_system, x, y, rhs);
+            if (diagonal == 0)
+                continue;
+            color_type sum = neighbor_sum(_system, _buffer, x, y);
+            for (int c = 0; c < 3; c++)
+                _solution.data[i][c] = (1 - _weight) * _buffer.data[i][c] + _weight * (rhs[c] + sum[c]) / diagonal;
+        }
+    });
+}
+
+/**
+ * @brief Interpolates a solution bilinearly to another grid, e.g., from one level of a pyramid to the next.
+ * @param _coarse Coarse solution.
+ * @param _width Width of the fine grid.
+ * @param _height Height of the fine grid.
+ * @param _fine Output fine solution.
+ */
+inline void interpolate_solution(const image& _coarse, int _width, int _height, image& _fine)
+{
+    _fine.assign(_width, _height, color_type{ 0, 0, 0 });
+    double sx = (double)_coarse.width / _width, sy = (double)_coarse.height / _height;
+    parallel_for(0, _height, [&](int y) {
+        double cy = std::min((double)_coarse.height - 1, std::max(0.0, (y + 0.5) * sy - 0.5));
+        int y0 = (int)cy, y1 = std::min(_coarse.height - 1, y0 + 1);
+        double fy = cy - y0;
+        for (int x = 0; x < _width; x++)
+        {
+            double cx = std::min((double)_coarse.width - 1, std::max(0.0, (x + 0.5) * sx - 0.5));
+            int x0 = (int)cx, x1 = std::min(_coarse.width - 1, x0 + 1);
+            double fx = cx - x0;
+            for (int c = 0; c < 3; c++)
+                _fine(x, y)[c] = (1 - fy) * ((1 - fx) * _coarse(x0, y0)[c] + fx * _coarse(x1, y0)[c]) + fy * ((1 - fx) * _coarse(x0, y1)[c] + fx * _coarse(x1, y1)[c]);
+        }
+    });
+}
+
+/**
+ * @brief Turns the solution of a previous solve, e.g., before a small edit of the scene, into the initial guess of a system.
+ * @param _system Poisson system.
+ * @param _guess Previous solution; resampled bilinearly if its resolution differs from the system.
+ * @param _solution Output initial guess with the pinned pixels set.
+ */
+inline void warm_start_solution(const poisson_system& _system, const image& _guess, image& _solution)
+{
+    if (_guess.width == _system.width && _guess.height == _system.height)
+        _solution = _guess;
+    else
+        interpolate_solution(_guess, _system.width, _system.height, _solution);
+    initialize_solution(_system, _solution);
+}
+
+/**
+ * @brief Relaxes a Poisson system until the relative residual falls below the tolerance.
+ * @param _system Poisson system.
+ * @param _solution Initial guess on input (resized and black if it does not match), solution on output.
+ * @param _options Parameters of the relaxation.
+ * @param _history Optional output of the relative residual after every check.
+ * @return Number of sweeps, negated if the tolerance was not reached.
+ */
+inline int relax_poisson_system(const poisson_system& _system, image& _solution, const solver_options& _options, std::vector<double>* _history = nullptr)
+{
+    initialize_solution(_system, _solution);
+    double norm = right_hand_side_norm(_system);
+    if (norm == 0)
+        norm = 1;
+    image buffer;
+    std::unique_ptr<red_black_sor> sor;
+    if (_options.method == relaxation::red_black_sor)
+    {
+        sor.reset(new red_black_sor(_system));
+        sor->load(_solution);
+    }
+    int interval = std::max(1, _options.check_interval);
+    for (int iteration = 0;; iteration += interval)
+    {
+        double relative = std::sqrt(sor ? sor->residual_squared_norm() : residual_squared_norm(_system, _solution)) / norm;
+        if (_history != nullptr)
+            _history->push_back(relative);
+        if (relative <= _options.tolerance || iteration >= _options.max_iterations)
+        {
+            if (sor)
+                sor->store(_solution);
+            return relative <= _options.tolerance ? iteration : -iteration;
+        }
+        if (sor)
+        {
+            sor->sweep(interval, _options.omega, _options.sweeps_per_pass);
+            continue;
+        }
+        for (int sweep = 0; sweep < interval; sweep++)
+        {
+            if (_options.method == relaxation::gauss_seidel)
+                gauss_seidel_sweep(_system, _solution);
+            else
+                jacobi_sweep(_system, _solution, buffer, _options.jacobi_weight);
+        }
+    }
+}
+
+/**
+ * @brief Solves a pyramid of Poisson systems from the coarsest to the finest level, starting each level from the interpolated solution of the previous one.
+ * @param _levels Systems from the finest to the coarsest level, e.g., from build_poisson_pyramid.
+ * @param _options Parameters of the relaxation.
+ * @param _stats Optional output of the convergence history.
+ * @param _initial_guess Optional warm start, see warm_start_solution, which replaces the nested iteration: only the finest level is relaxed.
+ * @return Solution of the finest level.
+ */
+inline image solve_reference(const std::vector<poisson_system>& _levels, const solver_options& _options, solver_statistics* _stats = nullptr,
+                             const image* _initial_guess = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    solver_statistics stats;
+    image solution, coarse;
+    int first_level = (int)_levels.size() - 1;
+    if (_initial_guess != nullptr)
+    {
+        warm_start_solution(_levels.front(), *_initial_guess, solution);
+        first_level = 0;
+    }
+    for (int level = first_level; level >= 0; level--)
+    {
+        if (level < first_level)
+            interpolate_solution(coarse, _levels[level].width, _levels[level].height, solution);
+        int iterations = relax_poisson_system(_levels[level], solution, _options, level == 0 ? &stats.residuals : nullptr);
+        if (level == 0)
+        {
+            stats.iterations = std::abs(iterations);
+            stats.converged  = iterations >= 0 && !stats.residuals.empty() && stats.residuals.back() <= _options.tolerance;
+        }
+        else
+        {
+            stats.coarse_iterations += std::abs(iterations);
+            std::swap(coarse, solution);
+        }
+    }
+    stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    if (_stats != nullptr)
+        *_stats = stats;
+    return solution;
+}
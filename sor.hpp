@@ -0,0 +1,432 @@
+#pragma once
+
+#include "image.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Red-black successive over-relaxation of a Poisson system, with the unknowns stored per channel and color for vectorized, cache-blocked sweeps.
+ * @details A pixel (x,y) is red if x + y is even and black otherwise. Every row of a channel is split into its red and its black pixels, each stored contiguously, such that the pixel at index k of a row of one color has its upper and lower neighbors at index k of the other color in the rows above and below, and its left and right neighbors at index k-1 and k, or k and k+1, depending on the parity of the row. Each pixel stores its equation as a mask with the open neighbors and a bit for free pixels, the inverse diagonal and the right-hand side. The sweeps update a row of one color with eight pixels per AVX2 instruction if the compiler targets AVX2, and with a scalar loop otherwise. Pinned pixels, unconnected pixels and the padding are masked out of the update, so they keep their values.
+ *
+ * A full sweep relaxes all red pixels and then all black pixels. Instead of streaming the image twice per sweep, several sweeps are fused into one pass over the rows: at each step, sweep s relaxes the red pixels of row y - 2s and the black pixels of the row above. Every update still sees exactly the values it would see in consecutive full sweeps, so the result does not depend on the fusion, while only a few rows per sweep need to stay in the cache. The three channels are independent and are relaxed in parallel.
+ *
+ * Within a channel, the rows are split into one band per thread. Since a half-sweep only reads the rows next to the ones it updates, the updates of a pass at one row depend on a cone of rows that widens by one row per half-sweep. Each band first runs the pass on a trapezoid that shrinks by one row per half-sweep at its inner boundaries and depends on nothing outside the band. Then the inverted trapezoids across the boundaries complete the pass, again all in parallel. The result is the same as that of the sequential sweeps.
+ */
+class red_black_sor
+{
+public:
+    /**
+     * @brief Bit of the mask that marks a pixel whose value is relaxed.
+     */
+    static const unsigned char free_bit = 16;
+
+    /**
+     * @brief Converts a Poisson system into the layout of the smoother.
+     * @param _system Poisson system.
+     */
+    explicit red_black_sor(const poisson_system& _system)
+        : width(_system.width)
+        , height(_system.height)
+        , half_width((_system.width + 1) / 2)
+        , stride((_system.width + 1) / 2 + 2)
+        , radius(jacobi_radius(_system))
+        , num_half_sweeps(0)
+        , schedule(1)
+    {
+        size_t plane = (size_t)(height + 2) * stride;
+        for (int color = 0; color < 2; color++)
+        {
+            masks[color].assign(plane, 0);
+            inverse_diagonals[color].assign(plane, 0.f);
+            for (int c = 0; c < 3; c++)
+            {
+                values[color][c].assign(plane, 0.f);
+                rhs[color][c].assign(plane, 0.f);
+            }
+        }
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                int color    = (x + y) & 1;
+                size_t index = offset(y, x / 2);
+                size_t i     = _system.constraints.mask.index(x, y);
+                if (_system.constraints.mask.data[i] && _system.constraints.weights.data[i] >= 1)
+                {
+                    for (int c = 0; c < 3; c++)
+                        values[color][c][index] = (float)_system.constraints.colors.data[i][c];
+                    continue;
+                }
+                // soft constraints add a = w / (1 - w) to the diagonal and a c to the right-hand side
+                double alpha = 0;
+                if (_system.constraints.mask.data[i])
+                    alpha = _system.constraints.weights.data[i] / (1 - _system.constraints.weights.data[i]);
+                const edge_barriers& barriers = _system.barriers;
+                double diagonal               = barriers.degree(x, y) + alpha;
+                if (diagonal == 0)
+                    continue;
+                masks[color][index] = (unsigned char)(free_bit | (barriers.blocked_left(x, y) ? 0 : 1) | (barriers.blocked_right(x, y) ? 0 : 2) |
+                                                      (barriers.blocked_up(x, y) ? 0 : 4) | (barriers.blocked_down(x, y) ? 0 : 8));
+                inverse_diagonals[color][index] = (float)(1 / diagonal);
+                for (int c = 0; c < 3; c++)
+                    rhs[color][c][index] = (float)(alpha * _system.constraints.colors.data[i][c] - _system.source.data[i][c]);
+            }
+        });
+    }
+
+    /**
+     * @brief Copies a solution into the smoother and restarts the Chebyshev schedule. Pinned pixels keep their constraint colors.
+     * @param _solution Solution of the size of the system.
+     */
+    void load(const image& _solution)
+    {
+        num_half_sweeps = 0;
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                int color    = (x + y) & 1;
+                size_t index = offset(y, x / 2);
+                if (masks[color][index] & free_bit)
+                    for (int c = 0; c < 3; c++)
+                        values[color][c][index] = (float)_solution(x, y)[c];
+            }
+        });
+    }
+
+    /**
+     * @brief Copies the current values of all pixels into a solution.
+     * @param _solution Output solution, resized to the system.
+     */
+    void store(image& _solution) const
+    {
+        _solution.assign(width, height, color_type{ 0, 0, 0 });
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+            {
+                size_t index = offset(y, x / 2);
+                for (int c = 0; c < 3; c++)
+                    _solution(x, y)[c] = values[(x + y) & 1][c][index];
+            }
+        });
+    }
+
+    /**
+     * @brief Relaxes all channels with a number of red-black sweeps.
+     * @param _count Number of sweeps.
+     * @param _omega Relaxation factor in (0,2), where one gives red-black Gauss-Seidel; zero follows the Chebyshev schedule, and a negative value uses the optimal factor of the estimated spectral radius throughout.
+     * @param _sweeps_per_pass Number of sweeps that are fused into one pass over the rows.
+     */
+    void sweep(int _count, double _omega, int _sweeps_per_pass = 4)
+    {
+        // relaxation factor of every half-sweep, red before black
+        std::vector<float> omegas(2 * std::max(0, _count));
+        for (size_t half = 0; half < omegas.size(); half++, num_half_sweeps++)
+        {
+            schedule     = chebyshev_omega(num_half_sweeps, schedule, radius);
+            omegas[half] = (float)(_omega > 0 ? _omega : _omega < 0 ? optimal_omega() : schedule);
+        }
+
+        // bands of at least twice the height of the cones of the fused sweeps, so that the inverted trapezoids of neighboring boundaries do not overlap
+        int num_bands = std::max(1, std::min(num_worker_threads(), height / (8 * std::max(1, _sweeps_per_pass))));
+        for (int done = 0; done < _count;)
+        {
+            int fused                = std::max(1, std::min(_sweeps_per_pass, _count - done));
+            const float* pass_omegas = omegas.data() + 2 * done;
+            parallel_for(0, 3 * num_bands, [&](int task) {
+                int band = task / 3;
+                relax_wavefront(task % 3, fused, pass_omegas, band_begin(band, num_bands), band_begin(band + 1, num_bands), band > 0 ? 1 : 0, band + 1 < num_bands ? -1 : 0);
+            });
+            parallel_for(0, 3 * (num_bands - 1), [&](int task) {
+                int boundary = band_begin(task / 3 + 1, num_bands);
+                relax_wavefront(task % 3, fused, pass_omegas, boundary, boundary, -1, 1);
+            });
+            done += fused;
+        }
+    }
+
+    /**
+     * @brief Squared norm of the residual b - A u over the free pixels, as in the reference solver.
+     * @return Sum of the squared residuals over all channels.
+     */
+    double residual_squared_norm() const
+    {
+        std::vector<double> row_sums(height, 0.0);
+        parallel_for(0, height, [&](int y) {
+            for (int color = 0; color < 2; color++)
+            {
+                int left = neighbor_shift(color, y);
+                for (int k = 0; k < half_width; k++)
+                {
+                    size_t index       = offset(y, k);
+                    unsigned char mask = masks[color][index];
+                    if (!(mask & free_bit))
+                        continue;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        const std::vector<float>& other = values[1 - color][c];
+                        double sum = 0;
+                        if (mask & 1)
+                            sum += other[index + left];
+                        if (mask & 2)
+                            sum += other[index + left + 1];
+                        if (mask & 4)
+                            sum += other[index - stride];
+                        if (mask & 8)
+                            sum += other[index + stride];
+                        double r = rhs[color][c][index] + sum - values[color][c][index] / inverse_diagonals[color][index];
+                        row_sums[y] += r * r;
+                    }
+                }
+            }
+        });
+        double total = 0;
+        for (double sum : row_sums)
+            total += sum;
+        return total;
+    }
+
+    /**
+     * @brief Estimate of the spectral radius of the Jacobi iteration of a Poisson system from the distances of its free pixels to the constraints.
+     * @details The image border and the barriers are Neumann, so the slowest mode of an unconstrained stretch of d pixels between a constraint and the border is that of the model problem with a Dirichlet condition at one end and a Neumann condition at the other, with the spectral radius cos(pi / (2 d)); a stretch of 2 d pixels between two constraints has about the same radius cos(pi / (2 d + 1)). The estimate takes d as the largest number of steps through open edges from a free pixel to its nearest constrained pixel, hard or soft. A size-based bound, cos(pi / n) for n pixels along the longer side as for a Dirichlet border all around, ignores both the Neumann border, which allows longer modes, and the constraints inside, which cut the modes of the scenes much shorter and make its factor over-relax by far. Pixels that no constraint reaches count as the whole grid.
+     * @param _system Poisson system.
+     * @return Spectral radius in [0,1).
+     */
+    static double jacobi_radius(const poisson_system& _system)
+    {
+        const int width = _system.width, height = _system.height;
+        const edge_barriers& barriers = _system.barriers;
+        const int unreached = -1;
+        std::vector<int> distances((size_t)width * height, unreached);
+        std::vector<size_t> front, next;
+        for (size_t i = 0; i < distances.size(); i++)
+        {
+            if (_system.constraints.mask.data[i])
+            {
+                distances[i] = 0;
+                front.push_back(i);
+            }
+        }
+
+        // breadth-first search from all constrained pixels at once
+        int distance = 0;
+        size_t reached = front.size();
+        while (!front.empty())
+        {
+            next.clear();
+            for (size_t i : front)
+            {
+                int x = (int)(i % width), y = (int)(i / width);
+                const std::pair<bool, size_t> edges[4] = { { !barriers.blocked_left(x, y), i - 1 },
+                                                           { !barriers.blocked_right(x, y), i + 1 },
+                                                           { !barriers.blocked_up(x, y), i - width },
+                                                           { !barriers.blocked_down(x, y), i + width } };
+                for (const std::pair<bool, size_t>& edge : edges)
+                {
+                    if (edge.first && distances[edge.second] == unreached)
+                    {
+                        distances[edge.second] = distance + 1;
+                        next.push_back(edge.second);
+                    }
+                }
+            }
+            reached += next.size();
+            if (!next.empty())
+                distance++;
+            front.swap(next);
+        }
+        if (reached < distances.size())
+            distance = width + height;
+        return std::cos(3.14159265358979323846 / (2 * std::max(1, distance) + 1));
+    }
+
+    /**
+     * @brief Relaxation factor that is asymptotically optimal for the estimated spectral radius of the system.
+     * @return Relaxation factor 2 / (1 + sqrt(1 - rho^2)) in [1,2).
+     */
+    double optimal_omega() const
+    {
+        return 2 / (1 + std::sqrt(1 - radius * radius));
+    }
+
+    /**
+     * @brief Relaxation factor of a half-sweep in the Chebyshev acceleration of red-black SOR.
+     * @details The optimal factor is only optimal asymptotically; applied to a good initial guess, e.g., from a coarser level, it first amplifies the error. The Chebyshev schedule starts with 1 for the first half-sweep, continues with 1 / (1 - rho^2 / 2), then with 1 / (1 - rho^2 omega / 4) of the previous factor, and approaches the optimal factor from below.
+     * @param _half Index of the half-sweep since the last load.
+     * @param _previous Factor of the previous half-sweep.
+     * @param _rho Spectral radius of the Jacobi iteration.
+     * @return Relaxation factor.
+     */
+    static double chebyshev_omega(int _half, double _previous, double _rho)
+    {
+        if (_half == 0)
+            return 1;
+        return _half == 1 ? 1 / (1 - _rho * _rho / 2) : 1 / (1 - _rho * _rho * _previous / 4);
+    }
+
+    /**
+     * @brief Bytes that a pass over the rows moves between the memory and the cache, i.e., reading and writing the values and reading the equations of every pixel of every channel once.
+     * @return Number of bytes per pass.
+     */
+    double bytes_per_pass() const
+    {
+        return 3.0 * (height + 2) * stride * 2 * (2 * sizeof(float) + sizeof(float) + sizeof(float) + sizeof(unsigned char));
+    }
+
+    /**
+     * @brief Width of the grid.
+     */
+    int width;
+    /**
+     * @brief Height of the grid.
+     */
+    int height;
+    /**
+     * @brief Maximum number of pixels of one color per row.
+     */
+    int half_width;
+    /**
+     * @brief Distance between two rows in the arrays, including one element of padding at either end.
+     */
+    int stride;
+    /**
+     * @brief Values per color and channel, with one padding row above and below.
+     */
+    std::vector<float> values[2][3];
+    /**
+     * @brief Right-hand sides per color and channel.
+     */
+    std::vector<float> rhs[2][3];
+    /**
+     * @brief Inverse diagonals per color; zero for masked pixels.
+     */
+    std::vector<float> inverse_diagonals[2];
+    /**
+     * @brief Open neighbors (left, right, up, down in the lowest four bits) and the free bit per color.
+     */
+    std::vector<unsigned char> masks[2];
+
+private:
+    /**
+     * @brief Estimated spectral radius of the Jacobi iteration, see jacobi_radius.
+     */
+    double radius;
+    /**
+     * @brief Half-sweeps since the last load, i.e., the position in the Chebyshev schedule.
+     */
+    int num_half_sweeps;
+    /**
+     * @brief Relaxation factor of the last half-sweep of the Chebyshev schedule.
+     */
+    double schedule;
+
+    /**
+     * @brief Position of a pixel in the arrays.
+     * @param _y Row.
+     * @param _k Index of the pixel among the pixels of its color in the row.
+     * @return Index into the arrays.
+     */
+    size_t offset(int _y, int _k) const
+    {
+        return (size_t)(_y + 1) * stride + 1 + _k;
+    }
+
+    /**
+     * @brief Offset of the left neighbor in the other color relative to the index of a pixel; the right neighbor follows it.
+     * @param _color Color of the pixel, zero for red.
+     * @param _y Row of the pixel.
+     * @return -1 if the pixels of the color start at even columns in this row, 0 otherwise.
+     */
+    static int neighbor_shift(int _color, int _y)
+    {
+        return ((_color + _y) & 1) - 1;
+    }
+
+    /**
+     * @brief First row of a band of the parallel sweeps.
+     * @param _band Band index; the number of bands gives the height.
+     * @param _num_bands Number of bands.
+     * @return Row index.
+     */
+    int band_begin(int _band, int _num_bands) const
+    {
+        return (int)((long long)height * _band / _num_bands);
+    }
+
+    /**
+     * @brief Runs the fused half-sweeps of one pass over a range of rows of one channel that grows or shrinks by one row per half-sweep at either end.
+     * @details Half-sweep h relaxes the rows in [_begin + _top_slope h, _end + _bottom_slope h). At each step, half-sweep h relaxes the row step - h, such that every row sees the rows of the previous half-sweep around it. A range that shrinks at both ends only depends on itself, and a range that grows at both ends around a boundary depends only on the shrinking ranges of the bands on either side, so all bands and then all boundaries can run in parallel.
+     * @param _channel Channel.
+     * @param _fused Number of fused sweeps.
+     * @param _omegas Relaxation factors of the 2 _fused half-sweeps.
+     * @param _begin First row of the range of the first half-sweep.
+     * @param _end Row after the range of the first half-sweep.
+     * @param _top_slope Rows by which the beginning of the range moves down per half-sweep.
+     * @param _bottom_slope Rows by which the end of the range moves down per half-sweep.
+     */
+    void relax_wavefront(int _channel, int _fused, const float* _omegas, int _begin, int _end, int _top_slope, int _bottom_slope)
+    {
+        for (int step = _begin; step < _end + 4 * _fused - 2; step++)
+        {
+            for (int half = 0; half < 2 * _fused; half++)
+            {
+                int row = step - half;
+                if (row >= std::max(0, _begin + _top_slope * half) && row < std::min(height, _end + _bottom_slope * half))
+                    relax_row(_channel, half & 1, row, _omegas[half]);
+            }
+        }
+    }
+
+    /**
+     * @brief Relaxes the pixels of one color in one row of one channel.
+     * @param _channel Channel.
+     * @param _color Color, zero for red.
+     * @param _y Row.
+     * @param _omega Relaxation factor.
+     */
+    void relax_row(int _channel, int _color, int _y, float _omega)
+    {
+        size_t begin                 = offset(_y, 0);
+        float* u                     = values[_color][_channel].data() + begin;
+        const float* b               = rhs[_color][_channel].data() + begin;
+        const float* inverse         = inverse_diagonals[_color].data() + begin;
+        const unsigned char* mask    = masks[_color].data() + begin;
+        const float* left            = values[1 - _color][_channel].data() + begin + neighbor_shift(_color, _y);
+        const float* up              = values[1 - _color][_channel].data() + begin - stride;
+        const float* down            = values[1 - _color][_channel].data() + begin + stride;
+        int k                        = 0;
+#if defined(__AVX2__)
+        const __m256i bits[5] = { _mm256_set1_epi32(1), _mm256_set1_epi32(2), _mm256_set1_epi32(4), _mm256_set1_epi32(8), _mm256_set1_epi32(free_bit) };
+        const __m256 omega    = _mm256_set1_ps(_omega);
+        for (; k + 8 <= half_width; k += 8)
+        {
+            __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(mask + k)));
+            __m256 open[5];
+            for (int bit = 0; bit < 5; bit++)
+                open[bit] = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(m, bits[bit]), bits[bit]));
+            __m256 sum = _mm256_and_ps(open[0], _mm256_loadu_ps(left + k));
+            sum        = _mm256_add_ps(sum, _mm256_and_ps(open[1], _mm256_loadu_ps(left + k + 1)));
+            sum        = _mm256_add_ps(sum, _mm256_and_ps(open[2], _mm256_loadu_ps(up + k)));
+            sum        = _mm256_add_ps(sum, _mm256_and_ps(open[3], _mm256_loadu_ps(down + k)));
+            __m256 old = _mm256_loadu_ps(u + k);
+            __m256 gs  = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(b + k), sum), _mm256_loadu_ps(inverse + k));
+            __m256 now = _mm256_add_ps(old, _mm256_mul_ps(omega, _mm256_sub_ps(gs, old)));
+            _mm256_storeu_ps(u + k, _mm256_blendv_ps(old, now, open[4]));
+        }
+#endif
+        for (; k < half_width; k++)
+        {
+            unsigned char m = mask[k];
+            if (!(m & free_bit))
+                continue;
+            float sum = ((m & 1) ? left[k] : 0.f) + ((m & 2) ? left[k + 1] : 0.f) + ((m & 4) ? up[k] : 0.f) + ((m & 8) ? down[k] : 0.f);
+            u[k] += _omega * ((b[k] + sum) * inverse[k] - u[k]);
+        }
+    }
+};
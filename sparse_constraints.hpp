@@ -0,0 +1,306 @@
+#pragma once
+
+#include "constraints.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Dirichlet constraints stored sparsely: a bitset of the constrained pixels and their colors and weights packed row by row.
+ * @details The bits are stored per row in 64-bit words, such that bit k of word w of a row belongs to pixel 64 w + k, as in the edge barriers. The values of the constrained pixels are stored in the order of the pixels, so that the values of a row form one contiguous run. For every word, the index of the value of its first constrained pixel is stored as well. This gives O(1) access to the run of a row and to the value of any pixel (offset of its word plus the number of set bits before it), and stencil sweeps can walk a row word by word, consuming the values in order. Colors are stored in single precision.
+ */
+class sparse_constraint_grid
+{
+public:
+    /**
+     * @brief Creates an empty grid.
+     */
+    sparse_constraint_grid()
+        : width(0)
+        , height(0)
+        , words_per_row(0)
+        , num_rows(0)
+    {
+    }
+
+    /**
+     * @brief Creates a grid without constrained pixels, to which the rows are appended in order.
+     * @param _width Width in pixels.
+     * @param _height Height in pixels.
+     */
+    sparse_constraint_grid(int _width, int _height)
+        : width(_width)
+        , height(_height)
+        , words_per_row((_width + 63) / 64)
+        , num_rows(0)
+    {
+        clear();
+    }
+
+    /**
+     * @brief Compresses a dense constraint grid.
+     * @param _constraints Dense constraints.
+     */
+    explicit sparse_constraint_grid(const constraint_grid& _constraints)
+        : sparse_constraint_grid(_constraints.width, _constraints.height)
+    {
+        append_rows(_constraints, _constraints.height);
+    }
+
+    /**
+     * @brief Width in pixels.
+     */
+    int width;
+    /**
+     * @brief Height in pixels.
+     */
+    int height;
+    /**
+     * @brief Number of 64-bit words per row of the bitset.
+     */
+    int words_per_row;
+    /**
+     * @brief Number of rows that were appended so far.
+     */
+    int num_rows;
+    /**
+     * @brief Bits of the constrained pixels.
+     */
+    std::vector<uint64_t> bits;
+    /**
+     * @brief For every word of the bitset, the index of the value of its first constrained pixel, followed by the total number of values.
+     */
+    std::vector<uint32_t> offsets;
+    /**
+     * @brief Colors of the constrained pixels in pixel order.
+     */
+    std::vector<std::array<float, 3>> colors;
+    /**
+     * @brief Weights of the constrained pixels in pixel order.
+     */
+    std::vector<float> weights;
+
+    /**
+     * @brief Removes all constraints and rows.
+     */
+    void clear()
+    {
+        num_rows = 0;
+        bits.assign((size_t)words_per_row * height, 0);
+        offsets.assign(1, 0);
+        offsets.reserve(bits.size() + 1);
+        colors.clear();
+        weights.clear();
+    }
+
+    /**
+     * @brief Appends the next rows from a dense grid, e.g., a strip of a tiled rasterization.
+     * @param _strip Dense constraints whose rows 0 to _rows - 1 become the next rows of this grid.
+     * @param _rows Number of rows to append.
+     */
+    void append_rows(const constraint_grid& _strip, int _rows)
+    {
+        for (int r = 0; r < _rows && num_rows < height; r++, num_rows++)
+        {
+            for (int w = 0; w < words_per_row; w++)
+            {
+                uint64_t word = 0;
+                for (int x = 64 * w; x < std::min(width, 64 * w + 64); x++)
+                {
+                    size_t i = _strip.mask.index(x, r);
+                    if (!_strip.mask.data[i])
+                        continue;
+                    word |= (uint64_t)1 << (x & 63);
+                    const color_type& color = _strip.colors.data[i];
+                    colors.push_back(std::array<float, 3>{ { (float)color[0], (float)color[1], (float)color[2] } });
+                    weights.push_back(_strip.weights.data[i]);
+                }
+                bits[(size_t)num_rows * words_per_row + w] = word;
+                offsets.push_back((uint32_t)colors.size());
+            }
+        }
+    }
+
+    /**
+     * @brief Constrained pixels among 64 consecutive pixels.
+     * @param _word Word index within the row, i.e., pixels 64 _word to 64 _word + 63.
+     * @param _y Row.
+     * @return One bit per pixel.
+     */
+    uint64_t word(int _word, int _y) const
+    {
+        return bits[(size_t)_y * words_per_row + _word];
+    }
+
+    /**
+     * @brief Index of the value of the first constrained pixel of a word.
+     * @param _word Word index within the row.
+     * @param _y Row.
+     * @return Index into colors and weights.
+     */
+    size_t word_offset(int _word, int _y) const
+    {
+        return offsets[(size_t)_y * words_per_row + _word];
+    }
+
+    /**
+     * @brief Index of the value of the first constrained pixel of a row.
+     * @param _y Row.
+     * @return Index into colors and weights.
+     */
+    size_t row_begin(int _y) const
+    {
+        return offsets[(size_t)_y * words_per_row];
+    }
+
+    /**
+     * @brief Index after the value of the last constrained pixel of a row.
+     * @param _y Row.
+     * @return Index into colors and weights.
+     */
+    size_t row_end(int _y) const
+    {
+        return offsets[(size_t)(_y + 1) * words_per_row];
+    }
+
+    /**
+     * @brief Checks whether a pixel is constrained.
+     * @param _x Column.
+     * @param _y Row.
+     * @return True for a constrained pixel.
+     */
+    bool contains(int _x, int _y) const
+    {
+        return (word(_x >> 6, _y) >> (_x & 63)) & 1;
+    }
+
+    /**
+     * @brief Finds the value of a pixel.
+     * @param _x Column.
+     * @param _y Row.
+     * @return Index into colors and weights, or -1 if the pixel is not constrained.
+     */
+    long long find(int _x, int _y) const
+    {
+        if (!contains(_x, _y))
+            return -1;
+        uint64_t before = word(_x >> 6, _y) & (((uint64_t)1 << (_x & 63)) - 1);
+        return (long long)(word_offset(_x >> 6, _y) + popcount(before));
+    }
+
+    /**
+     * @brief Number of constrained pixels.
+     * @return Number of values.
+     */
+    long long num_constrained() const
+    {
+        return (long long)colors.size();
+    }
+
+    /**
+     * @brief Expands the constraints into a dense grid, e.g., for checking.
+     * @param _constraints Dense grid; its content is replaced.
+     */
+    void expand(constraint_grid& _constraints) const
+    {
+        _constraints = constraint_grid(width, height);
+        for (int y = 0; y < num_rows; y++)
+            merge_row(y, _constraints);
+    }
+
+    /**
+     * @brief Writes the constraints of one row into a dense grid of the same size, walking the row word by word. Constrained pixels replace the constraints of the grid, all others are left unchanged.
+     * @param _y Row.
+     * @param _constraints Dense grid of the size of this grid.
+     */
+    void merge_row(int _y, constraint_grid& _constraints) const
+    {
+        for (int w = 0; w < words_per_row; w++)
+        {
+            size_t value = word_offset(w, _y);
+            for (uint64_t bits_left = word(w, _y); bits_left != 0; bits_left &= bits_left - 1, value++)
+            {
+                int x = 64 * w + count_trailing_zeros(bits_left);
+                const std::array<float, 3>& color = colors[value];
+                _constraints.set(_constraints.mask.index(x, _y), color_type{ color[0], color[1], color[2] }, weights[value]);
+            }
+        }
+    }
+
+    /**
+     * @brief Size of the bitset, the offsets and the values.
+     * @return Number of bytes.
+     */
+    size_t memory_bytes() const
+    {
+        return bits.size() * sizeof(uint64_t) + offsets.size() * sizeof(uint32_t) + colors.size() * (sizeof(std::array<float, 3>) + sizeof(float));
+    }
+
+    /**
+     * @brief Counts the set bits of a word.
+     * @param _bits Word.
+     * @return Number of set bits.
+     */
+    static int popcount(uint64_t _bits)
+    {
+        int count = 0;
+        for (; _bits != 0; _bits &= _bits - 1)
+            count++;
+        return count;
+    }
+
+    /**
+     * @brief Position of the lowest set bit of a word.
+     * @param _bits Non-zero word.
+     * @return Bit index in [0,63].
+     */
+    static int count_trailing_zeros(uint64_t _bits)
+    {
+        int count = 0;
+        for (; (_bits & 1) == 0; _bits >>= 1)
+            count++;
+        return count;
+    }
+};
+
+/**
+ * @brief Rasterizes the diffusion curves of a scene directly into sparse constraints.
+ * @details The image is rasterized one row of tiles at a time into a dense strip, whose tiles run in parallel, and each strip is compressed before the next one is rasterized. The memory is thus bounded by one strip of the width of the image plus the sparse result, instead of a dense grid of the full resolution.
+ * @param _scene Scene to rasterize.
+ * @param _curves Flattened curves of the scene, at a tolerance that suits the resolution.
+ * @param _width Width of the grid in pixels.
+ * @param _height Height of the grid in pixels.
+ * @param _options Parameters of the rasterization.
+ * @return Sparse constraints.
+ */
+inline sparse_constraint_grid rasterize_sparse_diffusion_curves(const scene& _scene, const flattened_scene& _curves, int _width, int _height,
+                                                               const rasterization_options& _options = rasterization_options())
+{
+    diffusion_curve_rasterizer rasterizer(_scene, _curves, _options);
+    tile_bins bins = rasterizer.bin_segments(_width, _height);
+
+    sparse_constraint_grid constraints(_width, _height);
+    constraint_grid strip(_width, std::min(_height, bins.tile_size));
+    for (int tile_row = 0; tile_row < bins.tiles_y; tile_row++)
+    {
+        rasterizer.rasterize_tile_row(bins, tile_row, strip);
+        constraints.append_rows(strip, std::min(bins.tile_size, _height - tile_row * bins.tile_size));
+    }
+    return constraints;
+}
+
+/**
+ * @brief Rasterizes the diffusion curves of a scene directly into sparse constraints, flattening the curves at a quarter pixel.
+ * @param _scene Scene to rasterize.
+ * @param _width Width of the grid in pixels.
+ * @param _height Height of the grid in pixels.
+ * @param _options Parameters of the rasterization.
+ * @return Sparse constraints.
+ */
+inline sparse_constraint_grid rasterize_sparse_diffusion_curves(const scene& _scene, int _width, int _height, const rasterization_options& _options = rasterization_options())
+{
+    flattened_scene curves(_scene, 0.25 * _scene.width / std::max(1, _width));
+    return rasterize_sparse_diffusion_curves(_scene, curves, _width, _height, _options);
+}
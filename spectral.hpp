@@ -0,0 +1,686 @@
+#pragma once
+
+#include "image.hpp"
+#include "parallel.hpp"
+#include "poisson.hpp"
+#include "solver.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+/**
+ * @brief Complex discrete Fourier transform of a fixed length.
+ * @details Powers of two use an iterative radix-2 transform with precomputed twiddle factors. Lengths whose prime factors are at most max_radix use a mixed-radix Stockham transform, e.g., 2 (2^10 - 1) = 2 3 11 31 of the sine transform of an image that is 2^10 pixels wide with a Dirichlet border. Factors of 2, 3 and 4 have dedicated butterflies, and the butterflies of the other odd primes share the cosines and sines between pairs of inputs and outputs. Other lengths use Bluestein's algorithm, which rewrites the transform as a convolution with a chirp and evaluates it with radix-2 transforms of at least twice the length.
+ */
+class fourier_transform
+{
+public:
+    /**
+     * @brief Largest prime factor of a length that the mixed-radix transform handles; the butterfly of a prime p costs about p real multiplications per sample, which exceeds the cost of Bluestein's algorithm beyond about this size.
+     */
+    static const int max_radix = 31;
+
+    /**
+     * @brief Prepares the transform.
+     * @param _length Number of samples.
+     */
+    explicit fourier_transform(int _length)
+        : length(_length)
+        , size(1)
+    {
+        while (size < _length)
+            size *= 2;
+        const double pi = 3.14159265358979323846;
+        if (size != _length && factorize(_length))
+        {
+            size = _length;
+            roots.resize(_length);
+            for (int k = 0; k < _length; k++)
+                roots[k] = std::polar(1.0, -2 * pi * k / _length);
+            return;
+        }
+        if (size != _length)
+        {
+            // padded length of the convolution
+            size = 1;
+            while (size < 2 * _length - 1)
+                size *= 2;
+        }
+        twiddles.resize(size / 2);
+        for (int k = 0; k < size / 2; k++)
+            twiddles[k] = std::polar(1.0, -2 * pi * k / size);
+        if (size == _length)
+            return;
+
+        chirp.resize(_length);
+        for (int j = 0; j < _length; j++)
+        {
+            // j^2 modulo 2 * length keeps the angle accurate for long transforms
+            long long square = (long long)j * j % (2LL * _length);
+            chirp[j]         = std::polar(1.0, -pi * square / _length);
+        }
+        chirp_spectrum.assign(size, 0.0);
+        for (int j = 0; j < _length; j++)
+        {
+            chirp_spectrum[j] = std::conj(chirp[j]);
+            if (j > 0)
+                chirp_spectrum[size - j] = std::conj(chirp[j]);
+        }
+        radix2(chirp_spectrum.data(), false);
+    }
+
+    /**
+     * @brief Transforms in place without normalization, X_k = sum_j x_j exp(-+2 pi i j k / n).
+     * @param _data Samples, overwritten with the transform.
+     * @param _inverse Uses the positive sign in the exponent.
+     * @param _scratch Work space, resized as needed, which lets repeated calls avoid allocations.
+     */
+    void transform(std::complex<double>* _data, bool _inverse, std::vector<std::complex<double>>& _scratch) const
+    {
+        if (!factors.empty())
+        {
+            mixed_radix(_data, _inverse, _scratch);
+            return;
+        }
+        if (size == length)
+        {
+            radix2(_data, _inverse);
+            return;
+        }
+        // the inverse transform is the conjugate of the forward transform of the conjugate
+        _scratch.assign(size, 0.0);
+        for (int j = 0; j < length; j++)
+            _scratch[j] = multiply(_inverse ? std::conj(_data[j]) : _data[j], chirp[j]);
+        radix2(_scratch.data(), false);
+        for (int k = 0; k < size; k++)
+            _scratch[k] = multiply(_scratch[k], chirp_spectrum[k]);
+        radix2(_scratch.data(), true);
+        double scale = 1.0 / size;
+        for (int k = 0; k < length; k++)
+        {
+            std::complex<double> value = multiply(_scratch[k], chirp[k]) * scale;
+            _data[k]                   = _inverse ? std::conj(value) : value;
+        }
+    }
+
+    /**
+     * @brief Number of samples.
+     */
+    int length;
+
+private:
+    /**
+     * @brief Iterative radix-2 transform of the padded size.
+     * @param _data Samples, overwritten with the transform.
+     * @param _inverse Uses the positive sign in the exponent.
+     */
+    void radix2(std::complex<double>* _data, bool _inverse) const
+    {
+        for (int i = 1, j = 0; i < size; i++)
+        {
+            int bit = size >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j)
+                std::swap(_data[i], _data[j]);
+        }
+        for (int half = 1; half < size; half *= 2)
+        {
+            int step = size / (2 * half);
+            for (int start = 0; start < size; start += 2 * half)
+            {
+                for (int k = 0; k < half; k++)
+                {
+                    std::complex<double> twiddle = _inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+                    std::complex<double> odd     = multiply(_data[start + k + half], twiddle);
+                    _data[start + k + half]      = _data[start + k] - odd;
+                    _data[start + k] += odd;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Complex product without the checks for infinities and NaNs of std::complex, which compilers otherwise call out of line.
+     * @param _a First factor.
+     * @param _b Second factor.
+     * @return Product.
+     */
+    static std::complex<double> multiply(const std::complex<double>& _a, const std::complex<double>& _b)
+    {
+        return std::complex<double>(_a.real() * _b.real() - _a.imag() * _b.imag(), _a.real() * _b.imag() + _a.imag() * _b.real());
+    }
+
+    /**
+     * @brief Splits a length that is not a power of two into the radices of the mixed-radix transform, fours first, then the remaining two and the odd primes.
+     * @param _length Number of samples.
+     * @return False if a prime factor exceeds max_radix, which leaves the factors empty.
+     */
+    bool factorize(int _length)
+    {
+        factors.clear();
+        int rest = _length;
+        for (; rest % 4 == 0; rest /= 4)
+            factors.push_back(4);
+        for (int p = 2; p <= max_radix; p++)
+            for (; rest % p == 0; rest /= p)
+                factors.push_back(p);
+        if (rest != 1)
+            factors.clear();
+        return !factors.empty();
+    }
+
+    /**
+     * @brief Mixed-radix transform in the Stockham order, which alternates between the samples and the work space instead of reordering the samples.
+     * @details A stage of radix r splits the remaining transforms of length r m into r transforms of length m: output u of the butterfly of p, q is the sum over the inputs t at q + s (p + t m) with the weights exp(-2 pi i t u / r), times the twiddle factor exp(-2 pi i p u / (r m)), and goes to q + s (r p + u), where the stride s is the product of the previous radices.
+     * @param _data Samples, overwritten with the transform.
+     * @param _inverse Uses the positive sign in the exponent.
+     * @param _scratch Work space, resized to the length.
+     */
+    void mixed_radix(std::complex<double>* _data, bool _inverse, std::vector<std::complex<double>>& _scratch) const
+    {
+        _scratch.resize(length);
+        std::complex<double>* x = _data;
+        std::complex<double>* y = _scratch.data();
+        auto root = [&](int _k) { return _inverse ? std::conj(roots[_k]) : roots[_k]; };
+        // multiplication with -i for the forward and with i for the inverse transform
+        auto rotate = [&](const std::complex<double>& _value) {
+            return _inverse ? std::complex<double>(-_value.imag(), _value.real()) : std::complex<double>(_value.imag(), -_value.real());
+        };
+        int stride = 1, m = length;
+        for (int r : factors)
+        {
+            m /= r;
+            // distance between the inputs of a butterfly
+            const size_t span = (size_t)stride * m;
+            for (int p = 0; p < m; p++)
+            {
+                const std::complex<double>* in = x + (size_t)stride * p;
+                std::complex<double>* out      = y + (size_t)stride * r * p;
+                const int step                 = p * stride;
+                if (r == 2)
+                {
+                    std::complex<double> w1 = root(step);
+                    for (int q = 0; q < stride; q++)
+                    {
+                        std::complex<double> a0 = in[q], a1 = in[q + span];
+                        out[q]          = a0 + a1;
+                        out[q + stride] = multiply(a0 - a1, w1);
+                    }
+                }
+                else if (r == 3)
+                {
+                    std::complex<double> w1 = root(step), w2 = root(2 * step);
+                    const double sine       = std::sqrt(3.0) / 2;
+                    for (int q = 0; q < stride; q++)
+                    {
+                        std::complex<double> a0 = in[q], a1 = in[q + span], a2 = in[q + 2 * span];
+                        std::complex<double> sum = a1 + a2, difference = rotate(a1 - a2) * sine;
+                        std::complex<double> mid = a0 - sum * 0.5;
+                        out[q]              = a0 + sum;
+                        out[q + stride]     = multiply(mid + difference, w1);
+                        out[q + 2 * stride] = multiply(mid - difference, w2);
+                    }
+                }
+                else if (r == 4)
+                {
+                    std::complex<double> w1 = root(step), w2 = root(2 * step), w3 = root(3 * step);
+                    for (int q = 0; q < stride; q++)
+                    {
+                        std::complex<double> a0 = in[q], a1 = in[q + span], a2 = in[q + 2 * span], a3 = in[q + 3 * span];
+                        std::complex<double> even = a0 + a2, odd = a1 + a3, even_difference = a0 - a2, odd_difference = rotate(a1 - a3);
+                        out[q]              = even + odd;
+                        out[q + stride]     = multiply(even_difference + odd_difference, w1);
+                        out[q + 2 * stride] = multiply(even - odd, w2);
+                        out[q + 3 * stride] = multiply(even_difference - odd_difference, w3);
+                    }
+                }
+                else
+                {
+                    // odd prime: sums and differences of the inputs t and r - t share the cosines and the sines of the outputs u and r - u
+                    const int half = r / 2;
+                    std::complex<double> sums[max_radix / 2 + 1], differences[max_radix / 2 + 1];
+                    for (int q = 0; q < stride; q++)
+                    {
+                        std::complex<double> a0 = in[q], total = a0;
+                        for (int t = 1; t <= half; t++)
+                        {
+                            std::complex<double> first = in[q + t * span], second = in[q + (r - t) * span];
+                            sums[t]        = first + second;
+                            differences[t] = first - second;
+                            total += sums[t];
+                        }
+                        out[q] = total;
+                        for (int u = 1; u <= half; u++)
+                        {
+                            double cosine_real = 0, cosine_imag = 0, sine_real = 0, sine_imag = 0;
+                            for (int t = 1, angle = u; t <= half; t++, angle = angle + u < r ? angle + u : angle + u - r)
+                            {
+                                // cos and sin of 2 pi t u / r
+                                const std::complex<double>& w = roots[angle * (length / r)];
+                                cosine_real += sums[t].real() * w.real();
+                                cosine_imag += sums[t].imag() * w.real();
+                                sine_real -= differences[t].real() * w.imag();
+                                sine_imag -= differences[t].imag() * w.imag();
+                            }
+                            std::complex<double> even = a0 + std::complex<double>(cosine_real, cosine_imag);
+                            std::complex<double> odd  = rotate(std::complex<double>(sine_real, sine_imag));
+                            out[q + u * stride]       = multiply(even + odd, root(u * step));
+                            out[q + (r - u) * stride] = multiply(even - odd, root((r - u) * step));
+                        }
+                    }
+                }
+            }
+            std::swap(x, y);
+            stride *= r;
+        }
+        if (x != _data)
+            std::copy(x, x + length, _data);
+    }
+
+    /**
+     * @brief Size of the radix-2 transforms: the length if it is a power of two or handled by the mixed-radix transform, and the padded length of the convolution otherwise.
+     */
+    int size;
+    /**
+     * @brief Radices of the stages of the mixed-radix transform; empty if it is not used.
+     */
+    std::vector<int> factors;
+    /**
+     * @brief exp(-2 pi i k / length) of the mixed-radix transform.
+     */
+    std::vector<std::complex<double>> roots;
+    /**
+     * @brief exp(-2 pi i k / size) for the first half of the radix-2 transform.
+     */
+    std::vector<std::complex<double>> twiddles;
+    /**
+     * @brief exp(-pi i j^2 / length) of Bluestein's algorithm.
+     */
+    std::vector<std::complex<double>> chirp;
+    /**
+     * @brief Transform of the conjugate chirp, wrapped around to the padded size.
+     */
+    std::vector<std::complex<double>> chirp_spectrum;
+};
+
+/**
+ * @brief Boundary of a rectangular Poisson problem that the spectral solver handles.
+ */
+enum class spectral_boundary
+{
+    /**
+     * @brief All pixels at the border of the image are pinned and the interior pixels are solved for.
+     */
+    dirichlet,
+    /**
+     * @brief All pixels are solved for, up to at most one pinned pixel that fixes the constant.
+     */
+    neumann
+};
+
+/**
+ * @brief Work space of the transforms of one thread, which lets repeated transforms avoid allocations.
+ */
+struct spectral_scratch
+{
+    /**
+     * @brief Extended samples.
+     */
+    std::vector<std::complex<double>> extended;
+    /**
+     * @brief Work space of Bluestein's algorithm.
+     */
+    std::vector<std::complex<double>> convolution;
+};
+
+/**
+ * @brief Real trigonometric transform of a fixed length that diagonalizes the one-dimensional Laplacian with a spectral boundary.
+ * @details The Dirichlet case uses the sine transform DST-I, whose basis functions vanish one sample beyond both ends, with eigenvalues 2 - 2 cos(pi k / (n + 1)). The Neumann case uses the cosine transform DCT-II, whose basis functions are even about the half-sample beyond both ends, with eigenvalues 2 - 2 cos(pi k / n), and its inverse DCT-III. All of them are evaluated with complex transforms of the symmetrically extended samples of about twice the length. Since the extended samples and the results are real, one complex transform handles two rows at once, the first in the real and the second in the imaginary part.
+ */
+class trigonometric_transform
+{
+public:
+    /**
+     * @brief Prepares the transform.
+     * @param _length Number of samples.
+     * @param _boundary Boundary, which selects the transform.
+     */
+    trigonometric_transform(int _length, spectral_boundary _boundary)
+        : length(_length)
+        , boundary(_boundary)
+        , fourier(_boundary == spectral_boundary::dirichlet ? 2 * (_length + 1) : 2 * _length)
+    {
+        const double pi = 3.14159265358979323846;
+        eigenvalues.resize(_length);
+        shifts.resize(_length);
+        for (int k = 0; k < _length; k++)
+        {
+            // the sine transform starts at frequency one
+            eigenvalues[k] = boundary == spectral_boundary::dirichlet ? 2 - 2 * std::cos(pi * (k + 1) / (_length + 1)) : 2 - 2 * std::cos(pi * k / _length);
+            shifts[k]      = std::polar(1.0, -pi * k / (2 * _length));
+        }
+    }
+
+    /**
+     * @brief Forward transform of two rows in place.
+     * @param _first Samples of the first row, overwritten with the coefficients.
+     * @param _second Samples of the second row, overwritten with the coefficients; may be null.
+     * @param _scratch Work space.
+     */
+    void forward(double* _first, double* _second, spectral_scratch& _scratch) const
+    {
+        std::vector<std::complex<double>>& extended = _scratch.extended;
+        extended.assign(fourier.length, 0.0);
+        const int n = length, size = fourier.length;
+        for (int j = 0; j < n; j++)
+        {
+            std::complex<double> value(_first[j], _second != nullptr ? _second[j] : 0);
+            if (boundary == spectral_boundary::dirichlet)
+            {
+                extended[j + 1]        = value;
+                extended[size - 1 - j] = -value;
+            }
+            else
+            {
+                extended[j]            = value;
+                extended[size - 1 - j] = value;
+            }
+        }
+        fourier.transform(extended.data(), false, _scratch.convolution);
+        for (int k = 0; k < n; k++)
+        {
+            // separates the transforms of the real and the imaginary part by their symmetry
+            int m = boundary == spectral_boundary::dirichlet ? k + 1 : k;
+            std::complex<double> y = extended[m], mirrored = std::conj(extended[(size - m) % size]);
+            std::complex<double> first = (y + mirrored) * 0.5, second = (y - mirrored) * std::complex<double>(0, -0.5);
+            if (boundary == spectral_boundary::dirichlet)
+            {
+                _first[k] = -first.imag() / 2;
+                if (_second != nullptr)
+                    _second[k] = -second.imag() / 2;
+            }
+            else
+            {
+                _first[k] = (shifts[k] * first).real() / 2;
+                if (_second != nullptr)
+                    _second[k] = (shifts[k] * second).real() / 2;
+            }
+        }
+    }
+
+    /**
+     * @brief Inverse transform of two rows in place.
+     * @param _first Coefficients of the first row, overwritten with the samples.
+     * @param _second Coefficients of the second row, overwritten with the samples; may be null.
+     * @param _scratch Work space.
+     */
+    void inverse(double* _first, double* _second, spectral_scratch& _scratch) const
+    {
+        const int n = length;
+        if (boundary == spectral_boundary::dirichlet)
+        {
+            // the sine transform is its own inverse up to the scale
+            forward(_first, _second, _scratch);
+            for (int j = 0; j < n; j++)
+            {
+                _first[j] *= 2.0 / (n + 1);
+                if (_second != nullptr)
+                    _second[j] *= 2.0 / (n + 1);
+            }
+            return;
+        }
+        // Hermitian coefficients, whose transform is real for either row
+        std::vector<std::complex<double>>& extended = _scratch.extended;
+        extended.assign(fourier.length, 0.0);
+        for (int k = 0; k < n; k++)
+        {
+            std::complex<double> shift = k == 0 ? 1.0 : std::conj(shifts[k]);
+            std::complex<double> first = _first[k] * shift / (double)n, second = (_second != nullptr ? _second[k] : 0) * shift / (double)n;
+            extended[k] = first + std::complex<double>(0, 1) * second;
+            if (k > 0)
+                extended[2 * n - k] = std::conj(first) + std::complex<double>(0, 1) * std::conj(second);
+        }
+        fourier.transform(extended.data(), true, _scratch.convolution);
+        for (int j = 0; j < n; j++)
+        {
+            _first[j] = extended[j].real();
+            if (_second != nullptr)
+                _second[j] = extended[j].imag();
+        }
+    }
+
+    /**
+     * @brief Number of samples.
+     */
+    int length;
+    /**
+     * @brief Boundary, which selects the transform.
+     */
+    spectral_boundary boundary;
+    /**
+     * @brief Eigenvalue of the one-dimensional Laplacian for every coefficient.
+     */
+    std::vector<double> eigenvalues;
+
+private:
+    /**
+     * @brief Complex transform of the extended samples.
+     */
+    fourier_transform fourier;
+    /**
+     * @brief exp(-pi i k / (2 n)), which aligns the cosine transform with the extended samples.
+     */
+    std::vector<std::complex<double>> shifts;
+};
+
+/**
+ * @brief Checks whether a Poisson system is a rectangle that the spectral solver handles exactly.
+ * @details The system must not have soft constraints or barriers other than the border of the image. Either all pixels at the border are pinned and none inside, or at most one pixel is pinned, which is what the balancing of floating regions leaves when a scene has no constraints.
+ * @param _system Poisson system.
+ * @param _boundary Output boundary of the rectangle.
+ * @return True if the spectral solver applies.
+ */
+inline bool spectral_applicable(const poisson_system& _system, spectral_boundary& _boundary)
+{
+    const int width = _system.width, height = _system.height;
+    if (width < 3 || height < 3)
+        return false;
+    int num_pinned = 0;
+    bool border_pinned = true, interior_pinned = false;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            size_t i = (size_t)y * width + x;
+            if ((x + 1 < width && _system.barriers.blocked_right(x, y)) || (y + 1 < height && _system.barriers.blocked_down(x, y)))
+                return false;
+            if (!_system.constraints.mask.data[i])
+            {
+                if (x == 0 || y == 0 || x + 1 == width || y + 1 == height)
+                    border_pinned = false;
+                continue;
+            }
+            if (!is_pinned(_system, i))
+                return false;
+            num_pinned++;
+            if (x > 0 && y > 0 && x + 1 < width && y + 1 < height)
+                interior_pinned = true;
+        }
+    }
+    if (border_pinned && !interior_pinned)
+    {
+        _boundary = spectral_boundary::dirichlet;
+        return true;
+    }
+    _boundary = spectral_boundary::neumann;
+    return num_pinned <= 1;
+}
+
+/**
+ * @brief Solves a rectangular Poisson system directly with fast trigonometric transforms in O(N log N) operations.
+ * @details The Laplacian of a rectangle is the sum of the one-dimensional Laplacians of its rows and columns, so the two-dimensional transform diagonalizes it with the sums of their eigenvalues. The solver transforms the right-hand side of every channel along the rows, which decouples the frequencies into tridiagonal systems along the columns, solves them with the Thomas algorithm and transforms back. This needs half the transforms of a two-dimensional transform and no transposes. Rows and chunks of frequencies are processed in parallel. With the Neumann boundary, the constant is free: the solver drops the mean of the source, which the balancing of floating regions already removed, and shifts the solution to the pinned pixel, if any.
+ * @param _system Poisson system.
+ * @param _result Output solution, only set if the system is a rectangle.
+ * @param _stats Optional output of the relative residual of the solution and the solve time without its check; the iterations stay zero.
+ * @return False if the system is not a rectangle that the solver handles, see spectral_applicable.
+ */
+inline bool solve_spectral(const poisson_system& _system, image& _result, solver_statistics* _stats = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    spectral_boundary boundary;
+    if (!spectral_applicable(_system, boundary))
+        return false;
+
+    // unknowns of the rectangle, inset by the pinned border in the Dirichlet case
+    const int inset = boundary == spectral_boundary::dirichlet ? 1 : 0;
+    const int nx = _system.width - 2 * inset, ny = _system.height - 2 * inset;
+    const trigonometric_transform rows(nx, boundary);
+    const size_t plane = (size_t)nx * ny;
+    std::vector<double> values(3 * plane);
+
+    image solution;
+    initialize_solution(_system, solution);
+    parallel_for(0, ny, [&](int y) {
+        for (int x = 0; x < nx; x++)
+        {
+            int px = x + inset, py = y + inset;
+            size_t i = (size_t)py * _system.width + px;
+            color_type rhs;
+            if (is_pinned(_system, i))
+            {
+                // the seed of the Neumann case keeps the equation of a free pixel and the shift below pins it
+                for (int c = 0; c < 3; c++)
+                    rhs[c] = -_system.source.data[i][c];
+            }
+            else
+                pixel_equation(_system, px, py, rhs);
+            // pinned neighbors at the border of the Dirichlet rectangle
+            auto add = [&](int _x, int _y) {
+                if (is_pinned(_system, (size_t)_y * _system.width + _x))
+                    for (int c = 0; c < 3; c++)
+                        rhs[c] += solution(_x, _y)[c];
+            };
+            if (inset)
+            {
+                add(px - 1, py);
+                add(px + 1, py);
+                add(px, py - 1);
+                add(px, py + 1);
+            }
+            for (int c = 0; c < 3; c++)
+                values[c * plane + (size_t)y * nx + x] = rhs[c];
+        }
+    });
+
+    // transforms of all rows of the three channels, two at a time and in chunks that share their work space
+    auto transform_rows = [&](bool _inverse) {
+        const int num_pairs = (3 * ny + 1) / 2, chunk = 8;
+        parallel_for(0, (num_pairs + chunk - 1) / chunk, [&](int _chunk) {
+            spectral_scratch scratch;
+            for (int pair = _chunk * chunk; pair < std::min(num_pairs, (_chunk + 1) * chunk); pair++)
+            {
+                double* first  = values.data() + (size_t)(2 * pair) * nx;
+                double* second = 2 * pair + 1 < 3 * ny ? first + nx : nullptr;
+                if (_inverse)
+                    rows.inverse(first, second, scratch);
+                else
+                    rows.forward(first, second, scratch);
+            }
+        });
+    };
+
+    // after the transform along the rows, every frequency k is a tridiagonal system along its column with the diagonal eigenvalue_k + 2, or + 1 at the ends of
+    // Neumann columns; the inverse pivots of the Thomas algorithm are the same for all channels
+    std::vector<double> pivots(plane);
+    const int chunk = 64, num_chunks = (nx + chunk - 1) / chunk;
+    parallel_for(0, num_chunks, [&](int _chunk) {
+        for (int k = _chunk * chunk; k < std::min(nx, (_chunk + 1) * chunk); k++)
+        {
+            double previous = 0;
+            for (int y = 0; y < ny; y++)
+            {
+                int degree   = boundary == spectral_boundary::neumann && (y == 0 || y + 1 == ny) ? 1 : 2;
+                double pivot = rows.eigenvalues[k] + degree - previous;
+                // the constant frequency of the Neumann case is singular; its last unknown fixes the constant
+                previous                   = boundary == spectral_boundary::neumann && k == 0 && y + 1 == ny ? 0 : 1 / pivot;
+                pivots[(size_t)y * nx + k] = previous;
+            }
+        }
+    });
+
+    transform_rows(false);
+    if (boundary == spectral_boundary::neumann)
+    {
+        // drops the mean of the source, which makes the singular system consistent
+        for (int c = 0; c < 3; c++)
+        {
+            double mean = 0;
+            for (int y = 0; y < ny; y++)
+                mean += values[c * plane + (size_t)y * nx];
+            for (int y = 0; y < ny; y++)
+                values[c * plane + (size_t)y * nx] -= mean / ny;
+        }
+    }
+    // sweeps down and up the rows for a chunk of frequencies at a time, which keeps the accesses contiguous
+    parallel_for(0, 3 * num_chunks, [&](int _index) {
+        double* channel = values.data() + (_index % 3) * plane;
+        int begin = _index / 3 * chunk, end = std::min(nx, begin + chunk);
+        for (int k = begin; k < end; k++)
+            channel[k] *= pivots[k];
+        for (int y = 1; y < ny; y++)
+        {
+            double* row         = channel + (size_t)y * nx;
+            const double* above = row - nx;
+            const double* pivot = pivots.data() + (size_t)y * nx;
+            for (int k = begin; k < end; k++)
+                row[k] = (row[k] + above[k]) * pivot[k];
+        }
+        for (int y = ny - 2; y >= 0; y--)
+        {
+            double* row         = channel + (size_t)y * nx;
+            const double* below = row + nx;
+            const double* pivot = pivots.data() + (size_t)y * nx;
+            for (int k = begin; k < end; k++)
+                row[k] += below[k] * pivot[k];
+        }
+    });
+    transform_rows(true);
+
+    color_type shift = { 0, 0, 0 };
+    if (boundary == spectral_boundary::neumann)
+    {
+        for (size_t i = 0; i < solution.data.size(); i++)
+            if (is_pinned(_system, i))
+                for (int c = 0; c < 3; c++)
+                    shift[c] = solution.data[i][c] - values[c * plane + i];
+    }
+    parallel_for(0, ny, [&](int y) {
+        for (int x = 0; x < nx; x++)
+        {
+            size_t i = (size_t)(y + inset) * _system.width + x + inset;
+            if (is_pinned(_system, i))
+                continue;
+            for (int c = 0; c < 3; c++)
+                solution.data[i][c] = values[c * plane + (size_t)y * nx + x] + shift[c];
+        }
+    });
+
+    _result = solution;
+    if (_stats != nullptr)
+    {
+        // the check of the residual is not part of the solve
+        solver_statistics stats;
+        stats.solve_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        double norm    = right_hand_side_norm(_system);
+        stats.residuals.push_back(std::sqrt(residual_squared_norm(_system, solution)) / (norm > 0 ? norm : 1));
+        stats.converged = true;
+        *_stats         = stats;
+    }
+    return true;
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include "mesh_evaluator.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief Parameters of the adaptive tessellation of gradient meshes.
+ */
+struct tessellation_options
+{
+    /**
+     * @brief Pixels per scene unit of the target image.
+     */
+    double scale = 1;
+    /**
+     * @brief Maximum distance in pixels between the patch surface and the triangles.
+     */
+    double geometric_tolerance = 0.25;
+    /**
+     * @brief Maximum difference per color channel between the patch colors and the linearly interpolated vertex colors.
+     */
+    double color_tolerance = 1.0 / 255.0;
+    /**
+     * @brief Largest number of subdivisions along a patch edge or parameter direction.
+     */
+    int max_level = 64;
+    /**
+     * @brief Interpolation scheme of the patch colors.
+     */
+    color_interpolation colors = color_interpolation::bicubic;
+};
+
+/**
+ * @brief Vertex of a tessellated gradient mesh.
+ */
+struct colored_vertex
+{
+    /**
+     * @brief Position in scene units.
+     */
+    point_type position;
+    /**
+     * @brief Color at the vertex.
+     */
+    color_type color;
+};
+
+/**
+ * @brief Indexed triangle list with per-vertex colors.
+ */
+struct triangle_mesh
+{
+    /**
+     * @brief Vertex buffer.
+     */
+    std::vector<colored_vertex> vertices;
+    /**
+     * @brief Index buffer, three indices per triangle.
+     */
+    std::vector<unsigned int> indices;
+    /**
+     * @brief First vertex of each patch, plus the total number of vertices at the end.
+     */
+    std::vector<unsigned int> patch_vertex_offsets;
+    /**
+     * @brief First index of each patch, plus the total number of indices at the end.
+     */
+    std::vector<unsigned int> patch_index_offsets;
+
+    /**
+     * @brief Number of triangles.
+     * @return Number of triangles in the index buffer.
+     */
+    size_t num_triangles() const
+    {
+        return indices.size() / 3;
+    }
+};
+
+/**
+ * @brief Subdivision levels of a single patch.
+ */
+struct patch_tessellation_levels
+{
+    /**
+     * @brief Subdivisions of the edges v=0, v=1, u=0, u=1.
+     */
+    std::array<int, 4> edges;
+    /**
+     * @brief Interior subdivisions along u.
+     */
+    int inner_u;
+    /**
+     * @brief Interior subdivisions along v.
+     */
+    int inner_v;
+};
+
+/**
+ * @brief Cubic polynomials of all channels (x, y, r, g, b) of a curve on a patch, as coefficients c0 + c1 t + c2 t^2 + c3 t^3.
+ */
+typedef std::array<std::array<double, 4>, patch_coefficients::num_channels> channel_cubics;
+
+/**
+ * @brief Finds the number of uniform subdivisions of a cubic curve for which linear interpolation stays within the tolerances.
+ * @details The deviation is measured at the midpoint of every piece, which is where the error of linear interpolation of a cubic piece peaks for small pieces.
+ * @param _cubic Channel polynomials of the curve.
+ * @param _options Tessellation parameters.
+ * @return Number of pieces in [1, max_level].
+ */
+inline int curve_subdivision_level(const channel_cubics& _cubic, const tessellation_options& _options)
+{
+    for (int level = 1; level < _options.max_level; level++)
+    {
+        bool accept = true;
+        for (int piece = 0; piece < level && accept; piece++)
+        {
+            double t0 = (double)piece / level, t1 = (double)(piece + 1) / level, tm = 0.5 * (t0 + t1);
+            for (int c = 0; c < patch_coefficients::num_channels && accept; c++)
+            {
+                const std::array<double, 4>& a = _cubic[c];
+                double f0 = ((a[3] * t0 + a[2]) * t0 + a[1]) * t0 + a[0];
+                double f1 = ((a[3] * t1 + a[2]) * t1 + a[1]) * t1 + a[0];
+                double fm = ((a[3] * tm + a[2]) * tm + a[1]) * tm + a[0];
+                double error = std::abs(fm - 0.5 * (f0 + f1));
+                accept = c < 2 ? error * _options.scale <= _options.geometric_tolerance : error <= _options.color_tolerance;
+            }
+        }
+        if (accept)
+            return level;
+    }
+    return _options.max_level;
+}
+
+/**
+ * @brief Channel polynomials of a patch boundary, computed only from the data that both adjacent patches share, so that both derive the same subdivision and the same vertices.
+ * @param _patch Patch.
+ * @param _edge Edge index: 0 (v=0), 1 (v=1), 2 (u=0), 3 (u=1).
+ * @param _interpolation Interpolation scheme of the colors.
+ * @return Channel polynomials along the edge, running in direction of increasing u or v.
+ */
+inline channel_cubics patch_edge_cubics(const mesh_patch& _patch, int _edge, color_interpolation _interpolation)
+{
+    // corners and tangent direction of each edge
+    static const int edge_corners[4][2] = { { 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 } };
+    int a = edge_corners[_edge][0], b = edge_corners[_edge][1];
+    bool along_u = _edge < 2;
+    const std::array<point_type, 4>& tangents       = along_u ? _patch.tangents_u : _patch.tangents_v;
+    const std::array<color_type, 4>& color_tangents = along_u ? _patch.color_tangents_u : _patch.color_tangents_v;
+
+    channel_cubics cubic;
+    for (int c = 0; c < patch_coefficients::num_channels; c++)
+    {
+        double p0, p1, m0, m1;
+        if (c < 2)
+        {
+            p0 = _patch.positions[a][c], p1 = _patch.positions[b][c], m0 = tangents[a][c], m1 = tangents[b][c];
+        }
+        else
+        {
+            p0 = _patch.colors[a][c - 2], p1 = _patch.colors[b][c - 2];
+            m0 = _interpolation == color_interpolation::bicubic ? color_tangents[a][c - 2] : p1 - p0;
+            m1 = _interpolation == color_interpolation::bicubic ? color_tangents[b][c - 2] : p1 - p0;
+        }
+        cubic[c] = std::array<double, 4>{ p0, m0, -3 * p0 + 3 * p1 - 2 * m0 - m1, 2 * p0 - 2 * p1 + m0 + m1 };
+    }
+    return cubic;
+}
+
+/**
+ * @brief Channel polynomials of an isoparametric curve of a patch.
+ * @param _patch Patch in power basis.
+ * @param _along_u True for the curve along u at constant v, false for the curve along v at constant u.
+ * @param _fixed Value of the constant parameter.
+ * @return Channel polynomials along the curve.
+ */
+inline channel_cubics patch_isoline_cubics(const patch_coefficients& _patch, bool _along_u, double _fixed)
+{
+    channel_cubics cubic;
+    for (int c = 0; c < patch_coefficients::num_channels; c++)
+    {
+        const std::array<double, 16>& a = _patch.coefficients[c];
+        for (int k = 0; k < 4; k++)
+        {
+            if (_along_u)
+                cubic[c][k] = ((a[4 * k + 3] * _fixed + a[4 * k + 2]) * _fixed + a[4 * k + 1]) * _fixed + a[4 * k];
+            else
+                cubic[c][k] = ((a[12 + k] * _fixed + a[8 + k]) * _fixed + a[4 + k]) * _fixed + a[k];
+        }
+    }
+    return cubic;
+}
+
+/**
+ * @brief Chooses the subdivision levels of a patch from the error of its edges and of interior isoparametric curves.
+ * @param _patch Patch in Hermite form.
+ * @param _coefficients Patch in power basis.
+ * @param _options Tessellation parameters.
+ * @return Subdivision levels.
+ */
+inline patch_tessellation_levels patch_levels(const mesh_patch& _patch, const patch_coefficients& _coefficients, const tessellation_options& _options)
+{
+    patch_tessellation_levels levels;
+    for (int edge = 0; edge < 4; edge++)
+        levels.edges[edge] = curve_subdivision_level(patch_edge_cubics(_patch, edge, _options.colors), _options);
+    levels.inner_u = std::max(levels.edges[0], levels.edges[1]);
+    levels.inner_v = std::max(levels.edges[2], levels.edges[3]);
+    for (int i = 1; i < 4; i++)
+    {
+        levels.inner_u = std::max(levels.inner_u, curve_subdivision_level(patch_isoline_cubics(_coefficients, true, i / 4.0), _options));
+        levels.inner_v = std::max(levels.inner_v, curve_subdivision_level(patch_isoline_cubics(_coefficients, false, i / 4.0), _options));
+    }
+    return levels;
+}
+
+/**
+ * @brief Generates the triangulation of a patch with given subdivision levels.
+ * @details Without any subdivision, the patch becomes two triangles. Otherwise, an inner grid with at least one vertex is created and each of the four edges is stitched to the adjacent side of the inner grid, so that neighboring patches match along their edges for any interior levels.
+ * The local vertices are numbered: 4 corners, then the inner vertices of the four edges, then the inner grid row by row.
+ * @param _levels Subdivision levels.
+ * @param _vertex Function called as _vertex(u, v, edge, i) for each local vertex in order, where edge is -1 for corners and the inner grid.
+ * @param _triangle Function called as _triangle(a, b, c) with local vertex indices.
+ */
+template <typename VertexFunction, typename TriangleFunction>
+void generate_patch_triangles(const patch_tessellation_levels& _levels, VertexFunction _vertex, TriangleFunction _triangle)
+{
+    const std::array<int, 4>& e = _levels.edges;
+    bool subdivided = _levels.inner_u > 1 || _levels.inner_v > 1 || e[0] > 1 || e[1] > 1 || e[2] > 1 || e[3] > 1;
+    _vertex(0.0, 0.0, -1, 0);
+    _vertex(1.0, 0.0, -1, 0);
+    _vertex(0.0, 1.0, -1, 0);
+    _vertex(1.0, 1.0, -1, 0);
+    if (!subdivided)
+    {
+        _triangle(0, 1, 3);
+        _triangle(0, 3, 2);
+        return;
+    }
+
+    // edge vertices: parameters along the edges
+    int edge_start[4];
+    int next = 4;
+    for (int edge = 0; edge < 4; edge++)
+    {
+        edge_start[edge] = next;
+        for (int i = 1; i < e[edge]; i++)
+        {
+            double t = (double)i / e[edge];
+            if (edge < 2)
+                _vertex(t, edge == 0 ? 0.0 : 1.0, edge, i);
+            else
+                _vertex(edge == 2 ? 0.0 : 1.0, t, edge, i);
+            next++;
+        }
+    }
+
+    // inner grid with (nu-1) x (nv-1) vertices
+    int nu = std::max(2, _levels.inner_u);
+    int nv = std::max(2, _levels.inner_v);
+    int inner_start = next;
+    for (int j = 1; j < nv; j++)
+        for (int i = 1; i < nu; i++)
+            _vertex((double)i / nu, (double)j / nv, -1, 0);
+    struct inner_index
+    {
+        int start, nu;
+        int operator()(int i, int j) const { return start + (j - 1) * (nu - 1) + (i - 1); }
+    } inner = { inner_start, nu };
+
+    for (int j = 1; j < nv - 1; j++)
+    {
+        for (int i = 1; i < nu - 1; i++)
+        {
+            _triangle(inner(i, j), inner(i + 1, j), inner(i + 1, j + 1));
+            _triangle(inner(i, j), inner(i + 1, j + 1), inner(i, j + 1));
+        }
+    }
+
+    // stitch each edge to the facing side of the inner grid
+    static const int edge_corners[4][2] = { { 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 } };
+    std::vector<int> outer_ids, inner_ids;
+    std::vector<double> outer_params, inner_params;
+    for (int edge = 0; edge < 4; edge++)
+    {
+        outer_ids.clear(), inner_ids.clear(), outer_params.clear(), inner_params.clear();
+        outer_ids.push_back(edge_corners[edge][0]);
+        outer_params.push_back(0);
+        for (int i = 1; i < e[edge]; i++)
+        {
+            outer_ids.push_back(edge_start[edge] + i - 1);
+            outer_params.push_back((double)i / e[edge]);
+        }
+        outer_ids.push_back(edge_corners[edge][1]);
+        outer_params.push_back(1);
+
+        if (edge < 2)
+        {
+            int j = edge == 0 ? 1 : nv - 1;
+            for (int i = 1; i < nu; i++)
+            {
+                inner_ids.push_back(inner(i, j));
+                inner_params.push_back((double)i / nu);
+            }
+        }
+        else
+        {
+            int i = edge == 2 ? 1 : nu - 1;
+            for (int j = 1; j < nv; j++)
+            {
+                inner_ids.push_back(inner(i, j));
+                inner_params.push_back((double)j / nv);
+            }
+        }
+
+        size_t a = 0, b = 0;
+        while (a + 1 < outer_ids.size() || b + 1 < inner_ids.size())
+        {
+            bool advance_outer = b + 1 == inner_ids.size() || (a + 1 < outer_ids.size() && outer_params[a + 1] <= inner_params[b + 1]);
+            if (advance_outer)
+            {
+                _triangle(outer_ids[a], outer_ids[a + 1], inner_ids[b]);
+                a++;
+            }
+            else
+            {
+                _triangle(outer_ids[a], inner_ids[b + 1], inner_ids[b]);
+                b++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Adaptively tessellates gradient mesh patches into an indexed triangle list with per-vertex colors.
+ * @details The subdivision levels of each patch follow from the geometric and color tolerances. Edge vertices are computed from the edge data only, so adjacent patches share bit-identical vertex positions and the result is crack-free. Patches are processed in parallel: a count pass, a prefix sum over the patches, and a write pass into the flat buffers.
+ * @param _patches Patches to tessellate.
+ * @param _options Tessellation parameters.
+ * @return Triangle mesh whose vertices and triangles are stored consecutively per patch.
+ */
+inline triangle_mesh tessellate_patches(const std::vector<mesh_patch>& _patches, const tessellation_options& _options)
+{
+    int num_patches = (int)_patches.size();
+    std::vector<patch_tessellation_levels> levels(num_patches);
+    std::vector<unsigned int> vertex_counts(num_patches + 1, 0), index_counts(num_patches + 1, 0);
+
+    // pass 1: subdivision levels and buffer sizes per patch
+    parallel_for(0, num_patches, [&](int p) {
+        patch_coefficients coefficients(_patches[p], _options.colors);
+        levels[p] = patch_levels(_patches[p], coefficients, _options);
+        unsigned int num_vertices = 0, num_indices = 0;
+        generate_patch_triangles(
+            levels[p], [&num_vertices](double, double, int, int) { num_vertices++; }, [&num_indices](int, int, int) { num_indices += 3; });
+        vertex_counts[p] = num_vertices;
+        index_counts[p]  = num_indices;
+    });
+
+    triangle_mesh result;
+    result.patch_vertex_offsets.resize(num_patches + 1);
+    result.patch_index_offsets.resize(num_patches + 1);
+    unsigned int vertex_total = 0, index_total = 0;
+    for (int p = 0; p <= num_patches; p++)
+    {
+        result.patch_vertex_offsets[p] = vertex_total;
+        result.patch_index_offsets[p]  = index_total;
+        vertex_total += vertex_counts[p];
+        index_total += index_counts[p];
+    }
+    result.vertices.resize(vertex_total);
+    result.indices.resize(index_total);
+
+    // pass 2: write vertices and triangles
+    parallel_for(0, num_patches, [&](int p) {
+        const mesh_patch& patch = _patches[p];
+        patch_coefficients coefficients(patch, _options.colors);
+        channel_cubics edges[4];
+        for (int edge = 0; edge < 4; edge++)
+            edges[edge] = patch_edge_cubics(patch, edge, _options.colors);
+
+        colored_vertex* vertex = result.vertices.data() + result.patch_vertex_offsets[p];
+        unsigned int* index    = result.indices.data() + result.patch_index_offsets[p];
+        unsigned int base      = result.patch_vertex_offsets[p];
+        int corner             = 0;
+        generate_patch_triangles(
+            levels[p],
+            [&](double u, double v, int edge, int) {
+                if (edge < 0 && corner < 4)
+                {
+                    // corners are copied to match the neighbors exactly
+                    vertex->position = patch.positions[corner];
+                    vertex->color    = patch.colors[corner];
+                    corner++;
+                }
+                else if (edge >= 0)
+                {
+                    double t = edge < 2 ? u : v;
+                    for (int c = 0; c < patch_coefficients::num_channels; c++)
+                    {
+                        const std::array<double, 4>& a = edges[edge][c];
+                        double value = ((a[3] * t + a[2]) * t + a[1]) * t + a[0];
+                        if (c < 2)
+                            vertex->position[c] = value;
+                        else
+                            vertex->color[c - 2] = value;
+                    }
+                }
+                else
+                {
+                    coefficients.evaluate(u, v, vertex->position, vertex->color);
+                }
+                vertex++;
+            },
+            [&](int a, int b, int c) {
+                *index++ = base + a;
+                *index++ = base + b;
+                *index++ = base + c;
+            });
+    });
+    return result;
+}
@@ -0,0 +1,453 @@
+#pragma once
+
+#include "curves.hpp"
+#include "mesh.hpp"
+#include "reader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Axis-aligned rectangle of a scene in scene units.
+ */
+struct viewport
+{
+    /**
+     * @brief Left edge.
+     */
+    int x = 0;
+    /**
+     * @brief Top edge.
+     */
+    int y = 0;
+    /**
+     * @brief Width.
+     */
+    int width = 0;
+    /**
+     * @brief Height.
+     */
+    int height = 0;
+};
+
+/**
+ * @brief Parameters of the viewport culling.
+ */
+struct culling_options
+{
+    /**
+     * @brief Distance in scene units around the viewport whose primitives are kept, because the solver lets them influence the viewport. The solution of a Poisson problem depends on the whole domain, so the margin trades exactness at the border of the viewport for speed.
+     */
+    double margin = 0;
+    /**
+     * @brief Removes the primitives outside the viewport and its margin. If disabled, the scene is only translated, e.g., for comparisons.
+     */
+    bool cull = true;
+    /**
+     * @brief Clips the first and last Bezier segment of every kept run of a curve to the domain. The clipped segments are flattened to other vertices than the whole ones, within the flattening tolerance, so pixels at the curves may be rasterized differently than in the whole scene; disable it where the cropped assembly must match the whole one exactly.
+     */
+    bool clip = true;
+};
+
+/**
+ * @brief Number of primitives of a scene.
+ */
+struct primitive_counts
+{
+    /**
+     * @brief Number of diffusion curves.
+     */
+    int diffusion_curves = 0;
+    /**
+     * @brief Number of cubic Bezier segments of the diffusion curves.
+     */
+    int diffusion_segments = 0;
+    /**
+     * @brief Number of Poisson curves.
+     */
+    int poisson_curves = 0;
+    /**
+     * @brief Number of cubic Bezier segments of the Poisson curves.
+     */
+    int poisson_segments = 0;
+    /**
+     * @brief Number of gradient meshes.
+     */
+    int gradient_meshes = 0;
+    /**
+     * @brief Number of patches of the gradient meshes.
+     */
+    int mesh_patches = 0;
+};
+
+/**
+ * @brief Counts the primitives of a scene.
+ * @param _scene Scene to count.
+ * @return Number of curves, segments, meshes and patches.
+ */
+inline primitive_counts count_primitives(const scene& _scene)
+{
+    primitive_counts counts;
+    counts.diffusion_curves = (int)_scene.diffusion_curves.size();
+    counts.poisson_curves   = (int)_scene.poisson_curves.size();
+    counts.gradient_meshes  = (int)_scene.gradient_meshes.size();
+    for (const diffusion_curve& curve : _scene.diffusion_curves)
+        counts.diffusion_segments += num_bezier_segments(curve.control_points);
+    for (const poisson_curve& curve : _scene.poisson_curves)
+        counts.poisson_segments += num_bezier_segments(curve.control_points);
+    for (const gradient_mesh& mesh : _scene.gradient_meshes)
+        counts.mesh_patches += mesh.num_rows * mesh.num_cols;
+    return counts;
+}
+
+/**
+ * @brief Primitive counts before and after culling.
+ */
+struct culling_statistics
+{
+    /**
+     * @brief Primitives of the input scene.
+     */
+    primitive_counts before;
+    /**
+     * @brief Primitives of the cropped scene.
+     */
+    primitive_counts after;
+};
+
+/**
+ * @brief Part of a scene around a viewport, translated such that its domain starts at the origin.
+ */
+struct cropped_scene
+{
+    /**
+     * @brief Primitives that may affect the viewport. The width and height of the scene are those of the domain, i.e., the viewport with its margin, clamped to the original scene.
+     */
+    scene content;
+    /**
+     * @brief Domain of the cropped scene in the coordinates of the original scene.
+     */
+    viewport domain;
+    /**
+     * @brief Viewport in the coordinates of the cropped scene, i.e., the part of the rendered domain that is shown.
+     */
+    viewport view;
+};
+
+/**
+ * @brief Restricts a chain of color points to a parameter interval and maps it to [0,1], piecewise linearly between knots.
+ * @details Knot j is the original parameter of the new parameter j/(n-1) for n knots, i.e., of the start of the j-th Bezier segment of the cropped chain. Where consecutive knot intervals differ in length, the mapping bends, so the color there is inserted as a color point of its own, which keeps the linear interpolation between the color points unchanged.
+ * @param _color_points Color points sorted by their parameter.
+ * @param _knots Increasing original parameters of the segment boundaries of the cropped chain, at least two.
+ * @return Color points of the interval, including interpolated ones at both ends and at the bends.
+ */
+inline std::vector<color_point_type> crop_color_points(const std::vector<color_point_type>& _color_points, const std::vector<double>& _knots)
+{
+    std::vector<color_point_type> result;
+    if (_color_points.empty())
+        return result;
+    int num_spans = (int)_knots.size() - 1;
+    auto insert = [&](double _t, double _u) {
+        color_type color = sample_color_points(_color_points, _t);
+        result.push_back(color_point_type{ color[0], color[1], color[2], _u });
+    };
+    insert(_knots.front(), 0);
+    std::vector<color_point_type>::const_iterator point = std::upper_bound(_color_points.begin(), _color_points.end(), _knots.front(),
+                                                                           [](double t, const color_point_type& cp) { return t < cp[3]; });
+    for (int span = 0; span < num_spans; span++)
+    {
+        double t0 = _knots[span], t1 = _knots[span + 1];
+        for (; point != _color_points.end() && (*point)[3] < t1; ++point)
+            result.push_back(color_point_type{ (*point)[0], (*point)[1], (*point)[2], (span + ((*point)[3] - t0) / (t1 - t0)) / num_spans });
+        if (span + 1 == num_spans)
+            insert(t1, 1);
+        else if (std::abs((t1 - t0) - (_knots[span + 2] - t1)) > 1e-12)
+            insert(t1, (double)(span + 1) / num_spans);
+    }
+    return result;
+}
+
+/**
+ * @brief Finds the parameter interval of a cubic Bezier segment outside of which it does not reach a rectangle.
+ * @details The segment is subdivided depth-first, discarding the parts whose control polygon misses the rectangle, down to 1/256 of the segment or until a control polygon lies inside the rectangle. The first and last kept parts give the interval, so the curve outside of it is cut off, while the part inside may still leave and reenter the rectangle.
+ * @param _p Control points of the segment.
+ * @param _min Minimum corner of the rectangle.
+ * @param _max Maximum corner of the rectangle.
+ * @param _t0 Output start of the interval.
+ * @param _t1 Output end of the interval.
+ * @return False if the segment misses the rectangle.
+ */
+inline bool clip_bezier(const point_type _p[4], const point_type& _min, const point_type& _max, double& _t0, double& _t1)
+{
+    struct subdivision
+    {
+        point_type p[4];
+        double t0, t1;
+        int depth;
+    };
+    const int max_depth = 8;
+    _t0 = 1, _t1 = 0;
+    std::vector<subdivision> stack(1, subdivision{ { _p[0], _p[1], _p[2], _p[3] }, 0, 1, 0 });
+    while (!stack.empty())
+    {
+        subdivision s = stack.back();
+        stack.pop_back();
+        if (s.t0 >= _t0 && s.t1 <= _t1)
+            continue;
+        point_type lower = s.p[0], upper = s.p[0];
+        for (int k = 1; k < 4; k++)
+        {
+            for (int d = 0; d < 2; d++)
+            {
+                lower[d] = std::min(lower[d], s.p[k][d]);
+                upper[d] = std::max(upper[d], s.p[k][d]);
+            }
+        }
+        if (upper[0] < _min[0] || lower[0] > _max[0] || upper[1] < _min[1] || lower[1] > _max[1])
+            continue;
+        bool inside = lower[0] >= _min[0] && upper[0] <= _max[0] && lower[1] >= _min[1] && upper[1] <= _max[1];
+        if (inside || s.depth == max_depth)
+        {
+            _t0 = std::min(_t0, s.t0);
+            _t1 = std::max(_t1, s.t1);
+            continue;
+        }
+
+        // de Casteljau split at the half, pushing the right half first so that the left half is visited first
+        point_type p01, p12, p23, p012, p123, mid;
+        for (int d = 0; d < 2; d++)
+        {
+            p01[d]  = 0.5 * (s.p[0][d] + s.p[1][d]);
+            p12[d]  = 0.5 * (s.p[1][d] + s.p[2][d]);
+            p23[d]  = 0.5 * (s.p[2][d] + s.p[3][d]);
+            p012[d] = 0.5 * (p01[d] + p12[d]);
+            p123[d] = 0.5 * (p12[d] + p23[d]);
+            mid[d]  = 0.5 * (p012[d] + p123[d]);
+        }
+        double t_mid = 0.5 * (s.t0 + s.t1);
+        stack.push_back(subdivision{ { mid, p123, p23, s.p[3] }, t_mid, s.t1, s.depth + 1 });
+        stack.push_back(subdivision{ { s.p[0], p01, p012, mid }, s.t0, t_mid, s.depth + 1 });
+    }
+    return _t0 < _t1;
+}
+
+/**
+ * @brief Control points of the part of a cubic Bezier segment between two parameters.
+ * @param _p Control points of the segment.
+ * @param _t0 Start of the part.
+ * @param _t1 End of the part, larger than the start.
+ * @param _part Output control points of the part.
+ */
+inline void bezier_part(const point_type _p[4], double _t0, double _t1, point_type _part[4])
+{
+    // de Casteljau split at a parameter, keeping the left or the right part
+    auto split = [](const point_type _q[4], double _t, bool _left, point_type _out[4]) {
+        point_type q01, q12, q23, q012, q123, mid;
+        for (int d = 0; d < 2; d++)
+        {
+            q01[d]  = _q[0][d] + _t * (_q[1][d] - _q[0][d]);
+            q12[d]  = _q[1][d] + _t * (_q[2][d] - _q[1][d]);
+            q23[d]  = _q[2][d] + _t * (_q[3][d] - _q[2][d]);
+            q012[d] = q01[d] + _t * (q12[d] - q01[d]);
+            q123[d] = q12[d] + _t * (q23[d] - q12[d]);
+            mid[d]  = q012[d] + _t * (q123[d] - q012[d]);
+        }
+        point_type left[4] = { _q[0], q01, q012, mid }, right[4] = { mid, q123, q23, _q[3] };
+        for (int k = 0; k < 4; k++)
+            _out[k] = _left ? left[k] : right[k];
+    };
+    point_type head[4];
+    split(_p, _t1, true, head);
+    split(head, _t0 / _t1, false, _part);
+}
+
+/**
+ * @brief Finds the runs of consecutive Bezier segments of a chain whose control polygon overlaps a rectangle.
+ * @details The curve lies in the convex hull of its control points, so segments whose control points lie outside the rectangle cannot reach it.
+ * @param _control_points Control points of the chain, stored as 3n+1 points.
+ * @param _min Minimum corner of the rectangle.
+ * @param _max Maximum corner of the rectangle.
+ * @return Pairs of first segment and one past the last segment of each run.
+ */
+inline std::vector<std::pair<int, int>> visible_bezier_runs(const std::vector<point_type>& _control_points, const point_type& _min, const point_type& _max)
+{
+    std::vector<std::pair<int, int>> runs;
+    int num_segments = num_bezier_segments(_control_points);
+    for (int segment = 0; segment < num_segments; segment++)
+    {
+        point_type lower = _control_points[3 * segment], upper = lower;
+        for (int k = 1; k <= 3; k++)
+        {
+            for (int d = 0; d < 2; d++)
+            {
+                lower[d] = std::min(lower[d], _control_points[3 * segment + k][d]);
+                upper[d] = std::max(upper[d], _control_points[3 * segment + k][d]);
+            }
+        }
+        if (upper[0] < _min[0] || lower[0] > _max[0] || upper[1] < _min[1] || lower[1] > _max[1])
+            continue;
+        if (!runs.empty() && runs.back().second == segment)
+            runs.back().second++;
+        else
+            runs.push_back(std::make_pair(segment, segment + 1));
+    }
+    return runs;
+}
+
+/**
+ * @brief Crops a scene to a viewport plus margin before flattening and rasterization.
+ * @details Diffusion and Poisson curves are split into the runs of Bezier segments that overlap the domain, and unless disabled, the first and last segment of each run are clipped to the parameter interval in which they reach the domain, so that long segments that only graze it are not flattened and rasterized along their whole length. Each run becomes a curve of its own, with its color points or weights restricted to its parameter interval, so that all later stages see the same colors as for the full curve. Gradient meshes are cropped to the rectangular range of rows and columns whose patches overlap the domain, plus one ring of control points, so that the finite-difference tangents of the kept patches do not change; meshes without overlapping patches are removed. Everything is translated by the origin of the domain. Rendering the cropped scene at the scale of the full image and cutting out the view gives the viewport.
+ * @param _scene Scene to crop.
+ * @param _viewport Rectangle of the scene to show.
+ * @param _options Margin and culling switch.
+ * @param _stats Optional output of the primitive counts.
+ * @return Cropped scene with its domain and view.
+ */
+inline cropped_scene crop_scene(const scene& _scene, const viewport& _viewport, const culling_options& _options, culling_statistics* _stats = nullptr)
+{
+    cropped_scene result;
+    int margin           = (int)std::ceil(std::max(0.0, _options.margin));
+    result.domain.x      = std::max(0, _viewport.x - margin);
+    result.domain.y      = std::max(0, _viewport.y - margin);
+    result.domain.width  = std::min(_scene.width, _viewport.x + _viewport.width + margin) - result.domain.x;
+    result.domain.height = std::min(_scene.height, _viewport.y + _viewport.height + margin) - result.domain.y;
+    result.view          = _viewport;
+    result.view.x        = _viewport.x - result.domain.x;
+    result.view.y        = _viewport.y - result.domain.y;
+
+    scene& content = result.content;
+    content.width  = result.domain.width;
+    content.height = result.domain.height;
+    point_type origin = { (double)result.domain.x, (double)result.domain.y };
+    point_type lower  = { 0, 0 }, upper = { (double)content.width, (double)content.height };
+    auto translate = [&origin](const point_type& _point) { return point_type{ _point[0] - origin[0], _point[1] - origin[1] }; };
+
+    // copies a run of translated Bezier segments with its first and last segment clipped to the domain, and the original parameters of the segment boundaries
+    auto clip_run = [&](const std::vector<point_type>& _translated, const std::pair<int, int>& _run, std::vector<point_type>& _points, std::vector<double>& _knots) {
+        _points.clear();
+        _knots.clear();
+        if (!_options.cull)
+        {
+            _points = _translated;
+            _knots  = { 0.0, 1.0 };
+            return;
+        }
+        int num_segments = num_bezier_segments(_translated);
+        for (int segment = _run.first; segment < _run.second; segment++)
+        {
+            const point_type* p = &_translated[3 * segment];
+            double t0 = 0, t1 = 1, clip0, clip1;
+            if (_options.clip && (segment == _run.first || segment + 1 == _run.second) && clip_bezier(p, lower, upper, clip0, clip1))
+            {
+                t0 = segment == _run.first ? clip0 : 0;
+                t1 = segment + 1 == _run.second ? clip1 : 1;
+            }
+            point_type part[4] = { p[0], p[1], p[2], p[3] };
+            if (t0 > 0 || t1 < 1)
+                bezier_part(p, t0, t1, part);
+            if (_points.empty())
+            {
+                _points.push_back(part[0]);
+                _knots.push_back((segment + t0) / num_segments);
+            }
+            _points.insert(_points.end(), part + 1, part + 4);
+            _knots.push_back((segment + t1) / num_segments);
+        }
+    };
+
+    std::vector<point_type> translated, points;
+    std::vector<double> knots;
+    for (const diffusion_curve& curve : _scene.diffusion_curves)
+    {
+        int num_segments = num_bezier_segments(curve.control_points);
+        translated.clear();
+        for (const point_type& point : curve.control_points)
+            translated.push_back(translate(point));
+        std::vector<std::pair<int, int>> runs = _options.cull ? visible_bezier_runs(translated, lower, upper) : std::vector<std::pair<int, int>>(1, std::make_pair(0, num_segments));
+        for (const std::pair<int, int>& run : runs)
+        {
+            clip_run(translated, run, points, knots);
+            diffusion_curve part = curve;
+            part.control_points  = points;
+            if (knots.front() > 0 || knots.back() < 1)
+            {
+                part.colors_left  = crop_color_points(curve.colors_left, knots);
+                part.colors_right = crop_color_points(curve.colors_right, knots);
+            }
+            content.diffusion_curves.push_back(part);
+        }
+    }
+
+    for (const poisson_curve& curve : _scene.poisson_curves)
+    {
+        int num_segments = num_bezier_segments(curve.control_points);
+        translated.clear();
+        for (const point_type& point : curve.control_points)
+            translated.push_back(translate(point));
+        std::vector<std::pair<int, int>> runs = _options.cull ? visible_bezier_runs(translated, lower, upper) : std::vector<std::pair<int, int>>(1, std::make_pair(0, num_segments));
+        for (const std::pair<int, int>& run : runs)
+        {
+            clip_run(translated, run, points, knots);
+            poisson_curve part;
+            part.control_points = points;
+            part.weights        = knots.front() > 0 || knots.back() < 1 ? crop_color_points(curve.weights, knots) : curve.weights;
+            content.poisson_curves.push_back(part);
+        }
+    }
+
+    std::vector<mesh_patch> patches = _options.cull ? mesh_patches(_scene) : std::vector<mesh_patch>();
+    for (size_t m = 0; m < _scene.gradient_meshes.size(); m++)
+    {
+        const gradient_mesh& mesh = _scene.gradient_meshes[m];
+        int row0 = 0, row1 = mesh.num_rows, col0 = 0, col1 = mesh.num_cols;
+        if (_options.cull)
+        {
+            row0 = mesh.num_rows, row1 = 0, col0 = mesh.num_cols, col1 = 0;
+            for (const mesh_patch& patch : patches)
+            {
+                if (patch.mesh != (int)m)
+                    continue;
+                point_type patch_min, patch_max;
+                patch_bounds(patch, patch_min, patch_max);
+                if (patch_max[0] < origin[0] || patch_min[0] > origin[0] + upper[0] || patch_max[1] < origin[1] || patch_min[1] > origin[1] + upper[1])
+                    continue;
+                row0 = std::min(row0, patch.row), row1 = std::max(row1, patch.row + 1);
+                col0 = std::min(col0, patch.col), col1 = std::max(col1, patch.col + 1);
+            }
+            if (row0 >= row1)
+                continue;
+            // one ring of control points keeps the finite differences at the kept corners
+            row0 = std::max(0, row0 - 1), row1 = std::min(mesh.num_rows, row1 + 1);
+            col0 = std::max(0, col0 - 1), col1 = std::min(mesh.num_cols, col1 + 1);
+        }
+
+        gradient_mesh part;
+        part.num_rows = row1 - row0;
+        part.num_cols = col1 - col0;
+        bool has_tangents = !mesh.tangents_u.empty();
+        for (int row = row0; row <= row1; row++)
+        {
+            for (int col = col0; col <= col1; col++)
+            {
+                int index = mesh_index(mesh, row, col);
+                part.positions.push_back(translate(mesh.positions[index]));
+                part.colors.push_back(mesh.colors[index]);
+                if (has_tangents)
+                {
+                    part.tangents_u.push_back(mesh.tangents_u[index]);
+                    part.tangents_v.push_back(mesh.tangents_v[index]);
+                }
+            }
+        }
+        content.gradient_meshes.push_back(part);
+    }
+
+    if (_stats != nullptr)
+    {
+        _stats->before = count_primitives(_scene);
+        _stats->after  = count_primitives(content);
+    }
+    return result;
+}
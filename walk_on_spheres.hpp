@@ -0,0 +1,1341 @@
+#pragma once
+
+#include "curves.hpp"
+#include "grid.hpp"
+#include "image.hpp"
+#include "inverse_mapping.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "viewport.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Parameters of the walk-on-spheres evaluator.
+ */
+struct walk_on_spheres_options
+{
+    /**
+     * @brief Maximum distance between the curves and their polylines in scene units.
+     */
+    double tolerance = 0.1;
+    /**
+     * @brief Width of the shell around the boundaries in scene units, in which a walk stops at the closest boundary point.
+     */
+    double epsilon = 0.05;
+    /**
+     * @brief Largest radius in scene units of the half disks that reflect a walk at a Neumann side.
+     */
+    double neumann_radius = 4;
+    /**
+     * @brief Maximum number of steps per walk.
+     */
+    int max_steps = 500;
+    /**
+     * @brief Edge length in scene units of the cells of the segment index.
+     */
+    double cell_size = 8;
+    /**
+     * @brief Edge length in scene units of the cells of the flood fill that finds the pockets enclosed by Neumann sides.
+     */
+    double pocket_cell_size = 1;
+};
+
+/**
+ * @brief Counters of a batch of walks.
+ */
+struct walk_statistics
+{
+    /**
+     * @brief Number of walks.
+     */
+    long long walks = 0;
+    /**
+     * @brief Total number of steps of all walks.
+     */
+    long long steps = 0;
+    /**
+     * @brief Number of walks that reached the maximum number of steps without hitting a Dirichlet boundary.
+     */
+    long long unfinished = 0;
+    /**
+     * @brief Time of the batch in milliseconds.
+     */
+    double walk_ms = 0;
+
+    /**
+     * @brief Adds the counters of another batch.
+     * @param _other Counters to add.
+     */
+    void add(const walk_statistics& _other)
+    {
+        walks += _other.walks;
+        steps += _other.steps;
+        unfinished += _other.unfinished;
+        walk_ms += _other.walk_ms;
+    }
+};
+
+/**
+ * @brief Random numbers of one walk, derived by hashing a seed, a stream, e.g., a pixel, and the index of the walk.
+ * @details Every walk owns its sequence, so the estimate of a pixel does not depend on the number of threads or on how its walks are split into batches.
+ */
+class walk_random
+{
+public:
+    /**
+     * @brief Creates the sequence of a walk.
+     * @param _seed Seed of the whole evaluation.
+     * @param _stream Stream, e.g., the index of a pixel.
+     * @param _walk Index of the walk within the stream.
+     */
+    walk_random(uint64_t _seed, uint64_t _stream, uint64_t _walk)
+        : state(mix(mix(mix(_seed) ^ _stream) ^ _walk))
+    {
+    }
+
+    /**
+     * @brief Draws the next number (SplitMix64).
+     * @return Uniform number in [0,1).
+     */
+    double uniform()
+    {
+        state += 0x9e3779b97f4a7c15ull;
+        return (double)(mix(state) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    /**
+     * @brief Finalizer of SplitMix64.
+     * @param _value Value to scramble.
+     * @return Scrambled value.
+     */
+    static uint64_t mix(uint64_t _value)
+    {
+        _value = (_value ^ (_value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        _value = (_value ^ (_value >> 27)) * 0x94d049bb133111ebull;
+        return _value ^ (_value >> 31);
+    }
+
+    /**
+     * @brief Current state.
+     */
+    uint64_t state;
+};
+
+/**
+ * @brief Monte Carlo evaluator of the Poisson problem of a scene at arbitrary points, without a grid.
+ * @details A walk on spheres jumps from its start to a uniformly random point on the largest circle around it that contains no boundary, until it comes within epsilon of a boundary, whose color it returns; the mean over many walks converges to the solution at the start. The boundaries are the diffusion curves and the borders of the gradient meshes, flattened and clipped to the scene, and found by closest-point queries on a uniform grid of segments. The queries skip the rings of empty cells around a point, and more than a cell away from the boundary, the distance at the center of the cell minus the offset of the point bounds the radius without a query:
+ * - A Dirichlet side of a diffusion curve returns its color from colors_left or colors_right, as the rasterized constraints do.
+ * - A Neumann side reflects the walk to a random point on a half disk around the closest point, which is exact for straight curves.
+ * - The image border reflects as well, by mirroring the scene at the border: the walks are folded back into the image, and the source integrals include the mirror images of the Poisson curves. The closest-point queries need no mirror images, since the mirror image of a point in the scene is never closer to a segment in the scene than the point itself.
+ * - Inside a gradient mesh, the solution is the color of the mesh plus a harmonic correction, which vanishes at the mesh borders and the image border and takes the difference to the curve colors at diffusion curves. Walks that start inside a mesh thus estimate the correction, and walks outside return the mesh color at its borders.
+ * - A pocket that Neumann sides enclose has no Dirichlet boundary, and a walk would never leave it. As on the grid, its solution is the mean color of the constraints across its closed edges, and walks that start in it return this color right away. The pockets are found lazily, by a flood fill from the start of the first walk in each region on a grid of pocket_cell_size, and only if a diffusion curve has a Neumann side.
+ * The Poisson curves do not stop the walks. Their source is integrated exactly over the segments inside each circle against the Green's function of the disk and subtracted, as density per scene unit of length of the weights divided by the scene width, which matches the splatted source of the grid.
+ */
+class walk_on_spheres
+{
+public:
+    /**
+     * @brief Prepares the boundaries and sources of a scene.
+     * @param _scene Scene to evaluate.
+     * @param _options Parameters of the evaluator.
+     */
+    walk_on_spheres(const scene& _scene, const walk_on_spheres_options& _options)
+        : options(_options)
+        , width(_scene.width)
+        , height(_scene.height)
+        , diffusion_curves(_scene.diffusion_curves)
+        , mapping(mesh_patches(_scene), _scene.width, _scene.height, _scene.width, _scene.height, inverse_mapping_options())
+    {
+        flattened_scene curves(_scene, options.tolerance);
+        add_diffusion_curves(curves);
+        add_mesh_borders(_scene);
+        add_poisson_curves(_scene, curves);
+        boundary_index.build(boundary, width, height, options.cell_size);
+        source_index.build(sources, width, height, options.cell_size);
+        clearances.resize((size_t)boundary_index.cells_x * boundary_index.cells_y);
+        parallel_for(0, boundary_index.cells_y, [&](int y) {
+            for (int x = 0; x < boundary_index.cells_x; x++)
+            {
+                point_type center = { (x + 0.5) * boundary_index.cell_size, (y + 0.5) * boundary_index.cell_size };
+                clearances[(size_t)y * boundary_index.cells_x + x] = closest(center, std::numeric_limits<double>::infinity(), -1).distance;
+            }
+        });
+        for (source_segment& segment : sources)
+            source_index.cell_range(segment.p0, segment.p1, segment.cells);
+        for (const diffusion_curve& curve : diffusion_curves)
+        {
+            if (curve.boundary_left == boundary_condition::Neumann || curve.boundary_right == boundary_condition::Neumann)
+            {
+                pocket_size   = std::max(1e-6, options.pocket_cell_size);
+                pocket_x      = std::max(1, (int)std::ceil(width / pocket_size));
+                pocket_y      = std::max(1, (int)std::ceil(height / pocket_size));
+                pocket_labels = std::vector<std::atomic<int>>((size_t)pocket_x * pocket_y);
+                for (std::atomic<int>& label : pocket_labels)
+                    label.store(unknown_cell);
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Parameters of the evaluator.
+     */
+    walk_on_spheres_options options;
+    /**
+     * @brief Width of the scene.
+     */
+    double width;
+    /**
+     * @brief Height of the scene.
+     */
+    double height;
+
+    /**
+     * @brief Number of boundary segments, i.e., of the diffusion curves and the visible mesh borders.
+     * @return Number of segments.
+     */
+    int num_boundary_segments() const
+    {
+        return (int)boundary.size();
+    }
+
+    /**
+     * @brief Number of segments of the Poisson curves.
+     * @return Number of segments.
+     */
+    int num_source_segments() const
+    {
+        return (int)sources.size();
+    }
+
+    /**
+     * @brief Runs one walk.
+     * @param _point Start in scene units.
+     * @param _random Random numbers of the walk.
+     * @param _stats Counters to update.
+     * @return Estimate of the solution at the start.
+     */
+    color_type sample(const point_type& _point, walk_random& _random, walk_statistics& _stats) const
+    {
+        const double pi = 3.14159265358979323846;
+        _stats.walks++;
+        color_type result = { 0, 0, 0 };
+        if (pocket_color(_point, result))
+            return result;
+        bool inside  = mesh_color(_point, result);
+        point_type p = _point;
+        for (int step = 0; step < options.max_steps; step++)
+        {
+            _stats.steps++;
+            double border = inside ? std::min(std::min(p[0], width - p[0]), std::min(p[1], height - p[1])) : std::numeric_limits<double>::infinity();
+            double cap    = std::min(border, 0.5 * std::min(width, height));
+            // more than a cell away from the boundary, the clearance is a safe radius that saves the search
+            closest_point hit;
+            hit.segment  = -1;
+            double bound = clearance(p);
+            if (bound >= std::min(cap, boundary_index.cell_size))
+                cap = std::min(cap, bound);
+            else
+                hit = closest(p, cap, -1);
+            if (hit.segment < 0 && border <= options.epsilon)
+                return result;
+            if (hit.segment >= 0 && hit.distance <= options.epsilon)
+            {
+                const boundary_segment& segment = boundary[hit.segment];
+                point_type foot = segment.point(hit.t);
+                if (segment.curve < 0)
+                {
+                    // the mesh border keeps the color of its own mesh on the inside
+                    if (!inside)
+                        add(result, border_color(segment, hit.t), 1);
+                    return result;
+                }
+                const diffusion_curve& curve = diffusion_curves[segment.curve];
+                bool left                    = on_left(hit);
+                if ((left ? curve.boundary_left : curve.boundary_right) == boundary_condition::Dirichlet)
+                {
+                    add(result, sample_color_points(left ? curve.colors_left : curve.colors_right, segment.t0 + hit.t * (segment.t1 - segment.t0)), 1);
+                    color_type mesh;
+                    if (inside && mesh_color(foot, mesh))
+                        add(result, mesh, -1);
+                    return result;
+                }
+                p = reflect(hit, foot, inside, _random);
+                continue;
+            }
+
+            double radius = hit.segment >= 0 ? hit.distance : cap;
+            add(result, source_integral(p, radius, !inside), -1);
+            double angle = 2 * pi * _random.uniform();
+            p            = point_type{ p[0] + radius * std::cos(angle), p[1] + radius * std::sin(angle) };
+            if (!inside)
+                p = point_type{ fold(p[0], width), fold(p[1], height) };
+        }
+
+        // like the balancing of the floating regions, take the color across the nearest curve
+        _stats.unfinished++;
+        closest_point hit = closest(p, std::numeric_limits<double>::infinity(), -1);
+        if (hit.segment >= 0 && boundary[hit.segment].curve >= 0)
+        {
+            const boundary_segment& segment = boundary[hit.segment];
+            const diffusion_curve& curve    = diffusion_curves[segment.curve];
+            bool left                       = !on_left(hit);
+            if ((left ? curve.boundary_left : curve.boundary_right) == boundary_condition::Dirichlet && !inside)
+                add(result, sample_color_points(left ? curve.colors_left : curve.colors_right, segment.t0 + hit.t * (segment.t1 - segment.t0)), 1);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Estimates the solution at a point.
+     * @param _point Point in scene units.
+     * @param _num_walks Number of walks.
+     * @param _seed Seed of the random numbers; the point uses stream zero.
+     * @param _stats Optional output of the counters.
+     * @return Mean of the walks.
+     */
+    color_type evaluate(const point_type& _point, int _num_walks, uint64_t _seed = 0, walk_statistics* _stats = nullptr) const
+    {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now();
+        walk_statistics stats;
+        color_type sum = { 0, 0, 0 };
+        for (int walk = 0; walk < _num_walks; walk++)
+        {
+            walk_random random(_seed, 0, walk);
+            add(sum, sample(_point, random, stats), 1);
+        }
+        for (int c = 0; c < 3; c++)
+            sum[c] /= std::max(1, _num_walks);
+        stats.walk_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (_stats != nullptr)
+            *_stats = stats;
+        return sum;
+    }
+
+private:
+    /**
+     * @brief Segment of a diffusion curve or of a mesh border in scene units.
+     */
+    struct boundary_segment
+    {
+        /**
+         * @brief End points, clipped to the scene.
+         */
+        point_type p0, p1;
+        /**
+         * @brief Inverse of the squared length, or zero for a degenerate segment, to project points onto the segment.
+         */
+        double inverse_length_squared;
+        /**
+         * @brief Global curve parameters at the end points, for diffusion curves.
+         */
+        double t0, t1;
+        /**
+         * @brief Patch parameters at the end points, for mesh borders.
+         */
+        std::array<double, 2> uv0, uv1;
+        /**
+         * @brief Index of the diffusion curve, or -1 for a mesh border.
+         */
+        int curve;
+        /**
+         * @brief Patch of a mesh border.
+         */
+        int patch;
+        /**
+         * @brief Adjacent segments of the same polyline, or -1, to decide the side at a vertex.
+         */
+        int previous, next;
+
+        /**
+         * @brief Point on the segment.
+         * @param _t Parameter in [0,1] from p0 to p1.
+         * @return Point.
+         */
+        point_type point(double _t) const
+        {
+            return point_type{ p0[0] + _t * (p1[0] - p0[0]), p0[1] + _t * (p1[1] - p0[1]) };
+        }
+    };
+
+    /**
+     * @brief Segment of a Poisson curve with the source densities at its end points and its cell range in the index.
+     */
+    struct source_segment
+    {
+        /**
+         * @brief End points, clipped to the scene.
+         */
+        point_type p0, p1;
+        /**
+         * @brief Source densities at the end points, per scene unit of length.
+         */
+        color_type w0, w1;
+        /**
+         * @brief Cell range of the bounding box in the source index, see segment_grid::cell_range.
+         */
+        std::array<int, 4> cells;
+    };
+
+    /**
+     * @brief Uniform grid over the scene that lists the segments whose bounding box overlaps each cell.
+     */
+    struct segment_grid
+    {
+        /**
+         * @brief Number of cells per row and per column.
+         */
+        int cells_x = 0, cells_y = 0;
+        /**
+         * @brief Edge length of the cells in scene units.
+         */
+        double cell_size = 1;
+        /**
+         * @brief Segments of cell i at entries[offsets[i]] to entries[offsets[i + 1] - 1], in compressed row storage.
+         */
+        std::vector<int> offsets, entries;
+        /**
+         * @brief Chebyshev distance in cells from every cell to the nearest cell with segments, i.e., the number of rings around the cell without segments. A point is at least (rings - 1) * cell_size away from every segment.
+         */
+        std::vector<int> empty_rings;
+
+        /**
+         * @brief Clamped cell range (x0, y0, x1, y1), inclusive, of the bounding box of two points.
+         */
+        void cell_range(const point_type& _a, const point_type& _b, std::array<int, 4>& _range) const
+        {
+            _range[0] = cell(std::min(_a[0], _b[0]), cells_x);
+            _range[1] = cell(std::min(_a[1], _b[1]), cells_y);
+            _range[2] = cell(std::max(_a[0], _b[0]), cells_x);
+            _range[3] = cell(std::max(_a[1], _b[1]), cells_y);
+        }
+
+        /**
+         * @brief Cell of a coordinate along one axis, clamped to the grid.
+         * @param _coordinate Coordinate in scene units.
+         * @param _cells Number of cells along the axis.
+         * @return Index of the cell.
+         */
+        int cell(double _coordinate, int _cells) const
+        {
+            return std::min(_cells - 1, std::max(0, (int)std::floor(_coordinate / cell_size)));
+        }
+
+        /**
+         * @brief Sorts segments into the cells that their bounding boxes overlap, and computes the empty rings.
+         * @tparam Segment Segment type with end points p0 and p1.
+         * @param _segments Segments in scene units.
+         * @param _width Width of the scene.
+         * @param _height Height of the scene.
+         * @param _cell_size Edge length of the cells.
+         */
+        template <typename Segment>
+        void build(const std::vector<Segment>& _segments, double _width, double _height, double _cell_size)
+        {
+            cell_size = std::max(1e-6, _cell_size);
+            cells_x   = std::max(1, (int)std::ceil(_width / cell_size));
+            cells_y   = std::max(1, (int)std::ceil(_height / cell_size));
+            offsets.assign((size_t)cells_x * cells_y + 1, 0);
+            std::array<int, 4> range;
+            for (const Segment& segment : _segments)
+            {
+                cell_range(segment.p0, segment.p1, range);
+                for (int y = range[1]; y <= range[3]; y++)
+                    for (int x = range[0]; x <= range[2]; x++)
+                        offsets[(size_t)y * cells_x + x + 1]++;
+            }
+            for (size_t i = 1; i < offsets.size(); i++)
+                offsets[i] += offsets[i - 1];
+            entries.resize(offsets.back());
+            std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < _segments.size(); i++)
+            {
+                cell_range(_segments[i].p0, _segments[i].p1, range);
+                for (int y = range[1]; y <= range[3]; y++)
+                    for (int x = range[0]; x <= range[2]; x++)
+                        entries[cursor[(size_t)y * cells_x + x]++] = (int)i;
+            }
+
+            // two-pass distance transform, where all eight neighbors are one ring apart
+            const int far = std::max(cells_x, cells_y) + 1;
+            empty_rings.resize((size_t)cells_x * cells_y);
+            for (size_t cell = 0; cell < empty_rings.size(); cell++)
+                empty_rings[cell] = offsets[cell + 1] > offsets[cell] ? 0 : far;
+            auto relax = [&](int _x, int _y, int _dx, int _dy) {
+                int x = _x + _dx, y = _y + _dy;
+                if (x >= 0 && x < cells_x && y >= 0 && y < cells_y)
+                {
+                    int& rings = empty_rings[(size_t)_y * cells_x + _x];
+                    rings      = std::min(rings, empty_rings[(size_t)y * cells_x + x] + 1);
+                }
+            };
+            for (int y = 0; y < cells_y; y++)
+            {
+                for (int x = 0; x < cells_x; x++)
+                {
+                    relax(x, y, -1, 0);
+                    relax(x, y, -1, -1);
+                    relax(x, y, 0, -1);
+                    relax(x, y, 1, -1);
+                }
+            }
+            for (int y = cells_y - 1; y >= 0; y--)
+            {
+                for (int x = cells_x - 1; x >= 0; x--)
+                {
+                    relax(x, y, 1, 0);
+                    relax(x, y, 1, 1);
+                    relax(x, y, 0, 1);
+                    relax(x, y, -1, 1);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Result of a closest-point query.
+     */
+    struct closest_point
+    {
+        /**
+         * @brief Distance to the closest point, or the radius of the search if there is none.
+         */
+        double distance;
+        /**
+         * @brief Boundary segment of the closest point, or -1.
+         */
+        int segment;
+        /**
+         * @brief Parameter of the closest point on the segment in [0,1].
+         */
+        double t;
+        /**
+         * @brief Query point, whose side of the segment decides the boundary condition.
+         */
+        point_type walker;
+    };
+
+    /**
+     * @brief Diffusion curves of the scene, for their colors and boundary conditions.
+     */
+    std::vector<diffusion_curve> diffusion_curves;
+    /**
+     * @brief Inverse mapping of the gradient meshes in scene units.
+     */
+    mesh_inverse_mapping mapping;
+    /**
+     * @brief Segments of the diffusion curves and the visible mesh borders.
+     */
+    std::vector<boundary_segment> boundary;
+    /**
+     * @brief Segments of the Poisson curves.
+     */
+    std::vector<source_segment> sources;
+    /**
+     * @brief Index of the boundary segments.
+     */
+    segment_grid boundary_index;
+    /**
+     * @brief Index of the Poisson curve segments.
+     */
+    segment_grid source_index;
+    /**
+     * @brief Distance from the center of every cell of the boundary index to the nearest boundary segment.
+     */
+    std::vector<double> clearances;
+    /**
+     * @brief Labels of the cells of the pocket grid, see fill_pocket.
+     */
+    enum pocket_label
+    {
+        open_cell    = -1,
+        unknown_cell = -2,
+        queued_cell  = -3
+    };
+    /**
+     * @brief Edge length of the cells of the pocket grid.
+     */
+    double pocket_size = 1;
+    /**
+     * @brief Number of cells of the pocket grid per row and per column.
+     */
+    int pocket_x = 0, pocket_y = 0;
+    /**
+     * @brief Label of every cell of the pocket grid, i.e., the index of its pocket or a pocket_label, filled lazily; empty if no curve has a Neumann side.
+     */
+    mutable std::vector<std::atomic<int>> pocket_labels;
+    /**
+     * @brief Color of every pocket found so far.
+     */
+    mutable std::vector<color_type> pocket_colors;
+    /**
+     * @brief Guards the flood fills and the pocket colors.
+     */
+    mutable std::mutex pocket_mutex;
+
+    /**
+     * @brief Adds a weighted color to a sum.
+     * @param _sum Sum to add to.
+     * @param _value Color to add.
+     * @param _weight Weight of the color.
+     */
+    static void add(color_type& _sum, const color_type& _value, double _weight)
+    {
+        for (int c = 0; c < 3; c++)
+            _sum[c] += _weight * _value[c];
+    }
+
+    /**
+     * @brief Folds a coordinate of the plane, tiled with mirror images of the scene, back into the scene.
+     * @param _x Coordinate.
+     * @param _size Extent of the scene along the coordinate.
+     * @return Coordinate in [0, _size].
+     */
+    static double fold(double _x, double _size)
+    {
+        double period = 2 * _size;
+        double x      = std::fmod(_x, period);
+        if (x < 0)
+            x += period;
+        return x > _size ? period - x : x;
+    }
+
+    /**
+     * @brief Clips a segment to the scene (Liang-Barsky).
+     * @param _p0 First end point.
+     * @param _p1 Second end point.
+     * @param _s0 Output parameter of the first clipped end point.
+     * @param _s1 Output parameter of the second clipped end point.
+     * @return True if a part of positive length remains.
+     */
+    bool clip(const point_type& _p0, const point_type& _p1, double& _s0, double& _s1) const
+    {
+        _s0 = 0, _s1 = 1;
+        double upper[2] = { width, height };
+        for (int d = 0; d < 2 && _s0 < _s1; d++)
+        {
+            double delta = _p1[d] - _p0[d];
+            if (delta == 0)
+            {
+                if (_p0[d] < 0 || _p0[d] > upper[d])
+                    _s1 = _s0;
+                continue;
+            }
+            double enter = -_p0[d] / delta, leave = (upper[d] - _p0[d]) / delta;
+            if (enter > leave)
+                std::swap(enter, leave);
+            _s0 = std::max(_s0, enter);
+            _s1 = std::min(_s1, leave);
+        }
+        return _s0 < _s1;
+    }
+
+    /**
+     * @brief Appends a clipped boundary segment.
+     * @param _p0 First end point before clipping.
+     * @param _p1 Second end point before clipping.
+     * @param _s0 Parameter of the first clipped end point.
+     * @param _s1 Parameter of the second clipped end point.
+     * @param _segment Segment with the parameters at the unclipped end points, completed here.
+     */
+    void add_boundary(const point_type& _p0, const point_type& _p1, double _s0, double _s1, boundary_segment _segment)
+    {
+        _segment.p0 = point_type{ _p0[0] + _s0 * (_p1[0] - _p0[0]), _p0[1] + _s0 * (_p1[1] - _p0[1]) };
+        _segment.p1 = point_type{ _p0[0] + _s1 * (_p1[0] - _p0[0]), _p0[1] + _s1 * (_p1[1] - _p0[1]) };
+        double dx = _segment.p1[0] - _segment.p0[0], dy = _segment.p1[1] - _segment.p0[1];
+        _segment.inverse_length_squared = dx * dx + dy * dy > 0 ? 1 / (dx * dx + dy * dy) : 0;
+        double t0 = _segment.t0, t1 = _segment.t1;
+        _segment.t0 = t0 + _s0 * (t1 - t0);
+        _segment.t1 = t0 + _s1 * (t1 - t0);
+        std::array<double, 2> uv0 = _segment.uv0, uv1 = _segment.uv1;
+        for (int d = 0; d < 2; d++)
+        {
+            _segment.uv0[d] = uv0[d] + _s0 * (uv1[d] - uv0[d]);
+            _segment.uv1[d] = uv0[d] + _s1 * (uv1[d] - uv0[d]);
+        }
+        boundary.push_back(_segment);
+    }
+
+    /**
+     * @brief Adds the segments of the diffusion curves, linking the neighbors that were not clipped apart.
+     * @param _curves Flattened curves of the scene.
+     */
+    void add_diffusion_curves(const flattened_scene& _curves)
+    {
+        for (size_t i = 0; i < _curves.diffusion_curves.size(); i++)
+        {
+            const polyline& line = _curves.diffusion_curves[i];
+            int first = (int)boundary.size(), previous = -1;
+            for (int e = 0; e < line.num_segments(); e++)
+            {
+                double s0, s1;
+                if (!clip(line.points[e], line.points[e + 1], s0, s1))
+                {
+                    previous = -1;
+                    continue;
+                }
+                boundary_segment segment;
+                segment.t0       = line.params[e];
+                segment.t1       = line.params[e + 1];
+                segment.uv0      = { { 0, 0 } };
+                segment.uv1      = { { 0, 0 } };
+                segment.curve    = (int)i;
+                segment.patch    = -1;
+                segment.previous = s0 == 0 ? previous : -1;
+                segment.next     = -1;
+                if (segment.previous >= 0)
+                    boundary[segment.previous].next = (int)boundary.size();
+                add_boundary(line.points[e], line.points[e + 1], s0, s1, segment);
+                previous = s1 == 1 ? (int)boundary.size() - 1 : -1;
+            }
+            // closed curves continue across their first vertex
+            int last = (int)boundary.size() - 1;
+            if (line.num_segments() > 1 && line.points.front() == line.points.back() && previous == last && last > first && boundary[first].previous < 0 &&
+                boundary[first].t0 == line.params.front())
+            {
+                boundary[first].previous = last;
+                boundary[last].next      = first;
+            }
+        }
+    }
+
+    /**
+     * @brief Adds the outer edges of the gradient meshes, without the parts that a mesh drawn later covers.
+     * @param _scene Scene with the gradient meshes.
+     */
+    void add_mesh_borders(const scene& _scene)
+    {
+        inverse_mapping_statistics stats;
+        for (size_t p = 0; p < mapping.patches.size(); p++)
+        {
+            const mesh_patch& patch   = mapping.patches[p];
+            const gradient_mesh& mesh = _scene.gradient_meshes[patch.mesh];
+            // corners and tangents of the edges v=0, v=1, u=0, u=1 in Hermite form
+            const int corners[4][2] = { { 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 } };
+            const bool outer[4]     = { patch.row == 0, patch.row + 1 == mesh.num_rows, patch.col == 0, patch.col + 1 == mesh.num_cols };
+            for (int edge = 0; edge < 4; edge++)
+            {
+                if (!outer[edge])
+                    continue;
+                int a = corners[edge][0], b = corners[edge][1];
+                const std::array<point_type, 4>& tangents = edge < 2 ? patch.tangents_u : patch.tangents_v;
+                std::vector<point_type> control_points = { patch.positions[a],
+                                                           point_type{ patch.positions[a][0] + tangents[a][0] / 3, patch.positions[a][1] + tangents[a][1] / 3 },
+                                                           point_type{ patch.positions[b][0] - tangents[b][0] / 3, patch.positions[b][1] - tangents[b][1] / 3 },
+                                                           patch.positions[b] };
+                polyline line = flatten_bezier_chain(control_points, options.tolerance);
+                for (int e = 0; e < line.num_segments(); e++)
+                {
+                    double s0, s1;
+                    if (!clip(line.points[e], line.points[e + 1], s0, s1))
+                        continue;
+                    point_type middle = { 0.5 * (line.points[e][0] + line.points[e + 1][0]), 0.5 * (line.points[e][1] + line.points[e + 1][1]) };
+                    patch_location location = mapping.locate(middle[0], middle[1], nullptr, stats);
+                    if (location.patch >= 0 && mapping.patches[location.patch].mesh > patch.mesh)
+                        continue;
+                    boundary_segment segment;
+                    segment.t0 = segment.t1 = 0;
+                    double fixed            = edge == 0 || edge == 2 ? 0 : 1;
+                    segment.uv0             = edge < 2 ? std::array<double, 2>{ { line.params[e], fixed } } : std::array<double, 2>{ { fixed, line.params[e] } };
+                    segment.uv1             = edge < 2 ? std::array<double, 2>{ { line.params[e + 1], fixed } } : std::array<double, 2>{ { fixed, line.params[e + 1] } };
+                    segment.curve           = -1;
+                    segment.patch           = (int)p;
+                    segment.previous = segment.next = -1;
+                    add_boundary(line.points[e], line.points[e + 1], s0, s1, segment);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Adds the segments of the Poisson curves with their source densities.
+     * @param _scene Scene with the weights.
+     * @param _curves Flattened curves of the scene.
+     */
+    void add_poisson_curves(const scene& _scene, const flattened_scene& _curves)
+    {
+        for (size_t i = 0; i < _curves.poisson_curves.size(); i++)
+        {
+            const polyline& line = _curves.poisson_curves[i];
+            for (int e = 0; e < line.num_segments(); e++)
+            {
+                double s0, s1;
+                if (!clip(line.points[e], line.points[e + 1], s0, s1))
+                    continue;
+                const point_type& a = line.points[e];
+                const point_type& b = line.points[e + 1];
+                double t0 = line.params[e], t1 = line.params[e + 1];
+                source_segment segment;
+                segment.p0 = point_type{ a[0] + s0 * (b[0] - a[0]), a[1] + s0 * (b[1] - a[1]) };
+                segment.p1 = point_type{ a[0] + s1 * (b[0] - a[0]), a[1] + s1 * (b[1] - a[1]) };
+                segment.w0 = sample_color_points(_scene.poisson_curves[i].weights, t0 + s0 * (t1 - t0));
+                segment.w1 = sample_color_points(_scene.poisson_curves[i].weights, t0 + s1 * (t1 - t0));
+                for (int c = 0; c < 3; c++)
+                {
+                    segment.w0[c] /= _scene.width;
+                    segment.w1[c] /= _scene.width;
+                }
+                sources.push_back(segment);
+            }
+        }
+    }
+
+    /**
+     * @brief Color of the pocket that contains a point, filling the pocket grid around the point on the first query.
+     * @param _point Point in scene units.
+     * @param _color Output color of the pocket, unchanged if the point is not in a pocket.
+     * @return True if the point is in a pocket.
+     */
+    bool pocket_color(const point_type& _point, color_type& _color) const
+    {
+        if (pocket_labels.empty())
+            return false;
+        int x    = std::min(pocket_x - 1, std::max(0, (int)std::floor(_point[0] / pocket_size)));
+        int y    = std::min(pocket_y - 1, std::max(0, (int)std::floor(_point[1] / pocket_size)));
+        int cell = y * pocket_x + x;
+        if (pocket_labels[cell].load(std::memory_order_acquire) == open_cell)
+            return false;
+        std::lock_guard<std::mutex> lock(pocket_mutex);
+        if (pocket_labels[cell].load(std::memory_order_relaxed) == unknown_cell)
+            fill_pocket(x, y);
+        int label = pocket_labels[cell].load(std::memory_order_relaxed);
+        if (label < 0)
+            return false;
+        _color = pocket_colors[label];
+        return true;
+    }
+
+    /**
+     * @brief Labels the cells of the pocket grid that are connected to a cell by edges between their centers that cross no boundary segment.
+     * @details The breadth-first fill stops as soon as an edge meets a Dirichlet side or a mesh border, or it reaches a cell that is known to be open, and labels all cells that it reached as open. Otherwise, the cells are a pocket, whose color is the mean of the Dirichlet colors right across the Neumann sides that close it, as in find_floating_regions, or black if there are none. Every cell is filled at most once. The caller holds pocket_mutex.
+     * @param _x Column of the cell.
+     * @param _y Row of the cell.
+     */
+    void fill_pocket(int _x, int _y) const
+    {
+        const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+        std::vector<int> cells(1, _y * pocket_x + _x);
+        pocket_labels[cells[0]].store(queued_cell, std::memory_order_relaxed);
+        bool open          = false;
+        int num_outside    = 0;
+        color_type outside = { 0, 0, 0 };
+        for (size_t next = 0; next < cells.size() && !open; next++)
+        {
+            int x = cells[next] % pocket_x, y = cells[next] / pocket_x;
+            point_type center = { (x + 0.5) * pocket_size, (y + 0.5) * pocket_size };
+            for (int n = 0; n < 4 && !open; n++)
+            {
+                // the image border is a Neumann side
+                int nx = x + offsets[n][0], ny = y + offsets[n][1];
+                if (nx < 0 || nx >= pocket_x || ny < 0 || ny >= pocket_y)
+                    continue;
+                int neighbor = ny * pocket_x + nx;
+                double along;
+                int crossed = first_crossing(center, point_type{ (nx + 0.5) * pocket_size, (ny + 0.5) * pocket_size }, -1, along);
+                if (crossed < 0)
+                {
+                    int label = pocket_labels[neighbor].load(std::memory_order_relaxed);
+                    if (label == open_cell)
+                        open = true;
+                    else if (label == unknown_cell)
+                    {
+                        pocket_labels[neighbor].store(queued_cell, std::memory_order_relaxed);
+                        cells.push_back(neighbor);
+                    }
+                    continue;
+                }
+                // decide the side as a walk that arrives there would, e.g., at the ends of the curves and where curves overlap
+                point_type crossing = boundary[crossed].point(along);
+                double dx = center[0] - crossing[0], dy = center[1] - crossing[1];
+                double scale = 0.5 * options.epsilon / std::max(1e-12, std::sqrt(dx * dx + dy * dy));
+                closest_point hit = closest(point_type{ crossing[0] + scale * dx, crossing[1] + scale * dy }, options.epsilon, -1);
+                if (hit.segment < 0)
+                {
+                    hit.segment = crossed;
+                    hit.t       = along;
+                }
+                const boundary_segment& segment = boundary[hit.segment];
+                if (segment.curve < 0)
+                {
+                    open = true;
+                    continue;
+                }
+                const diffusion_curve& curve = diffusion_curves[segment.curve];
+                bool left                    = on_left(hit);
+                if ((left ? curve.boundary_left : curve.boundary_right) == boundary_condition::Dirichlet)
+                    open = true;
+                else if ((left ? curve.boundary_right : curve.boundary_left) == boundary_condition::Dirichlet)
+                {
+                    add(outside, sample_color_points(left ? curve.colors_right : curve.colors_left, segment.t0 + hit.t * (segment.t1 - segment.t0)), 1);
+                    num_outside++;
+                }
+            }
+        }
+        int label = open ? (int)open_cell : (int)pocket_colors.size();
+        if (!open)
+        {
+            for (int c = 0; c < 3; c++)
+                outside[c] = num_outside > 0 ? outside[c] / num_outside : 0;
+            pocket_colors.push_back(outside);
+        }
+        for (int cell : cells)
+            pocket_labels[cell].store(label, std::memory_order_release);
+    }
+
+    /**
+     * @brief Color of the topmost gradient mesh at a point.
+     * @param _point Point in scene units.
+     * @param _color Output color, unchanged if no mesh covers the point.
+     * @return True if a mesh covers the point.
+     */
+    bool mesh_color(const point_type& _point, color_type& _color) const
+    {
+        if (mapping.patches.empty())
+            return false;
+        inverse_mapping_statistics stats;
+        patch_location location = mapping.locate(_point[0], _point[1], nullptr, stats);
+        if (location.patch < 0)
+            return false;
+        point_type position;
+        mapping.coefficients[location.patch].evaluate(location.u, location.v, position, _color);
+        return true;
+    }
+
+    /**
+     * @brief Color of a mesh border at a point of one of its segments.
+     * @param _segment Segment of the mesh border.
+     * @param _t Parameter on the segment.
+     * @return Color of the mesh.
+     */
+    color_type border_color(const boundary_segment& _segment, double _t) const
+    {
+        point_type position;
+        color_type color;
+        mapping.coefficients[_segment.patch].evaluate(_segment.uv0[0] + _t * (_segment.uv1[0] - _segment.uv0[0]), _segment.uv0[1] + _t * (_segment.uv1[1] - _segment.uv0[1]),
+                                                      position, color);
+        return color;
+    }
+
+    /**
+     * @brief Squared distance from a point to a boundary segment.
+     * @param _segment Segment.
+     * @param _point Point.
+     * @param _t Output parameter of the closest point in [0,1].
+     * @return Squared distance.
+     */
+    static double squared_distance(const boundary_segment& _segment, const point_type& _point, double& _t)
+    {
+        double dx = _segment.p1[0] - _segment.p0[0], dy = _segment.p1[1] - _segment.p0[1];
+        double wx = _point[0] - _segment.p0[0], wy = _point[1] - _segment.p0[1];
+        _t = std::min(1.0, std::max(0.0, (wx * dx + wy * dy) * _segment.inverse_length_squared));
+        double ex = wx - _t * dx, ey = wy - _t * dy;
+        return ex * ex + ey * ey;
+    }
+
+    /**
+     * @brief Lower bound of the distance from a point to the boundary segments, from the distance at the center of its cell, which changes at most as fast as the point moves.
+     * @param _point Point in the scene.
+     * @return Lower bound; negative near the boundary.
+     */
+    double clearance(const point_type& _point) const
+    {
+        const segment_grid& index = boundary_index;
+        int cx = index.cell(_point[0], index.cells_x), cy = index.cell(_point[1], index.cells_y);
+        double dx = _point[0] - (cx + 0.5) * index.cell_size, dy = _point[1] - (cy + 0.5) * index.cell_size;
+        return clearances[(size_t)cy * index.cells_x + cx] - std::sqrt(dx * dx + dy * dy);
+    }
+
+    /**
+     * @brief Mirror images of a point at the image border that are closer to the scene than a radius, for the sources of the mirrored scene.
+     * @param _point Point in the scene.
+     * @param _radius Radius.
+     * @param _images Output images, the point itself first.
+     * @return Number of images, at most four since the radius is below half the size of the scene.
+     */
+    int mirror_images(const point_type& _point, double _radius, std::array<point_type, 4>& _images) const
+    {
+        _images[0] = _point;
+        int count  = 1;
+        bool mirror_x = std::min(_point[0], width - _point[0]) < _radius, mirror_y = std::min(_point[1], height - _point[1]) < _radius;
+        double x = _point[0] < 0.5 * width ? -_point[0] : 2 * width - _point[0];
+        double y = _point[1] < 0.5 * height ? -_point[1] : 2 * height - _point[1];
+        if (mirror_x)
+            _images[count++] = point_type{ x, _point[1] };
+        if (mirror_y)
+            _images[count++] = point_type{ _point[0], y };
+        if (mirror_x && mirror_y)
+            _images[count++] = point_type{ x, y };
+        return count;
+    }
+
+    /**
+     * @brief Finds the closest boundary point within a radius, searching rings of cells around the point, starting at the first ring with segments.
+     * @param _point Point in the scene.
+     * @param _radius Radius of the search.
+     * @param _exclude Diffusion curve whose segments are skipped, or -1.
+     * @return Closest point; the segment is -1 if there is none within the radius.
+     */
+    closest_point closest(const point_type& _point, double _radius, int _exclude) const
+    {
+        closest_point result;
+        result.distance = _radius;
+        result.segment  = -1;
+        result.t        = 0;
+        result.walker   = _point;
+        double best               = _radius * _radius;
+        const segment_grid& index = boundary_index;
+        int cx = index.cell(_point[0], index.cells_x), cy = index.cell(_point[1], index.cells_y);
+        int max_ring   = std::max(index.cells_x, index.cells_y);
+        int first_ring = index.empty_rings[(size_t)cy * index.cells_x + cx];
+        if ((first_ring - 1) * index.cell_size >= _radius)
+            return result;
+        for (int ring = first_ring; ring <= max_ring; ring++)
+        {
+            for (int y = std::max(0, cy - ring); y <= std::min(index.cells_y - 1, cy + ring); y++)
+            {
+                // the inner rows of the ring only have their two end cells
+                int step = y == cy - ring || y == cy + ring ? 1 : 2 * ring;
+                for (int x = cx - ring; x <= cx + ring; x += std::max(1, step))
+                {
+                    if (x < 0 || x >= index.cells_x)
+                        continue;
+                    int cell = y * index.cells_x + x;
+                    for (int k = index.offsets[cell]; k < index.offsets[cell + 1]; k++)
+                    {
+                        const boundary_segment& segment = boundary[index.entries[k]];
+                        if (segment.curve == _exclude && _exclude >= 0)
+                            continue;
+                        double t, d = squared_distance(segment, _point, t);
+                        if (d < best)
+                        {
+                            best           = d;
+                            result.segment = index.entries[k];
+                            result.t       = t;
+                        }
+                    }
+                }
+            }
+            double reach = ring * index.cell_size;
+            if (best <= reach * reach || reach >= _radius)
+                break;
+        }
+        if (result.segment >= 0)
+            result.distance = std::sqrt(best);
+        return result;
+    }
+
+    /**
+     * @brief Side of the walker at its closest point, with the direction averaged over the adjacent segments at a vertex, as in the rasterization of the constraints.
+     * @param _hit Closest point.
+     * @return True on the left side on screen (y down).
+     */
+    bool on_left(const closest_point& _hit) const
+    {
+        const boundary_segment& segment = boundary[_hit.segment];
+        auto direction = [&](const boundary_segment& _other) {
+            double dx = _other.p1[0] - _other.p0[0], dy = _other.p1[1] - _other.p0[1];
+            double length = std::sqrt(dx * dx + dy * dy);
+            return length > 0 ? point_type{ dx / length, dy / length } : point_type{ 0, 0 };
+        };
+        point_type d = direction(segment);
+        int neighbor = _hit.t <= 0 ? segment.previous : (_hit.t >= 1 ? segment.next : -1);
+        if (neighbor >= 0)
+        {
+            point_type other = direction(boundary[neighbor]);
+            d                = point_type{ d[0] + other[0], d[1] + other[1] };
+        }
+        const point_type& origin = _hit.t >= 1 ? segment.p1 : segment.p0;
+        return d[0] * (_hit.walker[1] - origin[1]) - d[1] * (_hit.walker[0] - origin[0]) < 0;
+    }
+
+    /**
+     * @brief Reflects a walk at a Neumann side to a uniformly random point on the half disk around its closest point that faces the walk.
+     * @details The radius is bounded by the distance to the other curves and, inside a mesh, to the image border.
+     * @param _hit Closest point.
+     * @param _foot Closest point on the segment.
+     * @param _inside True if the walk is inside a gradient mesh.
+     * @param _random Random numbers of the walk.
+     * @return New position of the walk in the scene.
+     */
+    point_type reflect(const closest_point& _hit, const point_type& _foot, bool _inside, walk_random& _random) const
+    {
+        const double pi                 = 3.14159265358979323846;
+        const boundary_segment& segment = boundary[_hit.segment];
+        double nx = _hit.walker[0] - _foot[0], ny = _hit.walker[1] - _foot[1];
+        double length = std::sqrt(nx * nx + ny * ny);
+        if (length > 0)
+            nx /= length, ny /= length;
+        else
+        {
+            double dx = segment.p1[0] - segment.p0[0], dy = segment.p1[1] - segment.p0[1];
+            double scale = 1 / std::max(1e-12, std::sqrt(dx * dx + dy * dy));
+            nx = -dy * scale, ny = dx * scale;
+        }
+
+        double radius = options.neumann_radius;
+        if (_inside)
+            radius = std::min(radius, std::min(std::min(_foot[0], width - _foot[0]), std::min(_foot[1], height - _foot[1])));
+        closest_point other = closest(_foot, radius, segment.curve);
+        if (other.segment >= 0)
+            radius = other.distance;
+        radius       = std::max(radius, 2 * options.epsilon);
+        double angle = (_random.uniform() - 0.5) * pi;
+        double c = std::cos(angle), s = std::sin(angle);
+        point_type p = { _foot[0] + radius * (c * nx - s * ny), _foot[1] + radius * (s * nx + c * ny) };
+        // the other curves bound the radius, but a curve can also fold back, e.g., across a thin ribbon
+        double along;
+        while (radius > 2 * options.epsilon && first_crossing(_foot, p, _hit.segment, along) >= 0)
+        {
+            radius *= 0.5;
+            p = point_type{ _foot[0] + radius * (c * nx - s * ny), _foot[1] + radius * (s * nx + c * ny) };
+        }
+        return point_type{ fold(p[0], width), fold(p[1], height) };
+    }
+
+    /**
+     * @brief Finds the first boundary segment that a step crosses.
+     * @param _from Start of the step, e.g., on the boundary.
+     * @param _to End of the step.
+     * @param _skip Segment of the start, which is not tested, or -1.
+     * @param _along Output parameter of the crossing on the segment in [0,1].
+     * @return Segment closest to the start that the step crosses other than at its start, or -1.
+     */
+    int first_crossing(const point_type& _from, const point_type& _to, int _skip, double& _along) const
+    {
+        int first         = -1;
+        double first_step = 1;
+        const segment_grid& index = boundary_index;
+        std::array<int, 4> range;
+        index.cell_range(_from, _to, range);
+        double dx = _to[0] - _from[0], dy = _to[1] - _from[1];
+        for (int y = range[1]; y <= range[3]; y++)
+        {
+            for (int x = range[0]; x <= range[2]; x++)
+            {
+                int cell = y * index.cells_x + x;
+                for (int k = index.offsets[cell]; k < index.offsets[cell + 1]; k++)
+                {
+                    if (index.entries[k] == _skip)
+                        continue;
+                    const boundary_segment& segment = boundary[index.entries[k]];
+                    double ex = segment.p1[0] - segment.p0[0], ey = segment.p1[1] - segment.p0[1];
+                    double denominator = dx * ey - dy * ex;
+                    if (denominator == 0)
+                        continue;
+                    double wx = segment.p0[0] - _from[0], wy = segment.p0[1] - _from[1];
+                    double step  = (wx * ey - wy * ex) / denominator;
+                    double along = (wx * dy - wy * dx) / denominator;
+                    // the adjacent segments touch the start
+                    if (step > 1e-6 && step <= first_step && along >= 0 && along <= 1)
+                    {
+                        first      = index.entries[k];
+                        first_step = step;
+                        _along     = along;
+                    }
+                }
+            }
+        }
+        return first;
+    }
+
+    /**
+     * @brief Integrates the Poisson curve sources against the Green's function of a disk, including the mirror images of the sources at the image border.
+     * @param _center Center of the disk in the scene.
+     * @param _radius Radius of the disk.
+     * @param _mirrors Include the mirror images.
+     * @return Integral per channel.
+     */
+    color_type source_integral(const point_type& _center, double _radius, bool _mirrors) const
+    {
+        color_type result = { 0, 0, 0 };
+        if (sources.empty())
+            return result;
+        std::array<point_type, 4> images;
+        int num_images = _mirrors ? mirror_images(_center, _radius, images) : (images[0] = _center, 1);
+        const segment_grid& index = source_index;
+        for (int mirror = 0; mirror < num_images; mirror++)
+        {
+            const point_type& center = images[mirror];
+            std::array<int, 4> range;
+            index.cell_range(point_type{ center[0] - _radius, center[1] - _radius }, point_type{ center[0] + _radius, center[1] + _radius }, range);
+            // large disks visit more cells than there are segments
+            if ((size_t)(range[2] - range[0] + 1) * (range[3] - range[1] + 1) > sources.size())
+            {
+                for (const source_segment& segment : sources)
+                    add_segment_integral(segment, center, _radius, result);
+                continue;
+            }
+            for (int y = range[1]; y <= range[3]; y++)
+            {
+                for (int x = range[0]; x <= range[2]; x++)
+                {
+                    int cell = y * index.cells_x + x;
+                    for (int k = index.offsets[cell]; k < index.offsets[cell + 1]; k++)
+                    {
+                        // segments that span several cells are integrated in the first cell of the range only
+                        const source_segment& segment = sources[index.entries[k]];
+                        if (std::max(segment.cells[0], range[0]) != x || std::max(segment.cells[1], range[1]) != y)
+                            continue;
+                        add_segment_integral(segment, center, _radius, result);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Adds the integral of the Green's function of a disk, (1/2pi) ln(R/r), times the linear density of a source segment over the part of the segment inside the disk.
+     * @details With t along the line of the segment from the foot of the center and h the distance of the line, the antiderivatives of ln(t^2+h^2)/2 and t ln(t^2+h^2)/2 are closed forms.
+     * @param _segment Source segment.
+     * @param _center Center of the disk.
+     * @param _radius Radius of the disk.
+     * @param _result Integral per channel to add to.
+     */
+    static void add_segment_integral(const source_segment& _segment, const point_type& _center, double _radius, color_type& _result)
+    {
+        const double pi = 3.14159265358979323846;
+        double dx = _segment.p1[0] - _segment.p0[0], dy = _segment.p1[1] - _segment.p0[1];
+        double length = std::sqrt(dx * dx + dy * dy);
+        if (length == 0)
+            return;
+        dx /= length, dy /= length;
+        double wx = _center[0] - _segment.p0[0], wy = _center[1] - _segment.p0[1];
+        double foot = wx * dx + wy * dy;
+        double h2   = std::max(0.0, wx * wx + wy * wy - foot * foot);
+        if (h2 >= _radius * _radius)
+            return;
+        double half = std::sqrt(_radius * _radius - h2);
+        double ta = std::max(0.0, foot - half) - foot, tb = std::min(length, foot + half) - foot;
+        if (tb <= ta)
+            return;
+
+        double h = std::sqrt(h2), log_radius = std::log(_radius);
+        auto f0 = [&](double _t) {
+            double q = _t * _t + h2;
+            return (q > 0 ? 0.5 * _t * std::log(q) : 0) - _t + (h > 0 ? h * std::atan(_t / h) : 0);
+        };
+        auto f1 = [&](double _t) {
+            double q = _t * _t + h2;
+            return 0.25 * ((q > 0 ? q * std::log(q) : 0) - _t * _t);
+        };
+        double j0 = (log_radius * (tb - ta) - (f0(tb) - f0(ta))) / (2 * pi);
+        double j1 = (0.5 * log_radius * (tb * tb - ta * ta) - (f1(tb) - f1(ta))) / (2 * pi);
+        for (int c = 0; c < 3; c++)
+        {
+            double slope  = (_segment.w1[c] - _segment.w0[c]) / length;
+            double offset = _segment.w0[c] + slope * foot;
+            _result[c] += offset * j0 + slope * j1;
+        }
+    }
+};
+
+/**
+ * @brief Progressive walk-on-spheres rendering of a region of a scene, e.g., a thumbnail of the whole scene or a crop.
+ * @details Every call adds walks to all pixels, in parallel over the rows, and the image is the mean so far. Pixel (x, y) is evaluated at the center of its cell in the viewport and uses the random stream y * width + x, so the image after n walks per pixel is the same for any number of threads and any split of the walks into calls.
+ */
+class progressive_walk_on_spheres
+{
+public:
+    /**
+     * @brief Creates an empty accumulation.
+     * @param _evaluator Evaluator of the scene, which must outlive the accumulation.
+     * @param _view Region of the scene in scene units.
+     * @param _width Width of the image in pixels.
+     * @param _height Height of the image in pixels.
+     * @param _seed Seed of the random numbers.
+     */
+    progressive_walk_on_spheres(const walk_on_spheres& _evaluator, const viewport& _view, int _width, int _height, uint64_t _seed = 0)
+        : evaluator(&_evaluator)
+        , view(_view)
+        , seed(_seed)
+        , walks_per_pixel(0)
+        , sum(_width, _height, color_type{ 0, 0, 0 })
+    {
+    }
+
+    /**
+     * @brief Evaluator of the scene.
+     */
+    const walk_on_spheres* evaluator;
+    /**
+     * @brief Region of the scene in scene units.
+     */
+    viewport view;
+    /**
+     * @brief Seed of the random numbers.
+     */
+    uint64_t seed;
+    /**
+     * @brief Number of walks per pixel so far.
+     */
+    int walks_per_pixel;
+    /**
+     * @brief Sum of the walks per pixel.
+     */
+    image sum;
+
+    /**
+     * @brief Adds walks to every pixel.
+     * @param _num_walks Number of walks per pixel.
+     * @param _stats Optional output of the counters of this call.
+     */
+    void add_walks(int _num_walks, walk_statistics* _stats = nullptr)
+    {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now();
+        std::vector<walk_statistics> row_stats(sum.height);
+        double scale_x = (double)view.width / std::max(1, sum.width), scale_y = (double)view.height / std::max(1, sum.height);
+        parallel_for(0, sum.height, [&](int y) {
+            for (int x = 0; x < sum.width; x++)
+            {
+                point_type point = { view.x + (x + 0.5) * scale_x, view.y + (y + 0.5) * scale_y };
+                uint64_t stream  = (uint64_t)y * sum.width + x;
+                color_type& value = sum(x, y);
+                for (int walk = walks_per_pixel; walk < walks_per_pixel + _num_walks; walk++)
+                {
+                    walk_random random(seed, stream, walk);
+                    color_type estimate = evaluator->sample(point, random, row_stats[y]);
+                    for (int c = 0; c < 3; c++)
+                        value[c] += estimate[c];
+                }
+            }
+        });
+        walks_per_pixel += _num_walks;
+
+        if (_stats != nullptr)
+        {
+            walk_statistics stats;
+            for (const walk_statistics& row : row_stats)
+                stats.add(row);
+            stats.walk_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            *_stats       = stats;
+        }
+    }
+
+    /**
+     * @brief Mean of the walks so far.
+     * @return Image of the region; black before the first walks.
+     */
+    image result() const
+    {
+        image mean(sum.width, sum.height, color_type{ 0, 0, 0 });
+        if (walks_per_pixel == 0)
+            return mean;
+        for (size_t i = 0; i < sum.data.size(); i++)
+            for (int c = 0; c < 3; c++)
+                mean.data[i][c] = sum.data[i][c] / walks_per_pixel;
+        return mean;
+    }
+};